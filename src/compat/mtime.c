@@ -28,6 +28,7 @@
 
 #ifdef __APPLE__
 #define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
 #endif
 
 int64_t getmtime_ns(const char *file) {
@@ -36,3 +37,15 @@ int64_t getmtime_ns(const char *file) {
   if (ret == -1) return -1;
   return sbuf.st_mtim.tv_nsec * INT64_C(1000000000) + sbuf.st_mtim.tv_sec;
 }
+
+int getstamp(const char *file, struct file_stamp *stamp) {
+  struct stat sbuf;
+  int ret = lstat(file, &sbuf);
+  if (ret == -1) return -1;
+  stamp->device = sbuf.st_dev;
+  stamp->inode = sbuf.st_ino;
+  stamp->size = sbuf.st_size;
+  stamp->mtime_ns = sbuf.st_mtim.tv_sec * INT64_C(1000000000) + sbuf.st_mtim.tv_nsec;
+  stamp->ctime_ns = sbuf.st_ctim.tv_sec * INT64_C(1000000000) + sbuf.st_ctim.tv_nsec;
+  return 0;
+}
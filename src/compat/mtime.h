@@ -28,6 +28,18 @@ extern "C" {
 // On error, returns -1 and sets errno.
 extern int64_t getmtime_ns(const char *file);
 
+// Everything about a file which changes when its content does
+struct file_stamp {
+  int64_t device;
+  int64_t inode;
+  int64_t size;
+  int64_t mtime_ns;
+  int64_t ctime_ns;
+};
+
+// Fill `stamp` from lstat(file). On error, returns -1 and sets errno.
+extern int getstamp(const char *file, struct file_stamp *stamp);
+
 #ifdef __cplusplus
 };
 #endif
@@ -55,12 +55,12 @@ struct RUsage rusage_sub(struct RUsage x, struct RUsage y) {
 #error Missing definition to access maxrss on this platform
 #endif
 
-struct RUsage getRUsageChildren() {
+static struct RUsage getRUsage(int who) {
   struct RUsage out;
   struct rusage usage;
 
   // Can not fail (who and pointer are vaild)
-  int ret = getrusage(RUSAGE_CHILDREN, &usage);
+  int ret = getrusage(who, &usage);
   assert(ret == 0);
 
   // These two are extremely portable:
@@ -74,3 +74,7 @@ struct RUsage getRUsageChildren() {
 
   return out;
 }
+
+struct RUsage getRUsageChildren() { return getRUsage(RUSAGE_CHILDREN); }
+
+struct RUsage getRUsageSelf() { return getRUsage(RUSAGE_SELF); }
@@ -39,6 +39,9 @@ extern struct RUsage rusage_sub(struct RUsage x, struct RUsage y);
 // This values reported only change after a call wait*()
 extern struct RUsage getRUsageChildren();
 
+// Resources used by this process, all threads included
+extern struct RUsage getRUsageSelf();
+
 #ifdef __cplusplus
 };
 #endif
@@ -36,6 +36,7 @@
 #include "types/sums.h"
 #include "util/diagnostic.h"
 #include "util/fragment.h"
+#include "util/phases.h"
 
 static CPPFile cppFile(__FILE__);
 
@@ -522,7 +523,8 @@ static std::unique_ptr<Expr> expand_patterns(const std::string &fnname,
             "_ a" + std::to_string(--var), DefValue(FRAGMENT_CPP_LINE, std::move(gets[i - 1]))));
         assert(out.second);
       }
-      Lambda *lam = new Lambda(rmap->body->fragment, "_ tuple_case", rmap.release());
+      FileFragment rmap_fragment = rmap->body->fragment;
+      Lambda *lam = new Lambda(rmap_fragment, "_ tuple_case", rmap.release());
       lam->fnname = fnname;
       des->cases.emplace_back(lam);
       for (auto p = patterns.rbegin(); p != patterns.rend(); ++p) {
@@ -576,8 +578,10 @@ static std::unique_ptr<Expr> expand_patterns(const std::string &fnname,
           new Destruct(fragment, Boolean,
                        new App(p.fragment, new VarRef(p.fragment, "_ guard"),
                                new VarRef(p.fragment, "Unit@wake"))));
-      des->cases.emplace_back(new Lambda(guard_true->fragment, "_", guard_true.release()));
-      des->cases.emplace_back(new Lambda(guard_false->fragment, "_", guard_false.release()));
+      FileFragment true_fragment = guard_true->fragment;
+      FileFragment false_fragment = guard_false->fragment;
+      des->cases.emplace_back(new Lambda(true_fragment, "_", guard_true.release()));
+      des->cases.emplace_back(new Lambda(false_fragment, "_", guard_false.release()));
       des->fragment = des->cases.front()->fragment;
       des->uses.resize(2);
       fmap->body = std::move(des);
@@ -593,7 +597,8 @@ static PatternTree cons_lookup(ResolveBinding *binding, std::unique_ptr<Expr> &e
   if (ast.name == "_") {
     // no-op; unbound
   } else if (!ast.name.empty() && lex_kind(ast.name) == LOWER) {
-    Lambda *lambda = new Lambda(expr->fragment, ast.name, expr.release());
+    FileFragment expr_fragment = expr->fragment;
+    Lambda *lambda = new Lambda(expr_fragment, ast.name, expr.release());
     if (ast.name.compare(0, 3, "_ k") != 0) lambda->token = ast.token;
     expr = std::unique_ptr<Expr>(lambda);
     out.var = 0;  // bound
@@ -702,17 +707,18 @@ static std::unique_ptr<Expr> rebind_match(const std::string &fnname, ResolveBind
     if (true) {
       std::string cname =
           match->patterns.size() == 1 ? fnname : fnname + ".case" + std::to_string(f);
-      expr =
-          std::unique_ptr<Expr>(new Lambda(p.expr->fragment, "_", p.expr.release(), cname.c_str()));
+      FileFragment expr_fragment = p.expr->fragment;
+      expr = std::unique_ptr<Expr>(new Lambda(expr_fragment, "_", p.expr.release(), cname.c_str()));
     }
     if (p.guard) {
-      patterns.back().guard_fragment = p.guard->fragment;
+      FileFragment guard_fragment = p.guard->fragment;
+      patterns.back().guard_fragment = guard_fragment;
       std::string gname =
           match->patterns.size() == 1 ? fnname : fnname + ".guard" + std::to_string(f);
       expr = std::unique_ptr<Expr>(new App(
           FRAGMENT_CPP_LINE,
           new App(FRAGMENT_CPP_LINE, new VarRef(FRAGMENT_CPP_LINE, "Pair@wake"), expr.release()),
-          new Lambda(p.guard->fragment, "_", p.guard.release(), gname.c_str())));
+          new Lambda(guard_fragment, "_", p.guard.release(), gname.c_str())));
     }
     patterns.back().tree = cons_lookup(binding, expr, p.pattern, multiarg);
     auto out = map->defs.insert(
@@ -1523,7 +1529,13 @@ static bool explore(Expr *expr, ExploreState &state, NameBinding *binding) {
 }
 
 std::unique_ptr<Expr> bind_refs(std::unique_ptr<Top> top, const PrimMap &pmap, bool &isTreeBuilt) {
-  std::unique_ptr<Expr> out = fracture(std::move(top));
+  Phase phase("bind_refs");
+  std::unique_ptr<Expr> out;
+  {
+    Phase fracture_phase("fracture");
+    out = fracture(std::move(top));
+  }
+  Phase explore_phase("explore");
   NameBinding bottom;
   ExploreState state(pmap);
   if (out && !explore(out.get(), state, &bottom)) isTreeBuilt = false;
@@ -29,7 +29,7 @@
 CPPFile expr_h("src/dst/expr.h");
 static CPPFile cppFile(__FILE__);
 
-Expr::~Expr() {}
+Expr::~Expr() { count_object(live_exprs, -1); }
 const TypeDescriptor Prim::type("Prim");
 const TypeDescriptor App::type("App");
 const TypeDescriptor Lambda::type("Lambda");
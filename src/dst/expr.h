@@ -28,6 +28,7 @@
 #include "types/type.h"
 #include "util/fragment.h"
 #include "util/hash.h"
+#include "util/phases.h"
 
 struct Receiver;
 struct Value;
@@ -51,7 +52,13 @@ struct Expr {
   long flags;
 
   Expr(const TypeDescriptor *type_, const FileFragment &fragment_, long flags_ = 0)
-      : type(type_), fragment(fragment_), meta(0), flags(flags_) {}
+      : type(type_), fragment(fragment_), meta(0), flags(flags_) {
+    count_object(live_exprs, 1);
+  }
+  Expr(const Expr &x)
+      : type(x.type), fragment(x.fragment), typeVar(x.typeVar), meta(x.meta), flags(x.flags) {
+    count_object(live_exprs, 1);
+  }
   virtual ~Expr();
 
   void set(long flag, long value /* 0 or 1 */) { flags = (flags & ~flag) | (-value & flag); }
@@ -25,6 +25,7 @@
 #include <re2/re2.h>
 
 #include <algorithm>
+#include <mutex>
 #include <set>
 #include <sstream>
 
@@ -360,6 +361,8 @@ static AST dst_type(CSTElement root) {
   }
 }
 
+static std::mutex topic_mutex;
+
 static void dst_topic(CSTElement topdef, Package &package, Symbols *globals) {
   CSTElement child = topdef.firstChildNode();
   TopFlags flags = dst_flags(child);
@@ -375,11 +378,15 @@ static void dst_topic(CSTElement topdef, Package &package, Symbols *globals) {
   File &file = package.files.back();
   AST def = dst_type(child);
 
-  // Confirm there are no open type variables
-  TypeMap ids;
-  TypeVar x;
-  x.setDOB();
-  def.unify(x, ids);
+  // Confirm there are no open type variables; TypeVars share a clock,
+  // and dst_file may be converting other files at the same time
+  {
+    std::lock_guard<std::mutex> lock(topic_mutex);
+    TypeMap ids;
+    TypeVar x;
+    x.setDOB();
+    def.unify(x, ids);
+  }
 
   auto it = file.topics.insert(std::make_pair(id, Topic(fragment, std::move(def))));
   if (!it.second) {
@@ -1442,13 +1449,15 @@ static Expr *dst_expr(CSTElement expr) {
   }
 }
 
-const char *dst_top(CSTElement root, Top &top) {
-  std::unique_ptr<Package> package(new Package);
+FileDST dst_file(CSTElement root) {
+  FileDST out;
+  std::unique_ptr<Package> &package = out.package;
+  Symbols &globals = out.globals;
+  package.reset(new Package);
   package->files.resize(1);
   File &file = package->files.back();
   file.content = std::unique_ptr<DefMap>(new DefMap(root.fragment()));
   DefMap &map = *file.content;
-  Symbols globals;
 
   for (CSTElement topdef = root.firstChildNode(); !topdef.empty(); topdef.nextSiblingNode()) {
     switch (topdef.id()) {
@@ -1490,7 +1499,15 @@ const char *dst_top(CSTElement root, Top &top) {
   package->exports.setpkg(package->name);
   globals.setpkg(package->name);
 
-  top.globals.join(globals, "global");
+  return out;
+}
+
+const char *dst_merge(FileDST &&in, Top &top) {
+  std::unique_ptr<Package> package(std::move(in.package));
+  File &file = package->files.back();
+  DefMap &map = *file.content;
+
+  top.globals.join(in.globals, "global");
 
   // localize all top-level symbols
   DefMap::Defs defs(std::move(map.defs));
@@ -1569,6 +1586,8 @@ const char *dst_top(CSTElement root, Top &top) {
   return it.first->second->name.c_str();
 }
 
+const char *dst_top(CSTElement root, Top &top) { return dst_merge(dst_file(root), top); }
+
 ExprParser::ExprParser(const std::string &content) : file("<command-line>", "def _ = " + content) {}
 
 std::unique_ptr<Expr> ExprParser::expr(DiagnosticReporter &reporter) {
@@ -20,11 +20,20 @@
 
 #include <memory>
 
+#include "expr.h"
 #include "parser/cst.h"
 
-struct Expr;
-struct Top;
+// A wakefile converted on its own, before it joins the others in a Top
+struct FileDST {
+  std::unique_ptr<Package> package;
+  Symbols globals;
+};
 
+// dst_file may convert several files at once, each thread reporting to its
+// own reporter; dst_merge must then add them to the Top in file order.
+FileDST dst_file(CSTElement root);
+const char *dst_merge(FileDST &&file, Top &top);
+// Both, for a single file
 const char *dst_top(CSTElement root, Top &top);
 
 struct ExprParser {
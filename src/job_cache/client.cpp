@@ -0,0 +1,174 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+
+#include "job_cache.h"
+#include "util/execpath.h"
+
+namespace job_cache {
+
+// How long an idle daemon waits for a new client before it exits.
+// Keeping the daemon around between builds is the whole point of
+// having one, so this is much longer than fuse-waked's linger.
+static const int linger_timeout = 60;
+
+Client::Client(std::string cache_dir)
+    : Client(std::move(cache_dir), find_execpath() + "/job-cache") {}
+
+Client::Client(std::string cache_dir, std::string executable)
+    : cache_dir(std::move(cache_dir)), executable(std::move(executable)) {}
+
+Client::~Client() {
+  if (fd != -1) (void)close(fd);
+}
+
+static int connect_socket(const std::string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) return -1;
+  (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  if (::connect(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1) {
+    int err = errno;
+    (void)close(sock);
+    errno = err;
+    return -1;
+  }
+
+  return sock;
+}
+
+bool Client::connect() {
+  if (fd != -1) return true;
+
+  std::string path = socket_path(cache_dir);
+  int wait_ms = 10;
+  for (int retry = 0; (fd = connect_socket(path)) == -1 && retry < 12; ++retry) {
+    // Only a missing or dead daemon is worth (re)starting
+    if (errno != ENOENT && errno != ECONNREFUSED) break;
+
+    struct timespec delay;
+    delay.tv_sec = wait_ms / 1000;
+    delay.tv_nsec = (wait_ms % 1000) * INT64_C(1000000);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+      std::string delayStr = std::to_string(linger_timeout);
+      execl(executable.c_str(), "job-cache", cache_dir.c_str(), "serve", delayStr.c_str(),
+            nullptr);
+      std::cerr << "execl " << executable << ": " << strerror(errno) << std::endl;
+      exit(1);
+    }
+
+    // Sleep the full amount (even if signals like SIGWINCH arrive)
+    int ok;
+    do {
+      ok = nanosleep(&delay, &delay);
+    } while (ok == -1 && errno == EINTR);
+
+    wait_ms <<= 1;
+
+    int status;
+    do waitpid(pid, &status, 0);
+    while (WIFSTOPPED(status));
+  }
+
+  if (fd == -1) {
+    std::cerr << "Could not contact job-cache daemon at " << path << ": " << strerror(errno)
+              << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+bool Client::call(const char *method, const JAST &params, JAST &result) {
+  if (!connect()) return false;
+
+  JAST request(JSON_OBJECT);
+  request.add("method", std::string(method));
+  request.add("cwd", get_cwd());
+  request.children.emplace_back("params", params);
+
+  if (!send_message(fd, request)) {
+    std::cerr << "job-cache " << method << ": send: " << strerror(errno) << std::endl;
+    return false;
+  }
+
+  MessageParser parser(fd);
+  std::vector<std::string> messages;
+  while (messages.empty()) {
+    MessageStatus status = parser.read(messages);
+    if (status != MessageStatus::Ok) {
+      std::cerr << "job-cache " << method << ": daemon hung up" << std::endl;
+      (void)close(fd);
+      fd = -1;
+      return false;
+    }
+  }
+
+  JAST response;
+  std::stringstream errs;
+  if (!JAST::parse(messages.front(), errs, response)) {
+    std::cerr << "job-cache " << method << ": bad response: " << errs.str() << std::endl;
+    return false;
+  }
+
+  if (response.get("ok").kind != JSON_TRUE) {
+    std::cerr << "job-cache " << method << ": " << response.get("error").value << std::endl;
+    return false;
+  }
+
+  result = response.get("result");
+  return true;
+}
+
+bool Client::read(const JAST &find_request, bool &found, JAST &result) {
+  if (!call("read", find_request, result)) return false;
+  found = result.get("found").kind == JSON_TRUE;
+  return true;
+}
+
+bool Client::add(const JAST &add_request) {
+  JAST result;
+  return call("add", add_request, result);
+}
+
+}  // namespace job_cache
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "json/json5.h"
+
+namespace job_cache {
+
+// The job-cache daemon listens on this socket inside of the cache directory.
+// Clients hold no other state so any number of them can share one daemon.
+std::string socket_path(const std::string &cache_dir);
+
+// Every message on the socket is a single JSON value terminated by a NUL
+// byte. JSON text never contains a raw NUL so no other escaping is needed.
+bool send_message(int fd, const JAST &message);
+
+enum class MessageStatus { Ok, Closed, Error };
+
+// Accumulates the bytes read from a socket and splits them into messages.
+class MessageParser {
+ private:
+  int fd;
+  std::string buffer;
+
+ public:
+  explicit MessageParser(int fd) : fd(fd) {}
+
+  // Performs a single read() on the socket and appends every message
+  // completed by it to `messages`. A read that completes no message still
+  // returns Ok, so this is safe to call whenever poll() reports POLLIN.
+  MessageStatus read(std::vector<std::string> &messages);
+};
+
+// A connection to the job-cache daemon of a single cache directory. If no
+// daemon is running one is started, just as daemon_client does for fuse-waked.
+class Client {
+ private:
+  std::string cache_dir;
+  std::string executable;
+  int fd = -1;
+
+  bool call(const char *method, const JAST &params, JAST &result);
+
+ public:
+  Client(const Client &) = delete;
+  explicit Client(std::string cache_dir);
+  Client(std::string cache_dir, std::string executable);
+  ~Client();
+
+  bool connect();
+
+  // Looks up a job matching `find_request`, which has the same format as the
+  // `job-cache <dir> read` argument. On a hit the outputs are materialized
+  // relative to the current working directory and `found` is set.
+  bool read(const JAST &find_request, bool &found, JAST &result);
+
+  // Inserts a job, with the same format as the `job-cache <dir> add` argument.
+  bool add(const JAST &add_request);
+};
+
+}  // namespace job_cache
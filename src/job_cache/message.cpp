@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "job_cache.h"
+
+#ifdef MSG_NOSIGNAL
+static const int send_flags = MSG_NOSIGNAL;
+#else
+static const int send_flags = 0;
+#endif
+
+namespace job_cache {
+
+std::string socket_path(const std::string &cache_dir) { return cache_dir + "/job-cache.sock"; }
+
+bool send_message(int fd, const JAST &message) {
+  std::stringstream ss;
+  ss << message;
+  ss.put('\0');
+  std::string data = ss.str();
+
+  const char *ptr = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    // A peer that went away is reported as a failure instead of raising SIGPIPE
+    ssize_t got = send(fd, ptr, left, send_flags);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    ptr += got;
+    left -= got;
+  }
+
+  return true;
+}
+
+MessageStatus MessageParser::read(std::vector<std::string> &messages) {
+  char buf[4096];
+  ssize_t got;
+  do {
+    got = ::read(fd, buf, sizeof(buf));
+  } while (got == -1 && errno == EINTR);
+
+  if (got == -1) return MessageStatus::Error;
+  if (got == 0) return MessageStatus::Closed;
+
+  // Only the newly read bytes can contain a terminator we have not seen yet
+  size_t start = buffer.size();
+  buffer.append(buf, got);
+
+  size_t begin = 0;
+  for (size_t i = start; i < buffer.size(); ++i) {
+    if (buffer[i] != '\0') continue;
+    messages.emplace_back(buffer, begin, i - begin);
+    begin = i + 1;
+  }
+  buffer.erase(0, begin);
+
+  return MessageStatus::Ok;
+}
+
+}  // namespace job_cache
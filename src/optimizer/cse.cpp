@@ -170,6 +170,7 @@ void RFun::pass_cse(PassCSE &p, std::unique_ptr<Term> self) {
 }
 
 std::unique_ptr<Term> Term::pass_cse(std::unique_ptr<Term> term, Runtime &runtime) {
+  Phase phase("pass_cse");
   TargetScope scope;
   std::vector<Hash> undo;
   PassCSE pass(scope, &undo, runtime);
@@ -0,0 +1,570 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "image.h"
+
+#include <re2/re2.h>
+#include <string.h>
+
+#include <unordered_map>
+
+#include "runtime/value.h"
+#include "ssa.h"
+#include "types/sums.h"
+#include "util/fragment.h"
+
+static CPPFile cppFile(__FILE__);
+
+// An image is laid out as:
+//   magic, files (name and line starts), specials, sums, type, root term
+// Numbers are varints; strings are a length and their bytes. Literals used by
+// several terms are written once and referred back to by number.
+static const char magic[] = "wake program 1";
+
+// By now their names are qualified, so check_special would not recognize them
+static std::shared_ptr<Sum> *const specials[] = {&Boolean, &Order, &List, &Pair,
+                                                 &Unit,    &JValue, &Result};
+
+#define TERM_RARG 0
+#define TERM_RLIT 1
+#define TERM_RAPP 2
+#define TERM_RPRIM 3
+#define TERM_RGET 4
+#define TERM_RDES 5
+#define TERM_RCON 6
+#define TERM_RFUN 7
+
+namespace {
+
+struct ImageWriter {
+  std::string out;
+  bool ok;
+  std::unordered_map<const FileContent *, uint64_t> file_ids;
+  std::vector<const FileContent *> files;
+  std::unordered_map<const Sum *, uint64_t> sum_ids;
+  std::vector<const Sum *> sums;
+  std::unordered_map<const RootPointer<Value> *, uint64_t> literal_ids;
+
+  ImageWriter() : ok(true) {}
+
+  void put_varint(uint64_t x);
+  void put_string(const std::string &str);
+  void put_fragment(const FileFragment &fragment);
+  void put_ast(const AST &ast);
+  void put_sum(const Sum *sum);
+  void put_literal(const RootPointer<Value> *value);
+  void put_args(const Redux *redux);
+  void put_term(const Term *term);
+
+  uint64_t sum_id(const Sum *sum);
+};
+
+struct ImageReader {
+  const std::string &in;
+  Heap &h;
+  size_t pos;
+  bool ok;
+  std::vector<const FileContent *> files;
+  std::vector<std::shared_ptr<Sum> > sums;
+  std::vector<std::shared_ptr<RootPointer<Value> > > literals;
+
+  ImageReader(const std::string &in_, Heap &h_) : in(in_), h(h_), pos(0), ok(true) {}
+
+  // A count of things each at least one byte long
+  uint64_t get_count();
+  uint64_t get_varint();
+  std::string get_string();
+  FileFragment get_fragment();
+  AST get_ast();
+  void get_sum();
+  std::shared_ptr<RootPointer<Value> > get_literal();
+  std::vector<size_t> get_args();
+  std::unique_ptr<Term> get_term();
+};
+
+}  // namespace
+
+void ImageWriter::put_varint(uint64_t x) {
+  while (x >= 0x80) {
+    out.push_back(static_cast<char>(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back(static_cast<char>(x));
+}
+
+void ImageWriter::put_string(const std::string &str) {
+  put_varint(str.size());
+  out += str;
+}
+
+void ImageWriter::put_fragment(const FileFragment &fragment) {
+  auto it = file_ids.emplace(fragment.fcontent(), files.size());
+  if (it.second) files.push_back(fragment.fcontent());
+  put_varint(it.first->second);
+  put_varint(fragment.startByte());
+  put_varint(fragment.endByte());
+}
+
+void ImageWriter::put_ast(const AST &ast) {
+  put_fragment(ast.token);
+  put_fragment(ast.region);
+  put_fragment(ast.definition);
+  put_string(ast.name);
+  put_string(ast.tag);
+  put_varint(ast.type ? 1 : 0);
+  if (ast.type) put_ast(*ast.type);
+  put_varint(ast.args.size());
+  for (auto &arg : ast.args) put_ast(arg);
+}
+
+void ImageWriter::put_sum(const Sum *sum) {
+  put_string(sum->name);
+  put_fragment(sum->token);
+  put_fragment(sum->region);
+  put_varint(sum->args.size());
+  for (auto &arg : sum->args) put_string(arg);
+  put_varint(sum->scoped);
+  put_varint(sum->members.size());
+  for (auto &cons : sum->members) {
+    put_ast(cons.ast);
+    put_varint(cons.scoped);
+  }
+}
+
+uint64_t ImageWriter::sum_id(const Sum *sum) {
+  auto it = sum_ids.emplace(sum, sums.size());
+  if (it.second) sums.push_back(sum);
+  return it.first->second;
+}
+
+void ImageWriter::put_literal(const RootPointer<Value> *value) {
+  auto it = literal_ids.emplace(value, literal_ids.size());
+  if (!it.second) {
+    out.push_back('B');
+    put_varint(it.first->second);
+    return;
+  }
+
+  Value *v = value->get();
+  if (typeid(*v) == typeid(String)) {
+    out.push_back('S');
+    put_string(static_cast<String *>(v)->as_str());
+  } else if (typeid(*v) == typeid(Integer)) {
+    out.push_back('I');
+    put_string(static_cast<Integer *>(v)->str());
+  } else if (typeid(*v) == typeid(Double)) {
+    double x = static_cast<Double *>(v)->value;
+    out.push_back('D');
+    out.append(reinterpret_cast<const char *>(&x), sizeof(x));
+  } else if (typeid(*v) == typeid(RegExp)) {
+    out.push_back('R');
+    put_string(static_cast<RegExp *>(v)->exp->pattern());
+  } else {
+    ok = false;
+  }
+}
+
+void ImageWriter::put_args(const Redux *redux) {
+  put_varint(redux->args.size());
+  for (auto x : redux->args) put_varint(x);
+}
+
+void ImageWriter::put_term(const Term *term) {
+  const std::type_info &id = typeid(*term);
+  if (id == typeid(RArg)) {
+    put_varint(TERM_RARG);
+  } else if (id == typeid(RLit)) {
+    put_varint(TERM_RLIT);
+  } else if (id == typeid(RApp)) {
+    put_varint(TERM_RAPP);
+  } else if (id == typeid(RPrim)) {
+    put_varint(TERM_RPRIM);
+  } else if (id == typeid(RGet)) {
+    put_varint(TERM_RGET);
+  } else if (id == typeid(RDes)) {
+    put_varint(TERM_RDES);
+  } else if (id == typeid(RCon)) {
+    put_varint(TERM_RCON);
+  } else if (id == typeid(RFun)) {
+    put_varint(TERM_RFUN);
+  } else {
+    ok = false;
+    return;
+  }
+
+  put_string(term->label);
+  put_varint(term->flags);
+
+  if (id == typeid(RLit)) {
+    put_literal(static_cast<const RLit *>(term)->value.get());
+  } else if (id == typeid(RApp) || id == typeid(RDes)) {
+    put_args(static_cast<const Redux *>(term));
+  } else if (id == typeid(RPrim)) {
+    const RPrim *prim = static_cast<const RPrim *>(term);
+    put_string(prim->name);
+    put_args(prim);
+  } else if (id == typeid(RGet)) {
+    const RGet *get = static_cast<const RGet *>(term);
+    put_varint(get->index);
+    put_args(get);
+  } else if (id == typeid(RCon)) {
+    const RCon *con = static_cast<const RCon *>(term);
+    const Constructor *cons = con->kind.get();
+    if (cons == &Constructor::array) {
+      put_varint(0);
+    } else if (cons->sum) {
+      put_varint(sum_id(cons->sum) + 1);
+      put_varint(cons->index);
+    } else {
+      ok = false;
+    }
+    put_args(con);
+  } else if (id == typeid(RFun)) {
+    const RFun *fun = static_cast<const RFun *>(term);
+    put_fragment(fun->fragment);
+    put_varint(fun->hash.data[0]);
+    put_varint(fun->hash.data[1]);
+    put_varint(fun->output);
+    put_varint(fun->escapes.size());
+    for (auto x : fun->escapes) put_varint(x);
+    put_varint(fun->terms.size());
+    for (auto &child : fun->terms) put_term(child.get());
+    put_varint(fun->code.size());
+    for (auto &op : fun->code) {
+      put_varint(op.code);
+      put_varint(op.output);
+    }
+  }
+}
+
+std::string save_program(Term *root, const std::string &type) {
+  ImageWriter w;
+  w.put_string(type);
+  w.put_term(root);
+  std::string body = std::move(w.out);
+
+  // Sums are only known once the terms have been written
+  w.out.clear();
+  for (auto special : specials) w.put_varint(*special ? w.sum_id(special->get()) + 1 : 0);
+  w.put_varint(w.sums.size());
+  for (auto sum : w.sums) w.put_sum(sum);
+  std::string sums = std::move(w.out);
+
+  w.out.assign(magic, sizeof(magic));
+  w.put_varint(w.files.size());
+  for (auto file : w.files) {
+    w.put_string(file->filename());
+    const std::vector<size_t> &newlines = file->newLines();
+    w.put_varint(newlines.size());
+    size_t last = 0;
+    for (auto x : newlines) {
+      w.put_varint(x - last);
+      last = x;
+    }
+  }
+
+  if (!w.ok) return "";
+  return w.out + sums + body;
+}
+
+uint64_t ImageReader::get_varint() {
+  uint64_t x = 0;
+  for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    uint8_t byte = in[pos++];
+    x |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return x;
+  }
+  ok = false;
+  return 0;
+}
+
+uint64_t ImageReader::get_count() {
+  uint64_t x = get_varint();
+  if (x > in.size() - pos) {
+    ok = false;
+    return 0;
+  }
+  return x;
+}
+
+std::string ImageReader::get_string() {
+  uint64_t len = get_count();
+  std::string out(in, pos, len);
+  pos += len;
+  return out;
+}
+
+FileFragment ImageReader::get_fragment() {
+  uint64_t id = get_varint();
+  uint64_t start = get_varint();
+  uint64_t end = get_varint();
+  if (id >= files.size() || start > end || end > UINT32_MAX) {
+    ok = false;
+    return FRAGMENT_CPP_LINE;
+  }
+  return FileFragment(files[id], start, end);
+}
+
+AST ImageReader::get_ast() {
+  FileFragment token = get_fragment();
+  FileFragment region = get_fragment();
+  FileFragment definition = get_fragment();
+  AST out(token, get_string());
+  out.region = region;
+  out.definition = definition;
+  out.tag = get_string();
+  if (get_varint()) out.type = optional<AST>(new AST(get_ast()));
+  uint64_t args = get_count();
+  for (uint64_t i = 0; ok && i < args; ++i) out.args.emplace_back(get_ast());
+  return out;
+}
+
+void ImageReader::get_sum() {
+  std::string name = get_string();
+  FileFragment token = get_fragment();
+  FileFragment region = get_fragment();
+  AST ast(token, std::move(name));
+  ast.region = region;
+  uint64_t args = get_count();
+  for (uint64_t i = 0; ok && i < args; ++i) ast.args.emplace_back(token, get_string());
+
+  auto sum = std::make_shared<Sum>(std::move(ast));
+  sum->scoped = get_varint();
+  uint64_t members = get_count();
+  for (uint64_t i = 0; ok && i < members; ++i) {
+    sum->addConstructor(get_ast());
+    sum->members.back().scoped = get_varint();
+  }
+  sums.emplace_back(std::move(sum));
+}
+
+std::shared_ptr<RootPointer<Value> > ImageReader::get_literal() {
+  if (pos >= in.size()) {
+    ok = false;
+    return nullptr;
+  }
+
+  char tag = in[pos++];
+  std::shared_ptr<RootPointer<Value> > out;
+  switch (tag) {
+    case 'B': {
+      uint64_t id = get_varint();
+      if (id >= literals.size()) {
+        ok = false;
+        return nullptr;
+      }
+      return literals[id];
+    }
+    case 'S':
+      out = std::make_shared<RootPointer<Value> >(String::literal(h, get_string()));
+      break;
+    case 'I': {
+      std::string str = get_string();
+      if (str.empty()) {
+        ok = false;
+        return nullptr;
+      }
+      out = std::make_shared<RootPointer<Value> >(Integer::literal(h, str));
+      break;
+    }
+    case 'D': {
+      double x;
+      if (in.size() - pos < sizeof(x)) {
+        ok = false;
+        return nullptr;
+      }
+      memcpy(&x, in.data() + pos, sizeof(x));
+      pos += sizeof(x);
+      h.guarantee(Double::reserve());
+      out = std::make_shared<RootPointer<Value> >(h.root(Double::claim(h, x)));
+      break;
+    }
+    case 'R': {
+      // The pattern was saved as compiled, so it is not adjusted again
+      RootPointer<RegExp> exp = RegExp::literal(h, "");
+      exp->exp = RegExp::recompile(get_string());
+      out = std::make_shared<RootPointer<Value> >(std::move(exp));
+      break;
+    }
+    default:
+      ok = false;
+      return nullptr;
+  }
+
+  literals.push_back(out);
+  return out;
+}
+
+std::vector<size_t> ImageReader::get_args() {
+  std::vector<size_t> out(get_count());
+  for (auto &x : out) x = get_varint();
+  return out;
+}
+
+std::unique_ptr<Term> ImageReader::get_term() {
+  uint64_t kind = get_varint();
+  std::string label = get_string();
+  size_t flags = get_varint();
+  if (!ok) return nullptr;
+
+  std::unique_ptr<Term> out;
+  switch (kind) {
+    case TERM_RARG:
+      out.reset(new RArg(label.c_str()));
+      break;
+    case TERM_RLIT: {
+      auto value = get_literal();
+      if (!ok) return nullptr;
+      out.reset(new RLit(std::move(value), label.c_str()));
+      break;
+    }
+    case TERM_RAPP: {
+      RApp *app = new RApp(0, 0, label.c_str());
+      out.reset(app);
+      app->args = get_args();
+      break;
+    }
+    case TERM_RPRIM: {
+      std::string name = get_string();
+      out.reset(new RPrim(name.c_str(), nullptr, nullptr, 0, get_args(), label.c_str()));
+      break;
+    }
+    case TERM_RGET: {
+      RGet *get = new RGet(get_varint(), 0, label.c_str());
+      out.reset(get);
+      get->args = get_args();
+      break;
+    }
+    case TERM_RDES:
+      out.reset(new RDes(get_args(), label.c_str()));
+      break;
+    case TERM_RCON: {
+      std::shared_ptr<Constructor> cons;
+      uint64_t id = get_varint();
+      if (id == 0) {
+        cons = std::shared_ptr<Constructor>(std::make_shared<int>(0), &Constructor::array);
+      } else {
+        uint64_t index = get_varint();
+        if (id > sums.size() || index >= sums[id - 1]->members.size()) {
+          ok = false;
+          return nullptr;
+        }
+        const std::shared_ptr<Sum> &sum = sums[id - 1];
+        cons = std::shared_ptr<Constructor>(sum, &sum->members[index]);
+      }
+      out.reset(new RCon(std::move(cons), get_args(), label.c_str()));
+      break;
+    }
+    case TERM_RFUN: {
+      FileFragment fragment = get_fragment();
+      RFun *fun = new RFun(fragment, label.c_str(), flags);
+      out.reset(fun);
+      fun->hash.data[0] = get_varint();
+      fun->hash.data[1] = get_varint();
+      fun->output = get_varint();
+      fun->escapes.resize(get_count());
+      for (auto &x : fun->escapes) x = get_varint();
+      uint64_t terms = get_count();
+      for (uint64_t i = 0; ok && i < terms; ++i) fun->terms.emplace_back(get_term());
+      fun->code.resize(get_count());
+      for (auto &op : fun->code) {
+        op.code = get_varint();
+        op.output = get_varint();
+        if (op.code > OP_RETURN || (op.code < OP_TAIL && op.output >= fun->terms.size())) {
+          ok = false;
+          return nullptr;
+        }
+        op.term = op.code < OP_TAIL ? fun->terms[op.output].get() : nullptr;
+      }
+      break;
+    }
+    default:
+      ok = false;
+      return nullptr;
+  }
+
+  if (!ok) return nullptr;
+  out->flags = flags;
+  return out;
+}
+
+std::unique_ptr<Term> load_program(const std::string &image, Heap &h, ProgramFiles &files,
+                                   std::string &type) {
+  ImageReader r(image, h);
+  if (image.compare(0, sizeof(magic), magic, sizeof(magic)) != 0) return nullptr;
+  r.pos = sizeof(magic);
+
+  std::unordered_map<std::string, FileContent *> known;
+  for (auto file : files.known) known.emplace(file->filename(), file);
+
+  uint64_t nfiles = r.get_count();
+  for (uint64_t i = 0; r.ok && i < nfiles; ++i) {
+    std::string name = r.get_string();
+    FileContent *file;
+    auto it = known.find(name);
+    if (it != known.end()) {
+      file = it->second;
+    } else {
+      files.made.emplace_back(new CPPFile(name.c_str()));
+      file = files.made.back().get();
+    }
+
+    uint64_t newlines = r.get_count();
+    size_t offset = 0;
+    if (newlines) file->clearNewLines();
+    for (uint64_t j = 0; r.ok && j < newlines; ++j) {
+      offset += r.get_varint();
+      if (offset > file->segment().size()) r.ok = false;
+      if (j > 0) file->addNewline(file->segment().start + offset);
+    }
+    r.files.push_back(file);
+  }
+
+  std::vector<uint64_t> special_ids;
+  for (size_t i = 0; i < sizeof(specials) / sizeof(specials[0]); ++i)
+    special_ids.push_back(r.get_varint());
+  uint64_t nsums = r.get_count();
+  for (uint64_t i = 0; r.ok && i < nsums; ++i) r.get_sum();
+  for (auto id : special_ids)
+    if (id > r.sums.size()) r.ok = false;
+
+  type = r.get_string();
+  std::unique_ptr<Term> root = r.get_term();
+  if (!r.ok || r.pos != image.size() || !dynamic_cast<RFun *>(root.get())) return nullptr;
+
+  for (size_t i = 0; i < special_ids.size(); ++i)
+    if (special_ids[i]) *specials[i] = r.sums[special_ids[i] - 1];
+  return root;
+}
+
+bool link_program(Term *root, const PrimMap &pmap) {
+  if (RPrim *prim = dynamic_cast<RPrim *>(root)) {
+    auto it = pmap.find(prim->name);
+    if (it == pmap.end()) return false;
+    prim->fn = it->second.fn;
+    prim->data = it->second.data;
+    prim->pflags = it->second.flags;
+  } else if (RFun *fun = dynamic_cast<RFun *>(root)) {
+    for (auto &term : fun->terms)
+      if (!link_program(term.get(), pmap)) return false;
+  }
+  return true;
+}
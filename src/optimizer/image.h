@@ -0,0 +1,53 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "types/primfn.h"
+
+struct Term;
+struct Heap;
+class FileContent;
+
+// The files which fragments of a program point into. An image names them;
+// the loader points fragments back at the files the caller has read (which
+// must be unchanged) and makes empty stand-ins for the rest (C++ sources).
+struct ProgramFiles {
+  std::vector<FileContent *> known;
+  std::vector<std::unique_ptr<FileContent> > made;
+};
+
+// An image of a scoped program, so that a later run can skip parsing,
+// type-checking and optimizing wakefiles which have not changed. The type
+// of the program is kept alongside it, formatted. Returns "" if some part
+// of the program cannot be saved.
+std::string save_program(Term *root, const std::string &type);
+
+// Returns null if the image is damaged. Literals are claimed from the heap,
+// but primitives stay unresolved until the program is linked.
+std::unique_ptr<Term> load_program(const std::string &image, Heap &h, ProgramFiles &files,
+                                   std::string &type);
+
+// Resolves primitives by name; fails if one is missing from pmap
+bool link_program(Term *root, const PrimMap &pmap);
+
+#endif
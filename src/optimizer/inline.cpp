@@ -295,6 +295,7 @@ void RFun::pass_inline(PassInline &p, std::unique_ptr<Term> self) {
 
 std::unique_ptr<Term> Term::pass_inline(std::unique_ptr<Term> term, size_t threshold,
                                         Runtime &runtime) {
+  Phase phase("pass_inline");
   PassInlineCommon common(&runtime, threshold);
   PassInline pass(common);
   // Top-level functions are not candidates for movement (inlining is still ok)
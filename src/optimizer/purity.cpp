@@ -96,6 +96,7 @@ void RFun::pass_purity(PassPurity &p) {
 }
 
 std::unique_ptr<Term> Term::pass_purity(std::unique_ptr<Term> term, int pflag, size_t sflag) {
+  Phase phase("pass_purity");
   PassPurity pass(pflag, sflag);
   pass.scope.push(term.get());
   do {
@@ -40,6 +40,7 @@ struct PassScope {
   size_t index;
   std::vector<size_t> escapes;
   std::vector<uint64_t> codes;
+  std::vector<Op> ops;
   PassScope(Runtime &runtime_, PassScope *next_, size_t start_)
       : runtime(runtime_), next(next_), start(start_), index(start_) {}
 };
@@ -66,9 +67,14 @@ static size_t scope_arg(PassScope &p, size_t input) {
   }
 }
 
+static void emit(PassScope &p, OpCode code, Term *term) {
+  p.ops.push_back(Op{code, static_cast<uint32_t>(p.index - p.start), term});
+}
+
 void RArg::pass_scope(PassScope &p) { p.codes.push_back(TYPE_RARG); }
 
 void RLit::pass_scope(PassScope &p) {
+  emit(p, OP_LIT, this);
   p.codes.push_back(TYPE_RLIT);
   (*value)->deep_hash(p.runtime.heap).push(p.codes);
 }
@@ -79,21 +85,30 @@ static void scope_redux(PassScope &p, Redux *redux, size_t type) {
   for (auto &x : redux->args) x = scope_arg(p, x);
 }
 
-void RApp::pass_scope(PassScope &p) { scope_redux(p, this, TYPE_RAPP); }
+void RApp::pass_scope(PassScope &p) {
+  emit(p, OP_APP, this);
+  scope_redux(p, this, TYPE_RAPP);
+}
 
 void RPrim::pass_scope(PassScope &p) {
+  emit(p, OP_PRIM, this);
   scope_redux(p, this, TYPE_RPRIM);
   Hash(name).push(p.codes);
 }
 
 void RGet::pass_scope(PassScope &p) {
+  emit(p, OP_GET, this);
   scope_redux(p, this, TYPE_RGET);
   p.codes.push_back(index);
 }
 
-void RDes::pass_scope(PassScope &p) { scope_redux(p, this, TYPE_RDES); }
+void RDes::pass_scope(PassScope &p) {
+  emit(p, OP_DES, this);
+  scope_redux(p, this, TYPE_RDES);
+}
 
 void RCon::pass_scope(PassScope &p) {
+  emit(p, OP_CON, this);
   scope_redux(p, this, TYPE_RCON);
   Hash(kind->ast.name).push(p.codes);
 }
@@ -110,12 +125,22 @@ void RFun::pass_scope(PassScope &p) {
   hash = Hash(frame.codes);
   escapes = std::move(frame.escapes);
 
+  // A final Term which is also the output can hand its result straight to our caller
+  code = std::move(frame.ops);
+  if (!terms.empty() && output == make_arg(0, terms.size() - 1) && terms.back()->tailCallOk()) {
+    code.insert(code.end() - 1, Op{OP_TAIL, 0, nullptr});
+  } else {
+    code.push_back(Op{OP_RETURN, 0, nullptr});
+  }
+
+  emit(p, OP_FUN, this);
   p.codes.push_back(TYPE_RFUN);
   hash.push(p.codes);
   for (auto &x : escapes) x = scope_arg(p, x);
 }
 
 std::unique_ptr<Term> Term::scope(std::unique_ptr<Term> term, Runtime &runtime) {
+  Phase phase("scope");
   PassScope pass(runtime, nullptr, 0);
   term->pass_scope(pass);
   return term;
@@ -25,7 +25,7 @@
 
 const size_t Term::invalid;
 
-Term::~Term() {}
+Term::~Term() { count_object(live_terms, -1); }
 
 void Redux::update(const SourceMap &map) {
   for (auto &x : args) x = map[x];
@@ -204,6 +204,7 @@ std::vector<std::unique_ptr<Term> > TargetScope::unwind(size_t newend) {
 }
 
 std::unique_ptr<Term> Term::optimize(std::unique_ptr<Term> term, Runtime &runtime) {
+  Phase phase("optimize");
   term = Term::pass_purity(std::move(term), PRIM_EFFECT, SSA_EFFECT);
   term = Term::pass_purity(std::move(term), PRIM_ORDERED, SSA_ORDERED);
   term = Term::pass_usage(std::move(term));
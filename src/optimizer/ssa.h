@@ -28,6 +28,7 @@
 #include "types/primfn.h"
 #include "util/hash.h"
 #include "util/location.h"
+#include "util/phases.h"
 
 struct Value;
 struct Expr;
@@ -65,7 +66,12 @@ struct Term {
   uintptr_t meta;     // temporary scratch space for a pass
 
   Term(const char *label_, size_t flags_ = 0, uintptr_t meta_ = 0)
-      : label(label_), flags(flags_), meta(meta_) {}
+      : label(label_), flags(flags_), meta(meta_) {
+    count_object(live_terms, 1);
+  }
+  Term(const Term &x) : label(x.label), flags(x.flags), meta(x.meta) {
+    count_object(live_terms, 1);
+  }
   const std::type_info &id() { return typeid(*this); }
   void set(size_t flag, bool value) {
     flags = (flags & ~flag) | (-static_cast<size_t>(value) & flag);
@@ -75,7 +81,6 @@ struct Term {
   virtual ~Term();
   virtual std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const = 0;
   virtual void format(std::ostream &os, TermFormat &format) const = 0;
-  virtual void interpret(InterpretContext &context) = 0;
   virtual bool tailCallOk() const = 0;
 
   // All terms must implement their pass behaviour
@@ -116,6 +121,15 @@ inline size_t arg_depth(size_t arg) { return arg & 65535; }
 inline size_t arg_offset(size_t arg) { return arg >> 16; }
 inline size_t make_arg(size_t depth, size_t offset) { return (offset << 16) | depth; }
 
+// After scope pass, RFun.code is the program run by Interpret::execute
+enum OpCode { OP_LIT, OP_FUN, OP_CON, OP_GET, OP_DES, OP_PRIM, OP_APP, OP_TAIL, OP_RETURN };
+
+struct Op {
+  uint32_t code;    // OpCode
+  uint32_t output;  // index into Scope of the Term's result
+  Term *term;       // the Term with this output, whose kind matches code
+};
+
 struct Redux : public Term {
   std::vector<size_t> args;
 
@@ -129,7 +143,6 @@ struct RArg final : public Leaf {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -148,7 +161,7 @@ struct RLit final : public Leaf {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -165,7 +178,7 @@ struct RApp final : public Redux {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -188,7 +201,7 @@ struct RPrim final : public Redux {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -207,7 +220,7 @@ struct RGet final : public Redux {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -224,7 +237,7 @@ struct RDes final : public Redux {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -244,7 +257,7 @@ struct RCon final : public Redux {
 
   void format(std::ostream &os, TermFormat &format) const override;
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -261,6 +274,7 @@ struct RFun final : public Term {
   size_t output;  // output can refer to a non-member Term
   std::vector<std::unique_ptr<Term> > terms;
   std::vector<size_t> escapes;
+  std::vector<Op> code;  // RArgs elided; ends in OP_RETURN or OP_TAIL + op
 
   RFun(const RFun &o, TargetScope &scope, size_t id);
   RFun(const FileFragment &fragment_, const char *label_, size_t flags_,
@@ -272,7 +286,7 @@ struct RFun final : public Term {
 
   std::unique_ptr<Term> clone(TargetScope &scope, size_t id) const override;
   void format(std::ostream &os, TermFormat &format) const override;
-  void interpret(InterpretContext &context) override;
+  void interpret(InterpretContext &context);
   bool tailCallOk() const override;
 
   void pass_purity(PassPurity &p) override;
@@ -56,6 +56,7 @@ void RFun::pass_sweep(PassSweep &p) {
 }
 
 std::unique_ptr<Term> Term::pass_sweep(std::unique_ptr<Term> term) {
+  Phase phase("pass_sweep");
   TargetScope scope;
   PassSweep pass(scope);
   pass.stream.transfer(std::move(term));
@@ -182,6 +182,7 @@ static void doit(ToSSACommon common, TermStack *stack, Expr *expr) {
 }
 
 std::unique_ptr<Term> Term::fromExpr(std::unique_ptr<Expr> expr, Runtime &runtime) {
+  Phase phase("fromExpr");
   TargetScope scope;
   ToSSACommon common(runtime, scope);
   RFun *out = new RFun(FRAGMENT_CPP_LINE, "top", 0);
@@ -65,6 +65,7 @@ void RFun::pass_usage(PassUsage &p) {
 }
 
 std::unique_ptr<Term> Term::pass_usage(std::unique_ptr<Term> term) {
+  Phase phase("pass_usage");
   PassUsage pass;
   pass.scope.push(term.get());
   term->pass_usage(pass);
@@ -21,26 +21,216 @@
 
 #include "database.h"
 
+#include <signal.h>
 #include <sqlite3.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <sstream>
-#include <unordered_set>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "status.h"
+#include "util/hash.h"
 
 // Increment every time the database schema changes
-#define SCHEMA_VERSION "5"
+#define SCHEMA_VERSION "9"
 
 #define VISIBLE 0
 #define INPUT 1
 #define OUTPUT 2
 #define INDEXES 3
 
+// A row of the files table, as kept in memory. Hashes of 64 hex digits,
+// which is nearly all of them, are kept as 32 bytes. Other hash text is
+// kept as-is if it fits.
+#define FILE_HASH_BYTES 32
+#define FILE_HASH_BINARY 0xff
+struct FileRow {
+  file_stamp stamp;
+  uint8_t hash[FILE_HASH_BYTES];
+  uint8_t length;  // FILE_HASH_BINARY, or the length of the text in hash
+  bool dirty;      // not yet written to the database
+
+  FileRow() : length(0), dirty(false) { memset(&stamp, 0, sizeof(stamp)); }
+
+  bool set_hash(const std::string &text);  // false if it does not fit
+  std::string get_hash() const;
+};
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+bool FileRow::set_hash(const std::string &text) {
+  if (text.size() == 2 * FILE_HASH_BYTES) {
+    bool binary = true;
+    for (size_t i = 0; binary && i < FILE_HASH_BYTES; ++i) {
+      int hi = hex_digit(text[2 * i]);
+      int lo = hex_digit(text[2 * i + 1]);
+      binary = hi >= 0 && lo >= 0;
+      hash[i] = (hi << 4) | lo;
+    }
+    if (binary) {
+      length = FILE_HASH_BINARY;
+      return true;
+    }
+  }
+
+  if (text.size() > FILE_HASH_BYTES) return false;
+  memcpy(hash, text.data(), text.size());
+  length = text.size();
+  return true;
+}
+
+std::string FileRow::get_hash() const {
+  if (length != FILE_HASH_BINARY) return std::string(reinterpret_cast<const char *>(hash), length);
+
+  static const char digits[] = "0123456789abcdef";
+  std::string out(2 * FILE_HASH_BYTES, '0');
+  for (size_t i = 0; i < FILE_HASH_BYTES; ++i) {
+    out[2 * i] = digits[hash[i] >> 4];
+    out[2 * i + 1] = digits[hash[i] & 15];
+  }
+  return out;
+}
+
+static bool same_stamp(const file_stamp &a, const file_stamp &b) {
+  return a.device == b.device && a.inode == b.inode && a.size == b.size &&
+         a.mtime_ns == b.mtime_ns && a.ctime_ns == b.ctime_ns;
+}
+
+// Output of a running job, kept in memory until there is enough of it to
+// be worth compressing into one row of the log table. Each read from the
+// job's pipes is one chunk; the index records where the chunks begin.
+struct PendingLog {
+  std::string data;
+  std::string index;  // LOG_CHUNK_BYTES per chunk
+};
+
+// Segments are flushed once they hold this much output
+#define LOG_SEGMENT_BYTES (256 * 1024)
+// Job output is written on the main thread; favour speed over ratio
+#define LOG_DEFLATE_LEVEL 1
+// A chunk is: 4 bytes of length, 1 of descriptor, 8 of microseconds after job start
+#define LOG_CHUNK_BYTES 13
+
+static void put_le(std::string &out, uint64_t x, int bytes) {
+  for (int i = 0; i < bytes; ++i) out.push_back(static_cast<char>(x >> (8 * i)));
+}
+
+static uint64_t get_le(const uint8_t *in, int bytes) {
+  uint64_t x = 0;
+  for (int i = 0; i < bytes; ++i) x |= static_cast<uint64_t>(in[i]) << (8 * i);
+  return x;
+}
+
+// The visible files of a job, indexed by the hashes of their paths, so
+// that checking a cached job's inputs costs one probe per input. Jobs
+// mostly share a few visible lists, so the lists of recent calls are kept.
+struct VisibleSet {
+  size_t key;         // std::hash of files
+  std::string files;  // NUL-separated paths
+  std::vector<std::pair<uint64_t, size_t> > index;  // path hash => offset in files, sorted
+
+  VisibleSet(size_t key_, const std::string &files_);
+  bool contains(const char *path, size_t length) const;
+};
+
+// How many visible lists reuse_job keeps indexed
+#define VISIBLE_SETS 8
+
+static uint64_t path_hash(const char *path, size_t length) { return Hash(path, length).data[0]; }
+
+VisibleSet::VisibleSet(size_t key_, const std::string &files_) : key(key_), files(files_) {
+  const char *start = files.c_str();
+  const char *tok = start;
+  const char *end = tok + files.size();
+  for (const char *scan = tok; scan != end; ++scan) {
+    if (*scan != 0) continue;
+    if (scan != tok) index.emplace_back(path_hash(tok, scan - tok), tok - start);
+    tok = scan + 1;
+  }
+  std::sort(index.begin(), index.end());
+}
+
+bool VisibleSet::contains(const char *path, size_t length) const {
+  auto it = std::lower_bound(index.begin(), index.end(),
+                             std::make_pair(path_hash(path, length), size_t(0)));
+  for (; it != index.end() && it->first == path_hash(path, length); ++it) {
+    const char *file = files.c_str() + it->second;
+    if (strlen(file) == length && memcmp(file, path, length) == 0) return true;
+  }
+  return false;
+}
+
+// Outputs of a cached job are checked from several threads once there are
+// this many per thread
+#define OUTPUTS_PER_THREAD 512
+#define MAX_OUTPUT_THREADS 8
+
+static bool outputs_exist(const std::vector<FileReflection> &files) {
+  size_t threads = std::min(files.size() / OUTPUTS_PER_THREAD, size_t(MAX_OUTPUT_THREADS));
+  threads = std::min(threads, size_t(std::thread::hardware_concurrency()));
+
+  std::atomic<bool> missing(false);
+  std::atomic<size_t> next(0);
+  auto check = [&]() {
+    size_t i;
+    while (!missing && (i = next.fetch_add(OUTPUTS_PER_THREAD)) < files.size()) {
+      size_t end = std::min(files.size(), i + OUTPUTS_PER_THREAD);
+      for (; i < end; ++i) {
+        if (access(files[i].path.c_str(), R_OK) != 0) {
+          missing = true;
+          break;
+        }
+      }
+    }
+  };
+
+  if (threads <= 1) {
+    check();
+    return !missing;
+  }
+
+  // The helpers never take signals meant for the main thread
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < threads; ++i) helpers.emplace_back(check);
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+  check();
+  for (auto &helper : helpers) helper.join();
+  return !missing;
+}
+
+// A write to wake.db, waiting for the writer thread to commit it
+struct QueuedWrite {
+  std::function<void()> run;
+  long job;    // the job it changes, or 0
+  bool reuse;  // it could change what reuse_job finds
+  std::chrono::steady_clock::time_point queued;
+};
+
+// The writer commits queued writes once the oldest has waited this long,
+// or sooner if this many are waiting
+#define WRITE_LATENCY std::chrono::milliseconds(20)
+#define WRITE_BATCH 1024
+
 struct Database::detail {
   bool debugdb;
   sqlite3 *db;
@@ -57,8 +247,7 @@ struct Database::detail {
   sqlite3_stmt *wipe_file;
   sqlite3_stmt *insert_file;
   sqlite3_stmt *update_file;
-  sqlite3_stmt *get_log;
-  sqlite3_stmt *replay_log;
+  sqlite3_stmt *read_log;
   sqlite3_stmt *get_tree;
   sqlite3_stmt *add_stats;
   sqlite3_stmt *link_stats;
@@ -71,7 +260,6 @@ struct Database::detail {
   sqlite3_stmt *find_owner;
   sqlite3_stmt *find_last;
   sqlite3_stmt *find_failed;
-  sqlite3_stmt *fetch_hash;
   sqlite3_stmt *delete_jobs;
   sqlite3_stmt *delete_dups;
   sqlite3_stmt *delete_stats;
@@ -88,6 +276,53 @@ struct Database::detail {
   sqlite3_stmt *remove_all_jobs;
   sqlite3_stmt *get_unhashed_file_paths;
   sqlite3_stmt *insert_unhashed_file;
+  sqlite3_stmt *load_files;
+  sqlite3_stmt *last_job;
+  sqlite3_stmt *get_target;
+  sqlite3_stmt *get_observations;
+  sqlite3_stmt *insert_observations;
+  sqlite3_stmt *insert_target;
+  sqlite3_stmt *delete_targets;
+  sqlite3_stmt *delete_observations;
+  sqlite3_stmt *get_program;
+  sqlite3_stmt *delete_programs;
+  sqlite3_stmt *delete_program;
+  sqlite3_stmt *insert_program;
+
+  // The files table is loaded once, on first use. Changes are written
+  // back in one transaction before anything else reads the table.
+  bool files_loaded;
+  std::unordered_map<std::string, FileRow> files;
+  std::vector<std::pair<const std::string, FileRow> *> dirty_files;
+
+  // Indexed visible lists of recent reuse_job calls, most recent first
+  std::vector<std::unique_ptr<VisibleSet> > visible_sets;
+
+  // Output of running jobs not yet written to the log table
+  std::unordered_map<long, PendingLog> pending_logs;
+  // Whether a hash in memory changed since the files table was last queued
+  bool files_changed;
+
+  // Held by whichever thread is using the sqlite connection
+  std::mutex db_mutex;
+  // Guards the queue and everything after it
+  std::mutex queue_mutex;
+  std::condition_variable wakeup;
+  std::vector<QueuedWrite> queue;
+  size_t uncommitted;                         // queued or committing writes
+  std::unordered_map<long, int> queued_jobs;  // job => queued or committing writes to it
+  int queued_reuse;                           // queued or committing writes which affect reuse
+  std::vector<std::string> write_errors;      // for the main thread to report
+  bool write_failed;
+  bool stopping;
+  WriteStats write_stats;
+  std::thread writer;
+
+  // Job ids are handed out here, so that inserting a job can be queued
+  long next_job;
+
+  // Target results kept by other programs can never be reused
+  std::string target_program;
 
   long run_id;
   detail(bool debugdb_)
@@ -106,8 +341,7 @@ struct Database::detail {
         wipe_file(0),
         insert_file(0),
         update_file(0),
-        get_log(0),
-        replay_log(0),
+        read_log(0),
         get_tree(0),
         add_stats(0),
         link_stats(0),
@@ -120,7 +354,6 @@ struct Database::detail {
         find_owner(0),
         find_last(0),
         find_failed(0),
-        fetch_hash(0),
         delete_jobs(0),
         delete_dups(0),
         delete_stats(0),
@@ -131,7 +364,27 @@ struct Database::detail {
         get_all_tags(0),
         get_edges(0),
         get_job_visualization(0),
-        get_file_access(0) {}
+        get_file_access(0),
+        load_files(0),
+        last_job(0),
+        get_target(0),
+        get_observations(0),
+        insert_observations(0),
+        insert_target(0),
+        delete_targets(0),
+        delete_observations(0),
+        get_program(0),
+        delete_programs(0),
+        delete_program(0),
+        insert_program(0),
+        files_loaded(false),
+        files_changed(false),
+        uncommitted(0),
+        queued_reuse(0),
+        write_failed(false),
+        stopping(false),
+        write_stats{0, 0, 0, 0, 0, 0, 0, 0},
+        next_job(0) {}
 };
 
 static void close_db(Database::detail *imp) {
@@ -168,6 +421,9 @@ static int schema_cb(void *data, int columns, char **values, char **labels) {
   return -1;
 }
 
+static void start_writer(Database::detail *imp);
+static void stop_writer(Database::detail *imp);
+
 std::string Database::open(bool wait, bool memory, bool tty) {
   if (imp->db) return "";
   // Increment the SCHEMA_VERSION every time the below string changes.
@@ -191,7 +447,11 @@ std::string Database::open(bool wait, bool memory, bool tty) {
       "  file_id  integer primary key,"
       "  path     text    not null,"
       "  hash     text    not null,"
-      "  modified integer not null);"
+      "  modified integer not null,"  // the file_stamp the hash was computed for
+      "  device   integer not null,"
+      "  inode    integer not null,"
+      "  size     integer not null,"
+      "  changed  integer not null);"
       "create unique index if not exists filenames on files(path);"
       "create table if not exists stats("
       "  stat_id    integer primary key autoincrement,"
@@ -233,10 +493,10 @@ std::string Database::open(bool wait, bool memory, bool tty) {
       "create table if not exists log("
       "  log_id     integer primary key autoincrement,"
       "  job_id     integer not null references jobs(job_id) on delete cascade,"
-      "  descriptor integer not null,"  // 1=stdout, 2=stderr"
-      "  seconds    real    not null,"  // seconds after job start
-      "  output     text    not null);"
-      "create index if not exists logorder on log(job_id, descriptor, log_id);"
+      "  chunks     blob    not null,"  // per read: length, descriptor, microseconds after start
+      "  length     integer not null,"  // bytes of output in this segment
+      "  output     blob    not null);"  // deflated, unless that would not be smaller
+      "create index if not exists logorder on log(job_id, log_id);"
       "create table if not exists tags("
       "  job_id  integer not null references jobs(job_id) on delete cascade,"
       "  uri     text,"
@@ -246,7 +506,21 @@ std::string Database::open(bool wait, bool memory, bool tty) {
       "  unhashed_file_id integer primary key autoincrement,"
       "  job_id integer not null references jobs(job_id) on delete cascade,"
       "  path             text not null);"
-      "create index if not exists unhashed_outputs on unhashed_files(job_id);";
+      "create index if not exists unhashed_outputs on unhashed_files(job_id);"
+      "create table if not exists observations("
+      "  run_id  integer primary key references runs(run_id),"
+      "  log     blob    not null);"  // kind, argument and result of each observation
+      "create table if not exists targets("
+      "  hash     blob    primary key,"  // hash(program, target, arguments)
+      "  program  blob    not null,"     // hash(program)
+      "  run_id   integer not null references observations(run_id),"
+      "  observed integer not null,"  // the result depends on this many of the run's observations
+      "  value    blob    not null);"
+      "create index if not exists targetruns on targets(run_id);"
+      "create table if not exists programs("
+      "  hash  blob primary key,"  // hash(wake version, wakefiles, command)
+      "  files blob not null,"     // hash(wakefiles)
+      "  image blob not null);";
 
   bool waiting = false;
   int ret;
@@ -324,25 +598,26 @@ std::string Database::open(bool wait, bool memory, bool tty) {
       "select status, runtime, cputime, membytes, ibytes, obytes, pathtime"
       " from stats where stat_id=?";
   const char *sql_insert_job =
-      "insert into jobs(run_id, use_id, label, directory, commandline, environment, stdin, "
-      "signature, stack)"
-      " values(?, ?1, ?, ?, ?, ?, ?, ?, ?)";
+      "insert into jobs(job_id, run_id, use_id, label, directory, commandline, environment, "
+      "stdin, signature, stack)"
+      " values(?1, ?2, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9)";
   const char *sql_insert_tree =
       "insert into filetree(access, job_id, file_id)"
       " values(?, ?, (select file_id from files where path=?))";
   const char *sql_insert_log =
-      "insert into log(job_id, descriptor, seconds, output)"
+      "insert into log(job_id, chunks, length, output)"
       " values(?, ?, ?, ?)";
   const char *sql_wipe_file =
       "update jobs set stale=1 where job_id in"
       " (select t.job_id from files f, filetree t"
       "  where f.path=? and f.hash<>? and t.file_id=f.file_id and t.access=1)";
   const char *sql_insert_file =
-      "insert or ignore into files(hash, modified, path) values (?, ?, ?)";
-  const char *sql_update_file = "update files set hash=?, modified=? where path=?";
-  const char *sql_get_log =
-      "select output from log where job_id=? and descriptor=? order by log_id";
-  const char *sql_replay_log = "select descriptor, output from log where job_id=? order by log_id";
+      "insert or ignore into files(hash, modified, device, inode, size, changed, path)"
+      " values (?, ?, ?, ?, ?, ?, ?)";
+  const char *sql_update_file =
+      "update files set hash=?, modified=?, device=?, inode=?, size=?, changed=? where path=?";
+  const char *sql_read_log =
+      "select chunks, length, output from log where job_id=? order by log_id";
   const char *sql_get_tree =
       "select f.path, f.hash from filetree t, files f"
       " where t.job_id=? and t.access=? and f.file_id=t.file_id order by t.tree_id";
@@ -397,7 +672,6 @@ std::string Database::open(bool wait, bool memory, bool tty) {
       "s.membytes, s.ibytes, s.obytes"
       " from jobs j left join stats s on j.stat_id=s.stat_id join runs r on j.run_id=r.run_id"
       " where s.status<>0 order by j.job_id";
-  const char *sql_fetch_hash = "select hash from files where path=? and modified=?";
   const char *sql_delete_jobs =
       "delete from jobs where job_id in"
       " (select job_id from jobs where keep=0 and use_id<>? except select job_id from filetree "
@@ -461,6 +735,25 @@ std::string Database::open(bool wait, bool memory, bool tty) {
   const char *sql_remove_all_jobs = "delete from jobs";
   const char *sql_get_unhashed_file_paths = "select path from unhashed_files";
   const char *sql_insert_unhashed_file = "insert into unhashed_files(job_id, path) values(?, ?)";
+  const char *sql_load_files =
+      "select path, hash, modified, device, inode, size, changed from files";
+  const char *sql_last_job =
+      "select max(coalesce((select seq from sqlite_sequence where name='jobs'), 0),"
+      " coalesce((select max(job_id) from jobs), 0))";
+  const char *sql_get_target = "select run_id, observed, value from targets where hash=?";
+  const char *sql_get_observations = "select log from observations where run_id=?";
+  const char *sql_insert_observations = "insert into observations(run_id, log) values(?, ?)";
+  const char *sql_insert_target =
+      "insert or replace into targets(hash, program, run_id, observed, value)"
+      " values(?, ?, ?, ?, ?)";
+  const char *sql_delete_targets = "delete from targets where program<>?";
+  const char *sql_delete_observations =
+      "delete from observations where run_id not in (select run_id from targets)";
+  const char *sql_get_program = "select image from programs where hash=?";
+  const char *sql_delete_programs = "delete from programs where files<>?";
+  const char *sql_delete_program = "delete from programs where hash=?";
+  const char *sql_insert_program =
+      "insert or replace into programs(hash, files, image) values(?, ?, ?)";
 
 #define PREPARE(sql, member)                                                                     \
   ret = sqlite3_prepare_v2(imp->db, sql, -1, &imp->member, 0);                                   \
@@ -483,8 +776,7 @@ std::string Database::open(bool wait, bool memory, bool tty) {
   PREPARE(sql_wipe_file, wipe_file);
   PREPARE(sql_insert_file, insert_file);
   PREPARE(sql_update_file, update_file);
-  PREPARE(sql_get_log, get_log);
-  PREPARE(sql_replay_log, replay_log);
+  PREPARE(sql_read_log, read_log);
   PREPARE(sql_get_tree, get_tree);
   PREPARE(sql_add_stats, add_stats);
   PREPARE(sql_link_stats, link_stats);
@@ -497,7 +789,6 @@ std::string Database::open(bool wait, bool memory, bool tty) {
   PREPARE(sql_find_owner, find_owner);
   PREPARE(sql_find_last, find_last);
   PREPARE(sql_find_failed, find_failed);
-  PREPARE(sql_fetch_hash, fetch_hash);
   PREPARE(sql_delete_jobs, delete_jobs);
   PREPARE(sql_delete_dups, delete_dups);
   PREPARE(sql_delete_stats, delete_stats);
@@ -514,6 +805,21 @@ std::string Database::open(bool wait, bool memory, bool tty) {
   PREPARE(sql_remove_all_jobs, remove_all_jobs);
   PREPARE(sql_get_unhashed_file_paths, get_unhashed_file_paths);
   PREPARE(sql_insert_unhashed_file, insert_unhashed_file);
+  PREPARE(sql_load_files, load_files);
+  PREPARE(sql_last_job, last_job);
+  PREPARE(sql_get_target, get_target);
+  PREPARE(sql_get_observations, get_observations);
+  PREPARE(sql_insert_observations, insert_observations);
+  PREPARE(sql_insert_target, insert_target);
+  PREPARE(sql_delete_targets, delete_targets);
+  PREPARE(sql_delete_observations, delete_observations);
+  PREPARE(sql_get_program, get_program);
+  PREPARE(sql_delete_programs, delete_programs);
+  PREPARE(sql_delete_program, delete_program);
+  PREPARE(sql_insert_program, insert_program);
+
+  // With --debug-db, statements are logged as they run; keep them in order
+  if (!imp->debugdb) start_writer(imp.get());
 
   return "";
 }
@@ -521,6 +827,8 @@ std::string Database::open(bool wait, bool memory, bool tty) {
 void Database::close() {
   int ret;
 
+  if (imp->db) stop_writer(imp.get());
+
 #define FINALIZE(member)                                                                       \
   if (imp->member) {                                                                           \
     ret = sqlite3_finalize(imp->member);                                                       \
@@ -545,8 +853,7 @@ void Database::close() {
   FINALIZE(wipe_file);
   FINALIZE(insert_file);
   FINALIZE(update_file);
-  FINALIZE(get_log);
-  FINALIZE(replay_log);
+  FINALIZE(read_log);
   FINALIZE(get_tree);
   FINALIZE(add_stats);
   FINALIZE(link_stats);
@@ -559,7 +866,6 @@ void Database::close() {
   FINALIZE(find_owner);
   FINALIZE(find_last);
   FINALIZE(find_failed);
-  FINALIZE(fetch_hash);
   FINALIZE(delete_jobs);
   FINALIZE(delete_dups);
   FINALIZE(delete_stats);
@@ -576,6 +882,18 @@ void Database::close() {
   FINALIZE(remove_all_jobs);
   FINALIZE(get_unhashed_file_paths);
   FINALIZE(insert_unhashed_file);
+  FINALIZE(load_files);
+  FINALIZE(last_job);
+  FINALIZE(get_target);
+  FINALIZE(get_observations);
+  FINALIZE(insert_observations);
+  FINALIZE(insert_target);
+  FINALIZE(delete_targets);
+  FINALIZE(delete_observations);
+  FINALIZE(get_program);
+  FINALIZE(delete_programs);
+  FINALIZE(delete_program);
+  FINALIZE(insert_program);
 
   close_db(imp.get());
 }
@@ -686,10 +1004,185 @@ static std::string rip_column(sqlite3_stmt *stmt, int col) {
                      sqlite3_column_bytes(stmt, col));
 }
 
+// Commits everything queued so far in one transaction, on whichever
+// thread gets here. The writes themselves never run on two threads at once.
+static void commit_writes(Database::detail *imp) {
+  std::lock_guard<std::mutex> db(imp->db_mutex);
+
+  std::vector<QueuedWrite> batch;
+  {
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    batch.swap(imp->queue);
+    imp->write_stats.queued = 0;
+  }
+  if (batch.empty()) return;
+
+  auto start = std::chrono::steady_clock::now();
+  single_step("Could not begin a transaction", imp->begin_txn, imp->debugdb);
+  for (auto &write : batch) write.run();
+  single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
+  auto end = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> lock(imp->queue_mutex);
+  for (auto &write : batch) {
+    if (write.job && --imp->queued_jobs[write.job] == 0) imp->queued_jobs.erase(write.job);
+    if (write.reuse) --imp->queued_reuse;
+  }
+  imp->uncommitted -= batch.size();
+
+  std::chrono::duration<double> busy = end - start;
+  std::chrono::duration<double> latency = end - batch.front().queued;
+  WriteStats &stats = imp->write_stats;
+  stats.writes += batch.size();
+  ++stats.commits;
+  stats.busy += busy.count();
+  stats.latency += latency.count();
+  if (latency.count() > stats.max_latency) stats.max_latency = latency.count();
+}
+
+static void write_behind(Database::detail *imp) {
+  std::unique_lock<std::mutex> lock(imp->queue_mutex);
+  while (true) {
+    imp->wakeup.wait(lock, [imp]() { return imp->stopping || !imp->queue.empty(); });
+    if (imp->stopping) return;  // stop_writer commits whatever is left
+
+    // Give more writes the chance to join this transaction
+    auto deadline = imp->queue.front().queued + WRITE_LATENCY;
+    imp->wakeup.wait_until(lock, deadline, [imp]() {
+      return imp->stopping || imp->queue.size() >= WRITE_BATCH;
+    });
+
+    lock.unlock();
+    commit_writes(imp);
+    lock.lock();
+  }
+}
+
+static void start_writer(Database::detail *imp) {
+  // Signals are for the main thread; the writer never takes them
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  imp->writer = std::thread(write_behind, imp);
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+}
+
+static void join_writer(Database::detail *imp) {
+  if (!imp->writer.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    imp->stopping = true;
+  }
+  imp->wakeup.notify_all();
+  imp->writer.join();
+}
+
+// Errors found by queued writes are reported on the main thread
+static void report_write_errors(Database::detail *imp) {
+  std::vector<std::string> errors;
+  bool failed;
+  {
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    errors.swap(imp->write_errors);
+    failed = imp->write_failed;
+  }
+  for (auto &error : errors) status_write(STREAM_ERROR, error);
+  if (failed) {
+    join_writer(imp);
+    commit_writes(imp);
+    exit(1);
+  }
+}
+
+static void queue_write(Database::detail *imp, long job, bool reuse, std::function<void()> run) {
+  bool wake;
+  {
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    imp->queue.push_back(QueuedWrite{std::move(run), job, reuse, std::chrono::steady_clock::now()});
+    ++imp->uncommitted;
+    if (job) ++imp->queued_jobs[job];
+    if (reuse) ++imp->queued_reuse;
+    WriteStats &stats = imp->write_stats;
+    stats.queued = imp->queue.size();
+    if (stats.queued > stats.max_queued) stats.max_queued = stats.queued;
+    // The writer only needs a nudge to start waiting, or to stop
+    wake = stats.queued == 1 || stats.queued == WRITE_BATCH;
+  }
+
+  if (!imp->writer.joinable()) {
+    commit_writes(imp);
+  } else if (wake) {
+    imp->wakeup.notify_one();
+  }
+  report_write_errors(imp);
+}
+
+static void queue_files(Database::detail *imp);
+static void queue_log(Database::detail *imp, long job);
+static void queue_logs(Database::detail *imp);
+
+// What a read needs to see committed before it runs
+enum SyncFor { SYNC_ALL, SYNC_REUSE, SYNC_JOB };
+
+static void sync_writes(Database::detail *imp, SyncFor what, long job = 0) {
+  if (what == SYNC_ALL) queue_logs(imp);
+  if (what == SYNC_JOB) queue_log(imp, job);
+  if (what != SYNC_JOB) queue_files(imp);
+
+  {
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    bool needed;
+    switch (what) {
+      case SYNC_ALL:
+        needed = imp->uncommitted != 0;
+        break;
+      case SYNC_REUSE:
+        needed = imp->queued_reuse != 0;
+        break;
+      default:
+        needed = imp->queued_jobs.count(job) != 0;
+        break;
+    }
+    if (!needed) return;
+    ++imp->write_stats.syncs;
+  }
+
+  commit_writes(imp);
+  report_write_errors(imp);
+}
+
+static void stop_writer(Database::detail *imp) {
+  join_writer(imp);
+  sync_writes(imp, SYNC_ALL);
+
+  WriteStats stats = imp->write_stats;
+  if (stats.commits != 0) {
+    std::stringstream s;
+    s << "wake: committed " << stats.writes << " writes to wake.db in " << stats.commits
+      << " transactions (" << stats.busy << "s); at most " << stats.max_queued
+      << " were queued, for " << 1000 * stats.max_latency << "ms at worst" << std::endl;
+    status_write(STREAM_LOG, s.str());
+  }
+}
+
+// The files table can lag behind the hashes in memory
+static std::string current_hash(Database::detail *imp, const std::string &path,
+                                std::string &&stored) {
+  auto it = imp->files.find(path);
+  return it == imp->files.end() ? std::move(stored) : it->second.get_hash();
+}
+
+WriteStats Database::write_stats() const {
+  std::lock_guard<std::mutex> lock(imp->queue_mutex);
+  return imp->write_stats;
+}
+
 void Database::entropy(uint64_t *key, int words) {
   const char *why = "Could not restore entropy";
   int word;
 
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   begin_txn();
 
   // Use entropy from DB
@@ -714,6 +1207,8 @@ void Database::prepare(const std::string &cmdline) {
   int64_t ts = static_cast<int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
 
   const char *why = "Could not insert run";
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   bind_integer(why, imp->add_run, 1, ts);
   bind_string(why, imp->add_run, 2, cmdline);
   single_step(why, imp->add_run, imp->debugdb);
@@ -722,6 +1217,8 @@ void Database::prepare(const std::string &cmdline) {
 
 void Database::clean() {
   const char *why = "Could not compute critical path";
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   begin_txn();
   while (sqlite3_step(imp->revtop_order) == SQLITE_ROW) {
     bind_integer(why, imp->setcrit_path, 1, sqlite3_column_int64(imp->revtop_order, 0));
@@ -734,6 +1231,11 @@ void Database::clean() {
   single_step("Could not clean database jobs", imp->delete_jobs, imp->debugdb);
   single_step("Could not clean database dups", imp->delete_dups, imp->debugdb);
   single_step("Could not clean database stats", imp->delete_stats, imp->debugdb);
+  if (!imp->target_program.empty()) {
+    bind_blob(why, imp->delete_targets, 1, imp->target_program);
+    single_step("Could not clean database targets", imp->delete_targets, imp->debugdb);
+  }
+  single_step("Could not clean database observations", imp->delete_observations, imp->debugdb);
 
   // This cannot be a prepared statement, because pragmas may run on prepare
   char *fail;
@@ -749,6 +1251,21 @@ void Database::end_txn() const {
   single_step("Could not commit a transaction", imp->commit_txn, imp->debugdb);
 }
 
+// Finds or indexes the set of `visible` files
+static const VisibleSet &visible_set(Database::detail *imp, const std::string &visible) {
+  size_t key = std::hash<std::string>()(visible);
+  auto &sets = imp->visible_sets;
+  for (auto it = sets.begin(); it != sets.end(); ++it) {
+    if ((*it)->key == key && (*it)->files == visible) {
+      std::rotate(sets.begin(), it, it + 1);
+      return *sets.front();
+    }
+  }
+  if (sets.size() == VISIBLE_SETS) sets.pop_back();
+  sets.emplace(sets.begin(), new VisibleSet(key, visible));
+  return *sets.front();
+}
+
 // This function needs to be able to run twice in succession and return the same results
 // ... because heap allocations are created to hold the file list output by this function.
 // Fortunately, updating use_id is the only side-effect and it does not affect reuse_job.
@@ -762,6 +1279,8 @@ Usage Database::reuse_job(const std::string &directory, const std::string &envir
   // When implementing indexed directories, beware of non-existent BADPATH files
 
   const char *why = "Could not check for a cached job";
+  sync_writes(imp.get(), SYNC_REUSE);
+  std::unique_lock<std::mutex> lock(imp->db_mutex);
   begin_txn();
   bind_string(why, imp->find_prior, 1, directory);
   bind_blob(why, imp->find_prior, 2, commandline);
@@ -794,54 +1313,55 @@ Usage Database::reuse_job(const std::string &directory, const std::string &envir
   }
   finish_stmt(why, imp->stats_job, imp->debugdb);
 
-  // Create a hash table of visible files
-  std::unordered_set<std::string> vis;
-  const char *tok = visible.c_str();
-  const char *end = tok + visible.size();
-  for (const char *scan = tok; scan != end; ++scan) {
-    if (*scan == 0 && scan != tok) {
-      vis.emplace(tok, scan - tok);
-      tok = scan + 1;
-    }
-  }
-
   // Confirm all inputs are still visible
+  const VisibleSet &vis = visible_set(imp.get(), visible);
   bind_integer(why, imp->get_tree, 1, job);
   bind_integer(why, imp->get_tree, 2, INPUT);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
-    if (vis.find(rip_column(imp->get_tree, 0)) == vis.end()) out.found = false;
+  while (out.found && sqlite3_step(imp->get_tree) == SQLITE_ROW) {
+    const char *path = static_cast<const char *>(sqlite3_column_blob(imp->get_tree, 0));
+    if (!vis.contains(path, sqlite3_column_bytes(imp->get_tree, 0))) out.found = false;
   }
   finish_stmt(why, imp->get_tree, imp->debugdb);
 
   // Confirm all outputs still exist, and report their old hashes
-  bind_integer(why, imp->get_tree, 1, job);
-  bind_integer(why, imp->get_tree, 2, OUTPUT);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
-    std::string path = rip_column(imp->get_tree, 0);
-    if (access(path.c_str(), R_OK) != 0) out.found = false;
-    files.emplace_back(std::move(path), rip_column(imp->get_tree, 1));
+  if (out.found) {
+    bind_integer(why, imp->get_tree, 1, job);
+    bind_integer(why, imp->get_tree, 2, OUTPUT);
+    while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
+      std::string path = rip_column(imp->get_tree, 0);
+      std::string hash = current_hash(imp.get(), path, rip_column(imp->get_tree, 1));
+      files.emplace_back(std::move(path), std::move(hash));
+    }
+    finish_stmt(why, imp->get_tree, imp->debugdb);
+    out.found = outputs_exist(files);
   }
-  finish_stmt(why, imp->get_tree, imp->debugdb);
 
   // If we need to rerun the job (outputs don't exist), wipe the files-to-check list
   if (!out.found) {
     files.clear();
   }
 
+  end_txn();
+  lock.unlock();
+
   if (out.found && !check) {
-    bind_integer(why, imp->update_prior, 1, imp->run_id);
-    bind_integer(why, imp->update_prior, 2, job);
-    single_step(why, imp->update_prior, imp->debugdb);
+    long prior = job;
+    queue_write(imp.get(), 0, false, [this, prior]() {
+      const char *why = "Could not check for a cached job";
+      bind_integer(why, imp->update_prior, 1, imp->run_id);
+      bind_integer(why, imp->update_prior, 2, prior);
+      single_step(why, imp->update_prior, imp->debugdb);
+    });
   }
 
-  end_txn();
-
   return out;
 }
 
 Usage Database::predict_job(uint64_t hashcode, double *pathtime) {
   Usage out;
   const char *why = "Could not predict a job";
+  // Only an estimate; the stats of jobs still queued to be written can be missed
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   bind_integer(why, imp->predict_job, 1, hashcode);
   if (sqlite3_step(imp->predict_job) == SQLITE_ROW) {
     out.found = true;
@@ -871,29 +1391,40 @@ void Database::insert_job(const std::string &directory, const std::string &comma
                           uint64_t signature, const std::string &label, const std::string &stack,
                           const std::string &visible, long *job) {
   const char *why = "Could not insert a job";
-  begin_txn();
-  bind_integer(why, imp->insert_job, 1, imp->run_id);
-  bind_string(why, imp->insert_job, 2, label);
-  bind_string(why, imp->insert_job, 3, directory);
-  bind_blob(why, imp->insert_job, 4, commandline);
-  bind_blob(why, imp->insert_job, 5, environment);
-  bind_string(why, imp->insert_job, 6, stdin_file);
-  bind_integer(why, imp->insert_job, 7, signature);
-  bind_blob(why, imp->insert_job, 8, stack);
-  single_step(why, imp->insert_job, imp->debugdb);
-  *job = sqlite3_last_insert_rowid(imp->db);
-  const char *tok = visible.c_str();
-  const char *end = tok + visible.size();
-  for (const char *scan = tok; scan != end; ++scan) {
-    if (*scan == 0 && scan != tok) {
-      bind_integer(why, imp->insert_tree, 1, VISIBLE);
-      bind_integer(why, imp->insert_tree, 2, *job);
-      bind_string(why, imp->insert_tree, 3, tok, scan - tok);
-      single_step(why, imp->insert_tree, imp->debugdb);
-      tok = scan + 1;
-    }
+  if (imp->next_job == 0) {
+    std::lock_guard<std::mutex> lock(imp->db_mutex);
+    if (sqlite3_step(imp->last_job) == SQLITE_ROW)
+      imp->next_job = sqlite3_column_int64(imp->last_job, 0);
+    finish_stmt(why, imp->last_job, imp->debugdb);
+    ++imp->next_job;
   }
-  end_txn();
+  long id = *job = imp->next_job++;
+
+  // The visible files must be in the files table first
+  queue_files(imp.get());
+  queue_write(imp.get(), id, false, [=]() {
+    bind_integer(why, imp->insert_job, 1, id);
+    bind_integer(why, imp->insert_job, 2, imp->run_id);
+    bind_string(why, imp->insert_job, 3, label);
+    bind_string(why, imp->insert_job, 4, directory);
+    bind_blob(why, imp->insert_job, 5, commandline);
+    bind_blob(why, imp->insert_job, 6, environment);
+    bind_string(why, imp->insert_job, 7, stdin_file);
+    bind_integer(why, imp->insert_job, 8, signature);
+    bind_blob(why, imp->insert_job, 9, stack);
+    single_step(why, imp->insert_job, imp->debugdb);
+    const char *tok = visible.c_str();
+    const char *end = tok + visible.size();
+    for (const char *scan = tok; scan != end; ++scan) {
+      if (*scan == 0 && scan != tok) {
+        bind_integer(why, imp->insert_tree, 1, VISIBLE);
+        bind_integer(why, imp->insert_tree, 2, id);
+        bind_string(why, imp->insert_tree, 3, tok, scan - tok);
+        single_step(why, imp->insert_tree, imp->debugdb);
+        tok = scan + 1;
+      }
+    }
+  });
 }
 
 template <class F>
@@ -917,9 +1448,10 @@ static void scan_until_sep(char sep, const std::string &to_scan, F f) {
   }
 }
 
-void Database::finish_job(long job, const std::string &inputs, const std::string &outputs,
-                          const std::string &all_outputs, int64_t starttime, int64_t endtime,
-                          uint64_t hashcode, bool keep, Usage reality) {
+static void write_finish(Database::detail *imp, long job, const std::string &inputs,
+                         const std::string &outputs, const std::string &all_outputs,
+                         int64_t starttime, int64_t endtime, uint64_t hashcode, bool keep,
+                         Usage reality) {
   // Compute the unhashed_outputs
   std::set<std::string> output_set;
   std::vector<std::string> unhashed_outputs;
@@ -929,8 +1461,6 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
   });
 
   const char *why = "Could not save job inputs and outputs";
-  begin_txn();
-
   bind_integer(why, imp->add_stats, 1, hashcode);
   bind_integer(why, imp->add_stats, 2, reality.status);
   bind_double(why, imp->add_stats, 3, reality.runtime);
@@ -954,12 +1484,13 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
   finish_stmt(why, imp->get_tree, imp->debugdb);
 
   // Insert inputs, confirming they are visible
-  scan_until_sep('\0', inputs, [&, this](const std::string &input) {
+  scan_until_sep('\0', inputs, [&](const std::string &input) {
     if (visible.find(input) == visible.end()) {
       std::stringstream s;
       s << "Job " << job << " erroneously added input '" << input
         << "' which was not a visible file." << std::endl;
-      status_write(STREAM_ERROR, s.str());
+      std::lock_guard<std::mutex> lock(imp->queue_mutex);
+      imp->write_errors.push_back(s.str());
     } else {
       bind_integer(why, imp->insert_tree, 1, INPUT);
       bind_integer(why, imp->insert_tree, 2, job);
@@ -991,25 +1522,35 @@ void Database::finish_job(long job, const std::string &inputs, const std::string
   bind_integer(why, imp->delete_overlap, 2, job);
   single_step(why, imp->delete_overlap, imp->debugdb);
 
-  bool fail = false;
   bind_integer(why, imp->detect_overlap, 1, job);
   while (sqlite3_step(imp->detect_overlap) == SQLITE_ROW) {
     std::stringstream s;
     s << "File output by multiple Jobs: " << rip_column(imp->detect_overlap, 0) << std::endl;
-    status_write(STREAM_ERROR, s.str());
-    fail = true;
+    std::lock_guard<std::mutex> lock(imp->queue_mutex);
+    imp->write_errors.push_back(s.str());
+    imp->write_failed = true;
   }
   finish_stmt(why, imp->detect_overlap, imp->debugdb);
+}
 
-  end_txn();
-
-  if (fail) exit(1);
+void Database::finish_job(long job, const std::string &inputs, const std::string &outputs,
+                          const std::string &all_outputs, int64_t starttime, int64_t endtime,
+                          uint64_t hashcode, bool keep, Usage reality) {
+  // The inputs and outputs must be in the files table first
+  queue_files(imp.get());
+  queue_log(imp.get(), job);
+  queue_write(imp.get(), job, true, [=]() {
+    write_finish(imp.get(), job, inputs, outputs, all_outputs, starttime, endtime, hashcode, keep,
+                 reality);
+  });
 }
 
 std::vector<std::string> Database::clear_jobs() {
   const char *why = "Could not clear jobs";
   std::vector<std::string> out;
 
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   begin_txn();
 
   while (sqlite3_step(imp->get_output_files) == SQLITE_ROW) {
@@ -1028,95 +1569,352 @@ std::vector<std::string> Database::clear_jobs() {
 
   end_txn();
 
+  // Reload whatever is left of the files table when next needed
+  imp->files.clear();
+  imp->files_loaded = false;
+
   return out;
 }
 
 void Database::tag_job(long job, const std::string &uri, const std::string &content) {
-  const char *why = "Could not tag a job";
-  bind_integer(why, imp->tag_job, 1, job);
-  bind_string(why, imp->tag_job, 2, uri);
-  bind_string(why, imp->tag_job, 3, content);
-  single_step(why, imp->tag_job, imp->debugdb);
+  queue_write(imp.get(), job, false, [=]() {
+    const char *why = "Could not tag a job";
+    bind_integer(why, imp->tag_job, 1, job);
+    bind_string(why, imp->tag_job, 2, uri);
+    bind_string(why, imp->tag_job, 3, content);
+    single_step(why, imp->tag_job, imp->debugdb);
+  });
 }
 
 std::vector<FileReflection> Database::get_tree(int kind, long job) {
   std::vector<FileReflection> out;
   const char *why = "Could not read job tree";
+  sync_writes(imp.get(), SYNC_JOB, job);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   bind_integer(why, imp->get_tree, 1, job);
   bind_integer(why, imp->get_tree, 2, kind);
-  while (sqlite3_step(imp->get_tree) == SQLITE_ROW)
-    out.emplace_back(rip_column(imp->get_tree, 0), rip_column(imp->get_tree, 1));
+  while (sqlite3_step(imp->get_tree) == SQLITE_ROW) {
+    std::string path = rip_column(imp->get_tree, 0);
+    std::string hash = current_hash(imp.get(), path, rip_column(imp->get_tree, 1));
+    out.emplace_back(std::move(path), std::move(hash));
+  }
   finish_stmt(why, imp->get_tree, imp->debugdb);
   return out;
 }
 
 void Database::save_output(long job, int descriptor, const char *buffer, int size, double runtime) {
+  if (size <= 0) return;
+  PendingLog &log = imp->pending_logs[job];
+  log.data.append(buffer, size);
+  put_le(log.index, size, 4);
+  put_le(log.index, descriptor, 1);
+  put_le(log.index, runtime > 0 ? static_cast<uint64_t>(runtime * 1e6 + 0.5) : 0, 8);
+  if (log.data.size() >= LOG_SEGMENT_BYTES) queue_log(imp.get(), job);
+}
+
+static void write_log(Database::detail *imp, long job, const PendingLog &log) {
+  uLongf size = compressBound(log.data.size());
+  std::unique_ptr<Bytef[]> deflated(new Bytef[size]);
+  int ret = compress2(deflated.get(), &size, reinterpret_cast<const Bytef *>(log.data.data()),
+                      log.data.size(), LOG_DEFLATE_LEVEL);
+
   const char *why = "Could not save job output";
   bind_integer(why, imp->insert_log, 1, job);
-  bind_integer(why, imp->insert_log, 2, descriptor);
-  bind_double(why, imp->insert_log, 3, runtime);
-  bind_string(why, imp->insert_log, 4, buffer, size);
+  bind_blob(why, imp->insert_log, 2, log.index);
+  bind_integer(why, imp->insert_log, 3, log.data.size());
+  if (ret == Z_OK && size < log.data.size()) {
+    bind_blob(why, imp->insert_log, 4, reinterpret_cast<const char *>(deflated.get()), size);
+  } else {
+    bind_blob(why, imp->insert_log, 4, log.data);
+  }
   single_step(why, imp->insert_log, imp->debugdb);
 }
 
-std::string Database::get_output(long job, int descriptor) const {
-  std::stringstream out;
+// Segments are compressed and written by the writer thread
+static void queue_log(Database::detail *imp, long job) {
+  auto it = imp->pending_logs.find(job);
+  if (it == imp->pending_logs.end()) return;
+  PendingLog log = std::move(it->second);
+  imp->pending_logs.erase(it);
+  queue_write(imp, job, false, [imp, job, log = std::move(log)]() { write_log(imp, job, log); });
+}
+
+static void queue_logs(Database::detail *imp) {
+  if (imp->pending_logs.empty()) return;
+  std::vector<long> jobs;
+  for (auto &log : imp->pending_logs) jobs.push_back(log.first);
+  for (long job : jobs) queue_log(imp, job);
+}
+
+// Splits a segment's output back into the chunks it was written as
+struct ChunkSplitter {
+  const uint8_t *index, *end;
+  int descriptor;
+  const Database::OutputFn &fn;
+  uint64_t left;
+  int chunk_descriptor;
+  double seconds;
+
+  ChunkSplitter(const void *index_, size_t size, int descriptor_, const Database::OutputFn &fn_)
+      : index(static_cast<const uint8_t *>(index_)),
+        end(index + size),
+        descriptor(descriptor_),
+        fn(fn_),
+        left(0) {}
+
+  // false if there is more output than the index accounts for
+  bool feed(const char *data, size_t size) {
+    while (size > 0) {
+      if (left == 0) {
+        if (end - index < LOG_CHUNK_BYTES) return false;
+        left = get_le(index, 4);
+        chunk_descriptor = get_le(index + 4, 1);
+        seconds = get_le(index + 5, 8) / 1e6;
+        index += LOG_CHUNK_BYTES;
+        continue;
+      }
+      size_t take = left < size ? left : size;
+      if (descriptor == 0 || descriptor == chunk_descriptor)
+        fn(chunk_descriptor, seconds, data, take);
+      data += take;
+      size -= take;
+      left -= take;
+    }
+    return true;
+  }
+};
+
+static bool inflate_segment(const void *data, size_t size, ChunkSplitter &splitter) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK) return false;
+
+  // Only this much of the segment is ever decompressed at once
+  std::vector<char> buffer(64 * 1024);
+  zs.next_in = static_cast<Bytef *>(const_cast<void *>(data));
+  zs.avail_in = size;
+  int ret;
+  bool ok = true;
+  do {
+    zs.next_out = reinterpret_cast<Bytef *>(buffer.data());
+    zs.avail_out = buffer.size();
+    ret = inflate(&zs, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END) ok = false;
+    if (ok) ok = splitter.feed(buffer.data(), buffer.size() - zs.avail_out);
+  } while (ok && ret != Z_STREAM_END);
+
+  inflateEnd(&zs);
+  return ok;
+}
+
+static void read_log(Database::detail *imp, long job, int descriptor,
+                     const Database::OutputFn &fn) {
   const char *why = "Could not read job output";
-  bind_integer(why, imp->get_log, 1, job);
-  bind_integer(why, imp->get_log, 2, descriptor);
-  while (sqlite3_step(imp->get_log) == SQLITE_ROW) {
-    out.write(static_cast<const char *>(sqlite3_column_blob(imp->get_log, 0)),
-              sqlite3_column_bytes(imp->get_log, 0));
+  bind_integer(why, imp->read_log, 1, job);
+  while (sqlite3_step(imp->read_log) == SQLITE_ROW) {
+    ChunkSplitter splitter(sqlite3_column_blob(imp->read_log, 0),
+                           sqlite3_column_bytes(imp->read_log, 0), descriptor, fn);
+    size_t length = sqlite3_column_int64(imp->read_log, 1);
+    const void *output = sqlite3_column_blob(imp->read_log, 2);
+    size_t size = sqlite3_column_bytes(imp->read_log, 2);
+    bool ok = size == length ? splitter.feed(static_cast<const char *>(output), size)
+                             : inflate_segment(output, size, splitter);
+    if (!ok) std::cerr << why << " " << job << ": corrupt log segment" << std::endl;
   }
-  finish_stmt(why, imp->get_log, imp->debugdb);
-  return out.str();
+  finish_stmt(why, imp->read_log, imp->debugdb);
+}
+
+void Database::read_output(long job, int descriptor, const OutputFn &fn) const {
+  sync_writes(imp.get(), SYNC_JOB, job);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
+  read_log(imp.get(), job, descriptor, fn);
+}
+
+std::string Database::get_output(long job, int descriptor) const {
+  std::string out;
+  read_output(job, descriptor,
+              [&](int, double, const char *data, size_t size) { out.append(data, size); });
+  return out;
 }
 
 void Database::replay_output(long job, const char *stdout, const char *stderr) {
-  const char *why = "Could not replay job output";
-  bind_integer(why, imp->replay_log, 1, job);
   bool needlf[2] = {false, false};
-  while (sqlite3_step(imp->replay_log) == SQLITE_ROW) {
-    int fd = sqlite3_column_int64(imp->replay_log, 0);
-    const char *str = static_cast<const char *>(sqlite3_column_blob(imp->replay_log, 1));
-    int len = sqlite3_column_bytes(imp->replay_log, 1);
-    if (len > 0) {
-      status_write(fd == 2 ? stderr : stdout, str, len);
-      needlf[fd - 1] = str[len - 1] != '\n';
-    }
-  }
-  finish_stmt(why, imp->replay_log, imp->debugdb);
+  read_output(job, 0, [&](int fd, double, const char *data, size_t size) {
+    status_write(fd == 2 ? stderr : stdout, data, size);
+    needlf[fd - 1] = data[size - 1] != '\n';
+  });
   if (needlf[0]) status_write(stdout, "\n", 1);
   if (needlf[1]) status_write(stderr, "\n", 1);
 }
 
-void Database::add_hash(const std::string &file, const std::string &hash, long modified) {
+static void load_files(Database::detail *imp) {
+  if (imp->files_loaded) return;
+  imp->files_loaded = true;
+
+  const char *why = "Could not load file hashes";
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
+  while (sqlite3_step(imp->load_files) == SQLITE_ROW) {
+    FileRow row;
+    // A hash too unusual to keep in memory is recomputed on use
+    if (!row.set_hash(rip_column(imp->load_files, 1))) continue;
+    row.stamp.mtime_ns = sqlite3_column_int64(imp->load_files, 2);
+    row.stamp.device = sqlite3_column_int64(imp->load_files, 3);
+    row.stamp.inode = sqlite3_column_int64(imp->load_files, 4);
+    row.stamp.size = sqlite3_column_int64(imp->load_files, 5);
+    row.stamp.ctime_ns = sqlite3_column_int64(imp->load_files, 6);
+    imp->files.emplace(rip_column(imp->load_files, 0), row);
+  }
+  finish_stmt(why, imp->load_files, imp->debugdb);
+}
+
+static void write_file(Database::detail *imp, const std::string &file, const std::string &hash,
+                       const file_stamp &stamp) {
   const char *why = "Could not insert a hash";
-  begin_txn();
   bind_string(why, imp->wipe_file, 1, file);
   bind_string(why, imp->wipe_file, 2, hash);
   single_step(why, imp->wipe_file, imp->debugdb);
-  bind_string(why, imp->update_file, 1, hash);
-  bind_integer(why, imp->update_file, 2, modified);
-  bind_string(why, imp->update_file, 3, file);
-  single_step(why, imp->update_file, imp->debugdb);
-  bind_string(why, imp->insert_file, 1, hash);
-  bind_integer(why, imp->insert_file, 2, modified);
-  bind_string(why, imp->insert_file, 3, file);
-  single_step(why, imp->insert_file, imp->debugdb);
-  end_txn();
+  for (sqlite3_stmt *stmt : {imp->update_file, imp->insert_file}) {
+    bind_string(why, stmt, 1, hash);
+    bind_integer(why, stmt, 2, stamp.mtime_ns);
+    bind_integer(why, stmt, 3, stamp.device);
+    bind_integer(why, stmt, 4, stamp.inode);
+    bind_integer(why, stmt, 5, stamp.size);
+    bind_integer(why, stmt, 6, stamp.ctime_ns);
+    bind_string(why, stmt, 7, file);
+    single_step(why, stmt, imp->debugdb);
+  }
 }
 
-std::string Database::get_hash(const std::string &file, long modified) {
+// Hashes are written by the writer thread, from a copy of the dirty rows
+static void queue_files(Database::detail *imp) {
+  if (imp->dirty_files.empty()) return;
+
+  std::vector<std::pair<std::string, FileRow> > rows;
+  rows.reserve(imp->dirty_files.size());
+  for (auto file : imp->dirty_files) {
+    rows.emplace_back(*file);
+    file->second.dirty = false;
+  }
+  imp->dirty_files.clear();
+
+  // A changed hash marks the jobs which read the file as stale
+  bool reuse = imp->files_changed;
+  imp->files_changed = false;
+  queue_write(imp, 0, reuse, [imp, rows = std::move(rows)]() {
+    for (auto &row : rows) write_file(imp, row.first, row.second.get_hash(), row.second.stamp);
+  });
+}
+
+void Database::add_hash(const std::string &file, const std::string &hash,
+                        const file_stamp &stamp) {
+  load_files(imp.get());
+
+  auto insert = imp->files.emplace(file, FileRow());
+  auto it = insert.first;
+  FileRow &row = it->second;
+  row.stamp = stamp;
+  if (!insert.second && row.get_hash() != hash) imp->files_changed = true;
+  if (!row.set_hash(hash)) {
+    // Write it out rather than keep it in memory
+    queue_files(imp.get());
+    imp->files.erase(it);
+    queue_write(imp.get(), 0, true, [=]() { write_file(imp.get(), file, hash, stamp); });
+  } else if (!row.dirty) {
+    row.dirty = true;
+    imp->dirty_files.push_back(&*it);
+  }
+}
+
+std::string Database::get_hash(const std::string &file, const file_stamp &stamp) {
+  load_files(imp.get());
+
+  auto it = imp->files.find(file);
+  if (it == imp->files.end() || !same_stamp(it->second.stamp, stamp)) return "";
+  return it->second.get_hash();
+}
+
+bool Database::get_target(const std::string &hash, TargetResult &out) {
+  const char *why = "Could not find a target result";
+  // Results are saved as wake exits, so there are no queued writes to wait for
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
+  bind_blob(why, imp->get_target, 1, hash);
+  bool found = sqlite3_step(imp->get_target) == SQLITE_ROW;
+  if (found) {
+    out.hash = hash;
+    out.run = sqlite3_column_int64(imp->get_target, 0);
+    out.observed = sqlite3_column_int64(imp->get_target, 1);
+    out.value = rip_column(imp->get_target, 2);
+  }
+  finish_stmt(why, imp->get_target, imp->debugdb);
+  return found;
+}
+
+std::string Database::get_observations(long run) {
+  const char *why = "Could not read target observations";
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
+  bind_integer(why, imp->get_observations, 1, run);
+  std::string out;
+  if (sqlite3_step(imp->get_observations) == SQLITE_ROW) out = rip_column(imp->get_observations, 0);
+  finish_stmt(why, imp->get_observations, imp->debugdb);
+  return out;
+}
+
+void Database::save_targets(const std::string &program, const std::string &observations,
+                            std::vector<TargetResult> &&results) {
+  imp->target_program = program;
+  if (results.empty()) return;
+  Database::detail *imp = this->imp.get();
+  long run = imp->run_id;
+  queue_write(imp, 0, false, [imp, run, program, observations, results = std::move(results)]() {
+    const char *why = "Could not save target results";
+    bind_integer(why, imp->insert_observations, 1, run);
+    bind_blob(why, imp->insert_observations, 2, observations);
+    single_step(why, imp->insert_observations, imp->debugdb);
+    for (auto &result : results) {
+      bind_blob(why, imp->insert_target, 1, result.hash);
+      bind_blob(why, imp->insert_target, 2, program);
+      bind_integer(why, imp->insert_target, 3, run);
+      bind_integer(why, imp->insert_target, 4, result.observed);
+      bind_blob(why, imp->insert_target, 5, result.value);
+      single_step(why, imp->insert_target, imp->debugdb);
+    }
+  });
+}
+
+std::string Database::get_program(const std::string &hash) {
+  const char *why = "Could not find a compiled program";
+  // Programs are read before wake queues any writes
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
+  bind_blob(why, imp->get_program, 1, hash);
   std::string out;
-  const char *why = "Could not fetch a hash";
-  bind_string(why, imp->fetch_hash, 1, file);
-  bind_integer(why, imp->fetch_hash, 2, modified);
-  if (sqlite3_step(imp->fetch_hash) == SQLITE_ROW) out = rip_column(imp->fetch_hash, 0);
-  finish_stmt(why, imp->fetch_hash, imp->debugdb);
+  if (sqlite3_step(imp->get_program) == SQLITE_ROW) out = rip_column(imp->get_program, 0);
+  finish_stmt(why, imp->get_program, imp->debugdb);
   return out;
 }
 
+void Database::save_program(const std::string &hash, const std::string &files,
+                            std::string &&image) {
+  Database::detail *imp = this->imp.get();
+  queue_write(imp, 0, false, [imp, hash, files, image = std::move(image)]() {
+    const char *why = "Could not save a compiled program";
+    bind_blob(why, imp->delete_programs, 1, files);
+    single_step(why, imp->delete_programs, imp->debugdb);
+    bind_blob(why, imp->insert_program, 1, hash);
+    bind_blob(why, imp->insert_program, 2, files);
+    bind_blob(why, imp->insert_program, 3, image);
+    single_step(why, imp->insert_program, imp->debugdb);
+  });
+}
+
+void Database::forget_program(const std::string &hash) {
+  Database::detail *imp = this->imp.get();
+  queue_write(imp, 0, false, [imp, hash]() {
+    const char *why = "Could not forget a compiled program";
+    bind_blob(why, imp->delete_program, 1, hash);
+    single_step(why, imp->delete_program, imp->debugdb);
+  });
+}
+
 static std::vector<std::string> chop_null(const std::string &str) {
   std::vector<std::string> out;
   const char *tok = str.c_str();
@@ -1169,8 +1967,12 @@ static JobReflection find_one(const Database *db, sqlite3_stmt *query, bool verb
   desc.usage.obytes = sqlite3_column_int64(query, 17);
   if (desc.stdin_file.empty()) desc.stdin_file = "/dev/null";
   if (verbose) {
-    desc.stdout_payload = db->get_output(desc.job, 1);
-    desc.stderr_payload = db->get_output(desc.job, 2);
+    read_log(db->imp.get(), desc.job, 1, [&](int, double, const char *data, size_t size) {
+      desc.stdout_payload.append(data, size);
+    });
+    read_log(db->imp.get(), desc.job, 2, [&](int, double, const char *data, size_t size) {
+      desc.stderr_payload.append(data, size);
+    });
     // visible
     bind_integer(why, db->imp->get_tree, 1, desc.job);
     bind_integer(why, db->imp->get_tree, 2, VISIBLE);
@@ -1215,6 +2017,8 @@ std::vector<std::string> Database::get_outputs() const {
   const char *why = "Could not get outputs";
   std::vector<std::string> out;
 
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   begin_txn();
   while (sqlite3_step(imp->get_output_files) == SQLITE_ROW) {
     out.emplace_back(rip_column(imp->get_output_files, 0));
@@ -1248,21 +2052,29 @@ static std::vector<FileAccess> get_all_file_accesses(const Database *db, sqlite3
 }
 
 std::vector<JobReflection> Database::failed(bool verbose) {
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   return find_all(this, imp->find_failed, verbose);
 }
 
 std::vector<JobReflection> Database::last(bool verbose) {
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   return find_all(this, imp->find_last, verbose);
 }
 
 std::vector<JobReflection> Database::explain(long job, bool verbose) {
   const char *why = "Could not bind args";
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   bind_integer(why, imp->find_job, 1, job);
   return find_all(this, imp->find_job, verbose);
 }
 
 std::vector<JobReflection> Database::explain(const std::string &file, int use, bool verbose) {
   const char *why = "Could not bind args";
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   bind_string(why, imp->find_owner, 1, file);
   bind_integer(why, imp->find_owner, 2, use);
   return find_all(this, imp->find_owner, verbose);
@@ -1270,6 +2082,8 @@ std::vector<JobReflection> Database::explain(const std::string &file, int use, b
 
 std::vector<JobEdge> Database::get_edges() {
   std::vector<JobEdge> out;
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   while (sqlite3_step(imp->get_edges) == SQLITE_ROW) {
     out.emplace_back(sqlite3_column_int64(imp->get_edges, 0),
                      sqlite3_column_int64(imp->get_edges, 1));
@@ -1280,6 +2094,8 @@ std::vector<JobEdge> Database::get_edges() {
 
 std::vector<JobTag> Database::get_tags() {
   std::vector<JobTag> out;
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   while (sqlite3_step(imp->get_all_tags) == SQLITE_ROW) {
     out.emplace_back(sqlite3_column_int64(imp->get_all_tags, 0), rip_column(imp->get_all_tags, 1),
                      rip_column(imp->get_all_tags, 2));
@@ -1289,9 +2105,13 @@ std::vector<JobTag> Database::get_tags() {
 }
 
 std::vector<JobReflection> Database::get_job_visualization() const {
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   return find_all(this, imp->get_job_visualization, true);
 }
 
 std::vector<FileAccess> Database::get_file_accesses() const {
+  sync_writes(imp.get(), SYNC_ALL);
+  std::lock_guard<std::mutex> lock(imp->db_mutex);
   return get_all_file_accesses(this, imp->get_file_access);
 }
@@ -18,10 +18,13 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "compat/mtime.h"
+
 struct FileReflection {
   std::string path;
   std::string hash;
@@ -91,6 +94,26 @@ struct FileAccess {
   long job;  // id of the job which has the access
 };
 
+// Counters for the queue of writes to wake.db
+struct WriteStats {
+  size_t queued;       // writes waiting to be committed
+  size_t max_queued;   // the most that were ever waiting at once
+  uint64_t writes;     // writes committed
+  uint64_t commits;    // transactions they were committed in
+  uint64_t syncs;      // reads which first had to commit the writes they depend on
+  double busy;         // seconds spent committing
+  double latency;      // seconds from queueing a transaction's oldest write until it committed,
+  double max_latency;  // ... summed over the transactions and at worst
+};
+
+// A target result kept for later runs (see TargetStore)
+struct TargetResult {
+  std::string hash;   // of the program, the target and its arguments
+  long run;           // the run whose observations the result depends on
+  long observed;      // ... the first this many of them
+  std::string value;  // encoded as by TargetStore
+};
+
 struct Database {
   struct detail;
   std::unique_ptr<detail> imp;
@@ -109,6 +132,8 @@ struct Database {
   void begin_txn() const;
   void end_txn() const;
 
+  // Writes are queued and committed in the background, many to a
+  // transaction. Reads see every write queued before them.
   Usage reuse_job(const std::string &directory, const std::string &environment,
                   const std::string &commandline,
                   const std::string &stdin_file,  // "" -> /dev/null
@@ -133,6 +158,12 @@ struct Database {
 
   void save_output(  // call only if needs_build -> true
       long job, int descriptor, const char *buffer, int size, double runtime);
+  // Output is passed to fn in the pieces the job wrote it, in order,
+  // without holding all of it in memory. fn must not use the database.
+  typedef std::function<void(int descriptor, double seconds, const char *data, size_t size)>
+      OutputFn;
+  void read_output(long job, int descriptor,  // 0 = stdout and stderr
+                   const OutputFn &fn) const;
   std::string get_output(long job, int descriptor) const;
   void replay_output(long job, const char *stdout, const char *stderr);
 
@@ -147,9 +178,25 @@ struct Database {
   //    of the removed files
   std::vector<std::string> clear_jobs();
 
-  void add_hash(const std::string &file, const std::string &hash, long modified);
+  // Hashes are kept in memory and written back in batches. They are
+  // only reused while the file's stamp is unchanged.
+  void add_hash(const std::string &file, const std::string &hash, const file_stamp &stamp);
+
+  std::string get_hash(const std::string &file, const file_stamp &stamp);
 
-  std::string get_hash(const std::string &file, long modified);
+  // Results are saved at the end of a run, together with the observations
+  // that run made, and replace any kept for the same hash. clean() then
+  // drops the results of every other program, which can never be reused.
+  bool get_target(const std::string &hash, TargetResult &out);
+  std::string get_observations(long run);
+  void save_targets(const std::string &program, const std::string &observations,
+                    std::vector<TargetResult> &&results);
+
+  // Compiled programs (see image.h) are kept only while the wakefiles they
+  // were compiled from are unchanged; saving one drops those of other files
+  std::string get_program(const std::string &hash);
+  void save_program(const std::string &hash, const std::string &files, std::string &&image);
+  void forget_program(const std::string &hash);
 
   std::vector<JobReflection> explain(long job, bool verbose);
 
@@ -164,6 +211,8 @@ struct Database {
 
   std::vector<JobReflection> get_job_visualization() const;
   std::vector<FileAccess> get_file_accesses() const;
+
+  WriteStats write_stats() const;
 };
 
 #endif
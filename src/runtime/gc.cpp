@@ -22,18 +22,35 @@
 #include "gc.h"
 
 #include <assert.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <iomanip>
 #include <map>
+#include <mutex>
+#include <random>
 #include <sstream>
+#include <thread>
 #include <vector>
 
 #include "status.h"
 
 #define INITIAL_HEAP_SIZE 1024
+// Large enough to amortize a minor GC, small enough to stay in cache (4MiB)
+#define NURSERY_SIZE (1 << 19)
+// Each parallel GC thread copies into local allocation buffers this large
+#define LAB_SIZE 4096
+// Smaller heaps are copied faster than threads can be started (1MiB)
+#define PARALLEL_MIN_PADS (1 << 17)
+
+// Everything is condemned, as a full GC expects; only a minor GC narrows this
+// to the nursery, restoring it when done
+HeapRegions heap_regions = {0, 0, 0, 0, 0, UINTPTR_MAX, nullptr};
 
 HeapObject::~HeapObject() {}
 
@@ -49,6 +66,12 @@ HeapStep PadObject::explore(HeapStep step) {
   return step;
 }
 
+size_t PadObject::pads() { return 1; }
+
+void PadObject::scan(GCWorker *worker) {}
+
+void PadObject::trace(HeapGraph *graph) {}
+
 const char *PadObject::type() const { return "PadObject"; }
 
 void PadObject::format(std::ostream &os, FormatState &state) const { os << "PadObject"; }
@@ -69,6 +92,15 @@ const char *MovedObject::type() const { return "MovedObject"; }
 
 HeapStep MovedObject::explore(HeapStep step) { return to->explore(step); }
 
+size_t MovedObject::pads() {
+  assert(0 /* unreachable */);
+  return 0;
+}
+
+void MovedObject::scan(GCWorker *worker) { assert(0 /* unreachable */); }
+
+void MovedObject::trace(HeapGraph *graph) { assert(0 /* unreachable */); }
+
 void MovedObject::format(std::ostream &os, FormatState &state) const { to->format(os, state); }
 
 Category MovedObject::category() const {
@@ -82,6 +114,29 @@ struct HeapStats {
   HeapStats() : type(nullptr), objects(0), pads(0) {}
 };
 
+struct PauseStats {
+  size_t collections;
+  size_t pads;  // copied
+  double seconds, longest;
+  PauseStats() : collections(0), pads(0), seconds(0), longest(0) {}
+
+  void add(double pause, size_t copied) {
+    ++collections;
+    pads += copied;
+    seconds += pause;
+    longest = std::max(longest, pause);
+  }
+};
+
+// An allocation chosen by the sampling profiler
+struct Sample {
+  HeapObject *obj;  // null once collected
+  size_t site;
+  size_t bytes;
+  double weight;  // the bytes of allocation this sample stands for
+  bool survived;
+};
+
 struct Space {
   size_t size;
   size_t alloc;
@@ -115,41 +170,176 @@ void Space::resize(size_t size_) {
 struct Heap::Imp {
   int profile_heap;
   double heap_factor;
+  bool generational;
+  int gc_threads;
   Space spaces[2];
   int space;
   size_t last_pads;
   size_t most_pads;
   HeapStats peak[10];
-  HeapObject *finalize;
-
-  Imp(int profile_heap_, double heap_factor_)
+  HeapObject *finalize;  // objects in the allocation space
+  // Only used by a generational heap:
+  Space nursery;
+  PadObject *old_free;
+  PadObject *old_end;
+  HeapObject *tenured;  // objects in the old space
+  std::vector<HeapPointerBase *> remembered_fields;
+  std::vector<HeapObject *> remembered_objects;
+  PauseStats minor, major;
+  // Only used while sampling allocations:
+  double sample_bytes;
+  std::mt19937_64 sample_rng;
+  std::exponential_distribution<double> sample_gap;
+  std::vector<Sample> pending;  // not yet attributed to a site
+  std::vector<Sample> samples;  // live and attributed
+  std::vector<HeapSiteStats> sites;
+
+  Imp(int profile_heap_, double heap_factor_, bool generational_, int gc_threads_)
       : profile_heap(profile_heap_),
         heap_factor(heap_factor_),
+        generational(generational_),
+        gc_threads(gc_threads_),
         spaces(),
         space(0),
         last_pads(0),
         most_pads(0),
         peak(),
-        finalize(nullptr) {}
+        finalize(nullptr),
+        nursery(generational_ ? NURSERY_SIZE : 1),  // unused unless generational
+        old_free(spaces[space].array),
+        old_end(old_free + spaces[space].size),
+        tenured(nullptr),
+        sample_bytes(0) {}
 };
 
-Heap::Heap(int profile_heap_, double heap_factor_)
-    : imp(new Imp(profile_heap_, heap_factor_)),
+Heap::Heap(int profile_heap_, double heap_factor_, bool generational_, int gc_threads_)
+    : imp(new Imp(profile_heap_, heap_factor_, generational_, gc_threads_)),
       roots(),
-      free(imp->spaces[imp->space].array),
-      end(free + imp->spaces[imp->space].size) {}
+      sample_at(UINTPTR_MAX),
+      sample_pending(false) {
+  Space &alloc = imp->generational ? imp->nursery : imp->spaces[imp->space];
+  free = alloc.array;
+  end = free + alloc.size;
+  if (imp->generational) {
+    heap_regions.generational = this;
+    publish_regions();
+  }
+}
 
 Heap::~Heap() {
   GC(0);
-  assert(free == imp->spaces[imp->space].array);
+  if (imp->generational) {
+    assert(imp->old_free == imp->spaces[imp->space].array);
+    assert(free == imp->nursery.array);
+    heap_regions = HeapRegions{0, 0, 0, 0, 0, UINTPTR_MAX, nullptr};
+  } else {
+    assert(free == imp->spaces[imp->space].array);
+  }
 }
 
-size_t Heap::used() const { return (free - imp->spaces[imp->space].array) * sizeof(PadObject); }
+size_t Heap::used() const {
+  size_t old = imp->generational ? imp->old_free - imp->spaces[imp->space].array : 0;
+  Space &alloc = imp->generational ? imp->nursery : imp->spaces[imp->space];
+  return (old + (free - alloc.array)) * sizeof(PadObject);
+}
 
-size_t Heap::alloc() const { return (end - imp->spaces[imp->space].array) * sizeof(PadObject); }
+size_t Heap::alloc() const {
+  size_t old = imp->generational ? imp->old_end - imp->spaces[imp->space].array : 0;
+  Space &alloc = imp->generational ? imp->nursery : imp->spaces[imp->space];
+  return (old + (end - alloc.array)) * sizeof(PadObject);
+}
 
 size_t Heap::avail() const { return (end - free) * sizeof(PadObject); }
 
+void Heap::publish_regions() {
+  PadObject *old = imp->spaces[imp->space].array;
+  heap_regions.old_begin = reinterpret_cast<uintptr_t>(old);
+  heap_regions.old_size = (imp->old_free - old) * sizeof(PadObject);
+  heap_regions.young_begin = reinterpret_cast<uintptr_t>(imp->nursery.array);
+  heap_regions.young_size = imp->nursery.size * sizeof(PadObject);
+}
+
+void HeapPointerBase::remember() { heap_regions.generational->remember(this); }
+
+void Heap::remember(HeapPointerBase *field) { imp->remembered_fields.push_back(field); }
+
+void Heap::remember_object(HeapObject *obj) {
+  // Targets are typically updated many times in a row
+  if (imp->remembered_objects.empty() || imp->remembered_objects.back() != obj)
+    imp->remembered_objects.push_back(obj);
+}
+
+void Heap::sample(size_t bytes) {
+  imp->sample_bytes = bytes;
+  if (bytes) {
+    imp->sample_gap = std::exponential_distribution<double>(1.0 / bytes);
+    next_sample();
+  } else {
+    sample_at = UINTPTR_MAX;
+    sample_pending = false;
+    imp->pending.clear();
+    imp->samples.clear();
+  }
+}
+
+// Exponential gaps sample every byte with equal probability, whatever the allocation pattern
+void Heap::next_sample() {
+  sample_at = reinterpret_cast<uintptr_t>(free) +
+              static_cast<uintptr_t>(imp->sample_gap(imp->sample_rng));
+}
+
+void Heap::record_sample(PadObject *obj) {
+  size_t bytes = (free - obj) * sizeof(PadObject);
+  double weight = bytes / (1 - std::exp(-(bytes / imp->sample_bytes)));
+  imp->pending.push_back(Sample{obj, 0, bytes, weight, false});
+  sample_pending = true;
+  next_sample();
+}
+
+void Heap::attribute(size_t site) {
+  if (imp->sites.size() <= site) imp->sites.resize(site + 1);
+  HeapSiteStats &stats = imp->sites[site];
+  for (Sample &s : imp->pending) {
+    stats.objects += s.weight / s.bytes;
+    stats.bytes += s.weight;
+    if (s.survived) stats.survived += s.weight;
+    if (!s.obj) continue;
+    s.site = site;
+    imp->samples.push_back(s);
+  }
+  imp->pending.clear();
+  sample_pending = false;
+}
+
+static void follow(Sample &s, bool everything) {
+  if (!s.obj || !(everything || heap_regions.young(s.obj))) return;
+  if (typeid(*s.obj) == typeid(MovedObject)) {
+    s.obj = static_cast<MovedObject *>(s.obj)->to;
+    s.survived = true;
+  } else {
+    s.obj = nullptr;
+  }
+}
+
+// Call after copying, while the condemned objects are still intact
+void Heap::track_samples(bool everything) {
+  for (Sample &s : imp->pending) follow(s, everything);
+
+  for (HeapSiteStats &site : imp->sites) site.live = 0;
+  size_t keep = 0;
+  for (Sample &s : imp->samples) {
+    bool survived = s.survived;
+    follow(s, everything);
+    if (!s.obj) continue;
+    HeapSiteStats &site = imp->sites[s.site];
+    if (!survived) site.survived += s.weight;
+    site.live += s.weight;
+    imp->samples[keep++] = s;
+  }
+  imp->samples.resize(keep);
+  for (HeapSiteStats &site : imp->sites) site.peak = std::max(site.peak, site.live);
+}
+
 void *Heap::scratch(size_t bytes) {
   size_t size = (bytes + sizeof(PadObject) - 1) / sizeof(PadObject);
   Space &idle = imp->spaces[imp->space ^ 1];
@@ -172,6 +362,19 @@ void Heap::report() const {
         << std::setw(12) << std::right << (x.pads * sizeof(PadObject)) << std::endl;
     }
     s << "------------------------------------------" << std::endl;
+    s << "  Collection   Count  Pause ms  Max ms      Copied" << std::endl;
+    s << "  ------------------------------------------------" << std::endl;
+    const PauseStats *kinds[] = {&imp->minor, &imp->major};
+    const char *names[] = {"minor", imp->generational ? "major" : "full"};
+    for (int i = 0; i < 2; ++i) {
+      const PauseStats &x = *kinds[i];
+      if (!x.collections) continue;
+      s << "  " << std::setw(10) << std::left << names[i] << std::right << std::setw(8)
+        << x.collections << std::fixed << std::setprecision(1) << std::setw(10)
+        << (x.seconds * 1000) << std::setw(8) << (x.longest * 1000) << std::setw(12)
+        << (x.pads * sizeof(PadObject)) << std::endl;
+    }
+    s << "------------------------------------------" << std::endl;
     status_write(STREAM_REPORT, s.str());
   }
 }
@@ -187,9 +390,347 @@ struct StatOrder {
   bool operator()(Kind a, Kind b) { return a.second.pads > b.second.pads; }
 };
 
+// Destroy the objects in 'list' which were not moved; return the survivors prepended to 'keep'
+static HeapObject *sweep(HeapObject *list, HeapObject *keep) {
+  HeapObject *next;
+  for (HeapObject *obj = list; obj; obj = next) {
+    if (typeid(*obj) == typeid(MovedObject)) {
+      MovedObject *mo = static_cast<MovedObject *>(obj);
+      DestroyableObject *survivor = static_cast<DestroyableObject *>(mo->to);
+      next = survivor->next;
+      survivor->next = keep;
+      keep = survivor;
+    } else {
+      next = static_cast<DestroyableObject *>(obj)->next;
+      obj->~HeapObject();
+    }
+  }
+  return keep;
+}
+
 void Heap::GC(size_t requested_pads) {
+  auto start = std::chrono::steady_clock::now();
+
+  size_t nursery_pads = std::max(static_cast<size_t>(NURSERY_SIZE), requested_pads);
+  // GC(0), as when the heap is destroyed, always collects everything
+  bool minor = imp->generational && requested_pads != 0 &&
+               static_cast<size_t>(imp->old_end - imp->old_free) >=
+                   static_cast<size_t>(free - imp->nursery.array);
+
+  PadObject *before = minor ? imp->old_free : nullptr;
+  // Allocation resumes elsewhere; keep the distance to the next sample
+  uintptr_t sample_left = sample_at - reinterpret_cast<uintptr_t>(free);
+  if (minor) {
+    minor_gc();
+  } else {
+    major_gc(imp->generational ? nursery_pads : requested_pads);
+  }
+
+  if (imp->generational) {
+    // The nursery is empty now, so it can be resized to fit the request
+    imp->nursery.resize(nursery_pads);
+    free = imp->nursery.array;
+    end = free + nursery_pads;
+    imp->remembered_fields.clear();
+    imp->remembered_objects.clear();
+    publish_regions();
+  }
+
+  if (imp->sample_bytes) sample_at = reinterpret_cast<uintptr_t>(free) + sample_left;
+
+  std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+  if (minor) {
+    imp->minor.add(pause.count(), imp->old_free - before);
+  } else {
+    imp->major.add(pause.count(), imp->last_pads);
+  }
+}
+
+// Promote every live object in the nursery to the old space
+void Heap::minor_gc() {
+  heap_regions.condemned_begin = heap_regions.young_begin;
+  heap_regions.condemned_size = heap_regions.young_size;
+
+  Placement progress(imp->old_free, imp->old_free);
+
+  for (RootRing *root = roots.next; root != &roots; root = root->next) {
+    if (!root->root || !heap_regions.young(root->root)) continue;
+    auto out = root->root->moveto(progress.free);
+    progress.free = out.free;
+    root->root = out.obj;
+  }
+
+  for (HeapPointerBase *field : imp->remembered_fields) {
+    progress.free = field->moveto(progress.free);
+  }
+
+  for (HeapObject *obj : imp->remembered_objects) {
+    progress.free = obj->descend(progress.free).free;
+  }
+
+  while (progress.obj != progress.free) progress = progress.obj->descend(progress.free);
+
+  if (imp->sample_bytes) track_samples(false);
+  imp->tenured = sweep(imp->finalize, imp->tenured);
+  imp->finalize = nullptr;
+  imp->old_free = progress.free;
+
+  heap_regions.condemned_begin = 0;
+  heap_regions.condemned_size = UINTPTR_MAX;
+}
+
+// The parallel GC forwards objects out of these spaces. Two bits per
+// object record whether a thread has claimed it and whether its copy is
+// done; as every object spans at least two pads, one bit per pad suffices.
+struct ForwardMap {
+  uintptr_t begin;
+  size_t pads;
+  std::unique_ptr<std::atomic<uint64_t>[]> bits;
+
+  ForwardMap(PadObject *begin_, size_t pads_)
+      : begin(reinterpret_cast<uintptr_t>(begin_)),
+        pads(pads_),
+        bits(new std::atomic<uint64_t>[pads_ / 64 + 1]()) {}
+
+  bool contains(HeapObject *obj) const { return HeapRegions::contains(begin, pads * 8, obj); }
+  size_t index(HeapObject *obj) const {
+    return (reinterpret_cast<uintptr_t>(obj) - begin) / sizeof(PadObject);
+  }
+  // Returns true if this call set the bit
+  bool set(size_t bit) {
+    uint64_t mask = UINT64_C(1) << (bit % 64);
+    return !(bits[bit / 64].fetch_or(mask, std::memory_order_acq_rel) & mask);
+  }
+  bool test(size_t bit) const {
+    return bits[bit / 64].load(std::memory_order_acquire) >> (bit % 64) & 1;
+  }
+};
+
+// Objects copied into to-space but whose children are not yet forwarded
+struct GreyRegion {
+  PadObject *begin;
+  PadObject *end;
+};
+
+struct ParallelGC {
+  std::vector<ForwardMap> &condemned;
+  std::atomic<PadObject *> top;
+  PadObject *limit;
+  std::vector<std::unique_ptr<GCWorker> > workers;
+  std::atomic<size_t> active;
+  bool profile;
+
+  ParallelGC(std::vector<ForwardMap> &condemned_, PadObject *to, PadObject *limit_, bool profile_)
+      : condemned(condemned_), top(to), limit(limit_), active(0), profile(profile_) {}
+
+  PadObject *claim(size_t pads) {
+    PadObject *out = top.fetch_add(pads);
+    assert(out + pads <= limit);
+    return out;
+  }
+};
+
+// Each thread copies objects into its own local allocation buffer (LAB)
+// and scans them from there. When a LAB fills, the part not yet scanned
+// becomes a grey region which idle threads may steal.
+struct GCWorker {
+  ParallelGC *gc;
+  PadObject *scan, *free, *end;  // the LAB
+  std::mutex mutex;
+  std::vector<GreyRegion> grey;
+  std::atomic<size_t> greys;
+  std::map<const char *, ObjectStats> stats;
+
+  explicit GCWorker(ParallelGC *gc_)
+      : gc(gc_), scan(nullptr), free(nullptr), end(nullptr), greys(0) {}
+
+  HeapObject *forward(HeapObject *obj);
+  PadObject *allocate(size_t pads);
+  void retire();
+  void push(GreyRegion region);
+  bool pop(GreyRegion &region);
+  bool steal(GreyRegion &region);
+  void visit(HeapObject *obj);
+  void scan_lab();
+  void scan_region(GreyRegion region);
+  void run();
+};
+
+GCWorker *HeapPointerBase::evacuate(GCWorker *worker) {
+  if (obj) obj = worker->forward(obj);
+  return worker;
+}
+
+HeapObject *GCWorker::forward(HeapObject *obj) {
+  for (ForwardMap &space : gc->condemned) {
+    if (!space.contains(obj)) continue;
+    size_t pad = space.index(obj);
+    if (!space.test(pad + 1)) {
+      if (space.set(pad)) {
+        // Large objects get a region of their own, rather than retiring a LAB early
+        size_t pads = obj->pads();
+        bool large = pads > LAB_SIZE / 4;
+        PadObject *to = large ? gc->claim(pads) : allocate(pads);
+        HeapObject *out = obj->moveto(to).obj;
+        space.set(pad + 1);
+        if (large) push(GreyRegion{to, to + pads});
+        return out;
+      }
+      // Another thread is copying it
+      while (!space.test(pad + 1)) std::this_thread::yield();
+    }
+    return static_cast<MovedObject *>(obj)->to;
+  }
+  return obj;
+}
+
+PadObject *GCWorker::allocate(size_t pads) {
+  if (static_cast<size_t>(end - free) < pads) {
+    retire();
+    scan = free = gc->claim(LAB_SIZE);
+    end = free + LAB_SIZE;
+  }
+  PadObject *out = free;
+  free += pads;
+  return out;
+}
+
+void GCWorker::retire() {
+  if (scan != free) push(GreyRegion{scan, free});
+  // Keep the heap walkable
+  while (free != end) free = PadObject::place(free);
+  scan = free;
+}
+
+void GCWorker::push(GreyRegion region) {
+  std::lock_guard<std::mutex> lock(mutex);
+  grey.push_back(region);
+  greys.store(grey.size());
+}
+
+bool GCWorker::pop(GreyRegion &region) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (grey.empty()) return false;
+  region = grey.back();
+  grey.pop_back();
+  greys.store(grey.size());
+  return true;
+}
+
+bool GCWorker::steal(GreyRegion &region) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (grey.empty()) return false;
+  // Take the oldest region, which is least likely to be in the owner's cache
+  region = grey.front();
+  grey.erase(grey.begin());
+  greys.store(grey.size());
+  return true;
+}
+
+void GCWorker::visit(HeapObject *obj) {
+  if (gc->profile && typeid(*obj) != typeid(PadObject)) {
+    ObjectStats &s = stats[obj->type()];
+    ++s.objects;
+    s.pads += obj->pads();
+  }
+  obj->scan(this);
+}
+
+void GCWorker::scan_lab() {
+  while (scan != free) {
+    HeapObject *obj = scan;
+    // Step past the object first, so a LAB retired while scanning it leaves it out
+    scan += obj->pads();
+    visit(obj);
+  }
+}
+
+void GCWorker::scan_region(GreyRegion region) {
+  while (region.begin != region.end) {
+    HeapObject *obj = region.begin;
+    region.begin += obj->pads();
+    visit(obj);
+  }
+}
+
+void GCWorker::run() {
+  GreyRegion region;
+  while (true) {
+    scan_lab();
+    if (pop(region)) {
+      scan_region(region);
+      continue;
+    }
+
+    // Out of work; wait for another thread to make some, or for all to finish
+    gc->active.fetch_sub(1);
+    bool stole = false;
+    for (int tries = 0;; ++tries) {
+      if (gc->active.load() == 0) return;
+      for (auto &victim : gc->workers) {
+        if (victim->greys.load() == 0) continue;
+        gc->active.fetch_add(1);
+        if ((stole = victim->steal(region))) break;
+        gc->active.fetch_sub(1);
+      }
+      if (stole) break;
+      // Don't take the CPU from threads with work (or from running jobs)
+      if (tries < 64) {
+        std::this_thread::yield();
+      } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+      }
+    }
+    scan_region(region);
+  }
+}
+
+// Copy everything reachable from the roots out of 'condemned' into [to, limit)
+static PadObject *parallel_copy(RootRing &roots, std::vector<ForwardMap> &condemned, PadObject *to,
+                                PadObject *limit, int threads, bool profile,
+                                std::map<const char *, ObjectStats> &stats) {
+  ParallelGC gc(condemned, to, limit, profile);
+  for (int i = 0; i < threads; ++i) gc.workers.emplace_back(new GCWorker(&gc));
+  gc.active.store(threads);
+
+  GCWorker *main = gc.workers[0].get();
+  for (RootRing *root = roots.next; root != &roots; root = root->next) {
+    if (root->root) root->root = main->forward(root->root);
+  }
+
+  // GC threads never take signals
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  std::vector<std::thread> helpers;
+  for (int i = 1; i < threads; ++i) helpers.emplace_back(&GCWorker::run, gc.workers[i].get());
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+
+  main->run();
+  for (auto &helper : helpers) helper.join();
+
+  for (auto &worker : gc.workers) {
+    worker->retire();
+    for (auto &x : worker->stats) {
+      ObjectStats &s = stats[x.first];
+      s.objects += x.second.objects;
+      s.pads += x.second.pads;
+    }
+  }
+
+  return gc.top.load();
+}
+
+// Copy everything reachable into a fresh old space
+void Heap::major_gc(size_t requested_pads) {
   Space &from = imp->spaces[imp->space];
-  size_t no_gc_overrun = (free - from.array) + requested_pads;
+  PadObject *from_free = imp->generational ? imp->old_free : free;
+  size_t young_pads = imp->generational ? free - imp->nursery.array : 0;
+  size_t live_pads = (from_free - from.array) + young_pads;
+  bool parallel = imp->gc_threads > 1 && live_pads >= PARALLEL_MIN_PADS;
+  // Parallel copying wastes under a third of each LAB, plus the LABs left partly full
+  size_t copy_pads = parallel ? live_pads + live_pads / 3 + imp->gc_threads * LAB_SIZE : live_pads;
+  size_t no_gc_overrun = copy_pads + requested_pads;
   size_t estimate_desired_size = imp->heap_factor * imp->last_pads + requested_pads;
   size_t elems = std::max(no_gc_overrun, estimate_desired_size);
 
@@ -199,48 +740,57 @@ void Heap::GC(size_t requested_pads) {
 
   Placement progress(to.array, to.array);
   std::map<const char *, ObjectStats> stats;
+  int profile = imp->profile_heap;
 
-  for (RootRing *root = roots.next; root != &roots; root = root->next) {
-    if (!root->root) continue;
-    auto out = root->root->moveto(progress.free);
-    progress.free = out.free;
-    root->root = out.obj;
-  }
+  if (parallel) {
+    std::vector<ForwardMap> condemned;
+    condemned.emplace_back(from.array, from_free - from.array);
+    if (imp->generational) condemned.emplace_back(imp->nursery.array, young_pads);
+    progress.free = parallel_copy(roots, condemned, to.array, to.array + elems, imp->gc_threads,
+                                  profile, stats);
+  } else {
+    for (RootRing *root = roots.next; root != &roots; root = root->next) {
+      if (!root->root) continue;
+      auto out = root->root->moveto(progress.free);
+      progress.free = out.free;
+      root->root = out.obj;
+    }
 
-  int profile = imp->profile_heap;
-  while (progress.obj != progress.free) {
-    auto next = progress.obj->descend(progress.free);
-    if (profile) {
-      ObjectStats &s = stats[progress.obj->type()];
-      ++s.objects;
-      s.pads += (static_cast<PadObject *>(next.obj) - static_cast<PadObject *>(progress.obj));
+    while (progress.obj != progress.free) {
+      auto next = progress.obj->descend(progress.free);
+      if (profile) {
+        ObjectStats &s = stats[progress.obj->type()];
+        ++s.objects;
+        s.pads += (static_cast<PadObject *>(next.obj) - static_cast<PadObject *>(progress.obj));
+      }
+      progress = next;
     }
-    progress = next;
   }
 
-  DestroyableObject *tail = nullptr;
-  HeapObject *next;
-  for (HeapObject *obj = imp->finalize; obj; obj = next) {
-    if (typeid(*obj) == typeid(MovedObject)) {
-      MovedObject *mo = static_cast<MovedObject *>(obj);
-      DestroyableObject *keep = static_cast<DestroyableObject *>(mo->to);
-      next = keep->next;
-      keep->next = tail;
-      tail = keep;
-    } else {
-      next = static_cast<DestroyableObject *>(obj)->next;
-      obj->~HeapObject();
-    }
+  if (imp->sample_bytes) track_samples(true);
+  HeapObject *survivors = sweep(imp->tenured, sweep(imp->finalize, nullptr));
+  if (imp->generational) {
+    imp->tenured = survivors;
+    imp->finalize = nullptr;
+  } else {
+    imp->finalize = survivors;
   }
-  imp->finalize = tail;
 
-  end = to.array + elems;
-  free = progress.free;
-  imp->last_pads = free - to.array;
+  PadObject *limit = to.array + elems;
+  imp->last_pads = progress.free - to.array;
   // Contain heap growth due to no_gc_overrun pessimism
   size_t desired_sized = imp->heap_factor * imp->last_pads + requested_pads;
   if (desired_sized < elems) {
-    end = to.array + desired_sized;
+    limit = to.array + desired_sized;
+  }
+
+  if (imp->generational) {
+    // Leave room to promote a full nursery
+    imp->old_free = progress.free;
+    imp->old_end = limit;
+  } else {
+    free = progress.free;
+    end = limit;
   }
 
   if (imp->profile_heap) {
@@ -283,6 +833,162 @@ void Heap::GC(size_t requested_pads) {
   }
 }
 
+// The live objects and roots as a graph, for a heap snapshot
+struct HeapGraph {
+  const std::vector<HeapObject *> &objects;  // by address
+  uint32_t first;                            // the node of objects[0]
+  std::vector<size_t> offsets;               // node i's edges are [offsets[i], offsets[i+1])
+  std::vector<uint32_t> edges;
+
+  HeapGraph(const std::vector<HeapObject *> &objects_, uint32_t first_)
+      : objects(objects_), first(first_), offsets(1, 0) {}
+
+  uint32_t node(HeapObject *obj) const {
+    auto it = std::lower_bound(objects.begin(), objects.end(), obj);
+    assert(it != objects.end() && *it == obj);
+    return first + (it - objects.begin());
+  }
+  void add(HeapObject *obj) { edges.push_back(node(obj)); }
+  void end_node() { offsets.push_back(edges.size()); }
+};
+
+HeapGraph *HeapPointerBase::trace(HeapGraph *graph) {
+  if (obj) graph->add(obj);
+  return graph;
+}
+
+// The bytes each node keeps alive, which is the size of its subtree in the
+// dominator tree; found with the Semi-NCA algorithm, starting from node 0.
+static std::vector<size_t> retained_sizes(const HeapGraph &graph, const std::vector<size_t> &size) {
+  const uint32_t none = UINT32_MAX;
+  size_t nodes = graph.offsets.size() - 1;
+
+  // Number the nodes in depth-first preorder; below, nodes are named by these numbers
+  std::vector<uint32_t> number(nodes, none), vertex, parent;
+  std::vector<std::pair<uint32_t, size_t> > stack;
+  number[0] = 0;
+  vertex.push_back(0);
+  parent.push_back(0);
+  stack.emplace_back(0, graph.offsets[0]);
+  while (!stack.empty()) {
+    uint32_t v = stack.back().first;
+    size_t &edge = stack.back().second;
+    if (edge == graph.offsets[v + 1]) {
+      stack.pop_back();
+      continue;
+    }
+    uint32_t w = graph.edges[edge++];
+    if (number[w] != none) continue;
+    number[w] = vertex.size();
+    vertex.push_back(w);
+    parent.push_back(number[v]);
+    stack.emplace_back(w, graph.offsets[w]);
+  }
+
+  size_t reached = vertex.size();
+  std::vector<size_t> pred_offsets(reached + 1, 0);
+  for (uint32_t v : vertex) {
+    for (size_t e = graph.offsets[v]; e != graph.offsets[v + 1]; ++e)
+      ++pred_offsets[number[graph.edges[e]] + 1];
+  }
+  for (size_t i = 0; i < reached; ++i) pred_offsets[i + 1] += pred_offsets[i];
+  std::vector<uint32_t> preds(pred_offsets[reached]);
+  std::vector<size_t> fill(pred_offsets.begin(), pred_offsets.end() - 1);
+  for (uint32_t i = 0; i < reached; ++i) {
+    uint32_t v = vertex[i];
+    for (size_t e = graph.offsets[v]; e != graph.offsets[v + 1]; ++e)
+      preds[fill[number[graph.edges[e]]]++] = i;
+  }
+
+  // Semidominators, with a path-compressed forest of the nodes processed so far
+  std::vector<uint32_t> semi(reached), label(reached), ancestor(reached, none), path;
+  for (uint32_t i = 0; i < reached; ++i) semi[i] = label[i] = i;
+  auto eval = [&](uint32_t v) {
+    if (ancestor[v] == none) return v;
+    path.clear();
+    for (uint32_t x = v; ancestor[ancestor[x]] != none; x = ancestor[x]) path.push_back(x);
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      uint32_t x = *it, a = ancestor[x];
+      if (semi[label[a]] < semi[label[x]]) label[x] = label[a];
+      ancestor[x] = ancestor[a];
+    }
+    return label[v];
+  };
+  for (uint32_t w = reached - 1; w > 0; --w) {
+    for (size_t e = pred_offsets[w]; e != pred_offsets[w + 1]; ++e)
+      semi[w] = std::min(semi[w], semi[eval(preds[e])]);
+    ancestor[w] = parent[w];
+  }
+
+  // The immediate dominator is the nearest common ancestor of parent and semidominator
+  std::vector<uint32_t> &idom = label;
+  idom[0] = 0;
+  for (uint32_t w = 1; w < reached; ++w) {
+    uint32_t d = parent[w];
+    while (d > semi[w]) d = idom[d];
+    idom[w] = d;
+  }
+
+  std::vector<size_t> retained(reached);
+  for (uint32_t i = 0; i < reached; ++i) retained[i] = size[vertex[i]];
+  for (uint32_t w = reached - 1; w > 0; --w) retained[idom[w]] += retained[w];
+
+  std::vector<size_t> out(nodes, 0);
+  for (uint32_t i = 0; i < reached; ++i) out[vertex[i]] = retained[i];
+  return out;
+}
+
+HeapSnapshot Heap::snapshot() {
+  GC(0);
+
+  // Afterwards, the live objects are packed together, with only padding between them
+  PadObject *begin = imp->spaces[imp->space].array;
+  PadObject *top = imp->generational ? imp->old_free : free;
+  std::vector<HeapObject *> objects;
+  for (PadObject *x = begin; x != top;) {
+    HeapObject *obj = x;
+    x += obj->pads();
+    if (typeid(*obj) != typeid(PadObject)) objects.push_back(obj);
+  }
+
+  std::vector<RootRing *> rings;
+  for (RootRing *root = roots.next; root != &roots; root = root->next) {
+    if (root->root) rings.push_back(root);
+  }
+
+  // Node 0 points to the roots, which point into the objects
+  size_t first = 1 + rings.size();
+  size_t nodes = first + objects.size();
+  assert(nodes < UINT32_MAX);
+  HeapGraph graph(objects, first);
+  for (size_t i = 0; i < rings.size(); ++i) graph.edges.push_back(1 + i);
+  graph.end_node();
+  for (RootRing *root : rings) {
+    graph.add(root->root);
+    graph.end_node();
+  }
+  std::vector<size_t> size(nodes, 0);
+  for (size_t i = 0; i < objects.size(); ++i) {
+    objects[i]->trace(&graph);
+    graph.end_node();
+    size[first + i] = objects[i]->pads() * sizeof(PadObject);
+  }
+
+  std::vector<size_t> retained = retained_sizes(graph, size);
+
+  HeapSnapshot out;
+  out.objects = objects.size();
+  out.bytes = retained[0];
+  for (size_t i = 0; i < rings.size(); ++i)
+    out.roots.push_back(HeapRootStats{rings[i]->root->type(), retained[1 + i]});
+  for (HeapSiteStats &site : imp->sites) site.retained = 0;
+  // A sampled object stands for weight/bytes objects like it
+  for (Sample &s : imp->samples)
+    imp->sites[s.site].retained += retained[graph.node(s.obj)] * s.weight / s.bytes;
+  out.sites = imp->sites;
+  return out;
+}
+
 Category Value::category() const { return VALUE; }
 
 DestroyableObject::DestroyableObject(Heap &h) : next(h.imp->finalize) { h.imp->finalize = this; }
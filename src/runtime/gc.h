@@ -23,6 +23,7 @@
 #include <memory>
 #include <ostream>
 #include <typeinfo>
+#include <vector>
 #ifdef DEBUG_GC
 #include <cassert>
 #endif
@@ -38,6 +39,8 @@ struct HeapPointerBase;
 struct DestroyableObject;
 struct PadObject;
 struct FormatState;
+struct GCWorker;
+struct HeapGraph;
 struct Promise;
 template <typename T>
 struct HeapPointer;
@@ -61,6 +64,11 @@ struct HeapObject {
   virtual Placement moveto(PadObject *free) = 0;
   virtual Placement descend(PadObject *free) = 0;
   virtual HeapStep explore(HeapStep step) = 0;
+  // For the parallel GC: the object's size, and forwarding its children
+  virtual size_t pads() = 0;
+  virtual void scan(GCWorker *worker) = 0;
+  // For heap snapshots: add the object's children to 'graph'
+  virtual void trace(HeapGraph *graph) = 0;
   virtual const char *type() const = 0;
   virtual void format(std::ostream &os, FormatState &state) const = 0;
   virtual Category category() const = 0;
@@ -157,17 +165,44 @@ struct RootPointer {
   friend struct RootPointer;
 };
 
+// Address ranges consulted by the write barrier and the collector. There
+// is only ever one generational Heap, which keeps these up to date.
+struct HeapRegions {
+  uintptr_t old_begin, old_size;              // tenured objects; empty unless generational
+  uintptr_t young_begin, young_size;          // the nursery
+  uintptr_t condemned_begin, condemned_size;  // objects the running GC evacuates
+  Heap *generational;
+
+  static bool contains(uintptr_t begin, uintptr_t size, const void *x) {
+    return reinterpret_cast<uintptr_t>(x) - begin < size;
+  }
+  bool old(const void *x) const { return contains(old_begin, old_size, x); }
+  bool young(const void *x) const { return contains(young_begin, young_size, x); }
+  bool condemned(const void *x) const { return contains(condemned_begin, condemned_size, x); }
+};
+
+extern HeapRegions heap_regions;
+
 struct HeapPointerBase {
   HeapPointerBase(HeapObject *obj_) : obj(obj_) {}
   PadObject *moveto(PadObject *free);
+  GCWorker *evacuate(GCWorker *worker);
+  HeapGraph *trace(HeapGraph *graph);
   HeapStep explore(HeapStep step);
 
  protected:
   HeapObject *obj;
+
+  // Write barrier: an old object which newly points into the nursery must
+  // be remembered, as the next minor GC only scans the nursery's roots.
+  void barrier(HeapObject *x) {
+    if (heap_regions.old(this) && heap_regions.young(x) && !heap_regions.young(obj)) remember();
+  }
+  void remember();
 };
 
 inline PadObject *HeapPointerBase::moveto(PadObject *free) {
-  if (!obj) return free;
+  if (!obj || !heap_regions.condemned(obj)) return free;
   Placement out = obj->moveto(free);
   obj = out.obj;
   return out.free;
@@ -185,6 +220,7 @@ struct HeapPointer : public HeapPointerBase {
   template <typename Y>
   HeapPointer(const RootPointer<Y> &x) : HeapPointerBase(static_cast<T *>(x.get())) {}
   HeapPointer(T *x = nullptr) : HeapPointerBase(x) {}
+  HeapPointer(const HeapPointer &x) = default;
 
   explicit operator bool() const { return obj; }
   void reset() { obj = nullptr; }
@@ -193,17 +229,25 @@ struct HeapPointer : public HeapPointerBase {
   T *operator->() const { return get(); }
   T &operator*() const { return *get(); }
 
+  HeapPointer &operator=(const HeapPointer &x) {
+    barrier(x.obj);
+    obj = x.obj;
+    return *this;
+  }
   template <typename Y>
   HeapPointer &operator=(HeapPointer<Y> x) {
+    barrier(x.get());
     obj = static_cast<T *>(x.get());
     return *this;
   }
   template <typename Y>
   HeapPointer &operator=(const RootPointer<Y> &x) {
+    barrier(x.get());
     obj = static_cast<T *>(x.get());
     return *this;
   }
   HeapPointer &operator=(T *x) {
+    barrier(x);
     obj = x;
     return *this;
   }
@@ -220,6 +264,9 @@ struct PadObject final : public HeapObject {
   Placement moveto(PadObject *free) override;
   Placement descend(PadObject *free) override;
   HeapStep explore(HeapStep step) override;
+  size_t pads() override;
+  void scan(GCWorker *worker) override;
+  void trace(HeapGraph *graph) override;
   const char *type() const override;
   void format(std::ostream &os, FormatState &state) const override;
   Category category() const override;
@@ -235,25 +282,66 @@ struct alignas(PadObject) MovedObject final : public HeapObject {
   Placement moveto(PadObject *free) override;
   Placement descend(PadObject *free) override;
   HeapStep explore(HeapStep step) override;
+  size_t pads() override;
+  void scan(GCWorker *worker) override;
+  void trace(HeapGraph *graph) override;
   const char *type() const override;
   void format(std::ostream &os, FormatState &state) const override;
   Category category() const override;
 };
 
+// Estimates for one allocation site, scaled up from its sampled objects
+struct HeapSiteStats {
+  double objects, bytes;  // allocated
+  double survived;        // bytes which outlived a collection
+  double live, peak;      // bytes live after the last collection, and after the fullest
+  double retained;        // bytes kept alive only through the site's objects, per snapshot()
+  HeapSiteStats() : objects(0), bytes(0), survived(0), live(0), peak(0), retained(0) {}
+};
+
+struct HeapRootStats {
+  const char *type;  // of the object the root points to
+  size_t retained;   // bytes kept alive only through this root
+};
+
+struct HeapSnapshot {
+  size_t objects, bytes;             // everything live
+  std::vector<HeapSiteStats> sites;  // indexed by the site passed to Heap::attribute
+  std::vector<HeapRootStats> roots;
+};
+
 struct GCNeededException {
   size_t needed;
   GCNeededException(size_t needed_) : needed(needed_) {}
 };
 
 struct Heap {
-  Heap(int profile_heap_, double heap_factor_);
+  // A generational heap allocates into a nursery, promoting its survivors
+  // to an old space which is only collected when it fills up. With more
+  // than one gc_thread, large heaps are copied by that many threads.
+  Heap(int profile_heap_, double heap_factor_, bool generational_ = false, int gc_threads_ = 1);
   ~Heap();
 
   // Call this from main loop (no pointers on stack) when GCNeededException
   void GC(size_t requested_pads);
-  // Report max heap usage
+  // Report max heap usage and GC pauses
   void report() const;
 
+  // Objects which hold HeapPointers outside the heap (eg: in a std::vector)
+  // must be remembered after those pointers change; the barrier misses them.
+  void remember(HeapObject *obj) {
+    if (heap_regions.generational == this && heap_regions.old(obj)) remember_object(obj);
+  }
+  void remember(HeapPointerBase *field);
+
+  // Sample roughly one allocation per 'bytes' allocated (0 to stop), and
+  // charge the samples taken since the last call to attribute() to 'site'.
+  void sample(size_t bytes);
+  bool sampled() const { return sample_pending; }
+  void attribute(size_t site);
+  // Collect everything, then measure what each root and site retains
+  HeapSnapshot snapshot();
+
   // Reserve enough space for a sequence of allocations
   void reserve(size_t requested_pads) {
     if (static_cast<size_t>(end - free) < requested_pads) throw GCNeededException(requested_pads);
@@ -274,6 +362,8 @@ struct Heap {
   PadObject *claim(size_t requested_pads) {
     PadObject *out = free;
     free += requested_pads;
+    // Never true unless sampling
+    if (reinterpret_cast<uintptr_t>(free) > sample_at) record_sample(out);
 #ifdef DEBUG_GC
     assert(requested_pads <= limit);
     limit -= requested_pads;
@@ -307,12 +397,24 @@ struct Heap {
   struct Imp;
   std::unique_ptr<Imp> imp;
   RootRing roots;
+  // Allocation happens between free and end; in the nursery if generational
   PadObject *free;
   PadObject *end;
+  // The next allocation to cross this address is sampled
+  uintptr_t sample_at;
+  bool sample_pending;
 #ifdef DEBUG_GC
   size_t limit;
 #endif
 
+  void remember_object(HeapObject *obj);
+  void record_sample(PadObject *obj);
+  void next_sample();
+  void track_samples(bool everything);
+  void minor_gc();
+  void major_gc(size_t requested_pads);
+  void publish_regions();
+
   friend struct DestroyableObject;
 };
 
@@ -339,6 +441,9 @@ struct alignas(PadObject) GCObject : public B {
   Placement moveto(PadObject *free) final override;
   Placement descend(PadObject *free) final override;
   HeapStep explore(HeapStep step) final override;
+  size_t pads() final override;
+  void scan(GCWorker *worker) final override;
+  void trace(HeapGraph *graph) final override;
   // Can be further specialized
   const char *type() const override;
 
@@ -385,6 +490,21 @@ Placement GCObject<T, B>::descend(PadObject *free) {
                    self()->template recurse<PadObject *, &HeapPointerBase::moveto>(free));
 }
 
+template <typename T, typename B>
+size_t GCObject<T, B>::pads() {
+  return self()->objend() - static_cast<PadObject *>(static_cast<HeapObject *>(self()));
+}
+
+template <typename T, typename B>
+void GCObject<T, B>::scan(GCWorker *worker) {
+  self()->template recurse<GCWorker *, &HeapPointerBase::evacuate>(worker);
+}
+
+template <typename T, typename B>
+void GCObject<T, B>::trace(HeapGraph *graph) {
+  self()->template recurse<HeapGraph *, &HeapPointerBase::trace>(graph);
+}
+
 template <typename T, typename B>
 HeapStep GCObject<T, B>::explore(HeapStep step) {
   return self()->template recurse<HeapStep, &HeapPointerBase::explore>(step);
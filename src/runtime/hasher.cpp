@@ -0,0 +1,262 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "hasher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "blake2/blake2.h"
+#include "compat/nofollow.h"
+
+#define HASH_BYTES 32
+// Large reads keep the number of syscalls per file small
+#define READ_BYTES (1024 * 1024)
+
+static std::string hex(const uint8_t *hash) {
+  static const char digits[] = "0123456789abcdef";
+  std::string out;
+  out.reserve(2 * HASH_BYTES);
+  for (int i = 0; i < HASH_BYTES; ++i) {
+    out.push_back(digits[hash[i] >> 4]);
+    out.push_back(digits[hash[i] & 15]);
+  }
+  return out;
+}
+
+static bool hash_link(const std::string &path, std::string &hash, std::string &error,
+                      uint64_t &bytes) {
+  std::vector<char> target(8192);
+  ssize_t got;
+  while ((got = readlink(path.c_str(), target.data(), target.size())) ==
+         static_cast<ssize_t>(target.size())) {
+    target.resize(2 * target.size());
+  }
+
+  if (got == -1) {
+    error = "readlink(" + path + "): " + strerror(errno);
+    return false;
+  }
+
+  uint8_t out[HASH_BYTES];
+  blake2b_state S;
+  blake2b_init(&S, sizeof(out));
+  blake2b_update(&S, reinterpret_cast<uint8_t *>(target.data()), got);
+  blake2b_final(&S, &out[0], sizeof(out));
+  hash = hex(out);
+  bytes = got;
+  return true;
+}
+
+static bool hash_content(const std::string &path, int fd, std::string &hash, std::string &error,
+                         uint64_t &bytes) {
+#ifdef POSIX_FADV_SEQUENTIAL
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  // Each thread reuses its own buffer
+  static thread_local std::unique_ptr<uint8_t[]> buffer(new uint8_t[READ_BYTES]);
+
+  uint8_t out[HASH_BYTES];
+  blake2b_state S;
+  blake2b_init(&S, sizeof(out));
+  ssize_t got;
+  bytes = 0;
+  while ((got = read(fd, buffer.get(), READ_BYTES)) != 0) {
+    if (got == -1) {
+      if (errno == EINTR) continue;
+      error = "read(" + path + "): " + strerror(errno);
+      return false;
+    }
+    blake2b_update(&S, buffer.get(), got);
+    bytes += got;
+  }
+  blake2b_final(&S, &out[0], sizeof(out));
+  hash = hex(out);
+  return true;
+}
+
+bool hash_file(const std::string &path, std::string &hash, std::string &error, uint64_t &bytes) {
+  bytes = 0;
+
+  int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == EISDIR) {
+      hash.assign(2 * HASH_BYTES, '0');
+      return true;
+    }
+    if (errno == ELOOP || errno == EMLINK) return hash_link(path, hash, error, bytes);
+    error = "open(" + path + "): " + strerror(errno);
+    return false;
+  }
+
+  struct stat st;
+  bool ok;
+  if (fstat(fd, &st) != 0) {
+    error = "fstat(" + path + "): " + strerror(errno);
+    ok = false;
+  } else if (S_ISDIR(st.st_mode)) {
+    hash.assign(2 * HASH_BYTES, '0');
+    ok = true;
+  } else if (S_ISLNK(st.st_mode)) {
+    ok = hash_link(path, hash, error, bytes);
+  } else {
+    ok = hash_content(path, fd, hash, error, bytes);
+  }
+
+  close(fd);
+  return ok;
+}
+
+struct FileHasher::detail {
+  mutable std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<std::pair<long, std::string> > queue;  // token, path
+  std::vector<FileHash> done;
+  size_t outstanding = 0;
+  bool stopping = false;
+  HashStats stats = {0, 0, 0};
+  int pipe_fds[2];
+  std::vector<std::thread> threads;
+
+  void work();
+};
+
+void FileHasher::detail::work() {
+  while (true) {
+    std::pair<long, std::string> next;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      wakeup.wait(lock, [this]() { return stopping || !queue.empty(); });
+      if (stopping) return;
+      next = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    FileHash item;
+    item.token = next.first;
+    const std::string &path = next.second;
+    uint64_t bytes;
+    auto start = std::chrono::steady_clock::now();
+    if (!hash_file(path, item.hash, item.error, bytes)) item.hash.clear();
+    std::chrono::duration<double> busy = std::chrono::steady_clock::now() - start;
+
+    bool first;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      first = done.empty();
+      done.emplace_back(std::move(item));
+      ++stats.files;
+      stats.bytes += bytes;
+      stats.busy += busy.count();
+    }
+
+    // Only the first result since the last collect() needs to wake the main thread
+    if (first) {
+      char token = 0;
+      while (write(pipe_fds[1], &token, 1) == -1 && errno == EINTR) {
+      }
+    }
+  }
+}
+
+FileHasher::FileHasher(size_t threads) : imp(new FileHasher::detail) {
+  if (pipe(imp->pipe_fds) == -1) {
+    perror("pipe");
+    exit(1);
+  }
+  for (int fd : imp->pipe_fds) {
+    int flags;
+    if ((flags = fcntl(fd, F_GETFD, 0)) != -1) fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+  }
+  int flags;
+  if ((flags = fcntl(imp->pipe_fds[0], F_GETFL, 0)) != -1)
+    fcntl(imp->pipe_fds[0], F_SETFL, flags | O_NONBLOCK);
+
+  // Signals are for the main thread's poll.wait(); the workers never take them
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  if (threads < 1) threads = 1;
+  for (size_t i = 0; i < threads; ++i) {
+    imp->threads.emplace_back(&FileHasher::detail::work, imp.get());
+  }
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+}
+
+FileHasher::~FileHasher() {
+  {
+    std::lock_guard<std::mutex> lock(imp->mutex);
+    imp->stopping = true;
+  }
+  imp->wakeup.notify_all();
+  for (auto &thread : imp->threads) thread.join();
+  close(imp->pipe_fds[0]);
+  close(imp->pipe_fds[1]);
+}
+
+int FileHasher::ready_fd() const { return imp->pipe_fds[0]; }
+
+size_t FileHasher::outstanding() const {
+  std::lock_guard<std::mutex> lock(imp->mutex);
+  return imp->outstanding;
+}
+
+HashStats FileHasher::stats() const {
+  std::lock_guard<std::mutex> lock(imp->mutex);
+  return imp->stats;
+}
+
+void FileHasher::submit(long token, const std::string &path) {
+  {
+    std::lock_guard<std::mutex> lock(imp->mutex);
+    imp->queue.emplace_back(token, path);
+    ++imp->outstanding;
+  }
+  imp->wakeup.notify_one();
+}
+
+std::vector<FileHash> FileHasher::collect() {
+  // Drain the wakeups before taking the results, so that a result which
+  // arrives after this point leaves the pipe readable again.
+  char buffer[64];
+  while (read(imp->pipe_fds[0], buffer, sizeof(buffer)) > 0) {
+  }
+
+  std::vector<FileHash> out;
+  std::lock_guard<std::mutex> lock(imp->mutex);
+  out.swap(imp->done);
+  imp->outstanding -= out.size();
+  return out;
+}
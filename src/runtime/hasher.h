@@ -0,0 +1,68 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HASHER_H
+#define HASHER_H
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Hashes `path` exactly as `shim-wake <hash> path` does: the BLAKE2b-256
+// of a file's content, of a symlink's target, or all zeros for a
+// directory. On success, `hash` is the hex digest and `bytes` how much
+// was read. Otherwise `error` says why.
+bool hash_file(const std::string &path, std::string &hash, std::string &error, uint64_t &bytes);
+
+struct FileHash {
+  long token;
+  std::string hash;   // empty on failure
+  std::string error;  // set on failure
+};
+
+struct HashStats {
+  uint64_t files;
+  uint64_t bytes;
+  double busy;  // seconds spent hashing, summed over the threads
+};
+
+// A pool of threads which hash files on behalf of the main thread. When
+// hashes are ready, ready_fd() becomes readable and collect() returns them.
+class FileHasher {
+ public:
+  explicit FileHasher(size_t threads);
+  ~FileHasher();
+
+  FileHasher(const FileHasher &) = delete;
+  FileHasher &operator=(const FileHasher &) = delete;
+
+  int ready_fd() const;
+  // Number of files submitted but not yet collected
+  size_t outstanding() const;
+  HashStats stats() const;
+
+  void submit(long token, const std::string &path);
+  std::vector<FileHash> collect();
+
+ private:
+  struct detail;
+  std::unique_ptr<detail> imp;
+};
+
+#endif
@@ -27,52 +27,85 @@
 #include "types/type.h"
 #include "value.h"
 
-#define UNOP(name, fn)                         \
-  static PRIMFN(prim_##name) {                 \
-    EXPECT(1);                                 \
-    INTEGER_MPZ(arg0, 0);                      \
-    MPZ out;                                   \
-    fn(out.value, arg0);                       \
-    RETURN(Integer::alloc(runtime.heap, out)); \
+// Operands which fit an int64_t skip GMP, unless 'fast' overflows computing z.
+// small() never yields INT64_MIN, so negating an operand cannot overflow.
+#define SMALL(x, i) static_cast<Integer *>(args[i])->small(x)
+
+static int64_t gcd(int64_t x, int64_t y) {
+  if (x < 0) x = -x;
+  if (y < 0) y = -y;
+  while (y) {
+    int64_t r = x % y;
+    x = y;
+    y = r;
   }
+  return x;
+}
 
-UNOP(com, mpz_com)
-UNOP(abs, mpz_abs)
-UNOP(neg, mpz_neg)
+static bool lcm(int64_t x, int64_t y, int64_t *z) {
+  int64_t g = gcd(x, y);
+  if (g == 0) {
+    *z = 0;
+    return true;
+  }
+  if (__builtin_mul_overflow(x / g, y, z) || *z == INT64_MIN) return false;
+  if (*z < 0) *z = -*z;
+  return true;
+}
 
-#define BINOP(name, fn)                        \
-  static PRIMFN(prim_##name) {                 \
-    EXPECT(2);                                 \
-    INTEGER_MPZ(arg0, 0);                      \
-    INTEGER_MPZ(arg1, 1);                      \
-    MPZ out;                                   \
-    fn(out.value, arg0, arg1);                 \
-    RETURN(Integer::alloc(runtime.heap, out)); \
+#define UNOP(name, fn, fast)                                            \
+  static PRIMFN(prim_##name) {                                          \
+    EXPECT(1);                                                          \
+    INTEGER_MPZ(arg0, 0);                                               \
+    int64_t x, z;                                                       \
+    if (SMALL(x, 0) && (fast)) RETURN(Integer::alloc(runtime.heap, z)); \
+    MPZ out;                                                            \
+    fn(out.value, arg0);                                                \
+    RETURN(Integer::alloc(runtime.heap, out));                          \
+  }
+
+UNOP(com, mpz_com, (z = ~x, true))
+UNOP(abs, mpz_abs, (z = x < 0 ? -x : x, true))
+UNOP(neg, mpz_neg, (z = -x, true))
+
+#define BINOP(name, fn, fast)                                                          \
+  static PRIMFN(prim_##name) {                                                         \
+    EXPECT(2);                                                                         \
+    INTEGER_MPZ(arg0, 0);                                                              \
+    INTEGER_MPZ(arg1, 1);                                                              \
+    int64_t x, y, z;                                                                   \
+    if (SMALL(x, 0) && SMALL(y, 1) && (fast)) RETURN(Integer::alloc(runtime.heap, z)); \
+    MPZ out;                                                                           \
+    fn(out.value, arg0, arg1);                                                         \
+    RETURN(Integer::alloc(runtime.heap, out));                                         \
   }
 
-BINOP(add, mpz_add)
-BINOP(sub, mpz_sub)
-BINOP(mul, mpz_mul)
-BINOP(xor, mpz_xor)
-BINOP(and, mpz_and)
-BINOP(or, mpz_ior)
-BINOP(gcd, mpz_gcd)
-BINOP(lcm, mpz_lcm)
-
-#define BINOP_ZERO(name, fn)                          \
-  static PRIMFN(prim_##name) {                        \
-    EXPECT(2);                                        \
-    INTEGER_MPZ(arg0, 0);                             \
-    INTEGER_MPZ(arg1, 1);                             \
-    bool division_by_zero = mpz_cmp_si(arg1, 0) == 0; \
-    REQUIRE(!division_by_zero);                       \
-    MPZ out;                                          \
-    fn(out.value, arg0, arg1);                        \
-    RETURN(Integer::alloc(runtime.heap, out));        \
+BINOP(add, mpz_add, !__builtin_add_overflow(x, y, &z))
+BINOP(sub, mpz_sub, !__builtin_sub_overflow(x, y, &z))
+BINOP(mul, mpz_mul, !__builtin_mul_overflow(x, y, &z))
+BINOP(xor, mpz_xor, (z = x ^ y, true))
+BINOP(and, mpz_and, (z = x & y, true))
+BINOP(or, mpz_ior, (z = x | y, true))
+BINOP(gcd, mpz_gcd, (z = gcd(x, y), true))
+BINOP(lcm, mpz_lcm, lcm(x, y, &z))
+
+#define BINOP_ZERO(name, fn, fast)                                                     \
+  static PRIMFN(prim_##name) {                                                         \
+    EXPECT(2);                                                                         \
+    INTEGER_MPZ(arg0, 0);                                                              \
+    INTEGER_MPZ(arg1, 1);                                                              \
+    bool division_by_zero = mpz_cmp_si(arg1, 0) == 0;                                  \
+    REQUIRE(!division_by_zero);                                                        \
+    int64_t x, y, z;                                                                   \
+    if (SMALL(x, 0) && SMALL(y, 1) && (fast)) RETURN(Integer::alloc(runtime.heap, z)); \
+    MPZ out;                                                                           \
+    fn(out.value, arg0, arg1);                                                         \
+    RETURN(Integer::alloc(runtime.heap, out));                                         \
   }
 
-BINOP_ZERO(div, mpz_tdiv_q)
-BINOP_ZERO(mod, mpz_tdiv_r)
+// Both truncate toward zero, like C
+BINOP_ZERO(div, mpz_tdiv_q, (z = x / y, true))
+BINOP_ZERO(mod, mpz_tdiv_r, (z = x % y, true))
 
 #define BINOP_SI2(name, fn1, fn2)              \
   static PRIMFN(prim_##name) {                 \
@@ -192,6 +225,8 @@ static PRIMFN(prim_icmp) {
   EXPECT(2);
   INTEGER_MPZ(arg0, 0);
   INTEGER_MPZ(arg1, 1);
+  int64_t x, y;
+  if (SMALL(x, 0) && SMALL(y, 1)) RETURN(alloc_order(runtime.heap, (x > y) - (x < y)));
   RETURN(alloc_order(runtime.heap, mpz_cmp(arg0, arg1)));
 }
 
@@ -37,6 +37,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <limits>
@@ -52,9 +53,13 @@
 #include "compat/sigwinch.h"
 #include "compat/spawn.h"
 #include "database.h"
+#include "hasher.h"
+#include "launcher.h"
 #include "poll.h"
 #include "prim.h"
+#include "scheduler.h"
 #include "status.h"
+#include "target.h"
 #include "types/data.h"
 #include "types/type.h"
 #include "util/execpath.h"
@@ -66,8 +71,10 @@
 #define TERM_ATTEMPTS 6
 // How long between first and second SIGTERM attempt (exponentially increasing)
 #define TERM_BASE_GAP_MS 100
-// The most file descriptors used by wake for itself (database/stdio/etc)
-#define MAX_SELF_FDS 24
+// The most file descriptors used by wake for itself (database/stdio/hashing/etc)
+#define MAX_SELF_FDS 48
+// The most threads used to hash files
+#define MAX_HASH_THREADS 16
 // The default memory to provision for jobs (2MB)
 #define DEFAULT_PHYS_USAGE (2 * 1024 * 1024)
 
@@ -231,6 +238,7 @@ struct Task {
   std::string stdin_file;
   std::string environ;
   std::string cmdline;
+  CriticalPaths::Handle crit;
   Task(RootPointer<Job> &&job_, const std::string &dir_, const std::string &stdin_file_,
        const std::string &environ_, const std::string &cmdline_)
       : job(std::move(job_)),
@@ -240,16 +248,15 @@ struct Task {
         cmdline(cmdline_) {}
 };
 
-static bool operator<(const std::unique_ptr<Task> &x, const std::unique_ptr<Task> &y) {
-  // anything with dependants on stderr/stdout is infinity (ie: run first)
-  if (x->job->q_stdout || x->job->q_stderr) return false;
-  if (y->job->q_stdout || y->job->q_stderr) return true;
-  // 0 (unknown runtime) is infinity for this comparison (ie: run first)
-  if (x->job->predict.runtime == 0 && y->job->predict.runtime != 0) return false;
-  if (y->job->predict.runtime == 0 && x->job->predict.runtime != 0) return true;
-  if (x->job->pathtime < y->job->pathtime) return true;
-  if (x->job->pathtime > y->job->pathtime) return false;
-  return x->job->job < y->job->job;
+static LaunchPriority launch_priority(const Job *job) {
+  LaunchPriority out;
+  // anything with dependants on stderr/stdout is run first
+  out.urgent = job->q_stdout || job->q_stderr;
+  // as is anything with an unknown (0) runtime
+  out.unknown = job->predict.runtime == 0;
+  out.pathtime = job->pathtime;
+  out.id = job->job;
+  return out;
 }
 
 // A JobEntry is a forked job with pid|stdout|stderr incomplete
@@ -263,6 +270,7 @@ struct JobEntry {
   std::string stderr_buf;
   std::string echo_line;
   std::list<Status>::iterator status;
+  CriticalPaths::Handle crit;
 
   JobEntry(JobTable::detail *imp_, RootPointer<Job> &&job_)
       : imp(imp_), job(std::move(job_)), pid(0), pipe_stdout(-1), pipe_stderr(-1) {}
@@ -275,18 +283,15 @@ double JobEntry::runtime(struct timespec now) {
   return now.tv_sec - job->start.tv_sec + (now.tv_nsec - job->start.tv_nsec) / 1000000000.0;
 }
 
-struct CriticalJob {
-  double pathtime;
-  double runtime;
-};
-
 // Implementation details for a JobTable
 struct JobTable::detail {
   Poll poll;
   long num_running;
   std::map<pid_t, std::shared_ptr<JobEntry> > pidmap;
   std::map<int, std::shared_ptr<JobEntry> > pipes;
-  std::vector<std::unique_ptr<Task> > pending;
+  LaunchQueue<std::unique_ptr<Task> > pending;
+  // The pathtimes of the pending jobs and those in pidmap
+  CriticalPaths critical;
   sigset_t block;  // signals that can race with poll.wait()
   Database *db;
   double active, limit;              // CPUs
@@ -299,28 +304,56 @@ struct JobTable::detail {
   bool batch;
   struct timespec wall;
   RUsage childrenUsage;
+  // Files being hashed, by token, and who is waiting for them
+  std::unique_ptr<FileHasher> hasher;
+  std::map<long, std::pair<RootPointer<Continuation>, std::string> > hashing;
+  long next_hash;
+  // Jobs are spawned by the launcher while use_launcher holds, else by vfork
+  Launcher launcher;
+  bool use_launcher;
+  LaunchHistogram forked, spawned;
 
   CriticalJob critJob(double nexttime) const;
+  void reap(std::map<pid_t, std::shared_ptr<JobEntry> >::iterator it);
+  void hash(RootPointer<Continuation> &&continuation, const std::string &file);
+  int finish_hashes(Runtime &runtime);
 };
 
 CriticalJob JobTable::detail::critJob(double nexttime) const {
-  CriticalJob out;
-  out.pathtime = nexttime;
-  out.runtime = 0;
-  for (auto &pm : pidmap) {
-    Job *job = pm.second->job.get();
-    if (job->pathtime > out.pathtime) {
-      out.pathtime = job->pathtime;
-      out.runtime = job->record.runtime;
-    }
+  return critical.longest(nexttime);
+}
+
+// Forgets a job whose process has exited
+void JobTable::detail::reap(std::map<pid_t, std::shared_ptr<JobEntry> >::iterator it) {
+  critical.remove(it->second->crit);
+  pidmap.erase(it);
+}
+
+// Hashes `file` off the main thread and resumes `continuation` with the result
+void JobTable::detail::hash(RootPointer<Continuation> &&continuation, const std::string &file) {
+  if (!hasher) {
+    size_t threads = std::max(1.0, std::min(ceil(limit), double(MAX_HASH_THREADS)));
+    hasher.reset(new FileHasher(threads));
+    poll.add(hasher->ready_fd());
   }
-  for (auto &j : pending) {
-    if (j->job->pathtime > out.pathtime) {
-      out.pathtime = j->job->pathtime;
-      out.runtime = j->job->record.runtime;
-    }
+  long token = next_hash++;
+  hashing.emplace(token, std::make_pair(std::move(continuation), file));
+  hasher->submit(token, file);
+}
+
+int JobTable::detail::finish_hashes(Runtime &runtime) {
+  int done = 0;
+  for (auto &result : hasher->collect()) {
+    auto it = hashing.find(result.token);
+    assert(it != hashing.end());
+    if (!result.error.empty()) status_write(STREAM_ERROR, "wake hash " + result.error + "\n");
+    target_observe(runtime, "hash", it->second.second, result.hash);
+    runtime.heap.guarantee(String::reserve(result.hash.size()));
+    it->second.first->resume(runtime, String::claim(runtime.heap, result.hash));
+    hashing.erase(it);
+    ++done;
   }
-  return out;
+  return done;
 }
 
 static bool nice_end(const char *s) {
@@ -440,7 +473,7 @@ static int get_concurrency() {
 }
 
 JobTable::JobTable(Database *db, ResourceBudget memory, ResourceBudget cpu, bool debug,
-                   bool verbose, bool quiet, bool check, bool batch)
+                   bool verbose, bool quiet, bool check, bool batch, bool launcher)
     : imp(new JobTable::detail) {
   imp->num_running = 0;
   imp->debug = debug;
@@ -453,6 +486,8 @@ JobTable::JobTable(Database *db, ResourceBudget memory, ResourceBudget cpu, bool
   imp->limit = cpu.get(get_concurrency());
   imp->phys_active = 0;
   imp->phys_limit = memory.get(get_physical_memory());
+  imp->next_hash = 0;
+  imp->use_launcher = launcher;
   memset(&imp->childrenUsage, 0, sizeof(struct RUsage));
 
   // Double-check that ::parse() did not do something crazy.
@@ -574,6 +609,22 @@ JobTable::~JobTable() {
   // We don't care about file descriptors any more
   imp->poll.clear();
 
+  if (imp->hasher) {
+    HashStats stats = imp->hasher->stats();
+    std::stringstream s;
+    s << "wake: hashed " << stats.files << " files (" << ResourceBudget::format(stats.bytes)
+      << ") in " << stats.busy << "s of hashing time" << std::endl;
+    status_write(STREAM_LOG, s.str());
+  }
+
+  if (imp->forked.launches) {
+    status_write(STREAM_LOG, "wake: fork server launched " + imp->forked.format() + "\n");
+  }
+  if (imp->spawned.launches) {
+    status_write(STREAM_LOG, "wake: vfork launched " + imp->spawned.format() + "\n");
+  }
+  imp->launcher.stop();
+
   // SIGTERM strategy is to double the gap between termination attempts every retry
   struct timespec limit;
   limit.tv_sec = TERM_BASE_GAP_MS / 1000;
@@ -612,7 +663,8 @@ JobTable::~JobTable() {
       int status;
       while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
         if (WIFSTOPPED(status)) continue;
-        imp->pidmap.erase(pid);
+        auto it = imp->pidmap.find(pid);
+        if (it != imp->pidmap.end()) imp->reap(it);
       }
     }
   }
@@ -659,6 +711,11 @@ static std::string pretty_cmd(const std::string &x) {
   return out.str();
 }
 
+// How far down the queue launch() looks for a job that fits in memory,
+// and how many such jobs may start ahead of the best one
+static const size_t launch_window = 64;
+static const size_t launch_patience = 16;
+
 static void launch(JobTable *jobtable) {
   // Note: We schedule jobs whenever we are under CPU quota, without considering if the
   // new job will cause us to exceed the quota. This is necessary, for two reasons:
@@ -670,20 +727,35 @@ static void launch(JobTable *jobtable) {
   // For memory, we follow a more conservative policy. We don't start a job that would
   // oversubscribe RAM, unless there are no other jobs running yet. The rational:
   //   - exceeding memory would slow down the build due to thrashing
-  //   - RAM is never "wasted" (disk cache / etc), so just wait for the next critical job
   //   - even if a job uses more memory than the system has, eventually attempt it anyway (progress)
-  auto &heap = jobtable->imp->pending;
-  while (!heap.empty() && jobtable->imp->num_running < jobtable->imp->max_children &&
-         jobtable->imp->active < jobtable->imp->limit &&
-         (jobtable->imp->phys_active == 0 ||
-          jobtable->imp->phys_active + heap.front()->job->memory() < jobtable->imp->phys_limit)) {
-    Task &task = *heap.front();
+  // A job that doesn't fit in the remaining memory doesn't block the jobs behind it at first.
+  // We start the most critical job among the next few that does fit, so the CPUs don't sit
+  // idle while we wait for memory. After a few of those, we stop backfilling so that running
+  // jobs drain; the skipped job goes first once memory frees up, or once nothing else runs.
+  auto &queue = jobtable->imp->pending;
+  auto fits = [jobtable](const std::unique_ptr<Task> &task) {
+    return jobtable->imp->phys_active == 0 ||
+           jobtable->imp->phys_active + task->job->memory() < jobtable->imp->phys_limit;
+  };
+  // The launcher must start before any job's pipes exist, or it would hold them open
+  std::string shim_path = find_execpath() + "/../lib/wake/shim-wake";
+  if (!queue.empty() && jobtable->imp->use_launcher && !jobtable->imp->launcher.running())
+    jobtable->imp->use_launcher = jobtable->imp->launcher.start(shim_path);
+
+  while (!queue.empty() && jobtable->imp->num_running < jobtable->imp->max_children &&
+         jobtable->imp->active < jobtable->imp->limit) {
+    auto next = queue.select(fits, launch_window, launch_patience);
+    if (next == queue.end()) break;
+    std::unique_ptr<Task> owned = queue.pop(next);
+    Task &task = *owned;
     jobtable->imp->active += task.job->threads();
     jobtable->imp->phys_active += task.job->memory();
 
     std::shared_ptr<JobEntry> entry =
         std::make_shared<JobEntry>(jobtable->imp.get(), std::move(task.job));
+    entry->crit = task.crit;
 
+    auto launched = std::chrono::steady_clock::now();
     int pipe_stdout[2];
     int pipe_stderr[2];
     if (pipe(pipe_stdout) == -1 || pipe(pipe_stderr) == -1) {
@@ -700,30 +772,43 @@ static void launch(JobTable *jobtable) {
     jobtable->imp->pipes[pipe_stdout[0]] = entry;
     jobtable->imp->pipes[pipe_stderr[0]] = entry;
     clock_gettime(CLOCK_REALTIME, &entry->job->start);
-    std::stringstream prelude;
-    prelude << find_execpath() << "/../lib/wake/shim-wake" << '\0'
-            << (task.stdin_file.empty() ? "/dev/null" : task.stdin_file.c_str()) << '\0'
-            << std::to_string(pipe_stdout[1]) << '\0' << std::to_string(pipe_stderr[1]) << '\0'
-            << task.dir << '\0';
-    std::string shim = prelude.str() + task.cmdline;
-    auto cmdline = split_null(shim);
-    auto environ = split_null(task.environ);
-
-    sigset_t set;
-    sigemptyset(&set);
-    sigaddset(&set, SIGCHLD);
-    sigprocmask(SIG_UNBLOCK, &set, 0);
-    pid_t pid = wake_spawn(cmdline[0], cmdline, environ);
-    sigprocmask(SIG_BLOCK, &set, 0);
-
-    delete[] cmdline;
-    delete[] environ;
+    const char *stdin_file = task.stdin_file.empty() ? "/dev/null" : task.stdin_file.c_str();
+
+    pid_t pid = -1;
+    if (jobtable->imp->use_launcher) {
+      pid = jobtable->imp->launcher.spawn(stdin_file, pipe_stdout[1], pipe_stderr[1], task.dir,
+                                          task.cmdline, task.environ);
+      if (pid == -1) jobtable->imp->use_launcher = false;
+    }
+
+    bool forked = pid != -1;
+    if (!forked) {
+      std::stringstream prelude;
+      prelude << shim_path << '\0' << stdin_file << '\0' << std::to_string(pipe_stdout[1]) << '\0'
+              << std::to_string(pipe_stderr[1]) << '\0' << task.dir << '\0';
+      std::string shim = prelude.str() + task.cmdline;
+      auto cmdline = split_null(shim);
+      auto environ = split_null(task.environ);
+
+      sigset_t set;
+      sigemptyset(&set);
+      sigaddset(&set, SIGCHLD);
+      sigprocmask(SIG_UNBLOCK, &set, 0);
+      pid = wake_spawn(cmdline[0], cmdline, environ);
+      sigprocmask(SIG_BLOCK, &set, 0);
+
+      delete[] cmdline;
+      delete[] environ;
+    }
+
     ++jobtable->imp->num_running;
     jobtable->imp->pidmap[pid] = entry;
     entry->job->pid = entry->pid = pid;
     entry->job->state |= STATE_FORKED;
     close(pipe_stdout[1]);
     close(pipe_stderr[1]);
+    std::chrono::duration<double> latency = std::chrono::steady_clock::now() - launched;
+    (forked ? jobtable->imp->forked : jobtable->imp->spawned).add(latency.count());
     bool indirect = *entry->job->cmdline != task.cmdline;
     double predict = entry->job->predict.status == 0 ? entry->job->predict.runtime : 0;
     std::string pretty = pretty_cmd(entry->job->cmdline->as_str());
@@ -763,9 +848,6 @@ static void launch(JobTable *jobtable) {
 
     // entry->job->stdin_file.clear();
     // entry->job->cmdline.clear();
-
-    std::pop_heap(heap.begin(), heap.end());
-    heap.resize(heap.size() - 1);
   }
 }
 
@@ -781,14 +863,15 @@ JobEntry::~JobEntry() {
 }
 
 bool JobTable::wait(Runtime &runtime) {
-  char buffer[4096];
+  // A full pipe holds 64 KiB; drain it in one read rather than sixteen
+  static char buffer[64 * 1024];
   struct timespec nowait;
   memset(&nowait, 0, sizeof(nowait));
 
   launch(this);
 
   bool compute = false;
-  while (!exit_now() && imp->num_running) {
+  while (!exit_now() && (imp->num_running || !imp->hashing.empty())) {
     // Block all signals we expect to interrupt pselect
     sigset_t saved;
     sigprocmask(SIG_BLOCK, &imp->block, &saved);
@@ -827,6 +910,11 @@ bool JobTable::wait(Runtime &runtime) {
     int done = 0;
 
     for (auto fd : ready_fds) {
+      if (imp->hasher && fd == imp->hasher->ready_fd()) {
+        done += imp->finish_hashes(runtime);
+        continue;
+      }
+
       auto it = imp->pipes.find(fd);
       assert(it != imp->pipes.end());  // ready_fds <= poll_fds == pipes.keys()
       std::shared_ptr<JobEntry> entry = it->second;
@@ -914,10 +1002,13 @@ bool JobTable::wait(Runtime &runtime) {
 
       // It is possible that this is not our child
       auto it = imp->pidmap.find(pid);
-      if (it == imp->pidmap.end()) continue;
+      if (it == imp->pidmap.end()) {
+        imp->launcher.reaped(pid);
+        continue;
+      }
 
       std::shared_ptr<JobEntry> entry = it->second;
-      imp->pidmap.erase(it);
+      imp->reap(it);
       assert(entry);
 
       entry->pid = 0;
@@ -1027,6 +1118,7 @@ static PRIMTYPE(type_job_fail) {
 
 static PRIMFN(prim_job_fail_launch) {
   EXPECT(2);
+  target_effect(runtime);
   JOB(job, 0);
 
   REQUIRE(job->state == 0);
@@ -1050,6 +1142,7 @@ static PRIMFN(prim_job_fail_launch) {
 
 static PRIMFN(prim_job_fail_finish) {
   EXPECT(2);
+  target_effect(runtime);
   JOB(job, 0);
 
   REQUIRE(job->state & STATE_MERGED);
@@ -1084,6 +1177,7 @@ static PRIMTYPE(type_job_launch) {
 static PRIMFN(prim_job_launch) {
   JobTable *jobtable = static_cast<JobTable *>(data);
   EXPECT(11);
+  target_effect(runtime);
   JOB(job, 0);
   STRING(dir, 1);
   STRING(stdin_file, 2);
@@ -1096,10 +1190,10 @@ static PRIMFN(prim_job_launch) {
 
   REQUIRE(job->state == 0);
 
-  auto &heap = jobtable->imp->pending;
-  heap.emplace_back(new Task(runtime.heap.root(job), dir->as_str(), stdin_file->as_str(),
-                             env->as_str(), cmd->as_str()));
-  std::push_heap(heap.begin(), heap.end());
+  std::unique_ptr<Task> task(new Task(runtime.heap.root(job), dir->as_str(), stdin_file->as_str(),
+                                      env->as_str(), cmd->as_str()));
+  task->crit = jobtable->imp->critical.add(job->pathtime, job->record.runtime);
+  jobtable->imp->pending.push(launch_priority(job), std::move(task));
 
   // If a scheduled job claims a longer critical path, we need to adjust the total path time
   if (job->pathtime >= status_state.remain) {
@@ -1126,6 +1220,7 @@ static PRIMTYPE(type_job_virtual) {
 
 static PRIMFN(prim_job_virtual) {
   EXPECT(9);
+  target_effect(runtime);
   JOB(job, 0);
   STRING(stdout_payload, 1);
   STRING(stderr_payload, 2);
@@ -1184,6 +1279,7 @@ static PRIMTYPE(type_job_create) {
 static PRIMFN(prim_job_create) {
   JobTable *jobtable = static_cast<JobTable *>(data);
   EXPECT(11);
+  target_effect(runtime);
   STRING(label, 0);
   STRING(dir, 1);
   STRING(stdin_file, 2);
@@ -1253,6 +1349,7 @@ static PRIMTYPE(type_job_cache) {
 static PRIMFN(prim_job_cache) {
   JobTable *jobtable = static_cast<JobTable *>(data);
   EXPECT(6);
+  target_effect(runtime);
   STRING(dir, 0);
   STRING(stdin_file, 1);
   STRING(env, 2);
@@ -1369,6 +1466,7 @@ static PRIMTYPE(type_job_kill) {
 
 static PRIMFN(prim_job_kill) {
   EXPECT(2);
+  target_effect(runtime);
   JOB(arg0, 0);
   INTEGER_MPZ(arg1, 1);
 
@@ -1427,8 +1525,7 @@ static PRIMTYPE(type_job_id) {
 static PRIMFN(prim_job_id) {
   EXPECT(1);
   JOB(arg0, 0);
-  MPZ out(arg0->job);
-  RETURN(Integer::alloc(runtime.heap, out));
+  RETURN(Integer::alloc(runtime.heap, arg0->job));
 }
 
 static PRIMTYPE(type_job_desc) {
@@ -1456,6 +1553,7 @@ static int64_t int64_ns(struct timespec tv) {
 
 static PRIMFN(prim_job_finish) {
   EXPECT(10);
+  target_effect(runtime);
   JOB(job, 0);
   STRING(inputs, 1);
   STRING(outputs, 2);
@@ -1487,6 +1585,7 @@ static PRIMTYPE(type_job_tag) {
 
 static PRIMFN(prim_job_tag) {
   EXPECT(3);
+  target_effect(runtime);
   JOB(job, 0);
   STRING(uri, 1);
   STRING(content, 2);
@@ -1504,9 +1603,12 @@ static PRIMTYPE(type_add_hash) {
 static PRIMFN(prim_add_hash) {
   JobTable *jobtable = static_cast<JobTable *>(data);
   EXPECT(2);
+  target_effect(runtime);
   STRING(file, 0);
   STRING(hash, 1);
-  jobtable->imp->db->add_hash(file->as_str(), hash->as_str(), getmtime_ns(file->c_str()));
+  file_stamp stamp;
+  if (getstamp(file->c_str(), &stamp) != 0) memset(&stamp, 0, sizeof(stamp));
+  jobtable->imp->db->add_hash(file->as_str(), hash->as_str(), stamp);
   RETURN(args[0]);
 }
 
@@ -1514,23 +1616,57 @@ static PRIMTYPE(type_get_hash) {
   return args.size() == 1 && args[0]->unify(Data::typeString) && out->unify(Data::typeString);
 }
 
-static PRIMFN(prim_get_hash) {
+static std::string observe_get_hash(Runtime &runtime, const std::string &file, void *data) {
   JobTable *jobtable = static_cast<JobTable *>(data);
+  file_stamp stamp;
+  std::string hash;
+  if (getstamp(file.c_str(), &stamp) == 0) hash = jobtable->imp->db->get_hash(file, stamp);
+  return hash;
+}
+
+static PRIMFN(prim_get_hash) {
   EXPECT(1);
   STRING(file, 0);
-  std::string hash = jobtable->imp->db->get_hash(file->as_str(), getmtime_ns(file->c_str()));
+  std::string hash = observe_get_hash(runtime, file->as_str(), data);
+  target_observe(runtime, "get_hash", file->as_str(), hash);
   RETURN(String::alloc(runtime.heap, hash));
 }
 
+static PRIMTYPE(type_hash_file) {
+  return args.size() == 1 && args[0]->unify(Data::typeString) && out->unify(Data::typeString);
+}
+
+// Hashes a file in a thread of wake's own; an empty result means it could not be read
+static std::string observe_hash(Runtime &runtime, const std::string &file, void *data) {
+  std::string hash, error;
+  uint64_t bytes;
+  return hash_file(file, hash, error, bytes) ? hash : std::string();
+}
+
+static PRIMFN(prim_hash_file) {
+  JobTable *jobtable = static_cast<JobTable *>(data);
+  EXPECT(1);
+  STRING(file, 0);
+
+  runtime.heap.reserve(Tuple::fulfiller_pads);
+  Continuation *continuation = scope->claim_fulfiller(runtime, output);
+  jobtable->imp->hash(runtime.heap.root(continuation), file->as_str());
+}
+
 static PRIMTYPE(type_get_modtime) {
   return args.size() == 1 && args[0]->unify(Data::typeString) && out->unify(Data::typeInteger);
 }
 
+static std::string observe_modtime(Runtime &runtime, const std::string &file, void *data) {
+  return std::to_string(getmtime_ns(file.c_str()));
+}
+
 static PRIMFN(prim_get_modtime) {
   EXPECT(1);
   STRING(file, 0);
-  MPZ out(getmtime_ns(file->c_str()));
-  RETURN(Integer::alloc(runtime.heap, out));
+  int64_t mtime = getmtime_ns(file->c_str());
+  target_observe(runtime, "modtime", file->as_str(), std::to_string(mtime));
+  RETURN(Integer::alloc(runtime.heap, mtime));
 }
 
 static PRIMTYPE(type_search_path) {
@@ -1538,12 +1674,19 @@ static PRIMTYPE(type_search_path) {
          out->unify(Data::typeString);
 }
 
+// arg is the PATH, a NUL, then the executable
+static std::string observe_search_path(Runtime &runtime, const std::string &arg, void *data) {
+  size_t nul = arg.find('\0');
+  return find_in_path(arg.substr(nul + 1), arg.substr(0, nul));
+}
+
 static PRIMFN(prim_search_path) {
   EXPECT(2);
   STRING(path, 0);
   STRING(exec, 1);
 
   auto out = find_in_path(exec->as_str(), path->as_str());
+  target_observe(runtime, "search_path", path->as_str() + '\0' + exec->as_str(), out);
   RETURN(String::alloc(runtime.heap, out));
 }
 
@@ -1637,6 +1780,12 @@ static PRIMFN(prim_job_record) {
   }
 }
 
+// arg is the mode, a NUL, then the file
+static std::string observe_access(Runtime &runtime, const std::string &arg, void *data) {
+  size_t nul = arg.find('\0');
+  return access(arg.c_str() + nul + 1, std::stoi(arg.substr(0, nul))) == 0 ? "1" : "0";
+}
+
 static PRIMTYPE(type_access) {
   return args.size() == 2 && args[0]->unify(Data::typeString) &&
          args[1]->unify(Data::typeInteger) && out->unify(Data::typeBoolean);
@@ -1651,7 +1800,10 @@ static PRIMFN(prim_access) {
   int mode = R_OK;
   if (mpz_cmp_si(kind, 1) == 0) mode = W_OK;
   if (mpz_cmp_si(kind, 2) == 0) mode = X_OK;
-  RETURN(claim_bool(runtime.heap, access(file->c_str(), mode) == 0));
+  std::string arg = std::to_string(mode) + '\0' + file->as_str();
+  std::string ok = observe_access(runtime, arg, nullptr);
+  target_observe(runtime, "access", arg, ok);
+  RETURN(claim_bool(runtime.heap, ok == "1"));
 }
 
 void prim_register_job(JobTable *jobtable, PrimMap &pmap) {
@@ -1676,9 +1828,16 @@ void prim_register_job(JobTable *jobtable, PrimMap &pmap) {
   prim_register(pmap, "add_hash", prim_add_hash, type_add_hash, PRIM_IMPURE, jobtable);
   // Dead-code elimination ok, but not CSE/const-prop ok (must be ordered wrt. filesystem)
   prim_register(pmap, "get_hash", prim_get_hash, type_get_hash, PRIM_ORDERED, jobtable);
+  prim_register(pmap, "hash_file", prim_hash_file, type_hash_file, PRIM_ORDERED, jobtable);
   prim_register(pmap, "get_modtime", prim_get_modtime, type_get_modtime, PRIM_ORDERED);
   prim_register(pmap, "search_path", prim_search_path, type_search_path, PRIM_ORDERED);
   prim_register(pmap, "access", prim_access, type_access, PRIM_ORDERED);
+
+  observer_register("get_hash", observe_get_hash, jobtable);
+  observer_register("hash", observe_hash);
+  observer_register("modtime", observe_modtime);
+  observer_register("search_path", observe_search_path);
+  observer_register("access", observe_access);
 }
 
 static void wake(Runtime &runtime, HeapPointer<Continuation> &q, HeapObject *value) {
@@ -54,8 +54,9 @@ struct JobTable {
   struct detail;
   std::unique_ptr<detail> imp;
 
+  // launcher: spawn jobs through a resident fork server (see launcher.h)
   JobTable(Database *db, ResourceBudget memory, ResourceBudget cpu, bool debug, bool verbose,
-           bool quiet, bool check, bool batch);
+           bool quiet, bool check, bool batch, bool launcher);
   ~JobTable();
 
   // Wait for a job to complete; false -> no more active jobs
@@ -26,6 +26,7 @@
 
 #include "json/json5.h"
 #include "prim.h"
+#include "target.h"
 #include "types/data.h"
 #include "types/datatype.h"
 #include "types/sums.h"
@@ -126,6 +127,8 @@ static PRIMTYPE(type_json) {
 static PRIMFN(prim_json_file) {
   EXPECT(1);
   STRING(file, 0);
+  if (runtime.targets)
+    target_observe(runtime, "read", file->as_str(), observe_file(runtime, file->as_str()));
   std::stringstream errs;
   JAST jast;
   if (JAST::parse(file->c_str(), errs, jast)) {
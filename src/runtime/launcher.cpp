@@ -0,0 +1,222 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "launcher.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "compat/spawn.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // wake ignores SIGPIPE anyway
+#endif
+
+extern char **environ;
+
+Launcher::Launcher() : sock(-1), pid(-1) {}
+
+Launcher::~Launcher() { stop(); }
+
+bool Launcher::start(const std::string &shim) {
+#ifdef __linux__
+  // A failed exec only shows up later as a dead socket; check the shim now so
+  // that launch() falls back to spawning jobs directly.
+  if (access(shim.c_str(), X_OK) != 0) return false;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1) {
+    perror("socketpair");
+    return false;
+  }
+  int flags;
+  if ((flags = fcntl(fds[0], F_GETFD, 0)) != -1) fcntl(fds[0], F_SETFD, flags | FD_CLOEXEC);
+
+  std::string fd = std::to_string(fds[1]);
+  const char *argv[] = {shim.c_str(), "<launcher>", fd.c_str(), nullptr};
+  pid = wake_spawn(argv[0], const_cast<char **>(argv), environ);
+  close(fds[1]);
+  if (pid == -1) {
+    close(fds[0]);
+    return false;
+  }
+
+  sock = fds[0];
+  return true;
+#else
+  (void)shim;
+  return false;
+#endif
+}
+
+void Launcher::stop() {
+  // The launcher exits once it sees the socket close
+  if (sock != -1) close(sock);
+  sock = -1;
+  if (pid == -1) return;
+  while (waitpid(pid, nullptr, 0) == -1 && errno == EINTR) {
+  }
+  pid = -1;
+}
+
+bool Launcher::reaped(pid_t child) {
+  if (child != pid) return false;
+  pid = -1;
+  return true;
+}
+
+static bool send_all(int sock, const char *data, size_t size) {
+  while (size) {
+    ssize_t got = send(sock, data, size, MSG_NOSIGNAL);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return false;
+    data += got;
+    size -= got;
+  }
+  return true;
+}
+
+pid_t Launcher::spawn(const std::string &stdin_file, int stdout_fd, int stderr_fd,
+                      const std::string &dir, const std::string &cmdline,
+                      const std::string &environ) {
+  if (sock == -1) return -1;
+
+  std::string body;
+  body.reserve(stdin_file.size() + dir.size() + cmdline.size() + environ.size() + 2);
+  body.append(stdin_file);
+  body.push_back(0);
+  body.append(dir);
+  body.push_back(0);
+  body.append(cmdline);
+  body.append(environ);
+
+  uint32_t header[3] = {uint32_t(body.size()),
+                        uint32_t(std::count(cmdline.begin(), cmdline.end(), '\0')),
+                        uint32_t(std::count(environ.begin(), environ.end(), '\0'))};
+  int fds[2] = {stdout_fd, stderr_fd};
+
+  union {
+    char buf[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct iovec iov;
+  iov.iov_base = header;
+  iov.iov_len = sizeof(header);
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // The descriptors travel with the first byte of the header
+  ssize_t sent;
+  while ((sent = sendmsg(sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+  }
+
+  int32_t reply = -1;
+  char *out = reinterpret_cast<char *>(&reply);
+  size_t want = sizeof(reply);
+  bool ok = sent > 0 &&
+            send_all(sock, reinterpret_cast<char *>(header) + sent, sizeof(header) - sent) &&
+            send_all(sock, body.data(), body.size());
+  while (ok && want) {
+    ssize_t got = read(sock, out, want);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) ok = false;
+    out += got;
+    want -= got;
+  }
+
+  if (!ok || reply <= 0) {
+    if (ok) {
+      errno = -reply;
+      perror("wake launcher clone");
+    } else {
+      fprintf(stderr, "wake launcher: exited unexpectedly; spawning jobs directly\n");
+    }
+    stop();
+    return -1;
+  }
+
+  return reply;
+}
+
+LaunchHistogram::LaunchHistogram() : launches(0), seconds(0), max(0) {
+  std::fill(buckets, buckets + BUCKETS, 0);
+}
+
+void LaunchHistogram::add(double latency) {
+  int bucket = 0;
+  for (double limit = 1e-6; bucket < BUCKETS - 1 && latency >= limit; limit *= 2) ++bucket;
+  ++buckets[bucket];
+  ++launches;
+  seconds += latency;
+  max = std::max(max, latency);
+}
+
+static std::string format_us(double microseconds) {
+  std::stringstream s;
+  if (microseconds < 1000) {
+    s << static_cast<uint64_t>(microseconds) << "us";
+  } else if (microseconds < 1000000) {
+    s << static_cast<uint64_t>(microseconds / 1000) << "ms";
+  } else {
+    s << static_cast<uint64_t>(microseconds / 1000000) << "s";
+  }
+  return s.str();
+}
+
+std::string LaunchHistogram::format() const {
+  std::stringstream s;
+  s << launches << " jobs in " << seconds << "s";
+  if (launches == 0) return s.str();
+  s << " (" << format_us(1e6 * seconds / launches) << " mean, " << format_us(1e6 * max)
+    << " max);";
+  const char *sep = " ";
+  for (int i = 0; i < BUCKETS; ++i) {
+    if (buckets[i] == 0) continue;
+    s << sep;
+    if (i == BUCKETS - 1) {
+      s << ">=" << format_us(1 << (i - 1));
+    } else {
+      s << "<" << format_us(1 << i);
+    }
+    s << ": " << buckets[i];
+    sep = ", ";
+  }
+  return s.str();
+}
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <string>
+
+// A resident `shim-wake <launcher>` process which spawns jobs for wake.
+// Forking from that small process and exec'ing the command directly is
+// cheaper than vfork'ing wake and exec'ing a shim-wake per job.
+//
+// Each request is a header of three uint32_t (body bytes, argument count,
+// environment count) sent with the job's stdout and stderr as SCM_RIGHTS,
+// followed by a body of NUL-terminated strings: the stdin file, the
+// directory, the arguments and then the environment. The launcher answers
+// with an int32_t pid, or -errno. Jobs are cloned with CLONE_PARENT, so
+// they are wake's own children and are reaped like any other.
+class Launcher {
+ public:
+  Launcher();
+  ~Launcher();
+
+  Launcher(const Launcher &) = delete;
+  Launcher &operator=(const Launcher &) = delete;
+
+  // Starts the launcher from `shim`; false where it is not supported
+  bool start(const std::string &shim);
+  bool running() const { return sock != -1; }
+
+  // Spawns `cmdline` (NUL-separated) as shim-wake would. Returns -1 if the
+  // launcher failed, after which it is stopped and the caller must fall back.
+  pid_t spawn(const std::string &stdin_file, int stdout_fd, int stderr_fd, const std::string &dir,
+              const std::string &cmdline, const std::string &environ);
+
+  void stop();
+  // wake reaped `child` itself; true if that was the launcher
+  bool reaped(pid_t child);
+
+ private:
+  int sock;
+  pid_t pid;
+};
+
+// Launch latencies in power-of-two buckets of microseconds
+struct LaunchHistogram {
+  static const int BUCKETS = 24;
+  uint64_t buckets[BUCKETS];  // bucket i counts latencies below 2^i us
+  uint64_t launches;
+  double seconds;
+  double max;
+
+  LaunchHistogram();
+  void add(double latency);
+  // eg: "1000 jobs in 0.08s (80us mean, 1.2ms max); <64us: 12, <128us: 950, <256us: 38"
+  std::string format() const;
+};
+
+#endif
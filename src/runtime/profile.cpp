@@ -26,11 +26,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <iostream>
 
+#include "gc.h"
 #include "json/json5.h"
 #include "util/execpath.h"
+#include "util/phases.h"
 
 static unsigned dump_tree(std::ostream &os, const std::string &name, const Profile *node) {
   unsigned value = node->count;
@@ -68,3 +72,102 @@ void Profile::report(const char *file, const std::string &command) const {
     }
   }
 }
+
+void Profile::add_phases(const PhaseLog &phases) {
+  // A phase's own time excludes the phases nested within it
+  std::vector<double> own;
+  std::vector<size_t> open;
+  for (size_t i = 0; i < phases.phases.size(); ++i) {
+    const PhaseStats &x = phases.phases[i];
+    open.resize(x.depth);
+    if (!open.empty()) own[open.back()] -= x.cpu;
+    own.push_back(x.cpu);
+    open.push_back(i);
+  }
+
+  std::vector<Profile *> path(1, &children["compile: <compiler>"]);
+  for (size_t i = 0; i < phases.phases.size(); ++i) {
+    const PhaseStats &x = phases.phases[i];
+    path.resize(x.depth + 1);
+    Profile *node = &path.back()->children[x.name + ": <compiler>"];
+    node->count += std::max(0LL, std::llround(own[i] * PROFILE_HZ));
+    path.push_back(node);
+  }
+}
+
+void report_phases(const char *file, const std::string &command, const PhaseLog &phases) {
+  std::ofstream f(file, std::ios_base::trunc);
+  if (!f.fail()) {
+    chmod(file, 0644);
+    f << "{\"command\":\"" << json_escape(command) << "\",\"phases\":[";
+    bool first = true;
+    for (auto &x : phases.phases) {
+      f << (first ? "" : ",") << std::endl
+        << "{\"name\":\"" << json_escape(x.name) << "\",\"depth\":" << x.depth
+        << ",\"wallSeconds\":" << x.wall << ",\"cpuSeconds\":" << x.cpu
+        << ",\"peakRSSDeltaBytes\":" << x.peak_rss << ",\"liveTerms\":" << x.terms
+        << ",\"liveExprs\":" << x.exprs << ",\"liveTypeVars\":" << x.typevars << "}";
+      first = false;
+    }
+    f << "]}" << std::endl;
+  }
+  if (f.fail()) {
+    std::cerr << "Saving compiler phases to '" << file << "': " << strerror(errno) << std::endl;
+  }
+}
+
+size_t HeapProfile::site(std::vector<std::string> &&stack) {
+  auto it = ids.insert(std::make_pair(std::move(stack), stacks.size()));
+  if (it.second) stacks.push_back(&it.first->first);
+  return it.first->second;
+}
+
+void HeapProfile::report(const char *file, const std::string &command,
+                         const HeapSnapshot &snapshot) const {
+  std::ofstream f(file, std::ios_base::trunc);
+  if (!f.fail()) {
+    chmod(file, 0644);
+
+    std::vector<size_t> sites;
+    for (size_t i = 0; i < stacks.size() && i < snapshot.sites.size(); ++i) sites.push_back(i);
+    std::sort(sites.begin(), sites.end(), [&](size_t a, size_t b) {
+      const HeapSiteStats &x = snapshot.sites[a], &y = snapshot.sites[b];
+      return x.retained != y.retained ? x.retained > y.retained : x.bytes > y.bytes;
+    });
+    std::vector<HeapRootStats> roots(snapshot.roots);
+    std::stable_sort(
+        roots.begin(), roots.end(),
+        [](const HeapRootStats &a, const HeapRootStats &b) { return a.retained > b.retained; });
+
+    // Site statistics are estimates, scaled up from the sampled allocations
+    f << "{\"command\":\"" << json_escape(command) << "\",\"objects\":" << snapshot.objects
+      << ",\"bytes\":" << snapshot.bytes << ",\"sites\":[";
+    bool first = true;
+    for (size_t i : sites) {
+      const HeapSiteStats &x = snapshot.sites[i];
+      f << (first ? "" : ",") << std::endl << "{\"stack\":[";
+      first = false;
+      bool first_frame = true;
+      for (auto &frame : *stacks[i]) {
+        f << (first_frame ? "" : ",") << "\"" << json_escape(frame) << "\"";
+        first_frame = false;
+      }
+      f << "],\"allocatedObjects\":" << std::llround(x.objects)
+        << ",\"allocatedBytes\":" << std::llround(x.bytes)
+        << ",\"survivedBytes\":" << std::llround(x.survived)
+        << ",\"liveBytes\":" << std::llround(x.live) << ",\"peakBytes\":" << std::llround(x.peak)
+        << ",\"retainedBytes\":" << std::llround(x.retained) << "}";
+    }
+    f << "],\"roots\":[";
+    first = true;
+    for (auto &x : roots) {
+      f << (first ? "" : ",") << std::endl
+        << "{\"type\":\"" << json_escape(x.type) << "\",\"retainedBytes\":" << x.retained << "}";
+      first = false;
+    }
+    f << "]}" << std::endl;
+  }
+  if (f.fail()) {
+    std::cerr << "Saving heap profile to '" << file << "': " << strerror(errno) << std::endl;
+  }
+}
@@ -20,6 +20,13 @@
 
 #include <map>
 #include <string>
+#include <vector>
+
+// Stack traces are sampled this often per second of CPU time
+#define PROFILE_HZ 1000
+
+struct HeapSnapshot;
+struct PhaseLog;
 
 struct Profile {
   std::map<std::string, Profile> children;
@@ -27,6 +34,20 @@ struct Profile {
 
   Profile() : count(0) {}
   void report(const char *file, const std::string &cmd) const;
+  // Compiler phases join the trace under 'compile', sampled by their CPU time
+  void add_phases(const PhaseLog &phases);
+};
+
+// Compiler phases with the resources each used, as JSON
+void report_phases(const char *file, const std::string &cmd, const PhaseLog &phases);
+
+// Allocation sites for the heap profile, named by stack trace (innermost first)
+struct HeapProfile {
+  std::map<std::vector<std::string>, size_t> ids;
+  std::vector<const std::vector<std::string> *> stacks;  // by site
+
+  size_t site(std::vector<std::string> &&stack);
+  void report(const char *file, const std::string &cmd, const HeapSnapshot &snapshot) const;
 };
 
 #endif
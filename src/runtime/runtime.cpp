@@ -32,7 +32,10 @@
 #include "tuple.h"
 #include "value.h"
 
-#define PROFILE_HZ 1000
+// Average distance between sampled allocations in a heap profile
+#define HEAP_SAMPLE_BYTES (512 * 1024)
+// Allocation sites are told apart by this many stack frames; deep recursion would be slow
+#define HEAP_SAMPLE_FRAMES 256
 
 static volatile bool trace_needed = false;
 static void handle_SIGPROF(int sig) {
@@ -47,13 +50,17 @@ void Work::format(std::ostream &os, FormatState &state) const { os << "Work"; }
 
 Category Work::category() const { return WORK; }
 
-Runtime::Runtime(Profile *profile_, int profile_heap, double heap_factor)
+Runtime::Runtime(Profile *profile_, int profile_heap, double heap_factor, bool generational,
+                 int gc_threads, HeapProfile *heap_profile_)
     : abort(false),
       profile(profile_),
-      heap(profile_heap, heap_factor),
+      heap_profile(heap_profile_),
+      heap(profile_heap, heap_factor, generational, gc_threads),
       stack(heap.root<Work>(nullptr)),
       output(heap.root<HeapObject>(nullptr)),
-      sources(heap.root<HeapObject>(nullptr)) {
+      sources(heap.root<HeapObject>(nullptr)),
+      targets(nullptr) {
+  if (heap_profile) heap.sample(HEAP_SAMPLE_BYTES);
   if (profile) {
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -77,20 +84,25 @@ Runtime::~Runtime() {
   setitimer(ITIMER_PROF, &timer, 0);
 }
 
+// A function's result goes to cont, if set, or else into slot 'output' of the caller Scope
 struct Interpret final : public GCObject<Interpret, Work> {
   RFun *fun;
-  size_t index;
+  size_t index;  // into fun->code
   HeapPointer<Scope> scope;
   HeapPointer<Continuation> cont;
+  HeapPointer<Scope> caller;
+  size_t output;
 
-  Interpret(RFun *fun_, Scope *scope_, Continuation *cont_)
-      : fun(fun_), index(0), scope(scope_), cont(cont_) {}
+  Interpret(RFun *fun_, Scope *scope_, Continuation *cont_, Scope *caller_ = nullptr,
+            size_t output_ = 0)
+      : fun(fun_), index(0), scope(scope_), cont(cont_), caller(caller_), output(output_) {}
 
   template <typename T, T (HeapPointerBase::*memberfn)(T x)>
   T recurse(T arg) {
     arg = Work::recurse<T, memberfn>(arg);
     arg = (scope.*memberfn)(arg);
     arg = (cont.*memberfn)(arg);
+    arg = (caller.*memberfn)(arg);
     return arg;
   }
 
@@ -102,7 +114,9 @@ struct InterpretContext {
   Interpret *interpret;
   Scope *scope;
   size_t output;       // index into scope
-  Continuation *cont;  // set for tail calls
+  Continuation *cont;  // set for tail calls returning to a Continuation
+  Scope *dest;         // otherwise the result fills this Scope's slot
+  size_t slot;
 
   InterpretContext(Runtime &runtime_) : runtime(runtime_) {}
   static Promise *arg(Scope *scope, size_t arg);
@@ -114,36 +128,85 @@ struct InterpretContext {
 };
 
 void Interpret::execute(Runtime &runtime) {
+  // Indexed by OpCode
+  static void *const dispatch[] = {&&op_lit,  &&op_fun, &&op_con,  &&op_get,   &&op_des,
+                                   &&op_prim, &&op_app, &&op_tail, &&op_return};
+
   InterpretContext context(runtime);
   context.interpret = this;
   context.scope = scope.get();
   context.cont = nullptr;
+  context.dest = context.scope;
 
-  size_t limit = fun->terms.size();
-  bool tail = fun->output == make_arg(0, limit - 1) && fun->terms.back()->tailCallOk();
-  if (tail) --limit;
+  const Op *code = fun->code.data();
+  const Op *op = code + index;
 
   next = nullptr;  // potentially reschedule
-  for (context.output = index; context.output < limit; context.output = index) {
-    fun->terms[context.output]->interpret(context);
-    index = context.output + 1;
-    if (!context.interpret) return;
-  }
 
-  if (tail) {
-    context.interpret = nullptr;
-    context.cont = cont.get();
-    fun->terms.back()->interpret(context);
-  } else {
-    context.arg(fun->output)->await(runtime, cont.get());
-  }
+  // Every op jumps directly to its successor, until one yields by clearing interpret
+#define DISPATCH()                              \
+  do {                                          \
+    context.slot = context.output = op->output; \
+    goto *dispatch[op->code];                   \
+  } while (0)
+#define NEXT()                      \
+  do {                              \
+    index = ++op - code;            \
+    if (!context.interpret) return; \
+    DISPATCH();                     \
+  } while (0)
+
+  DISPATCH();
+
+op_lit:
+  static_cast<RLit *>(op->term)->interpret(context);
+  NEXT();
+op_fun:
+  static_cast<RFun *>(op->term)->interpret(context);
+  NEXT();
+op_con:
+  static_cast<RCon *>(op->term)->interpret(context);
+  NEXT();
+op_get:
+  static_cast<RGet *>(op->term)->interpret(context);
+  NEXT();
+op_des:
+  static_cast<RDes *>(op->term)->interpret(context);
+  NEXT();
+op_prim:
+  static_cast<RPrim *>(op->term)->interpret(context);
+  NEXT();
+op_app:
+  static_cast<RApp *>(op->term)->interpret(context);
+  NEXT();
+
+op_tail:
+  // The next op is the last, and delivers its result wherever ours should go
+  context.interpret = nullptr;
+  context.cont = cont.get();
+  context.dest = caller.get();
+  ++op;
+  context.output = op->output;
+  context.slot = output;
+  goto *dispatch[op->code];
+
+op_return: {
+  Promise *p = context.arg(fun->output);
+  context.cont = cont.get();
+  context.dest = caller.get();
+  context.slot = output;
+  if (!*p && !context.cont) runtime.heap.reserve(Tuple::fulfiller_pads);
+  context.finish(p);
+}
+#undef NEXT
+#undef DISPATCH
 }
 
 Continuation *InterpretContext::defer() {
   if (cont) {
     return cont;
   } else {
-    return scope->claim_fulfiller(runtime, output);
+    return dest->claim_fulfiller(runtime, slot);
   }
 }
 
@@ -151,7 +214,7 @@ void InterpretContext::finish(HeapObject *obj) {
   if (cont) {
     cont->resume(runtime, obj);
   } else {
-    scope->at(output)->instant_fulfill(obj);
+    dest->at(slot)->fulfill(runtime, obj);
   }
 }
 
@@ -168,13 +231,18 @@ Promise *InterpretContext::arg(Scope *it, size_t arg) {
   return it->at(arg_offset(arg));
 }
 
-bool RArg::tailCallOk() const {
-  // We don't invoke return, so cannot be tail called
-  return false;
+// Apply a one-argument function; the result goes to cont if set, else into dest's slot
+static void claim_call(Runtime &runtime, Closure *closure, HeapObject *value, Continuation *cont,
+                       Scope *dest, size_t slot, Scope *caller) {
+  RFun *fun = closure->fun;
+  Scope *bind = Scope::claim(runtime.heap, fun->terms.size(), closure->scope.get(), caller, fun);
+  bind->at(0)->instant_fulfill(value);
+  runtime.schedule(Interpret::claim(runtime.heap, fun, bind, cont, cont ? nullptr : dest, slot));
 }
 
-void RArg::interpret(InterpretContext &context) {
-  // No-Op; filled in by App during Scope construction
+bool RArg::tailCallOk() const {
+  // No code is emitted; filled in by App during Scope construction
+  return false;
 }
 
 bool RLit::tailCallOk() const { return true; }
@@ -267,7 +335,8 @@ void RDes::interpret(InterpretContext &context) {
       context.runtime.schedule(context.interpret);
       context.interpret = nullptr;
     }
-    context.runtime.claim_apply(handler, record, context.defer(), context.scope);
+    claim_call(context.runtime, handler, record, context.cont, context.dest, context.slot,
+               context.scope);
   } else {
     context.runtime.heap.reserve(Tuple::fulfiller_pads + CDes::reserve());
     arg->await(context.runtime,
@@ -328,31 +397,35 @@ void RPrim::interpret(InterpretContext &context) {
 
 struct CApp final : public GCObject<CApp, Continuation> {
   HeapPointer<Continuation> cont;
+  HeapPointer<Scope> dest;
   HeapPointer<Scope> caller;
-  size_t output;
+  size_t slot;
   RApp *app;
 
-  CApp(Continuation *cont_, Scope *caller_, size_t output_, RApp *app_)
-      : cont(cont_), caller(caller_), output(output_), app(app_) {}
+  CApp(Continuation *cont_, Scope *dest_, size_t slot_, Scope *caller_, RApp *app_)
+      : cont(cont_), dest(dest_), caller(caller_), slot(slot_), app(app_) {}
 
   template <typename T, T (HeapPointerBase::*memberfn)(T x)>
   T recurse(T arg) {
     arg = Continuation::recurse<T, memberfn>(arg);
     arg = (cont.*memberfn)(arg);
+    arg = (dest.*memberfn)(arg);
     arg = (caller.*memberfn)(arg);
     return arg;
   }
 
-  static void doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *caller,
-                   size_t output, RApp *app, Interpret *&resume);
+  // The result goes to cont if set, else into dest's slot; caller holds app's arguments
+  static void doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *dest,
+                   size_t slot, Scope *caller, RApp *app, Interpret *&resume);
   void execute(Runtime &runtime) override {
     Interpret *null = nullptr;
-    doit(runtime, static_cast<Closure *>(value.get()), cont.get(), caller.get(), output, app, null);
+    doit(runtime, static_cast<Closure *>(value.get()), cont.get(), dest.get(), slot, caller.get(),
+         app, null);
   }
 };
 
-void CApp::doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *caller,
-                size_t output, RApp *app, Interpret *&resume) {
+void CApp::doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *dest, size_t slot,
+                Scope *caller, RApp *app, Interpret *&resume) {
   RFun *fun = closure->fun;
   size_t applied = closure->applied;
   size_t nargs = app->args.size() - 1;
@@ -361,7 +434,7 @@ void CApp::doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *c
   Scope *callee = closure->scope.get();
 
   if (applied + nargs == fargs) {
-    runtime.heap.reserve(Scope::reserve(terms) + (1 + fargs) * Tuple::fulfiller_pads +
+    runtime.heap.reserve(Scope::reserve(terms) + fargs * Tuple::fulfiller_pads +
                          Interpret::reserve());
     // Skip over partially applied arguments
     Scope *it = callee;
@@ -381,9 +454,9 @@ void CApp::doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *c
       for (size_t i = 0; i < size; ++i) bind->claim_instant_fulfiller(runtime, pop + i, it->at(i));
       it = it->next.get();
     }
-    // Schedule an Interpreter
-    Interpret *interpret = Interpret::claim(runtime.heap, fun, bind,
-                                            cont ? cont : caller->claim_fulfiller(runtime, output));
+    // Schedule an Interpreter which returns directly into our slot
+    Interpret *interpret = cont ? Interpret::claim(runtime.heap, fun, bind, cont)
+                                : Interpret::claim(runtime.heap, fun, bind, nullptr, dest, slot);
     if (resume) {
       runtime.schedule(resume);
       resume = nullptr;
@@ -399,7 +472,7 @@ void CApp::doit(Runtime &runtime, Closure *closure, Continuation *cont, Scope *c
     if (cont) {
       cont->resume(runtime, closure);
     } else {
-      caller->at(output)->fulfill(runtime, closure);
+      dest->at(slot)->fulfill(runtime, closure);
     }
   }
 }
@@ -409,11 +482,11 @@ bool RApp::tailCallOk() const { return true; }
 void RApp::interpret(InterpretContext &context) {
   Promise *fn = context.arg(args[0]);
   if (*fn) {
-    CApp::doit(context.runtime, fn->coerce<Closure>(), context.cont, context.scope, context.output,
-               this, context.interpret);
+    CApp::doit(context.runtime, fn->coerce<Closure>(), context.cont, context.dest, context.slot,
+               context.scope, this, context.interpret);
   } else {
-    fn->await(context.runtime,
-              CApp::alloc(context.runtime.heap, context.cont, context.scope, context.output, this));
+    fn->await(context.runtime, CApp::alloc(context.runtime.heap, context.cont, context.dest,
+                                           context.slot, context.scope, this));
   }
 }
 
@@ -422,16 +495,16 @@ size_t Runtime::reserve_apply(RFun *fun) {
 }
 
 void Runtime::claim_apply(Closure *closure, HeapObject *value, Continuation *cont, Scope *caller) {
-  RFun *fun = closure->fun;
-  Scope *bind = Scope::claim(heap, fun->terms.size(), closure->scope.get(), caller, fun);
-  bind->at(0)->instant_fulfill(value);
-  schedule(Interpret::claim(heap, fun, bind, cont));
+  claim_call(*this, closure, value, cont, nullptr, 0, caller);
 }
 
 void Runtime::run() {
   int count = 0;
   bool lprofile = profile;
+  bool lsample = heap_profile;
   trace_needed = false;  // don't count time spent waiting for Jobs
+  // Allocations since the last run() were made by the runtime itself (eg: finished Jobs)
+  if (lsample && heap.sampled()) heap.attribute(heap_profile->site({"<runtime>"}));
   while (stack && !abort) {
     if (++count >= 10000) {
       if (JobTable::exit_now()) break;
@@ -451,6 +524,13 @@ void Runtime::run() {
           trace_needed = false;
         }
       }
+      if (lsample && heap.sampled()) {
+        if (Interpret *i = dynamic_cast<Interpret *>(w)) {
+          heap.attribute(heap_profile->site(i->scope->stack_functions(HEAP_SAMPLE_FRAMES)));
+        } else {
+          heap.attribute(heap_profile->site({std::string("<") + w->type() + ">"}));
+        }
+      }
     } catch (GCNeededException gc) {
       // retry work after memory is available
       w->next = stack;
@@ -43,15 +43,20 @@ struct Work : public HeapObject {
 };
 
 struct Profile;
+struct HeapProfile;
+struct TargetStore;
 struct Runtime {
   bool abort;
   Profile *profile;
+  HeapProfile *heap_profile;
   Heap heap;
   RootPointer<Work> stack;
   RootPointer<HeapObject> output;
   RootPointer<Record> sources;  // Vector String
+  TargetStore *targets;         // null unless target results are kept between runs
 
-  Runtime(Profile *profile_, int profile_heap, double heap_factor);
+  Runtime(Profile *profile_, int profile_heap, double heap_factor, bool generational = false,
+          int gc_threads = 1, HeapProfile *heap_profile_ = nullptr);
   ~Runtime();
   void run();
 
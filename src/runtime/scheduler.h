@@ -0,0 +1,132 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <functional>
+#include <iterator>
+#include <map>
+#include <utility>
+
+// The order in which queued jobs are launched. It is captured when a job
+// is queued; later changes to the job do not move it in the queue.
+struct LaunchPriority {
+  bool urgent;      // something already waits on the job's stdout or stderr
+  bool unknown;     // there is no prediction of the job's runtime
+  double pathtime;  // the longest chain of runtimes from this job to the end of the build
+  long id;
+
+  // True if this job should be launched before `o`. Urgent jobs come
+  // first, then those we know nothing about, then the longest paths.
+  bool operator<(const LaunchPriority &o) const {
+    if (urgent != o.urgent) return urgent;
+    if (unknown != o.unknown) return unknown;
+    if (pathtime != o.pathtime) return pathtime > o.pathtime;
+    return id > o.id;
+  }
+};
+
+// Jobs waiting to be launched, best first. Pushing and popping are
+// O(log n), as is selecting a job within a bounded window of the best.
+template <class T>
+class LaunchQueue {
+ private:
+  std::multimap<LaunchPriority, T> queue;
+  long passed;    // id of the best job when it was last passed over
+  size_t passes;  // how often it has been passed over
+
+ public:
+  LaunchQueue() : passed(-1), passes(0) {}
+
+  using iterator = typename std::multimap<LaunchPriority, T>::iterator;
+
+  bool empty() const { return queue.empty(); }
+  size_t size() const { return queue.size(); }
+  iterator end() { return queue.end(); }
+
+  void push(const LaunchPriority &priority, T &&task) {
+    queue.emplace(priority, std::move(task));
+  }
+
+  // Returns the best of the first `window` jobs for which `fits` is true,
+  // or end() if there is none. A job that does not fit the resources
+  // left over thus doesn't hold up the jobs behind it, at first. Once the
+  // best job has been passed over `patience` times, nothing else is
+  // selected until it fits, so that the resources it needs can drain.
+  template <class Fits>
+  iterator select(Fits fits, size_t window, size_t patience) {
+    if (queue.empty()) return queue.end();
+    auto best = queue.begin();
+    if (fits(best->second)) return best;
+
+    if (best->first.id != passed) {
+      passed = best->first.id;
+      passes = 0;
+    }
+    if (passes >= patience) return queue.end();
+
+    size_t seen = 1;
+    for (auto it = std::next(best); it != queue.end() && seen < window; ++it, ++seen) {
+      if (fits(it->second)) {
+        ++passes;
+        return it;
+      }
+    }
+    return queue.end();
+  }
+
+  T pop(iterator it) {
+    T task = std::move(it->second);
+    queue.erase(it);
+    return task;
+  }
+};
+
+struct CriticalJob {
+  double pathtime;
+  double runtime;
+};
+
+// The pathtimes of every job that is queued or running, so that the
+// longest remaining critical path is known without visiting them all.
+class CriticalPaths {
+ private:
+  // pathtime => runtime, longest first
+  std::multimap<double, double, std::greater<double> > paths;
+
+ public:
+  using Handle = std::multimap<double, double, std::greater<double> >::iterator;
+
+  Handle add(double pathtime, double runtime) { return paths.emplace(pathtime, runtime); }
+  void remove(Handle handle) { paths.erase(handle); }
+  size_t size() const { return paths.size(); }
+
+  // The longest critical path, unless none is longer than `floor`
+  CriticalJob longest(double floor) const {
+    CriticalJob out;
+    out.pathtime = floor;
+    out.runtime = 0;
+    if (!paths.empty() && paths.begin()->first > floor) {
+      out.pathtime = paths.begin()->first;
+      out.runtime = paths.begin()->second;
+    }
+    return out;
+  }
+};
+
+#endif
@@ -40,6 +40,7 @@
 
 #include "parser/wakefiles.h"
 #include "prim.h"
+#include "target.h"
 #include "types/data.h"
 #include "types/datatype.h"
 #include "types/type.h"
@@ -402,16 +403,25 @@ static bool promise_lexical(const Promise &a, const std::string &b) {
   return a.coerce<String>()->compare(b) < 0;
 }
 
-static PRIMFN(prim_sources) {
-  EXPECT(2);
-  STRING(arg0, 0);
-  REGEXP(arg1, 1);
+// The "sources" and "files" observations: arg is the directory, a NUL, then
+// the pattern; the result is a hash of the files matched
+static std::string observe_matches(const std::vector<std::string> &match) {
+  std::string all;
+  for (auto &x : match) {
+    all += x;
+    all.push_back(0);
+  }
+  Hash hash(all);
+  return std::string(reinterpret_cast<const char *>(&hash.data[0]), sizeof(hash.data));
+}
 
+static std::vector<Value *> find_sources(Runtime &runtime, const std::string &dir,
+                                         const RE2 &exp) {
   long skip = 0;
   Promise *low = runtime.sources->at(0);
   Promise *high = low + runtime.sources->size();
 
-  std::string root = make_canonical(arg0->as_str());
+  std::string root = make_canonical(dir);
   if (root != ".") {
     auto prefixL = root + "/";
     auto prefixH = root + "0";  // '/' + 1 = '0'
@@ -424,8 +434,41 @@ static PRIMFN(prim_sources) {
   for (Promise *i = low; i != high; ++i) {
     String *s = i->coerce<String>();
     re2::StringPiece piece(s->c_str() + skip, s->size() - skip);
-    if (RE2::FullMatch(piece, *arg1->exp)) found.push_back(s);
+    if (RE2::FullMatch(piece, exp)) found.push_back(s);
   }
+  return found;
+}
+
+static std::string observe_found(const std::vector<Value *> &found) {
+  std::vector<std::string> match;
+  for (Value *x : found) match.push_back(static_cast<String *>(x)->as_str());
+  return observe_matches(match);
+}
+
+static std::string observe_sources(Runtime &runtime, const std::string &arg, void *data) {
+  size_t nul = arg.find('\0');
+  auto exp = RegExp::recompile(arg.substr(nul + 1));
+  return observe_found(find_sources(runtime, arg.substr(0, nul), *exp));
+}
+
+static std::string observe_files(Runtime &runtime, const std::string &arg, void *data) {
+  size_t nul = arg.find('\0');
+  auto exp = RegExp::recompile(arg.substr(nul + 1));
+  std::string root = make_canonical(arg.substr(0, nul));
+  std::vector<std::string> match;
+  push_files(match, root, *exp, (root == ".") ? 0 : (root.size() + 1));
+  return observe_matches(match);
+}
+
+static PRIMFN(prim_sources) {
+  EXPECT(2);
+  STRING(arg0, 0);
+  REGEXP(arg1, 1);
+
+  std::vector<Value *> found = find_sources(runtime, arg0->as_str(), *arg1->exp);
+  if (runtime.targets)
+    target_observe(runtime, "sources", arg0->as_str() + '\0' + arg1->exp->pattern(),
+                   observe_found(found));
 
   runtime.heap.reserve(reserve_list(found.size()));
   RETURN(claim_list(runtime.heap, found.size(), found.data()));
@@ -442,6 +485,8 @@ static PRIMFN(prim_files) {
   std::vector<std::string> match;
   bool fail = push_files(match, root, *arg1->exp, skip);
   (void)fail;  // !!! There's a hole in the API
+  target_observe(runtime, "files", arg0->as_str() + '\0' + arg1->exp->pattern(),
+                 observe_matches(match));
 
   size_t need = reserve_list(match.size());
   for (auto &x : match) need += String::reserve(x.size());
@@ -511,6 +556,7 @@ static PRIMFN(prim_add_sources) {
     compact->at(j)->instant_fulfill(tuple->at(j)->coerce<HeapObject>());
 
   runtime.sources = compact;
+  if (runtime.targets) runtime.targets->sources_changed();
   RETURN(claim_bool(runtime.heap, true));
 }
 
@@ -541,15 +587,25 @@ static PRIMFN(prim_relative) {
 
 static PRIMTYPE(type_execpath) { return args.size() == 0 && out->unify(Data::typeString); }
 
+static std::string observe_execpath(Runtime &runtime, const std::string &arg, void *data) {
+  return find_execpath();
+}
+
 static PRIMFN(prim_execpath) {
   EXPECT(0);
+  target_observe(runtime, "execpath", "", find_execpath());
   RETURN(String::alloc(runtime.heap, find_execpath()));
 }
 
 static PRIMTYPE(type_workspace) { return args.size() == 0 && out->unify(Data::typeString); }
 
+static std::string observe_workspace(Runtime &runtime, const std::string &arg, void *data) {
+  return get_cwd();
+}
+
 static PRIMFN(prim_workspace) {
   EXPECT(0);
+  target_observe(runtime, "workspace", "", get_cwd());
   RETURN(String::alloc(runtime.heap, get_cwd()));
 }
 
@@ -557,8 +613,9 @@ static PRIMTYPE(type_pid) { return args.size() == 0 && out->unify(Data::typeInte
 
 static PRIMFN(prim_pid) {
   EXPECT(0);
-  MPZ out(getpid());
-  RETURN(Integer::alloc(runtime.heap, out));
+  // Not observed: it differs in every run, and wake only uses it to name
+  // jobs, which are effects in their own right
+  RETURN(Integer::alloc(runtime.heap, getpid()));
 }
 
 static PRIMTYPE(type_glob2regexp) {
@@ -585,4 +642,9 @@ void prim_register_sources(PrimMap &pmap) {
   prim_register(pmap, "execpath", prim_execpath, type_execpath, PRIM_PURE);
   prim_register(pmap, "workspace", prim_workspace, type_workspace, PRIM_PURE);
   prim_register(pmap, "pid", prim_pid, type_pid, PRIM_PURE);
+
+  observer_register("files", observe_files);
+  observer_register("sources", observe_sources);
+  observer_register("execpath", observe_execpath);
+  observer_register("workspace", observe_workspace);
 }
@@ -33,6 +33,7 @@
 #include "json/utf8.h"
 #include "prim.h"
 #include "status.h"
+#include "target.h"
 #include "types/data.h"
 #include "types/internal.h"
 #include "types/type.h"
@@ -70,8 +71,7 @@ static PRIMTYPE(type_strlen) {
 static PRIMFN(prim_strlen) {
   EXPECT(1);
   STRING(arg, 0);
-  MPZ out(arg->size());
-  RETURN(Integer::alloc(runtime.heap, out));
+  RETURN(Integer::alloc(runtime.heap, static_cast<int64_t>(arg->size())));
 }
 
 static PRIMTYPE(type_lcat) {
@@ -194,10 +194,15 @@ static PRIMFN(prim_read) {
       String *out = String::claim(runtime.heap, size);
       t.seekg(0, t.beg);
       t.read(out->c_str(), out->size());
-      if (t) RETURN(claim_result(runtime.heap, true, out));
+      if (t) {
+        if (runtime.targets)
+          target_observe(runtime, "read", path->as_str(), observe_content(out->as_str()));
+        RETURN(claim_result(runtime.heap, true, out));
+      }
     }
   }
 
+  target_observe(runtime, "read", path->as_str(), std::string("!") + strerror(errno));
   std::stringstream str;
   str << "read " << path->c_str() << ": " << strerror(errno);
   std::string s = str.str();
@@ -231,6 +236,7 @@ static PRIMFN(prim_write) {
   REQUIRE(mpz_cmp_si(mode, 0x1ff) <= 0);
   long mask = mpz_get_si(mode);
 
+  target_effect(runtime);
   deep_unlink(AT_FDCWD, path->c_str());
   std::ofstream t(path->c_str(), std::ios_base::trunc);
   if (!t.fail()) {
@@ -261,6 +267,7 @@ static PRIMFN(prim_unlink) {
 
   // Reservation must happen first so we don't have re-entrant side-effects
   runtime.heap.reserve(reserve_unit());
+  target_effect(runtime);
 
   // don't care if this succeeds
   (void)unlink(path->c_str());
@@ -275,10 +282,16 @@ static PRIMTYPE(type_getenv) {
   return args.size() == 1 && args[0]->unify(Data::typeString) && out->unify(list);
 }
 
+static std::string observe_getenv(Runtime &runtime, const std::string &name, void *data) {
+  const char *env = getenv(name.c_str());
+  return env ? std::string("=") + env : std::string();
+}
+
 static PRIMFN(prim_getenv) {
   EXPECT(1);
   STRING(arg0, 0);
   const char *env = getenv(arg0->c_str());
+  target_observe(runtime, "getenv", arg0->as_str(), observe_getenv(runtime, arg0->as_str(), 0));
   if (env) {
     size_t len = strlen(env);
     size_t need = reserve_list(1) + String::reserve(len);
@@ -313,6 +326,7 @@ static PRIMFN(prim_mkdir) {
   REQUIRE(mpz_cmp_si(mode, 0x1ff) <= 0);
   long mask = mpz_get_si(mode);
 
+  target_effect(runtime);
   // Remove any file or link that might be in the way
   // If this fails, it's ok. It will lead to mkdir() below failing with
   // an appropriate and hopefully more helpful error message.
@@ -407,6 +421,7 @@ static PRIMFN(prim_print) {
   STRING(stream, 0);
   STRING(message, 1);
   runtime.heap.reserve(reserve_unit());
+  target_effect(runtime);
   status_write(stream->c_str(), message->c_str(), message->size());
   RETURN(claim_unit(runtime.heap));
 }
@@ -421,9 +436,15 @@ static PRIMFN(prim_version) {
 
 static PRIMTYPE(type_level) { return args.size() == 0 && out->unify(Data::typeInteger); }
 
+static std::string observe_level(Runtime &runtime, const std::string &arg, void *data) {
+  StringInfo *info = static_cast<StringInfo *>(data);
+  return std::string(1, info->quiet ? '0' : !info->verbose ? '1' : info->debug ? '3' : '2');
+}
+
 static PRIMFN(prim_level) {
   EXPECT(0);
   StringInfo *info = static_cast<StringInfo *>(data);
+  target_observe(runtime, "level", "", observe_level(runtime, "", data));
 
   int x;
   if (info->quiet) {
@@ -438,8 +459,7 @@ static PRIMFN(prim_level) {
     x = 1;
   }
 
-  MPZ out(x);
-  RETURN(Integer::alloc(runtime.heap, out));
+  RETURN(Integer::alloc(runtime.heap, x));
 }
 
 static PRIMFN(prim_scmp) {
@@ -539,22 +559,25 @@ static PRIMFN(prim_str2code) {
   STRING(arg0, 0);
   uint32_t rune;
   int x = pop_utf8(&rune, arg0->c_str());
-  MPZ out(x >= 1 ? rune : arg0->c_str()[0]);
-  RETURN(Integer::alloc(runtime.heap, out));
+  RETURN(Integer::alloc(runtime.heap, x >= 1 ? rune : arg0->c_str()[0]));
 }
 
 static PRIMFN(prim_str2bin) {
   EXPECT(1);
   STRING(arg0, 0);
-  MPZ out(static_cast<unsigned char>(arg0->c_str()[0]));
-  RETURN(Integer::alloc(runtime.heap, out));
+  RETURN(Integer::alloc(runtime.heap, static_cast<unsigned char>(arg0->c_str()[0])));
 }
 
 static PRIMTYPE(type_cwd) { return args.size() == 0 && out->unify(Data::typeString); }
 
+static std::string observe_cwd(Runtime &runtime, const std::string &arg, void *data) {
+  return static_cast<StringInfo *>(data)->wake_cwd;
+}
+
 static PRIMFN(prim_cwd) {
   EXPECT(0);
   StringInfo *info = static_cast<StringInfo *>(data);
+  target_observe(runtime, "cwd", "", info->wake_cwd);
   RETURN(String::alloc(runtime.heap, info->wake_cwd));
 }
 
@@ -565,9 +588,19 @@ static PRIMTYPE(type_cmdline) {
   return args.size() == 0 && out->unify(list);
 }
 
+static std::string observe_cmdline(Runtime &runtime, const std::string &arg, void *data) {
+  std::string out;
+  for (char **arg = static_cast<StringInfo *>(data)->cmdline; *arg; ++arg) {
+    out += *arg;
+    out.push_back(0);
+  }
+  return out;
+}
+
 static PRIMFN(prim_cmdline) {
   EXPECT(0);
   StringInfo *info = static_cast<StringInfo *>(data);
+  target_observe(runtime, "cmdline", "", observe_cmdline(runtime, "", data));
 
   size_t need = 0, len = 0;
   for (char **arg = info->cmdline; *arg; ++arg) {
@@ -590,11 +623,18 @@ static PRIMTYPE(type_uname) {
   return args.size() == 0 && out->unify(pair);
 }
 
+static std::string observe_uname(Runtime &runtime, const std::string &arg, void *data) {
+  struct utsname uts;
+  if (uname(&uts) != 0) return std::string();
+  return std::string(uts.sysname) + '\0' + uts.machine;
+}
+
 static PRIMFN(prim_uname) {
   EXPECT(0);
   struct utsname uts;
   int ret = uname(&uts);
   REQUIRE(ret == 0);
+  target_observe(runtime, "uname", "", observe_uname(runtime, "", 0));
 
   size_t slen = strlen(uts.sysname);
   size_t mlen = strlen(uts.machine);
@@ -643,4 +683,11 @@ void prim_register_string(PrimMap &pmap, StringInfo *info) {
   prim_register(pmap, "unlink", prim_unlink, type_unlink, PRIM_IMPURE);
   prim_register(pmap, "write", prim_write, type_write, PRIM_IMPURE);
   prim_register(pmap, "read", prim_read, type_read, PRIM_ORDERED);
+
+  observer_register("read", observe_file);
+  observer_register("getenv", observe_getenv);
+  observer_register("level", observe_level, info);
+  observer_register("cwd", observe_cwd, info);
+  observer_register("cmdline", observe_cmdline, info);
+  observer_register("uname", observe_uname);
 }
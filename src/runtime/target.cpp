@@ -19,15 +19,27 @@
 #define _XOPEN_SOURCE 700
 #define _POSIX_C_SOURCE 200809L
 
+#include "target.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <map>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
+#include "database.h"
+#include "optimizer/ssa.h"
 #include "prim.h"
 #include "status.h"
 #include "tuple.h"
 #include "types/data.h"
 #include "types/datatype.h"
 #include "types/internal.h"
+#include "types/sums.h"
 #include "types/type.h"
 #include "value.h"
 
@@ -145,11 +157,39 @@ static PRIMFN(prim_tnew) {
   RETURN(t);
 }
 
+// Waits for a result to be fully evaluated before keeping it
+struct CTargetKeep final : public GCObject<CTargetKeep, Continuation> {
+  HeapPointer<Target> target;
+  HeapPointer<HeapObject> result;
+  Hash key;
+
+  CTargetKeep(Target *target_, HeapObject *result_, Hash key_)
+      : target(target_), result(result_), key(key_) {}
+
+  template <typename T, T (HeapPointerBase::*memberfn)(T x)>
+  T recurse(T arg) {
+    arg = Continuation::recurse<T, memberfn>(arg);
+    arg = (target.*memberfn)(arg);
+    arg = (result.*memberfn)(arg);
+    return arg;
+  }
+
+  void execute(Runtime &runtime) override;
+};
+
+void CTargetKeep::execute(Runtime &runtime) {
+  // value = hash(result) ... which we will ignore
+  runtime.targets->keep(key, target->location->as_str(), result.get());
+}
+
 struct CTargetFill final : public GCObject<CTargetFill, Continuation> {
   HeapPointer<Target> target;
   Hash hash;
+  Hash key;
+  bool keep;  // for later runs
 
-  CTargetFill(Target *target_, Hash hash_) : target(target_), hash(hash_) {}
+  CTargetFill(Target *target_, Hash hash_, Hash key_, bool keep_)
+      : target(target_), hash(hash_), key(key_), keep(keep_) {}
 
   template <typename T, T (HeapPointerBase::*memberfn)(T x)>
   T recurse(T arg) {
@@ -162,7 +202,17 @@ struct CTargetFill final : public GCObject<CTargetFill, Continuation> {
 };
 
 void CTargetFill::execute(Runtime &runtime) {
+  bool keep = this->keep && runtime.targets->active();
+  if (keep) runtime.heap.reserve(reserve_hash() + CTargetKeep::reserve());
+
   target->table[hash].promise.fulfill(runtime, value.get());
+  runtime.heap.remember(target.get());
+
+  if (keep) {
+    Value *result = static_cast<Value *>(value.get());
+    runtime.schedule(claim_hash(runtime.heap, result,
+                                CTargetKeep::claim(runtime.heap, target.get(), result, key)));
+  }
 }
 
 struct CTargetArgs final : public GCObject<CTargetArgs, Continuation> {
@@ -192,8 +242,6 @@ struct CTargetArgs final : public GCObject<CTargetArgs, Continuation> {
 void CTargetArgs::execute(Runtime &runtime) {
   // value = hash(list) ... which we will ignore
 
-  runtime.heap.reserve(Runtime::reserve_apply(body->fun) + CTargetFill::reserve());
-
   long i = 0;
   std::vector<uint64_t> hashes, subhashes;
   std::vector<Hash> subhashesp;
@@ -211,8 +259,21 @@ void CTargetArgs::execute(Runtime &runtime) {
 
   Hash hash(hashes), subhash(subhashes);
 
+  // A result not yet known to this run might be kept from an earlier one
+  TargetStore *store = runtime.targets;
+  bool keep = store && store->active() && target->table.count(hash) == 0;
+  Hash key;
+  size_t kept = 0;
+  if (keep) {
+    key = store->key(target->location->as_str(), hash, subhash);
+    kept = store->find(runtime, key, target->location->as_str());
+  }
+
+  runtime.heap.reserve(Runtime::reserve_apply(body->fun) + CTargetFill::reserve() + kept);
+
   auto ref = target->table.insert(std::make_pair(hash, TargetValue(subhash, subhashesp)));
   ref.first->second.promise.await(runtime, cont.get());
+  runtime.heap.remember(target.get());
 
   if (!(ref.first->second.subhash == subhash)) {
     std::stringstream ss;
@@ -238,9 +299,16 @@ void CTargetArgs::execute(Runtime &runtime) {
     status_write(STREAM_WARNING, ss.str());
   }
 
-  if (ref.second)
+  if (!ref.second) return;
+
+  if (kept) {
+    ref.first->second.promise.fulfill(runtime, store->claim(runtime.heap));
+    runtime.heap.remember(target.get());
+  } else {
     runtime.claim_apply(body.get(), target.get(),
-                        CTargetFill::claim(runtime.heap, target.get(), hash), caller.get());
+                        CTargetFill::claim(runtime.heap, target.get(), hash, key, keep),
+                        caller.get());
+  }
 }
 
 static PRIMFN(prim_tget) {
@@ -265,3 +333,405 @@ void prim_register_target(PrimMap &pmap) {
   prim_register(pmap, "tget", prim_tget, type_tget,
                 PRIM_FNARG);  // kind depends on function argument
 }
+
+static void put_varint(std::string &out, uint64_t x) {
+  while (x >= 0x80) {
+    out.push_back(static_cast<char>(x | 0x80));
+    x >>= 7;
+  }
+  out.push_back(static_cast<char>(x));
+}
+
+static bool get_varint(const std::string &in, size_t &pos, uint64_t &x) {
+  x = 0;
+  for (int shift = 0; pos < in.size() && shift < 64; shift += 7) {
+    uint8_t byte = in[pos++];
+    x |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+static void put_bytes(std::string &out, const char *data, size_t len) {
+  put_varint(out, len);
+  out.append(data, len);
+}
+
+static bool get_bytes(const std::string &in, size_t &pos, std::string &out) {
+  uint64_t len;
+  if (!get_varint(in, pos, len) || len > in.size() - pos) return false;
+  out.assign(in, pos, len);
+  pos += len;
+  return true;
+}
+
+struct ObserverEntry {
+  Observer fn;
+  void *data;
+};
+
+static std::map<std::string, ObserverEntry> &observers() {
+  static std::map<std::string, ObserverEntry> table;
+  return table;
+}
+
+void observer_register(const char *kind, Observer fn, void *data) {
+  observers()[kind] = ObserverEntry{fn, data};
+}
+
+std::string observe_file(Runtime &runtime, const std::string &path, void *data) {
+  std::ifstream file(path, std::ios::in | std::ios::binary);
+  std::stringstream content;
+  if (file) content << file.rdbuf();
+  if (!file) return std::string("!") + strerror(errno);
+  return observe_content(content.str());
+}
+
+std::string observe_content(const std::string &content) {
+  Hash hash(content);
+  return std::string("=") + std::string(reinterpret_cast<const char *>(&hash.data[0]), 16);
+}
+
+struct Observation {
+  std::string kind;
+  std::string arg;
+  std::string result;
+};
+
+// The observations made by an earlier run, checked lazily from the start
+struct StoredRun {
+  std::vector<Observation> log;
+  size_t holds;  // this many observations have been made again with the same result
+  bool failed;   // ... and the next one did not hold
+  StoredRun() : holds(0), failed(false) {}
+};
+
+struct TargetStats {
+  long hits;
+  long misses;
+  long kept;
+  TargetStats() : hits(0), misses(0), kept(0) {}
+};
+
+struct TargetStore::detail {
+  Database *db;
+  Hash program;
+  bool active;
+
+  // Records name their Constructor by its position here
+  std::vector<Constructor *> constructors;
+  std::unordered_map<const Constructor *, uint64_t> constructor_ids;
+
+  // Observations made by this run, each once
+  std::vector<Observation> log;
+  std::unordered_set<std::string> logged;
+
+  std::map<long, StoredRun> runs;
+  std::map<std::string, TargetStats> stats;
+  std::vector<TargetResult> results;
+
+  // The last lookup; a result found is claimed once its space is reserved
+  Hash found_key;
+  bool looked;
+  bool found;
+  size_t found_need;
+  std::string found_value;
+
+  void add_constructor(Constructor *cons);
+  void add_constructors(RFun *fun);
+  bool encode(HeapObject *value, std::string &out) const;
+  bool decode(Heap *h, const std::string &in, size_t &need, HeapObject **out) const;
+  bool holds(Runtime &runtime, long run, size_t observed);
+};
+
+void TargetStore::detail::add_constructor(Constructor *cons) {
+  if (constructor_ids.emplace(cons, constructors.size()).second) constructors.push_back(cons);
+}
+
+void TargetStore::detail::add_constructors(RFun *fun) {
+  for (auto &term : fun->terms) {
+    if (RCon *con = dynamic_cast<RCon *>(term.get())) add_constructor(con->kind.get());
+    if (RFun *child = dynamic_cast<RFun *>(term.get())) add_constructors(child);
+  }
+}
+
+TargetStore::TargetStore(Database *db, RFun *root, const std::string &version)
+    : imp(new detail) {
+  imp->db = db;
+  imp->active = true;
+  imp->looked = false;
+  imp->found = false;
+  imp->found_need = 0;
+
+  // The whole program is part of every key, so constructors can be numbered
+  // in the order the program uses them
+  std::vector<uint64_t> codes;
+  root->hash.push(codes);
+  Hash(version).push(codes);
+  imp->program = Hash(codes);
+
+  imp->add_constructor(&Constructor::array);
+  for (auto sum : {Boolean, Order, List, Pair, Unit, JValue, Result})
+    if (sum)
+      for (auto &cons : sum->members) imp->add_constructor(&cons);
+  imp->add_constructors(root);
+}
+
+TargetStore::~TargetStore() {}
+
+bool TargetStore::active() const { return imp->active; }
+
+void TargetStore::observe(const char *kind, const std::string &arg, const std::string &result) {
+  if (!imp->active) return;
+  std::string id(kind);
+  id.push_back(0);
+  put_bytes(id, arg.data(), arg.size());
+  id += result;
+  if (imp->logged.insert(std::move(id)).second) imp->log.push_back(Observation{kind, arg, result});
+}
+
+void TargetStore::effect() { imp->active = false; }
+
+void TargetStore::sources_changed() {
+  for (auto &run : imp->runs) {
+    run.second.holds = 0;
+    run.second.failed = false;
+  }
+}
+
+// Strings, numbers and records of them are kept; closures, jobs and the like
+// only mean something to the run which made them
+bool TargetStore::detail::encode(HeapObject *value, std::string &out) const {
+  std::unordered_map<HeapObject *, uint64_t> numbered;
+  std::vector<HeapObject *> todo(1, value);
+  while (!todo.empty()) {
+    HeapObject *obj = todo.back();
+    todo.pop_back();
+
+    auto seen = numbered.find(obj);
+    if (seen != numbered.end()) {
+      out.push_back('B');
+      put_varint(out, seen->second);
+      continue;
+    }
+    numbered.emplace(obj, numbered.size());
+
+    if (typeid(*obj) == typeid(String)) {
+      String *str = static_cast<String *>(obj);
+      out.push_back('S');
+      put_bytes(out, str->c_str(), str->size());
+    } else if (typeid(*obj) == typeid(Integer)) {
+      std::string str = static_cast<Integer *>(obj)->str();
+      out.push_back('I');
+      put_bytes(out, str.data(), str.size());
+    } else if (typeid(*obj) == typeid(Double)) {
+      double x = static_cast<Double *>(obj)->value;
+      out.push_back('D');
+      out.append(reinterpret_cast<const char *>(&x), sizeof(x));
+    } else if (Record *record = dynamic_cast<Record *>(obj)) {
+      auto id = constructor_ids.find(record->cons);
+      if (id == constructor_ids.end()) return false;
+      out.push_back('R');
+      put_varint(out, id->second);
+      put_varint(out, record->size());
+      for (size_t i = record->size(); i > 0; --i) {
+        Promise *field = record->at(i - 1);
+        if (!*field) return false;
+        todo.push_back(field->coerce<HeapObject>());
+      }
+    } else {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Without a heap, only checks the encoding and adds up the space it needs
+bool TargetStore::detail::decode(Heap *h, const std::string &in, size_t &need,
+                                 HeapObject **out) const {
+  std::vector<HeapObject *> numbered;
+  std::vector<std::pair<Record *, size_t> > open;  // records with fields still to fill
+  size_t pos = 0, objects = 0, unfilled = 1;
+  std::string bytes;
+  need = 0;
+
+  while (pos < in.size() && unfilled > 0) {
+    HeapObject *obj = nullptr;
+    size_t fields = 0;
+    uint64_t x, size;
+    char tag = in[pos++];
+    switch (tag) {
+      case 'B':
+        if (!get_varint(in, pos, x) || x >= objects) return false;
+        if (h) obj = numbered[x];
+        break;
+      case 'S':
+        if (!get_bytes(in, pos, bytes)) return false;
+        need += String::reserve(bytes.size());
+        if (h) obj = String::claim(*h, bytes);
+        break;
+      case 'I': {
+        if (!get_bytes(in, pos, bytes)) return false;
+        MPZ mpz(bytes);
+        need += Integer::reserve(mpz);
+        if (h) obj = Integer::claim(*h, mpz);
+        break;
+      }
+      case 'D': {
+        double d;
+        if (in.size() - pos < sizeof(d)) return false;
+        memcpy(&d, in.data() + pos, sizeof(d));
+        pos += sizeof(d);
+        need += Double::reserve();
+        if (h) obj = Double::claim(*h, d);
+        break;
+      }
+      case 'R': {
+        if (!get_varint(in, pos, x) || !get_varint(in, pos, size)) return false;
+        if (x >= constructors.size() || size > in.size() - pos) return false;
+        Constructor *cons = constructors[x];
+        if (cons != &Constructor::array && size != cons->ast.args.size()) return false;
+        need += Record::reserve(size);
+        if (h) obj = Record::claim(*h, cons, size);
+        fields = size;
+        break;
+      }
+      default:
+        return false;
+    }
+
+    if (tag != 'B') {
+      ++objects;
+      if (h) numbered.push_back(obj);
+    }
+    --unfilled;
+    if (h) {
+      if (open.empty()) {
+        *out = obj;
+      } else {
+        auto &parent = open.back();
+        parent.first->at(parent.second++)->instant_fulfill(obj);
+        if (parent.second == parent.first->size()) open.pop_back();
+      }
+      if (fields) open.emplace_back(static_cast<Record *>(obj), 0);
+    }
+    unfilled += fields;
+  }
+
+  return unfilled == 0 && pos == in.size();
+}
+
+bool TargetStore::detail::holds(Runtime &runtime, long run_id, size_t observed) {
+  auto insert = runs.emplace(run_id, StoredRun());
+  StoredRun &run = insert.first->second;
+  if (insert.second) {
+    std::string log = db->get_observations(run_id);
+    size_t pos = 0;
+    Observation x;
+    while (get_bytes(log, pos, x.kind) && get_bytes(log, pos, x.arg) &&
+           get_bytes(log, pos, x.result))
+      run.log.push_back(x);
+  }
+
+  auto &table = observers();
+  while (!run.failed && run.holds < observed && run.holds < run.log.size()) {
+    Observation &x = run.log[run.holds];
+    auto observer = table.find(x.kind);
+    if (observer != table.end() &&
+        observer->second.fn(runtime, x.arg, observer->second.data) == x.result) {
+      ++run.holds;
+    } else {
+      run.failed = true;
+    }
+  }
+  return run.holds >= observed;
+}
+
+Hash TargetStore::key(const std::string &location, Hash args, Hash aux) const {
+  std::vector<uint64_t> codes;
+  imp->program.push(codes);
+  Hash(location).push(codes);
+  args.push(codes);
+  aux.push(codes);
+  return Hash(codes);
+}
+
+static std::string hash_bytes(Hash hash) {
+  return std::string(reinterpret_cast<const char *>(&hash.data[0]), sizeof(hash.data));
+}
+
+size_t TargetStore::find(Runtime &runtime, Hash key, const std::string &location) {
+  if (!imp->active) return 0;
+
+  // After a failed reservation, the same lookup is made again
+  if (imp->looked && imp->found_key == key) return imp->found ? imp->found_need : 0;
+
+  TargetResult result;
+  imp->looked = true;
+  imp->found_key = key;
+  imp->found = imp->db->get_target(hash_bytes(key), result) &&
+               imp->decode(nullptr, result.value, imp->found_need, nullptr) &&
+               imp->holds(runtime, result.run, result.observed);
+
+  TargetStats &stats = imp->stats[location];
+  if (!imp->found) {
+    ++stats.misses;
+    return 0;
+  }
+  ++stats.hits;
+  imp->found_value = std::move(result.value);
+
+  // Anything which depends on the result depends on these observations too
+  StoredRun &run = imp->runs[result.run];
+  for (long i = 0; i < result.observed; ++i) {
+    Observation &x = run.log[i];
+    observe(x.kind.c_str(), x.arg, x.result);
+  }
+  return imp->found_need;
+}
+
+HeapObject *TargetStore::claim(Heap &h) {
+  HeapObject *out = nullptr;
+  size_t need;
+  imp->decode(&h, imp->found_value, need, &out);
+  imp->looked = false;
+  imp->found_value.clear();
+  return out;
+}
+
+void TargetStore::keep(Hash key, const std::string &location, HeapObject *value) {
+  if (!imp->active) return;
+  TargetResult result;
+  if (!imp->encode(value, result.value)) return;
+  result.hash = hash_bytes(key);
+  result.run = 0;
+  result.observed = imp->log.size();
+  imp->results.emplace_back(std::move(result));
+  ++imp->stats[location].kept;
+}
+
+void TargetStore::save() {
+  size_t observed = 0;
+  for (auto &result : imp->results) observed = std::max(observed, size_t(result.observed));
+
+  std::string log;
+  for (size_t i = 0; i < observed; ++i) {
+    Observation &x = imp->log[i];
+    put_bytes(log, x.kind.data(), x.kind.size());
+    put_bytes(log, x.arg.data(), x.arg.size());
+    put_bytes(log, x.result.data(), x.result.size());
+  }
+  imp->db->save_targets(hash_bytes(imp->program), log, std::move(imp->results));
+  imp->results.clear();
+}
+
+void TargetStore::report() const {
+  if (imp->stats.empty()) return;
+  std::stringstream s;
+  s << "wake: target results from earlier runs" << std::endl;
+  for (auto &x : imp->stats) {
+    s << "  " << x.first << ": " << x.second.hits << " reused, " << x.second.misses
+      << " computed, " << x.second.kept << " kept" << std::endl;
+  }
+  status_write(STREAM_INFO, s.str());
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TARGET_H
+#define TARGET_H
+
+#include <memory>
+#include <string>
+
+#include "runtime.h"
+#include "util/hash.h"
+
+struct Database;
+struct RFun;
+
+// Primitives which look outside the heap report what they saw as an
+// observation: a kind, what was looked at, and the result. To check that a
+// result still holds, the observation is made again by the Observer
+// registered for its kind.
+typedef std::string (*Observer)(Runtime &runtime, const std::string &arg, void *data);
+void observer_register(const char *kind, Observer fn, void *data = nullptr);
+
+// The "read" observation: a hash of the file's content, or why it could not be read
+std::string observe_file(Runtime &runtime, const std::string &path, void *data = nullptr);
+std::string observe_content(const std::string &content);
+
+// Results of target definitions, kept in wake.db for later runs. A result
+// is reused once every observation made before it was known still holds.
+// Observations are made in the order wake happened to run; nothing records
+// which of them a result actually used. Once wake has had an effect on the
+// world (launched a job, written a file, printed), results computed after
+// it are no longer kept, and kept results are no longer reused.
+struct TargetStore {
+  struct detail;
+  std::unique_ptr<detail> imp;
+
+  TargetStore(Database *db, RFun *root, const std::string &version);
+  ~TargetStore();
+
+  // Still free of effects, so kept results can be reused and new ones kept
+  bool active() const;
+
+  void observe(const char *kind, const std::string &arg, const std::string &result);
+  void effect();
+  // Observations of runtime.sources must be made again
+  void sources_changed();
+
+  // Hit/miss counts for each target, for --verbose
+  void report() const;
+  // Write the results kept by this run to wake.db
+  void save();
+
+  // The key of a target's result, given the hashes of its arguments
+  Hash key(const std::string &location, Hash args, Hash aux) const;
+  // Returns the heap space needed to claim a kept result which still holds, or 0
+  size_t find(Runtime &runtime, Hash key, const std::string &location);
+  HeapObject *claim(Heap &h);
+  // Keeps a fully evaluated result, if it is data which a later run can use
+  void keep(Hash key, const std::string &location, HeapObject *value);
+};
+
+inline void target_observe(Runtime &runtime, const char *kind, const std::string &arg,
+                           const std::string &result) {
+  if (runtime.targets) runtime.targets->observe(kind, arg, result);
+}
+
+inline void target_effect(Runtime &runtime) {
+  if (runtime.targets) runtime.targets->effect();
+}
+
+#endif
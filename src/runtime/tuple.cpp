@@ -23,6 +23,7 @@
 
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "optimizer/ssa.h"
 
@@ -287,6 +288,24 @@ std::vector<std::string> Scope::stack_trace(bool indent_compress) const {
   return scompress(std::move(out), indent_compress);
 }
 
+std::vector<std::string> Scope::stack_functions(size_t frames) const {
+  std::vector<std::string> out;
+  if (debug) {
+    std::unordered_set<const RFun *> funs;
+    std::unordered_set<std::string> seen;
+    const ScopeStack *s;
+    for (const Scope *i = this; i && frames; i = s->parent.get(), --frames) {
+      s = i->stack();
+      if (!funs.insert(s->fun).second) continue;
+      std::stringstream ss;
+      ss << s->fun->label << ": " << s->fun->fragment.location();
+      auto x = ss.str();
+      if (seen.insert(x).second) out.emplace_back(std::move(x));
+    }
+  }
+  return out;
+}
+
 template <typename T>
 struct ScopeObject : public TupleObject<T, Scope> {
   ScopeObject(size_t size, Scope *next, Scope *parent, RFun *fun);
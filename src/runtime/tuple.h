@@ -152,6 +152,8 @@ struct Scope : public Tuple {
 
   static bool debug;
   std::vector<std::string> stack_trace(bool indent_compress = true) const;
+  // The distinct functions among the innermost 'frames' of the stack, innermost first
+  std::vector<std::string> stack_functions(size_t frames) const;
   virtual const ScopeStack *stack() const = 0;
   virtual ScopeStack *stack() = 0;
   void set_fun(RFun *fun);
@@ -209,6 +209,48 @@ Integer *Integer::alloc(Heap &h, const MPZ &mpz) {
   return out;
 }
 
+#if GMP_LIMB_BITS == 64 && GMP_NAIL_BITS == 0
+static Integer *init(Integer *out, int64_t value) {
+  // The magnitude of INT64_MIN still fits an unsigned limb
+  mp_limb_t limb = value;
+  if (value) *static_cast<mp_limb_t *>(out->data()) = value < 0 ? -limb : limb;
+  return out;
+}
+
+Integer *Integer::claim(Heap &h, int64_t value) {
+  return init(new (h.claim(reserve(value))) Integer((value > 0) - (value < 0)), value);
+}
+
+Integer *Integer::alloc(Heap &h, int64_t value) {
+  return init(new (h.alloc(reserve(value))) Integer((value > 0) - (value < 0)), value);
+}
+#else
+// mpz_set_si takes a long, which can be narrower than an int64_t
+static void set(MPZ &mpz, int64_t value) {
+  uint64_t magnitude = value < 0 ? -static_cast<uint64_t>(value) : value;
+  mpz_import(mpz.value, 1, -1, sizeof(magnitude), 0, 0, &magnitude);
+  if (value < 0) mpz_neg(mpz.value, mpz.value);
+}
+
+size_t Integer::reserve(int64_t value) {
+  MPZ mpz;
+  set(mpz, value);
+  return reserve(mpz);
+}
+
+Integer *Integer::claim(Heap &h, int64_t value) {
+  MPZ mpz;
+  set(mpz, value);
+  return claim(h, mpz);
+}
+
+Integer *Integer::alloc(Heap &h, int64_t value) {
+  MPZ mpz;
+  set(mpz, value);
+  return alloc(h, mpz);
+}
+#endif
+
 RootPointer<Integer> Integer::literal(Heap &h, const std::string &value) {
   MPZ mpz(value);
   h.guarantee(reserve(mpz));
@@ -304,6 +346,10 @@ RegExp::RegExp(Heap &h, const re2::StringPiece &regexp)
                                     : re2::StringPiece("(?s)" + regexp.as_string()),
                                 opts)) {}
 
+std::shared_ptr<re2::RE2> RegExp::recompile(const std::string &pattern) {
+  return std::make_shared<RE2>(pattern, opts);
+}
+
 void RegExp::format(std::ostream &os, FormatState &state) const {
   if (APP_PRECEDENCE < state.p()) os << "(";
   os << "RegExp `";
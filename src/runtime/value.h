@@ -19,6 +19,7 @@
 #define VALUE_H
 
 #include <gmp.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include <limits>
@@ -172,6 +173,34 @@ struct Integer final : public GCObject<Integer, Value> {
   static Integer *claim(Heap &h, const MPZ &mpz);
   static Integer *alloc(Heap &h, const MPZ &mpz);
 
+  // Values which fit an int64_t are built and read without GMP temporaries
+  static Integer *claim(Heap &h, int64_t value);
+  static Integer *alloc(Heap &h, int64_t value);
+
+#if GMP_LIMB_BITS == 64 && GMP_NAIL_BITS == 0
+  static size_t reserve(int64_t value) {
+    return sizeof(Integer) / sizeof(PadObject) +
+           (value ? (sizeof(mp_limb_t) + sizeof(PadObject) - 1) / sizeof(PadObject) : 0);
+  }
+
+  bool small(int64_t &value) const {
+    if (length == 0) {
+      value = 0;
+      return true;
+    }
+    if (length != 1 && length != -1) return false;
+    mp_limb_t limb = *static_cast<const mp_limb_t *>(data());
+    if (limb > static_cast<mp_limb_t>(INT64_MAX)) return false;
+    value = length < 0 ? -static_cast<int64_t>(limb) : static_cast<int64_t>(limb);
+    return true;
+  }
+#else
+  // Narrower limbs (eg: emscripten) always take the plain GMP path
+  static size_t reserve(int64_t value);
+
+  bool small(int64_t &value) const { return false; }
+#endif
+
   // create a fake mpz_t out of the heap object
   const __mpz_struct wrap() const {
     __mpz_struct out;
@@ -218,6 +247,9 @@ struct RegExp final : public GCObject<RegExp, DestroyableObject> {
   void format(std::ostream &os, FormatState &state) const override;
   Hash shallow_hash() const override;
 
+  // Compiles exp->pattern() again, outside the heap
+  static std::shared_ptr<re2::RE2> recompile(const std::string &pattern);
+
   // Never call this during runtime! It can invalidate the heap.
   static RootPointer<RegExp> literal(Heap &h, const std::string &value);
 };
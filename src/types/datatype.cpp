@@ -53,6 +53,7 @@ void Sum::addConstructor(AST &&ast) {
   members.emplace_back(std::move(ast));
   Constructor &cons = members.back();
   cons.index = members.size() - 1;
+  cons.sum = this;
 }
 
 AST::AST(const FileFragment &token_, std::string &&name_, std::vector<AST> &&args_)
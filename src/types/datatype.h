@@ -61,10 +61,11 @@ struct Sum;
 struct Expr;
 struct Constructor {
   AST ast;
+  Sum *sum;   // null for array
   int index;  // sum->members[index] = this
   bool scoped;
 
-  Constructor(AST &&ast_) : ast(ast_), index(0), scoped(false) {}
+  Constructor(AST &&ast_) : ast(ast_), sum(nullptr), index(0), scoped(false) {}
   static Constructor array;
 };
 
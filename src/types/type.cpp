@@ -29,16 +29,20 @@
 #include "util/colour.h"
 #include "util/diagnostic.h"
 #include "util/fragment.h"
+#include "util/phases.h"
 
 static int globalClock = 0;
 static int globalEpoch = 1;  // before a tagging pass, globalEpoch > TypeVar.epoch for all TypeVars
 
-TypeVar::Imp::Imp() : link(nullptr), epoch(0), free_dob(0), nargs(0), cargs(nullptr), name() {}
+TypeVar::Imp::Imp() : link(nullptr), epoch(0), free_dob(0), nargs(0), cargs(nullptr), name() {
+  count_object(live_typevars, 1);
+}
 TypeVar::TypeVar() : imp(new Imp), var_dob(0) {}
 TypeChild::TypeChild() : var(), tag() {}
 
 TypeVar::Imp::Imp(const char *name_, int nargs_)
     : link(nullptr), epoch(0), free_dob(++globalClock), nargs(nargs_), name(name_) {
+  count_object(live_typevars, 1);
   cargs = nargs > 0 ? new TypeChild[nargs] : nullptr;
   for (int i = 0; i < nargs; ++i) {
     cargs[i].var.imp->free_dob = cargs[i].var.var_dob = ++globalClock;
@@ -49,6 +53,7 @@ TypeVar::TypeVar(const char *name_, int nargs_)
     : imp(new Imp(name_, nargs_)), var_dob(imp->free_dob) {}
 
 TypeVar::Imp::~Imp() {
+  count_object(live_typevars, -1);
   if (nargs) delete[] cargs;
 }
 
@@ -19,6 +19,7 @@
 #define DIAGNOSTIC_H
 
 #include <sstream>
+#include <vector>
 
 #include "location.h"
 
@@ -59,7 +60,36 @@ class DiagnosticReporter {
   virtual void report(Diagnostic diagnostic) = 0;
 };
 
-extern DiagnosticReporter *reporter;
+// Keeps diagnostics to pass on later, in the order they were reported
+class DiagnosticBuffer : public DiagnosticReporter {
+ public:
+  void replay(DiagnosticReporter &to) const {
+    for (auto &d : diagnostics) {
+      switch (d.getSeverity()) {
+        case S_ERROR:
+          to.reportError(d.getLocation(), d.getMessage());
+          break;
+        case S_WARNING:
+          to.reportWarning(d.getLocation(), d.getMessage());
+          break;
+        case S_INFORMATION:
+          to.reportInfo(d.getLocation(), d.getMessage());
+          break;
+        case S_HINT:
+          to.reportHint(d.getLocation(), d.getMessage());
+          break;
+      }
+    }
+  }
+
+ private:
+  std::vector<Diagnostic> diagnostics;
+
+  void report(Diagnostic diagnostic) override { diagnostics.push_back(std::move(diagnostic)); }
+};
+
+// Each thread reports to its own, so that files can be parsed at once
+extern thread_local DiagnosticReporter *reporter;
 
 #define ERROR(loc, stream)                  \
   do {                                      \
@@ -39,6 +39,8 @@ class FileContent {
 
   void clearNewLines();
   void addNewline(const uint8_t *first_column);
+  // Offsets of the first byte of each line, once the file has been lexed
+  const std::vector<size_t> &newLines() const { return newlines; }
 
   StringSegment segment() const { return ss; }
   const char *filename() const { return fname.c_str(); }
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "phases.h"
+
+#include <iostream>
+
+#include "compat/rusage.h"
+
+bool count_objects = false;
+std::atomic<long> live_terms(0);
+std::atomic<long> live_exprs(0);
+std::atomic<long> live_typevars(0);
+PhaseLog *phase_log = nullptr;
+
+void PhaseLog::begin(const char *name) {
+  RUsage usage = getRUsageSelf();
+  PhaseStats stats;
+  stats.name = name;
+  stats.depth = open.size();
+  open.push_back(Open{phases.size(), std::chrono::steady_clock::now(),
+                      usage.utime + usage.stime, static_cast<long>(usage.membytes)});
+  phases.emplace_back(std::move(stats));
+}
+
+void PhaseLog::end() {
+  auto now = std::chrono::steady_clock::now();
+  RUsage usage = getRUsageSelf();
+  Open &o = open.back();
+  PhaseStats &stats = phases[o.index];
+  std::chrono::duration<double> wall = now - o.start;
+  stats.wall = wall.count();
+  stats.cpu = usage.utime + usage.stime - o.cpu;
+  stats.peak_rss = static_cast<long>(usage.membytes) - o.rss;
+  stats.terms = live_terms.load(std::memory_order_relaxed);
+  stats.exprs = live_exprs.load(std::memory_order_relaxed);
+  stats.typevars = live_typevars.load(std::memory_order_relaxed);
+  open.pop_back();
+}
+
+void PhaseLog::report() const {
+  for (auto &x : phases) {
+    std::cerr << "Phase " << std::string(2 * x.depth, ' ') << x.name << ": " << x.wall
+              << "s wall, " << x.cpu << "s cpu, +" << (x.peak_rss >> 10) << "KiB peak RSS; "
+              << x.terms << " terms, " << x.exprs << " exprs, " << x.typevars << " type vars"
+              << std::endl;
+  }
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef PHASES_H
+#define PHASES_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Live compiler objects, counted only while phases are being recorded.
+// Wakefiles are parsed on several threads, so the counts are atomic.
+extern bool count_objects;
+extern std::atomic<long> live_terms;
+extern std::atomic<long> live_exprs;
+extern std::atomic<long> live_typevars;
+
+inline void count_object(std::atomic<long> &live, long delta) {
+  if (count_objects) live.fetch_add(delta, std::memory_order_relaxed);
+}
+
+// The resources used by one phase of compilation, nested phases included
+struct PhaseStats {
+  std::string name;
+  int depth;        // number of enclosing phases
+  double wall;      // seconds
+  double cpu;       // seconds, summed over threads
+  long peak_rss;    // growth of the peak resident set, in bytes
+  long terms;       // live when the phase ended
+  long exprs;
+  long typevars;
+};
+
+// Phases in the order they began. Only the main thread records phases.
+struct PhaseLog {
+  std::vector<PhaseStats> phases;
+
+  void begin(const char *name);
+  void end();
+  // One line per phase, for --verbose --debug
+  void report() const;
+
+ private:
+  struct Open {
+    size_t index;
+    std::chrono::steady_clock::time_point start;
+    double cpu;
+    long rss;
+  };
+  std::vector<Open> open;
+};
+
+// The log being recorded, or null
+extern PhaseLog *phase_log;
+
+// Records its lifetime as a phase
+struct Phase {
+  Phase(const char *name) {
+    if (phase_log) phase_log->begin(name);
+  }
+  ~Phase() {
+    if (phase_log) phase_log->end();
+  }
+};
+
+#endif
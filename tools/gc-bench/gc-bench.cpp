@@ -0,0 +1,134 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wcl/xoshiro_256.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "runtime/gc.h"
+#include "runtime/tuple.h"
+#include "runtime/value.h"
+#include "util/diagnostic.h"
+
+// The runtime reports through this; nothing here does
+thread_local DiagnosticReporter *reporter;
+
+// Measures full GC pauses over a synthetic heap: strings of 8-120 bytes
+// (like file names and command lines) under a tree of 8-wide records.
+
+#define FANOUT 8
+
+struct Pause {
+  double best;
+  double mean;
+  size_t bytes;  // of strings still reachable, to check the collector
+};
+
+static std::vector<size_t> make_lengths(size_t bytes, uint64_t seed) {
+  wcl::xoshiro_256 rng(std::make_tuple(seed, seed + 1, seed + 2, seed + 3));
+  std::vector<size_t> lengths;
+  size_t pads = 0;
+  while (pads * sizeof(PadObject) < bytes) {
+    size_t length = 8 + rng() % 113;
+    lengths.push_back(length);
+    pads += String::reserve(length);
+    // Amortized share of the records above each leaf
+    if (lengths.size() % (FANOUT - 1) == 0) pads += Record::reserve(FANOUT);
+  }
+  return lengths;
+}
+
+static size_t weigh(HeapObject *obj) {
+  if (typeid(*obj) == typeid(String)) return static_cast<String *>(obj)->size();
+  Record *node = static_cast<Record *>(obj);
+  size_t bytes = 0;
+  for (size_t i = 0; i < node->size() && *node->at(i); ++i) {
+    bytes += weigh(node->at(i)->coerce<HeapObject>());
+  }
+  return bytes;
+}
+
+static Pause measure(const std::vector<size_t> &lengths, int threads, int rounds) {
+  Heap heap(0, 1.1, false, threads);
+
+  size_t records = 0;
+  for (size_t n = lengths.size(); n > 1; n = (n + FANOUT - 1) / FANOUT) {
+    records += (n + FANOUT - 1) / FANOUT;
+  }
+  size_t pads = records * Record::reserve(FANOUT);
+  for (size_t length : lengths) pads += String::reserve(length);
+  heap.guarantee(pads);
+
+  std::string text(128, 'x');
+  std::vector<HeapObject *> level;
+  for (size_t length : lengths) level.push_back(String::claim(heap, text.data(), length));
+  while (level.size() > 1) {
+    std::vector<HeapObject *> up;
+    for (size_t i = 0; i < level.size(); i += FANOUT) {
+      Record *node = Record::claim(heap, nullptr, FANOUT);
+      for (size_t j = 0; j < FANOUT && i + j < level.size(); ++j) {
+        node->at(j)->instant_fulfill(level[i + j]);
+      }
+      up.push_back(node);
+    }
+    level.swap(up);
+  }
+  RootPointer<HeapObject> root = heap.root(level[0]);
+
+  Pause out = {1e9, 0, 0};
+  for (int i = 0; i < rounds; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    heap.GC(0);
+    std::chrono::duration<double> pause = std::chrono::steady_clock::now() - start;
+    out.best = std::min(out.best, pause.count());
+    out.mean += pause.count() / rounds;
+  }
+  out.bytes = weigh(root.get());
+  return out;
+}
+
+int main(int argc, char **argv) {
+  // gc-bench [threads] [heap-MB ...]
+  int threads = argc >= 2 ? atoi(argv[1]) : std::max(2U, std::thread::hardware_concurrency());
+  if (threads < 2) threads = 2;
+  std::vector<size_t> sizes;
+  for (int i = 2; i < argc; ++i) sizes.push_back(atol(argv[i]));
+  if (sizes.empty()) sizes = {100, 400, 1000, 4000};
+
+  printf("%d threads, best (mean) of 3 full collections\n\n", threads);
+  printf("%8s  %18s  %18s  %8s\n", "heap MB", "1 thread ms", "threads ms", "speedup");
+  bool ok = true;
+  for (size_t mb : sizes) {
+    std::vector<size_t> lengths = make_lengths(mb << 20, mb);
+    size_t bytes = 0;
+    for (size_t length : lengths) bytes += length;
+    Pause one = measure(lengths, 1, 3);
+    Pause many = measure(lengths, threads, 3);
+    printf("%8zu  %8.1f (%7.1f)  %8.1f (%7.1f)  %7.2fx\n", mb, one.best * 1000, one.mean * 1000,
+           many.best * 1000, many.mean * 1000, one.best / many.best);
+    ok = ok && one.bytes == bytes && many.bytes == bytes;
+  }
+
+  if (!ok) fprintf(stderr, "The heap was corrupted by a collection\n");
+  return ok ? 0 : 1;
+}
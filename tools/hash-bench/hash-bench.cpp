@@ -0,0 +1,134 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "runtime/hasher.h"
+#include "util/execpath.h"
+
+extern char **environ;
+
+// Compares hashing files the way wake used to, by spawning a `shim-wake
+// <hash>` process per file, with the thread pool wake now hashes them in.
+
+static std::vector<std::string> make_files(const std::string &dir, size_t count, size_t size) {
+  std::vector<std::string> files;
+  std::string content(size, 0);
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = 0; j < size; j += 64) content[j] = static_cast<char>(i + j);
+    files.push_back(dir + "/f" + std::to_string(i));
+    FILE *f = fopen(files.back().c_str(), "w");
+    if (!f) {
+      perror(files.back().c_str());
+      exit(1);
+    }
+    fwrite(content.data(), 1, content.size(), f);
+    fclose(f);
+  }
+  return files;
+}
+
+// Runs up to `threads` shims at once, as the job table would
+static double spawn_shims(const std::vector<std::string> &files, size_t threads) {
+  std::string shim = find_execpath() + "/../lib/wake/shim-wake";
+  int null = open("/dev/null", O_WRONLY);
+  std::string out = std::to_string(null);
+
+  auto start = std::chrono::steady_clock::now();
+  size_t running = 0;
+  for (const auto &file : files) {
+    if (running == threads) {
+      wait(nullptr);
+      --running;
+    }
+    const char *argv[] = {shim.c_str(), "/dev/null", out.c_str(), out.c_str(), ".", "<hash>",
+                          file.c_str(), nullptr};
+    pid_t pid;
+    if (posix_spawn(&pid, argv[0], nullptr, nullptr, const_cast<char **>(argv), environ) != 0) {
+      perror(argv[0]);
+      exit(1);
+    }
+    ++running;
+  }
+  while (running--) wait(nullptr);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  close(null);
+  return elapsed.count();
+}
+
+static double thread_pool(const std::vector<std::string> &files, size_t threads) {
+  auto start = std::chrono::steady_clock::now();
+  FileHasher hasher(threads);
+  for (size_t i = 0; i < files.size(); ++i) hasher.submit(i, files[i]);
+  while (hasher.outstanding() != 0) {
+    struct pollfd fd = {hasher.ready_fd(), POLLIN, 0};
+    poll(&fd, 1, -1);
+    for (auto &result : hasher.collect()) {
+      if (result.hash.empty()) {
+        fprintf(stderr, "%s\n", result.error.c_str());
+        exit(1);
+      }
+    }
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+  // hash-bench [files] [bytes-per-file] [threads]
+  size_t count = argc >= 2 ? atol(argv[1]) : 2000;
+  size_t size = argc >= 3 ? atol(argv[2]) : 16384;
+  size_t threads = argc >= 4 ? atol(argv[3]) : 4;
+  if (count < 1) count = 1;
+  if (threads < 1) threads = 1;
+
+  char dir[] = "/tmp/hash-bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  std::vector<std::string> files = make_files(dir, count, size);
+  double mb = count * size / 1048576.0;
+
+  printf("%zu files of %zu bytes, %zu threads\n\n", count, size, threads);
+  printf("%12s  %10s  %12s  %10s\n", "", "seconds", "files/s", "MiB/s");
+  double shims = spawn_shims(files, threads);
+  printf("%12s  %10.3f  %12.0f  %10.1f\n", "shim-wake", shims, count / shims, mb / shims);
+  double pool = thread_pool(files, threads);
+  printf("%12s  %10.3f  %12.0f  %10.1f\n", "thread pool", pool, count / pool, mb / pool);
+
+  for (const auto &file : files) unlink(file.c_str());
+  rmdir(dir);
+  return 0;
+}
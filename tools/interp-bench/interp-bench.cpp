@@ -0,0 +1,204 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "util/execpath.h"
+
+// Times wake programs which spend their time in the interpreter rather than
+// in jobs: list folds, tree operations, string formatting and arithmetic.
+// Each binary named on the command line gets its own workspace, so a baseline
+// wake can be compared against a new one. Startup (parsing and type-checking
+// the standard library) is measured with `Unit` and subtracted.
+
+static const char *bench_wake =
+    "package interp_bench\n"
+    "from wake import _\n"
+    "\n"
+    "export def benchFold n =\n"
+    "    def l = seq n\n"
+    "    foldl (_ + _) 0 l + foldr (_ + _) 0 (map (_ * 3) l) + len (filter (_ % 2 == 0) l)\n"
+    "\n"
+    "export def benchTree n =\n"
+    "    def keys = seq n | map (_ * 7919 % n)\n"
+    "    def tree = foldl (\\t \\k tinsert (k + n) t) (listToTree icmp keys) (seq (n / 4))\n"
+    "    tlen tree + len (filter (tcontains _ tree) keys)\n"
+    "\n"
+    "export def benchFormat n =\n"
+    "    seq n\n"
+    "    | map (\\i \"item {str i}: {format (Pair i (i * 2))}\")\n"
+    "    | catWith \", \"\n"
+    "    | strlen\n"
+    "\n"
+    "export def benchInteger n =\n"
+    "    def step acc i = (acc * 31 + i * i) % 1000000007 + i / 3 - (i % 7)\n"
+    "    foldl step 0 (seq n)\n";
+
+struct Bench {
+  const char *name;
+  const char *expr;
+};
+
+static const Bench benches[] = {
+    {"startup", "Unit"},
+    {"fold", "benchFold 300000"},
+    {"tree", "benchTree 10000"},
+    {"format", "benchFormat 30000"},
+    {"integer", "benchInteger 300000"},
+};
+
+// Runs wake in dir, returning its stdout; exits if wake fails
+static std::string run(const std::string &wake, const std::string &dir,
+                       const std::vector<std::string> &args) {
+  std::string out = dir + "/stdout";
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int null = open("/dev/null", O_WRONLY);
+    if (fd == -1 || null == -1 || chdir(dir.c_str()) != 0) _exit(127);
+    dup2(fd, 1);
+    dup2(null, 2);
+    std::vector<const char *> argv = {wake.c_str()};
+    for (const auto &arg : args) argv.push_back(arg.c_str());
+    argv.push_back(nullptr);
+    execv(argv[0], const_cast<char **>(argv.data()));
+    _exit(127);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid) {
+    perror("fork");
+    exit(1);
+  }
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s failed in %s\n", wake.c_str(), dir.c_str());
+    exit(1);
+  }
+  std::ifstream file(out);
+  std::stringstream result;
+  result << file.rdbuf();
+  return result.str();
+}
+
+struct Timing {
+  double best;
+  std::string result;
+};
+
+static Timing measure(const std::string &wake, const std::string &dir, const char *expr,
+                      int rounds) {
+  Timing out = {1e9, ""};
+  for (int i = 0; i < rounds; ++i) {
+    auto start = std::chrono::steady_clock::now();
+    out.result = run(wake, dir, {"--quiet", "--no-tty", "-x", expr});
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    out.best = std::min(out.best, elapsed.count());
+  }
+  return out;
+}
+
+int main(int argc, char **argv) {
+  // interp-bench [rounds] [wake ...]
+  int rounds = argc >= 2 ? atoi(argv[1]) : 3;
+  if (rounds < 1) rounds = 1;
+  std::vector<std::string> wakes;
+  for (int i = 2; i < argc; ++i) {
+    // Each wake runs from inside its workspace
+    char *path = realpath(argv[i], nullptr);
+    if (!path) {
+      perror(argv[i]);
+      return 1;
+    }
+    wakes.push_back(path);
+    free(path);
+  }
+  if (wakes.empty()) wakes.push_back(find_execpath() + "/wake");
+
+  char dir[] = "/tmp/interp-bench.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  std::vector<std::string> workspaces;
+  for (size_t i = 0; i < wakes.size(); ++i) {
+    workspaces.push_back(std::string(dir) + "/" + std::to_string(i));
+    if (mkdir(workspaces.back().c_str(), 0755) != 0) {
+      perror(workspaces.back().c_str());
+      return 1;
+    }
+    std::ofstream(workspaces.back() + "/bench.wake") << bench_wake;
+    run(wakes[i], workspaces.back(), {"--init", "."});
+  }
+
+  printf("best of %d runs, seconds (startup subtracted)\n\n", rounds);
+  printf("%8s", "");
+  for (size_t i = 0; i < wakes.size(); ++i) {
+    printf("  %10s", wakes.size() == 1 ? "seconds" : i ? "compared" : "baseline");
+  }
+  if (wakes.size() > 1) printf("  %8s", "speedup");
+  printf("\n");
+
+  bool ok = true;
+  std::vector<double> startup(wakes.size());
+  for (const Bench &bench : benches) {
+    printf("%8s", bench.name);
+    std::vector<Timing> times;
+    for (size_t i = 0; i < wakes.size(); ++i) {
+      times.push_back(measure(wakes[i], workspaces[i], bench.expr, rounds));
+      double seconds = times.back().best;
+      if (&bench == &benches[0]) {
+        startup[i] = seconds;
+      } else {
+        seconds = std::max(seconds - startup[i], 1e-6);
+        times.back().best = seconds;
+      }
+      printf("  %10.3f", seconds);
+      ok = ok && times.back().result == times[0].result;
+    }
+    if (wakes.size() > 1) printf("  %7.2fx", times[0].best / times.back().best);
+    printf("\n");
+    fflush(stdout);
+  }
+
+  for (const auto &workspace : workspaces) {
+    for (const char *file : {"/bench.wake", "/stdout", "/wake.db", "/wake.db-shm", "/wake.db-wal",
+                             "/wake.log"}) {
+      unlink((workspace + file).c_str());
+    }
+    rmdir(workspace.c_str());
+  }
+  rmdir(dir);
+
+  if (!ok) fprintf(stderr, "The wake binaries computed different results\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wcl/xoshiro_256.h>
+
+#include <string>
+#include <vector>
+
+#include "../job-cache/bloom.h"
+#include "load.h"
+
+// The filter the job-cache used before bloom.h grew a real filter: a
+// single hash selecting one of 32 bits, stored as an integer.
+class LegacyBloomFilter {
+  uint64_t bits = 0;
+
+ public:
+  void add_hash(const Hash256 &hash) { bits |= UINT64_C(1) << (hash.data[0] & 0x1F); }
+  bool is_subset_of(const LegacyBloomFilter &other) const { return (bits & ~other.bits) == 0; }
+};
+
+static Hash256 random_hash(wcl::xoshiro_256 &rng) {
+  Hash256 hash;
+  for (auto &word : hash.data) word = rng();
+  return hash;
+}
+
+struct Candidates {
+  size_t jobs = 0;
+  size_t input_rows = 0;
+};
+
+// Models the lookups a rebuild makes against a cache that holds
+// `stale_jobs` earlier runs of the same command. Each earlier run differs
+// from the current one in exactly one input, so all of them share the
+// (directory, commandline, environment, stdin) index entry and only the
+// bloom filter stands between them and the per-file check in all_match.
+//
+// For each filter we count the job rows that pass the filter and the
+// input_files rows all_match then reads before it finds the changed input.
+template <class Filter>
+static Candidates simulate(wcl::xoshiro_256 &rng, size_t inputs, size_t visible,
+                           size_t stale_jobs) {
+  std::vector<Hash256> current;
+  Filter query;
+  for (size_t i = 0; i < visible; ++i) {
+    Hash256 hash = random_hash(rng);
+    query.add_hash(hash);
+    if (i < inputs) current.push_back(hash);
+  }
+
+  Candidates out;
+  for (size_t job = 0; job < stale_jobs; ++job) {
+    size_t changed = rng() % inputs;
+    Filter bloom;
+    for (size_t i = 0; i < inputs; ++i) {
+      bloom.add_hash(i == changed ? random_hash(rng) : current[i]);
+    }
+    if (!bloom.is_subset_of(query)) continue;
+    out.jobs += 1;
+    out.input_rows += changed + 1;
+  }
+
+  // The job that actually matches is always a candidate and reads every row
+  out.jobs += 1;
+  out.input_rows += inputs;
+  return out;
+}
+
+// Adapts BloomFilter to the interface the simulation uses
+struct CurrentBloomFilter : public BloomFilter {
+  bool is_subset_of(const CurrentBloomFilter &other) const {
+    return BloomFilter::is_subset(data(), size(), other.data(), other.size());
+  }
+};
+
+int main(int argc, char **argv) {
+  // job-cache-bench load [options] <scratch-dir>
+  if (argc >= 2 && std::string(argv[1]) == "load") return load_main(argc - 1, argv + 1);
+
+  // job-cache-bench [stale-jobs] [visible-files-per-input]
+  size_t stale_jobs = argc >= 2 ? atol(argv[1]) : 1000;
+  size_t visible_ratio = argc >= 3 ? atol(argv[2]) : 2;
+  if (stale_jobs < 1) stale_jobs = 1;
+  if (visible_ratio < 1) visible_ratio = 1;
+
+  wcl::xoshiro_256 rng(wcl::xoshiro_256::get_rng_seed());
+
+  printf("%zu stale jobs per lookup, %zu visible files per input, %zu byte filter\n\n",
+         stale_jobs, visible_ratio, BloomFilter().size());
+  printf("%8s  %24s  %24s\n", "", "candidate jobs", "input rows read");
+  printf("%8s  %11s %12s  %11s %12s\n", "inputs", "before", "after", "before", "after");
+  for (size_t inputs : {10, 100, 10000}) {
+    size_t visible = inputs * visible_ratio;
+    Candidates before = simulate<LegacyBloomFilter>(rng, inputs, visible, stale_jobs);
+    Candidates after = simulate<CurrentBloomFilter>(rng, inputs, visible, stale_jobs);
+    printf("%8zu  %11zu %12zu  %11zu %12zu\n", inputs, before.jobs, after.jobs, before.input_rows,
+           after.input_rows);
+  }
+
+  return 0;
+}
@@ -0,0 +1,497 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "load.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <job_cache/job_cache.h>
+#include <json/json5.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <util/execpath.h>
+#include <util/mkdir_parents.h>
+#include <wcl/xoshiro_256.h>
+
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../job-cache/hash.h"
+#include "gopt/gopt-arg.h"
+#include "gopt/gopt.h"
+
+struct LoadOptions {
+  size_t jobs = 200;
+  size_t inputs = 50;
+  size_t shared_pool = 200;
+  double shared = 0.8;
+  size_t outputs = 4;
+  size_t output_size = 4096;
+  size_t redirects = 0;
+  size_t processes = 4;
+  size_t ops = 1000;
+  double read_ratio = 0.9;
+  uint64_t seed = 1;
+  std::string scratch;
+  std::string cache;
+  std::string job_cache;
+};
+
+struct SyntheticOutput {
+  std::string path;
+  std::string source;
+  Hash256 hash;
+};
+
+// Every job runs in /ws. Its inputs are a mix of files from a pool shared
+// by all jobs (think headers and toolchains) and files of its own.
+struct SyntheticJob {
+  std::string command_line;
+  std::vector<std::pair<std::string, Hash256>> inputs;
+  std::vector<SyntheticOutput> outputs;
+};
+
+struct Population {
+  std::vector<std::pair<std::string, Hash256>> shared;
+  std::vector<SyntheticJob> jobs;
+};
+
+enum SampleKind : uint8_t { SAMPLE_READ, SAMPLE_ADD };
+
+struct Sample {
+  double seconds;
+  uint8_t kind;
+  uint8_t hit;
+};
+
+static Hash256 random_hash(wcl::xoshiro_256 &rng) {
+  Hash256 hash;
+  for (auto &word : hash.data) word = rng();
+  return hash;
+}
+
+static bool write_file(const std::string &path, const std::string &content) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file) return false;
+  bool ok = fwrite(content.data(), 1, content.size(), file) == content.size();
+  return fclose(file) == 0 && ok;
+}
+
+static bool make_dir(const std::string &path) {
+  if (mkdir_with_parents(path, 0777) == 0) return true;
+  fprintf(stderr, "job-cache-bench: mkdir %s: %s\n", path.c_str(), strerror(errno));
+  return false;
+}
+
+// Output contents are random so each output is its own blob, and the
+// sources are written once up front so adds only measure the cache.
+static bool make_population(const LoadOptions &opts, Population &pop) {
+  wcl::xoshiro_256 rng(std::make_tuple(opts.seed, UINT64_C(0x6a6f62), UINT64_C(0x6361636865),
+                                       UINT64_C(0x62656e6368)));
+
+  for (size_t i = 0; i < opts.shared_pool; ++i) {
+    std::string path = "/ws/shared/d" + std::to_string(i % 16) + "/f" + std::to_string(i);
+    pop.shared.emplace_back(std::move(path), random_hash(rng));
+  }
+
+  size_t shared_inputs = std::min(opts.shared_pool, size_t(opts.inputs * opts.shared + 0.5));
+  std::vector<size_t> pool(opts.shared_pool);
+  std::iota(pool.begin(), pool.end(), 0);
+
+  std::string content(opts.output_size, '\0');
+  for (size_t k = 0; k < opts.jobs; ++k) {
+    SyntheticJob job;
+    std::string name = "job" + std::to_string(k);
+    job.command_line = "bench-compile " + name;
+
+    // A partial shuffle picks distinct shared inputs
+    for (size_t i = 0; i < shared_inputs; ++i) {
+      std::swap(pool[i], pool[i + rng() % (pool.size() - i)]);
+      job.inputs.push_back(pop.shared[pool[i]]);
+    }
+    for (size_t i = shared_inputs; i < opts.inputs; ++i) {
+      job.inputs.emplace_back("/ws/" + name + "/src/f" + std::to_string(i), random_hash(rng));
+    }
+
+    std::string source_dir = opts.scratch + "/src/" + name;
+    if (!make_dir(source_dir)) return false;
+    for (size_t i = 0; i < opts.outputs; ++i) {
+      for (auto &c : content) c = rng();
+      SyntheticOutput output;
+      output.path = "/ws/" + name + "/out/o" + std::to_string(i);
+      output.source = source_dir + "/o" + std::to_string(i);
+      output.hash = Hash256::blake2b(content);
+      if (!write_file(output.source, content)) {
+        fprintf(stderr, "job-cache-bench: write %s: %s\n", output.source.c_str(), strerror(errno));
+        return false;
+      }
+      job.outputs.emplace_back(std::move(output));
+    }
+
+    pop.jobs.emplace_back(std::move(job));
+  }
+
+  return true;
+}
+
+static void add_header(JAST &json, const SyntheticJob &job) {
+  json.add("cwd", std::string("/ws"));
+  json.add("command_line", std::string(job.command_line));
+  json.add("envrionment", std::string("PATH=/usr/bin"));
+  json.add("stdin", std::string());
+}
+
+static void add_file(JAST &files, const std::string &path, const Hash256 &hash) {
+  auto &file = files.add(JSON_OBJECT);
+  file.add("path", std::string(path));
+  file.add("hash", hash.to_hex());
+}
+
+static JAST add_request(const SyntheticJob &job) {
+  JAST json(JSON_OBJECT);
+  add_header(json, job);
+  auto &inputs = json.add("input_files", JSON_ARRAY);
+  for (const auto &input : job.inputs) add_file(inputs, input.first, input.second);
+  json.add("input_dirs", JSON_ARRAY);
+  auto &outputs = json.add("output_files", JSON_ARRAY);
+  for (const auto &output : job.outputs) {
+    auto &file = outputs.add(JSON_OBJECT);
+    file.add("src", std::string(output.source));
+    file.add("path", std::string(output.path));
+    file.add("hash", output.hash.to_hex());
+  }
+  return json;
+}
+
+// A build sees every shared file and its own, and may redirect where
+// its outputs land.
+static JAST read_request(const LoadOptions &opts, const Population &pop, size_t k) {
+  const SyntheticJob &job = pop.jobs[k];
+  JAST json(JSON_OBJECT);
+  add_header(json, job);
+  auto &visible = json.add("input_files", JSON_ARRAY);
+  for (const auto &input : pop.shared) add_file(visible, input.first, input.second);
+  for (const auto &input : job.inputs) {
+    bool shared = input.first.compare(0, 11, "/ws/shared/") == 0;
+    if (!shared) add_file(visible, input.first, input.second);
+  }
+
+  auto &redirects = json.add("dir_redirects", JSON_OBJECT);
+  for (size_t i = 0; i < opts.redirects; ++i) {
+    // The first redirect is the one that applies to this job
+    size_t target = i == 0 ? k : (k + i) % pop.jobs.size();
+    std::string name = "job" + std::to_string(target);
+    redirects.add("/ws/" + name + "/out", "redirected/" + name + "/");
+  }
+  return json;
+}
+
+// A rebuild after one input changed: a new job with new outputs that
+// lands next to the original in the cache. The new outputs are written to
+// dir before the add is timed. The cache may have linked
+// the last ones into its store, so they are replaced rather than rewritten.
+static bool variant_of(const SyntheticJob &job, const std::string &dir, size_t output_size,
+                       wcl::xoshiro_256 &rng, SyntheticJob &variant) {
+  variant = job;
+  variant.inputs[rng() % variant.inputs.size()].second = random_hash(rng);
+  std::string content(output_size, '\0');
+  for (size_t i = 0; i < variant.outputs.size(); ++i) {
+    SyntheticOutput &output = variant.outputs[i];
+    for (auto &c : content) c = rng();
+    output.source = dir + "/o" + std::to_string(i);
+    output.hash = Hash256::blake2b(content);
+    if (unlink(output.source.c_str()) != 0 && errno != ENOENT) return false;
+    if (!write_file(output.source, content)) {
+      fprintf(stderr, "job-cache-bench: write %s: %s\n", output.source.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::string samples_path(const LoadOptions &opts, const char *phase, size_t process) {
+  return opts.scratch + "/samples." + phase + "." + std::to_string(process);
+}
+
+// Runs in a forked process, which talks to the daemon on its own connection
+static int run_client(const LoadOptions &opts, const Population &pop, const char *phase,
+                      size_t process) {
+  std::string work_dir = opts.scratch + "/p" + std::to_string(process);
+  if (!make_dir(work_dir) || chdir(work_dir.c_str()) != 0) return 1;
+
+  job_cache::Client client(opts.cache, opts.job_cache);
+  std::vector<Sample> samples;
+  bool populate = strcmp(phase, "populate") == 0;
+  wcl::xoshiro_256 rng(std::make_tuple(opts.seed, UINT64_C(1) + process, UINT64_C(2), UINT64_C(3)));
+
+  size_t count = populate ? opts.jobs : opts.ops;
+  for (size_t i = 0; i < count; ++i) {
+    size_t k;
+    bool read;
+    if (populate) {
+      // Each process adds its share of the jobs
+      k = i;
+      read = false;
+      if (k % opts.processes != process) continue;
+    } else {
+      k = rng() % opts.jobs;
+      read = double(rng() >> 11) / double(UINT64_C(1) << 53) < opts.read_ratio;
+    }
+
+    Sample sample = {0, read ? SAMPLE_READ : SAMPLE_ADD, 0};
+    if (read) {
+      JAST request = read_request(opts, pop, k);
+      auto start = std::chrono::steady_clock::now();
+      bool found = false;
+      JAST result;
+      if (!client.read(request, found, result)) return 1;
+      sample.seconds = seconds_since(start);
+      sample.hit = found;
+    } else {
+      SyntheticJob variant;
+      if (!populate && !variant_of(pop.jobs[k], work_dir, opts.output_size, rng, variant)) return 1;
+      JAST request = add_request(populate ? pop.jobs[k] : variant);
+      auto start = std::chrono::steady_clock::now();
+      if (!client.add(request)) return 1;
+      sample.seconds = seconds_since(start);
+    }
+    samples.push_back(sample);
+  }
+
+  FILE *out = fopen(samples_path(opts, phase, process).c_str(), "w");
+  if (!out) return 1;
+  bool ok = fwrite(samples.data(), sizeof(Sample), samples.size(), out) == samples.size();
+  return fclose(out) == 0 && ok ? 0 : 1;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t rank = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+  return sorted[rank];
+}
+
+static bool run_phase(const LoadOptions &opts, const Population &pop, const char *phase) {
+  auto start = std::chrono::steady_clock::now();
+  std::vector<pid_t> children;
+  for (size_t i = 0; i < opts.processes; ++i) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+      fprintf(stderr, "job-cache-bench: fork: %s\n", strerror(errno));
+      return false;
+    }
+    if (pid == 0) _exit(run_client(opts, pop, phase, i));
+    children.push_back(pid);
+  }
+
+  bool ok = true;
+  for (pid_t pid : children) {
+    int status;
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  }
+  double wall = seconds_since(start);
+  if (!ok) {
+    fprintf(stderr, "job-cache-bench: a %s client failed\n", phase);
+    return false;
+  }
+
+  std::vector<double> reads, adds;
+  size_t hits = 0;
+  for (size_t i = 0; i < opts.processes; ++i) {
+    std::string path = samples_path(opts, phase, i);
+    FILE *in = fopen(path.c_str(), "r");
+    if (!in) return false;
+    Sample sample;
+    while (fread(&sample, sizeof(sample), 1, in) == 1) {
+      (sample.kind == SAMPLE_READ ? reads : adds).push_back(sample.seconds);
+      hits += sample.hit;
+    }
+    fclose(in);
+    unlink(path.c_str());
+  }
+  std::sort(reads.begin(), reads.end());
+  std::sort(adds.begin(), adds.end());
+
+  size_t ops = reads.size() + adds.size();
+  char hit_rate[16] = "-";
+  if (!reads.empty()) snprintf(hit_rate, sizeof(hit_rate), "%.1f%%", 100.0 * hits / reads.size());
+  printf("%-9s %7zu %9.1f %9.3f %9.3f %9.3f %9.3f %7s\n", phase, ops, ops / wall,
+         percentile(reads, 0.50) * 1e3, percentile(reads, 0.99) * 1e3,
+         percentile(adds, 0.50) * 1e3, percentile(adds, 0.99) * 1e3, hit_rate);
+  return true;
+}
+
+static int64_t file_size(const std::string &path) {
+  struct stat buf;
+  return stat(path.c_str(), &buf) == 0 ? buf.st_size : 0;
+}
+
+// Sums the sizes of the files under `dir`, which holds `blobs/<xx>/<hash>`
+static void blob_store_size(const std::string &dir, size_t &files, int64_t &bytes) {
+  DIR *top = opendir(dir.c_str());
+  if (!top) return;
+  while (struct dirent *group = readdir(top)) {
+    if (group->d_name[0] == '.') continue;
+    std::string group_dir = dir + "/" + group->d_name;
+    DIR *blobs = opendir(group_dir.c_str());
+    if (!blobs) continue;
+    while (struct dirent *blob = readdir(blobs)) {
+      if (blob->d_name[0] == '.') continue;
+      files += 1;
+      bytes += file_size(group_dir + "/" + blob->d_name);
+    }
+    closedir(blobs);
+  }
+  closedir(top);
+}
+
+static void print_help() {
+  printf(
+      "Usage: job-cache-bench load [OPTIONS] <scratch-dir>\n"
+      "\n"
+      "Adds a synthetic population of jobs to a cache from several processes\n"
+      "and then drives a mix of reads and adds (rebuilds with one changed\n"
+      "input) against it. The scratch directory should start out empty.\n"
+      "\n"
+      "  --jobs N          distinct jobs in the population (200)\n"
+      "  --inputs N        input files per job (50)\n"
+      "  --shared-pool N   files in the pool shared between jobs (200)\n"
+      "  --shared F        fraction of each job's inputs from the pool (0.8)\n"
+      "  --outputs N       output files per job (4)\n"
+      "  --output-size N   bytes per output file (4096)\n"
+      "  --redirects N     dir_redirects sent with each read (0)\n"
+      "  --processes N     concurrent client processes (4)\n"
+      "  --ops N           reads and adds per process after populating (1000)\n"
+      "  --read-ratio F    fraction of those that are reads (0.9)\n"
+      "  --seed N          seed for the population and the mix (1)\n"
+      "  --cache DIR       cache directory (<scratch-dir>/cache)\n"
+      "  --job-cache PATH  job-cache executable (next to job-cache-bench)\n");
+}
+
+int load_main(int argc, char **argv) {
+  // clang-format off
+  struct option options[] {
+    {0, "jobs", GOPT_ARGUMENT_REQUIRED},
+    {0, "inputs", GOPT_ARGUMENT_REQUIRED},
+    {0, "shared-pool", GOPT_ARGUMENT_REQUIRED},
+    {0, "shared", GOPT_ARGUMENT_REQUIRED},
+    {0, "outputs", GOPT_ARGUMENT_REQUIRED},
+    {0, "output-size", GOPT_ARGUMENT_REQUIRED},
+    {0, "redirects", GOPT_ARGUMENT_REQUIRED},
+    {0, "processes", GOPT_ARGUMENT_REQUIRED},
+    {0, "ops", GOPT_ARGUMENT_REQUIRED},
+    {0, "read-ratio", GOPT_ARGUMENT_REQUIRED},
+    {0, "seed", GOPT_ARGUMENT_REQUIRED},
+    {0, "cache", GOPT_ARGUMENT_REQUIRED},
+    {0, "job-cache", GOPT_ARGUMENT_REQUIRED},
+    {'h', "help", GOPT_ARGUMENT_FORBIDDEN},
+    {0, 0, GOPT_LAST}
+  };
+  // clang-format on
+
+  argc = gopt(argv, options);
+  gopt_errors("job-cache-bench load", options);
+
+  if (arg(options, "help")->count || argc != 2) {
+    print_help();
+    return arg(options, "help")->count ? 0 : 1;
+  }
+
+  auto count = [&](const char *name, size_t &out) {
+    if (arg(options, name)->count) out = strtoull(arg(options, name)->argument, nullptr, 0);
+  };
+  auto fraction = [&](const char *name, double &out) {
+    if (!arg(options, name)->count) return;
+    out = std::min(1.0, std::max(0.0, atof(arg(options, name)->argument)));
+  };
+
+  LoadOptions opts;
+  count("jobs", opts.jobs);
+  count("inputs", opts.inputs);
+  count("shared-pool", opts.shared_pool);
+  fraction("shared", opts.shared);
+  count("outputs", opts.outputs);
+  count("output-size", opts.output_size);
+  count("redirects", opts.redirects);
+  count("processes", opts.processes);
+  count("ops", opts.ops);
+  fraction("read-ratio", opts.read_ratio);
+  if (arg(options, "seed")->count) opts.seed = strtoull(arg(options, "seed")->argument, nullptr, 0);
+  opts.jobs = std::max<size_t>(opts.jobs, 1);
+  opts.inputs = std::max<size_t>(opts.inputs, 1);
+  opts.processes = std::max<size_t>(opts.processes, 1);
+
+  // The daemon resolves paths against each client's cwd, which differ
+  if (!make_dir(argv[1])) return 1;
+  char *scratch = realpath(argv[1], nullptr);
+  if (!scratch) {
+    fprintf(stderr, "job-cache-bench: realpath %s: %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+  opts.scratch = scratch;
+  free(scratch);
+  opts.cache = opts.scratch + "/cache";
+  if (arg(options, "cache")->count) opts.cache = arg(options, "cache")->argument;
+  if (!make_dir(opts.cache)) return 1;
+  char *cache = realpath(opts.cache.c_str(), nullptr);
+  if (!cache) return 1;
+  opts.cache = cache;
+  free(cache);
+  opts.job_cache = arg(options, "job-cache")->count ? arg(options, "job-cache")->argument
+                                                    : find_execpath() + "/job-cache";
+
+  Population pop;
+  if (!make_population(opts, pop)) return 1;
+
+  printf("%zu jobs of %zu inputs (%.0f%% from a pool of %zu) and %zu outputs of %zu bytes\n",
+         opts.jobs, opts.inputs, opts.shared * 100, opts.shared_pool, opts.outputs,
+         opts.output_size);
+  printf("%zu processes, %.0f%% reads, %zu redirects per read\n\n", opts.processes,
+         opts.read_ratio * 100, opts.redirects);
+  printf("%-9s %7s %9s %9s %9s %9s %9s %7s\n", "phase", "ops", "ops/s", "read p50", "read p99",
+         "add p50", "add p99", "hits");
+  printf("%-9s %7s %9s %9s %9s %9s %9s %7s\n", "", "", "", "(ms)", "(ms)", "(ms)", "(ms)", "");
+
+  if (!run_phase(opts, pop, "populate")) return 1;
+  if (opts.ops > 0 && !run_phase(opts, pop, "mixed")) return 1;
+
+  size_t blobs = 0;
+  int64_t blob_bytes = 0;
+  blob_store_size(opts.cache + "/blobs", blobs, blob_bytes);
+  int64_t db_bytes = file_size(opts.cache + "/cache.db") + file_size(opts.cache + "/cache.db-wal");
+  printf("\ncache.db %lld bytes (with wal), blob store %zu files of %lld bytes\n",
+         static_cast<long long>(db_bytes), blobs, static_cast<long long>(blob_bytes));
+  return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// job-cache-bench load [options] <scratch-dir>
+//
+// Synthesizes a population of jobs, adds them to a cache through the
+// job-cache daemon from several processes at once, and then drives a mix
+// of reads and adds against it. Reports latency percentiles, throughput
+// and the size of the cache. `argv[0]` is "load".
+int load_main(int argc, char **argv);
@@ -17,16 +17,56 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
 #include "hash.h"
 
-// TODO: Make the bloom filter bigger
-class BloomFilter {
-  uint64_t bits = 0;
+// A job's bloom filter holds the hashes of all of its inputs, and a lookup's
+// bloom filter holds the hashes of everything visible to it. A job can only
+// match when its filter is a subset of the lookup's, which lets the database
+// skip most non-matching jobs without reading their input rows.
+//
+// Input hashes are already uniformly random so no further hashing is needed.
+// Each of the `hash_count` bit positions is taken from its own 16-bit slice
+// of the Hash256, which allows filters of up to 2^16 bits and 16 hashes.
+template <size_t bit_count, size_t hash_count>
+class BasicBloomFilter {
+  static_assert(bit_count >= 64 && (bit_count & (bit_count - 1)) == 0,
+                "bloom filter size must be a power of two of at least 64 bits");
+  static_assert(bit_count <= (1 << 16), "bloom filter positions are taken 16 bits at a time");
+  static_assert(hash_count >= 1 && hash_count <= 16, "a Hash256 only has 16 16-bit slices");
+
+  uint64_t bits[bit_count / 64] = {0};
 
  public:
-  void add_hash(Hash256 hash) { bits |= 1 << (hash.data[0] & 0x1F); }
+  void add_hash(const Hash256 &hash) {
+    for (size_t i = 0; i < hash_count; ++i) {
+      size_t pos = (hash.data[i % 4] >> (16 * (i / 4))) & (bit_count - 1);
+      bits[pos / 64] |= UINT64_C(1) << (pos % 64);
+    }
+  }
+
   size_t size() const { return sizeof(bits); }
-  const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(&bits); }
+  const uint8_t *data() const { return reinterpret_cast<const uint8_t *>(bits); }
+
+  // Returns true if every bit set in `subset` is also set in `superset`.
+  // Filters of a different size than ours (ie: written with a different
+  // configuration) are never ruled out because we cannot compare them.
+  static bool is_subset(const void *subset, size_t subset_size, const void *superset,
+                        size_t superset_size) {
+    if (subset_size != sizeof(bits) || superset_size != sizeof(bits)) return true;
+    // The blobs handed to us by sqlite have no alignment guarantee
+    const uint8_t *sub = static_cast<const uint8_t *>(subset);
+    const uint8_t *super = static_cast<const uint8_t *>(superset);
+    for (size_t i = 0; i < sizeof(bits); ++i) {
+      if (sub[i] & ~super[i]) return false;
+    }
+    return true;
+  }
 };
+
+// 1024 bits with 6 hashes lets a lookup with 100 visible inputs rule out all
+// but ~1% of non-matching jobs. Changing either value is safe: existing filters
+// of another size simply stop being used to prune candidate jobs.
+using BloomFilter = BasicBloomFilter<1024, 6>;
@@ -0,0 +1,1940 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <json/json5.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <util/mkdir_parents.h>
+#include <util/unlink.h>
+#include <wcl/filepath.h>
+#include <wcl/trie.h>
+#include <wcl/xoshiro_256.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cache.h"
+#include "logging.h"
+#include "unique_fd.h"
+
+// moves the file or directory, crashes on error
+static void rename_no_fail(const char *old_path, const char *new_path) {
+  if (rename(old_path, new_path) < 0) {
+    log_fatal("rename(%s, %s): %s", old_path, new_path, strerror(errno));
+  }
+}
+
+// Ensures the the given directory has been created
+static void mkdir_no_fail(const char *dir) {
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+    log_fatal("mkdir(%s): %s", dir, strerror(errno));
+  }
+}
+
+// Ensures the given file has been deleted
+static void unlink_no_fail(const char *file) {
+  if (unlink(file) < 0) {
+    log_fatal("unlink(%s): %s", file, strerror(errno));
+  }
+}
+
+// Ensures the the given directory no longer exists
+static void rmdir_no_fail(const char *dir) {
+  if (rmdir(dir) < 0 && errno != ENOENT) {
+    log_fatal("rmdir(%s): %s", dir, strerror(errno));
+  }
+}
+
+// Outputs are copied from and to files that clients name, so a copy that
+// fails is the request's fault rather than the cache's
+[[noreturn]] static void copy_failed(const std::string &call) {
+  throw RequestError(call + ": " + strerror(errno));
+}
+
+// Copies using plain reads and writes, for when nothing better works
+static void copy_read_write(int src_fd, int dst_fd) {
+  char buf[64 * 1024];
+  while (true) {
+    ssize_t got = read(src_fd, buf, sizeof(buf));
+    if (got == 0) return;
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      copy_failed("read(src_fd = " + std::to_string(src_fd) + ")");
+    }
+    for (ssize_t done = 0; done < got;) {
+      ssize_t put = write(dst_fd, buf + done, got - done);
+      if (put < 0) {
+        if (errno == EINTR) continue;
+        copy_failed("write(dst_fd = " + std::to_string(dst_fd) + ")");
+      }
+      done += put;
+    }
+  }
+}
+
+// This function first attempts to reflink but if that isn't
+// supported by the filesystem it copies instead.
+#ifdef __APPLE__
+
+static void copy(int src_fd, int dst_fd) {
+  // TODO: APFS supports reflinking so we should use clonefile here
+  copy_read_write(src_fd, dst_fd);
+}
+
+#elif __GLIBC__ >= 2 && __GLIBC_MINOR__ >= 27
+
+#include <linux/fs.h>
+
+// This function uses `copy_file_range` to make an efficent copy. The
+// kernel may copy less than asked for so large files are copied a
+// chunk at a time. Older kernels cannot copy between file systems, in
+// which case we fall back to reading and writing.
+static void copy(int src_fd, int dst_fd) {
+  static constexpr off_t chunk_size = 128 << 20;
+  struct stat buf;
+  if (fstat(src_fd, &buf) < 0) {
+    copy_failed("fstat(src_fd = " + std::to_string(src_fd) + ")");
+  }
+  for (off_t done = 0; done < buf.st_size;) {
+    size_t want = std::min(buf.st_size - done, chunk_size);
+    ssize_t copied = copy_file_range(src_fd, nullptr, dst_fd, nullptr, want, 0);
+    if (copied < 0) {
+      if (done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP)) {
+        copy_read_write(src_fd, dst_fd);
+        return;
+      }
+      copy_failed("copy_file_range(src_fd = " + std::to_string(src_fd) +
+                  ", NULL, dst_fd = " + std::to_string(dst_fd) +
+                  ", size = " + std::to_string(want) + ", 0)");
+    }
+    // The file shrank while we were copying it
+    if (copied == 0) break;
+    done += copied;
+  }
+}
+
+#else
+static void copy(int src_fd, int dst_fd) { copy_read_write(src_fd, dst_fd); }
+#endif
+
+static UniqueFd open_for_copy(const char *path, int flags) {
+  auto fd = UniqueFd::try_open(path, flags, 0644);
+  if (!fd.valid()) copy_failed(std::string("open(") + path + ")");
+  return fd;
+}
+
+#ifdef FICLONE
+
+// Reflinks only work within one file system, and a client's workspace is
+// often on another one than the cache.
+static void copy_or_reflink(const char *src, const char *dst) {
+  auto src_fd = open_for_copy(src, O_RDONLY);
+  auto dst_fd = open_for_copy(dst, O_WRONLY | O_CREAT | O_TRUNC);
+
+  if (ioctl(dst_fd.get(), FICLONE, src_fd.get()) < 0) {
+    if (errno != EINVAL && errno != EOPNOTSUPP && errno != EXDEV) {
+      copy_failed(std::string("ioctl(") + dst + ", FICLONE, " + src + ")");
+    }
+    copy(src_fd.get(), dst_fd.get());
+  }
+}
+
+#else
+
+static void copy_or_reflink(const char *src, const char *dst) {
+  auto src_fd = open_for_copy(src, O_RDONLY);
+  auto dst_fd = open_for_copy(dst, O_WRONLY | O_CREAT | O_TRUNC);
+
+  copy(src_fd.get(), dst_fd.get());
+}
+
+#endif
+
+// Implements `bloom_subset(job_bloom, query_bloom)` for use in queries.
+// Anything we cannot compare (ie: NULL, or the integer filters written by
+// older versions) is treated as a possible match and left to the full
+// per-file check.
+static void bloom_subset(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+    sqlite3_result_int(context, 1);
+    return;
+  }
+  const void *subset = sqlite3_value_blob(argv[0]);
+  size_t subset_size = sqlite3_value_bytes(argv[0]);
+  const void *superset = sqlite3_value_blob(argv[1]);
+  size_t superset_size = sqlite3_value_bytes(argv[1]);
+  sqlite3_result_int(context,
+                     BloomFilter::is_subset(subset, subset_size, superset, superset_size));
+}
+
+// Several processes (and the daemon's worker threads) may write to the
+// same cache at once. sqlite only lets one of them write at a time, so
+// instead of failing with SQLITE_BUSY the others back off exponentially,
+// with jitter so that they don't all retry in lock step. Writers hold
+// the lock for one short transaction so the wait is rarely long; we only
+// give up once something has clearly gone wrong.
+static constexpr int busy_min_wait_us = 1000;
+static constexpr int busy_max_wait_us = 100000;
+static constexpr int busy_max_retries = 700;  // about a minute at the longest wait
+
+static int busy_backoff(void *, int retries) {
+  if (retries >= busy_max_retries) return 0;
+  int wait = busy_max_wait_us;
+  if (retries < 7) wait = std::min(busy_min_wait_us << retries, busy_max_wait_us);
+  // Sleep somewhere between half and all of the wait
+  usleep(wait / 2 + random() % (wait / 2 + 1));
+  return 1;
+}
+
+class Database {
+ private:
+  sqlite3 *db = nullptr;
+
+  // A local cache is written by the processes of one host, which the WAL
+  // serves well. The WAL index lives in shared memory that other hosts
+  // cannot see, though, so a shared tier on a network file system uses a
+  // rollback journal instead. With many hosts depending on it, the shared
+  // tier also waits for what it commits to reach the disk.
+  static const char *open_journal(bool shared) {
+    return shared ? "pragma journal_mode=delete; pragma synchronous=full;"
+                  : "pragma journal_mode=wal; pragma synchronous=0;";
+  }
+
+ public:
+  Database(const Database &) = delete;
+  Database(Database &&other) {
+    db = other.db;
+    other.db = nullptr;
+  }
+  Database() = delete;
+  ~Database() {
+    if (sqlite3_close(db) != SQLITE_OK) {
+      log_fatal("Could not close database: %s", sqlite3_errmsg(db));
+    }
+  }
+  // A `shared` database is a shared tier, see `open_journal`
+  Database(const std::string &cache_dir, bool shared) {
+    // We want to keep a sql file that has proper syntax highlighting
+    // around instead of embeding the schema. In order to acomplish this
+    // we use C++11 raw strings and the preprocessor. Unfortuently
+    // since starting a sql file with `R("` causes it to all highlight
+    // as a string we need to work around that. In sql `--` is a comment
+    // starter but in C++ its decrement. We take advantage of this by
+    // adding `--dummy, R("` to the start of the sql file which allows
+    // it to be valid and have no effect in both languages. Thus
+    // this dummy variable is needed at the import site. Additionally
+    // because the comma is lower precedence than the '=' operator we
+    // have to put parens around the include to get this trick to work.
+    // clang-format off
+    int dummy = 0;
+    const char* cache_schema = (
+        #include "schema.sql"
+    );
+    // clang-format on
+
+    // Make sure the cache directory exists
+    mkdir_no_fail(cache_dir.c_str());
+
+    std::string db_path = cache_dir + "/cache.db";
+    if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                        nullptr) != SQLITE_OK) {
+      log_fatal("error: %s", sqlite3_errmsg(db));
+    }
+
+    // Even setting up the schema can race with another writer
+    if (sqlite3_busy_handler(db, busy_backoff, nullptr) != SQLITE_OK) {
+      log_fatal("error: failed to set busy handler: %s", sqlite3_errmsg(db));
+    }
+
+    // If we happen to open the db as read only we need to fail.
+    // TODO: Why would this happen?
+    if (sqlite3_db_readonly(db, 0)) {
+      log_fatal("error: cache.db is read-only");
+    }
+
+    char *fail = nullptr;
+    if (sqlite3_exec(db, cache_schema, nullptr, nullptr, &fail) != SQLITE_OK) {
+      log_fatal("error: failed init stmt: %s: %s", fail, sqlite3_errmsg(db));
+    }
+
+    // Only after the schema: `auto_vacuum` is fixed once the file is written
+    if (sqlite3_exec(db, open_journal(shared), nullptr, nullptr, &fail) != SQLITE_OK) {
+      log_fatal("error: failed to set journal mode: %s: %s", fail, sqlite3_errmsg(db));
+    }
+
+    if (sqlite3_create_function(db, "bloom_subset", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                                nullptr, bloom_subset, nullptr, nullptr) != SQLITE_OK) {
+      log_fatal("error: failed to register bloom_subset: %s", sqlite3_errmsg(db));
+    }
+  }
+
+  sqlite3 *get() const { return db; }
+};
+
+class PreparedStatement {
+ private:
+  std::shared_ptr<Database> db = nullptr;
+  sqlite3_stmt *query_stmt = nullptr;
+  std::string why = "";
+
+ public:
+  PreparedStatement() = delete;
+  PreparedStatement(const PreparedStatement &) = delete;
+  PreparedStatement(PreparedStatement &&pstmt) {
+    db = pstmt.db;
+    query_stmt = pstmt.query_stmt;
+    pstmt.db = nullptr;
+    query_stmt = nullptr;
+  }
+  PreparedStatement &operator=(PreparedStatement &&pstmt) {
+    db = pstmt.db;
+    query_stmt = pstmt.query_stmt;
+    pstmt.db = nullptr;
+    query_stmt = nullptr;
+    return *this;
+  }
+
+  PreparedStatement(std::shared_ptr<Database> db, const std::string &sql_str) : db(db) {
+    if (sqlite3_prepare_v2(db->get(), sql_str.c_str(), sql_str.size(), &query_stmt, nullptr) !=
+        SQLITE_OK) {
+      log_fatal("error: failed to prepare statement: %s", sqlite3_errmsg(db->get()));
+    }
+  }
+
+  ~PreparedStatement() {
+    if (query_stmt) {
+      int ret = sqlite3_finalize(query_stmt);
+      if (ret != SQLITE_OK) {
+        log_fatal("sqlite3_finalize: %s", sqlite3_errmsg(db->get()));
+      }
+      query_stmt = nullptr;
+    }
+  }
+
+  void set_why(std::string why) { this->why = std::move(why); }
+
+  void bind_integer(int64_t index, int64_t value) {
+    int ret = sqlite3_bind_int64(query_stmt, index, value);
+    if (ret != SQLITE_OK) {
+      log_fatal("%s: sqlite3_bind_int64(%d, %d): %s", why.c_str(), index, value,
+                sqlite3_errmsg(db->get()));
+    }
+  }
+
+  void bind_string(int64_t index, const std::string &value) {
+    int ret = sqlite3_bind_text(query_stmt, index, value.c_str(), value.size(), SQLITE_TRANSIENT);
+    if (ret != SQLITE_OK) {
+      log_fatal("%s: sqlite3_bind_text(%d, %s): %s", why.c_str(), index, value.c_str(),
+                sqlite3_errmsg(sqlite3_db_handle(query_stmt)));
+    }
+  }
+
+  void bind_blob(int64_t index, const uint8_t *data, size_t size) {
+    int ret = sqlite3_bind_blob(query_stmt, index, data, size, SQLITE_TRANSIENT);
+    if (ret != SQLITE_OK) {
+      log_fatal("%s: sqlite3_bind_blob(%d): %s", why.c_str(), index,
+                sqlite3_errmsg(sqlite3_db_handle(query_stmt)));
+    }
+  }
+
+  // Hashes are stored as their raw 32 bytes
+  void bind_hash(int64_t index, const Hash256 &hash) {
+    bind_blob(index, reinterpret_cast<const uint8_t *>(hash.data), sizeof(hash.data));
+  }
+
+  int64_t read_integer(int64_t index) { return sqlite3_column_int64(query_stmt, index); }
+
+  std::string read_string(int64_t index) {
+    const char *str = reinterpret_cast<const char *>(sqlite3_column_text(query_stmt, index));
+    size_t size = sqlite3_column_bytes(query_stmt, index);
+    return std::string(str, size);
+  }
+
+  // Returns false for a malformed hash, which the caller treats like a
+  // row that is not there rather than comparing it to anything
+  bool read_hash(int64_t index, Hash256 &hash) {
+    const void *blob = sqlite3_column_blob(query_stmt, index);
+    int size = sqlite3_column_bytes(query_stmt, index);
+    if (!blob || size != sizeof(hash.data)) {
+      log_info("%s: hash column %lld holds %d bytes, not %zu", why.c_str(),
+               static_cast<long long>(index), size, sizeof(hash.data));
+      return false;
+    }
+    memcpy(hash.data, blob, sizeof(hash.data));
+    return true;
+  }
+
+  void reset() {
+    if (sqlite3_reset(query_stmt) != SQLITE_OK) {
+      log_fatal("error: %s; sqlite3_reset: %s", why.c_str(), sqlite3_errmsg(db->get()));
+    }
+
+    if (sqlite3_clear_bindings(query_stmt) != SQLITE_OK) {
+      log_fatal("error: %s; sqlite3_clear_bindings: %s", why.c_str(), sqlite3_errmsg(db->get()));
+    }
+  }
+
+  int step() {
+    int ret = sqlite3_step(query_stmt);
+    // The busy handler has already waited as long as it is willing to
+    if (ret == SQLITE_MISUSE || ret == SQLITE_ERROR || ret == SQLITE_BUSY || ret == SQLITE_LOCKED) {
+      log_fatal("error: %s; sqlite3_step: %s", why.c_str(), sqlite3_errmsg(db->get()));
+    }
+    return ret;
+  }
+};
+
+// Database and JSON classes
+
+// Every path is stored once and the other tables refer to it by id
+class PathTable {
+ private:
+  PreparedStatement add_path;
+  PreparedStatement find_path;
+
+ public:
+  static constexpr const char *insert_query = "insert or ignore into paths (path) values (?)";
+  static constexpr const char *find_query = "select path_id from paths where path = ?";
+
+  PathTable(std::shared_ptr<Database> db) : add_path(db, insert_query), find_path(db, find_query) {
+    add_path.set_why("Could not insert path");
+    find_path.set_why("Could not find path");
+  }
+
+  // NOTE: It is assumed that this is already running inside of a transaction
+  int64_t intern(const std::string &path) {
+    add_path.bind_string(1, path);
+    add_path.step();
+    add_path.reset();
+    find_path.bind_string(1, path);
+    find_path.step();
+    int64_t path_id = find_path.read_integer(0);
+    find_path.reset();
+    return path_id;
+  }
+};
+
+class InputFiles {
+ private:
+  PreparedStatement add_input_file;
+
+ public:
+  static constexpr const char *insert_query =
+      "insert into input_files (path, hash, job) values (?, ?, ?)";
+
+  InputFiles(std::shared_ptr<Database> db) : add_input_file(db, insert_query) {
+    add_input_file.set_why("Could not insert input file");
+  }
+
+  void insert(int64_t path_id, const Hash256 &hash, int64_t job_id) {
+    add_input_file.bind_integer(1, path_id);
+    add_input_file.bind_hash(2, hash);
+    add_input_file.bind_integer(3, job_id);
+    add_input_file.step();
+    add_input_file.reset();
+  }
+};
+
+class InputDirs {
+ private:
+  PreparedStatement add_input_dir;
+
+ public:
+  static constexpr const char *insert_query =
+      "insert into input_dirs (path, hash, job) values (?, ?, ?)";
+
+  InputDirs(std::shared_ptr<Database> db) : add_input_dir(db, insert_query) {
+    add_input_dir.set_why("Could not insert input directory");
+  }
+
+  void insert(int64_t path_id, const Hash256 &hash, int64_t job_id) {
+    add_input_dir.bind_integer(1, path_id);
+    add_input_dir.bind_hash(2, hash);
+    add_input_dir.bind_integer(3, job_id);
+    add_input_dir.step();
+    add_input_dir.reset();
+  }
+};
+
+class OutputFiles {
+ private:
+  PreparedStatement add_output_file;
+  PreparedStatement find_hash;
+
+ public:
+  static constexpr const char *insert_query =
+      "insert into output_files (path, hash, job) values (?, ?, ?)";
+
+  // Blobs are shared by every output file with the same hash, so these
+  // rows are the reference count of a blob. Thanks to the find_file
+  // index we only need to know if there is at least one.
+  static constexpr const char *find_hash_query =
+      "select 1 from output_files where hash = ? limit 1";
+
+  OutputFiles(std::shared_ptr<Database> db)
+      : add_output_file(db, insert_query), find_hash(db, find_hash_query) {
+    add_output_file.set_why("Could not insert output file");
+    find_hash.set_why("Could not look up an output file by hash");
+  }
+
+  // Returns true if some job still has an output with this hash, in
+  // which case its blob must stay in the store.
+  bool is_referenced(Hash256 hash) {
+    find_hash.bind_hash(1, hash);
+    bool referenced = find_hash.step() == SQLITE_ROW;
+    find_hash.reset();
+    return referenced;
+  }
+
+  void insert(int64_t path_id, const Hash256 &hash, int64_t job_id) {
+    add_output_file.bind_integer(1, path_id);
+    add_output_file.bind_hash(2, hash);
+    add_output_file.bind_integer(3, job_id);
+    add_output_file.step();
+    add_output_file.reset();
+  }
+};
+
+class JobTable {
+ private:
+  std::shared_ptr<Database> db;
+  PreparedStatement add_job;
+  PreparedStatement use_job;
+
+ public:
+  static constexpr const char *insert_query =
+      "insert into jobs (directory, commandline, environment, stdin, bloom_filter, last_use, size)"
+      "values (?, ?, ?, ?, ?, ?, ?)";
+
+  static constexpr const char *use_query = "update jobs set last_use = ? where job_id = ?";
+
+  JobTable(std::shared_ptr<Database> db)
+      : db(db), add_job(db, insert_query), use_job(db, use_query) {
+    add_job.set_why("Could not insert job");
+    use_job.set_why("Could not update the last use of a job");
+  }
+
+  int64_t insert(const std::string &cwd, const std::string &cmd, const std::string &env,
+                 const std::string &stdin_str, const BloomFilter &bloom, int64_t last_use,
+                 int64_t size) {
+    add_job.bind_string(1, cwd);
+    add_job.bind_string(2, cmd);
+    add_job.bind_string(3, env);
+    add_job.bind_string(4, stdin_str);
+    add_job.bind_blob(5, bloom.data(), bloom.size());
+    add_job.bind_integer(6, last_use);
+    add_job.bind_integer(7, size);
+    add_job.step();
+    int64_t job_id = sqlite3_last_insert_rowid(db->get());
+    add_job.reset();
+    return job_id;
+  }
+
+  void mark_used(int64_t job_id, int64_t last_use) {
+    use_job.bind_integer(1, last_use);
+    use_job.bind_integer(2, job_id);
+    use_job.step();
+    use_job.reset();
+  }
+};
+
+struct CacheSizeInfo {
+  int64_t bytes;
+  int64_t low_watermark;
+  int64_t high_watermark;
+};
+
+class CacheSize {
+ private:
+  PreparedStatement get_size;
+  PreparedStatement add_size;
+  PreparedStatement set_limits;
+
+ public:
+  static constexpr const char *get_query =
+      "select bytes, low_watermark, high_watermark from cache_size where id = 0";
+  static constexpr const char *add_query = "update cache_size set bytes = bytes + ? where id = 0";
+  static constexpr const char *set_limits_query =
+      "update cache_size set low_watermark = ?, high_watermark = ? where id = 0";
+
+  CacheSize(std::shared_ptr<Database> db)
+      : get_size(db, get_query), add_size(db, add_query), set_limits(db, set_limits_query) {
+    get_size.set_why("Could not read the cache size");
+    add_size.set_why("Could not update the cache size");
+    set_limits.set_why("Could not set the cache size limits");
+  }
+
+  CacheSizeInfo get() {
+    CacheSizeInfo info = {0, 0, 0};
+    if (get_size.step() == SQLITE_ROW) {
+      info.bytes = get_size.read_integer(0);
+      info.low_watermark = get_size.read_integer(1);
+      info.high_watermark = get_size.read_integer(2);
+    }
+    get_size.reset();
+    return info;
+  }
+
+  // `bytes` is negative when blobs are removed
+  void add(int64_t bytes) {
+    add_size.bind_integer(1, bytes);
+    add_size.step();
+    add_size.reset();
+  }
+
+  void set_watermarks(int64_t low, int64_t high) {
+    set_limits.bind_integer(1, low);
+    set_limits.bind_integer(2, high);
+    set_limits.step();
+    set_limits.reset();
+  }
+};
+
+// The cache uses `auto_vacuum=incremental` so pages freed by deleting
+// jobs stay in the database file until they are explicitly released.
+class IncrementalVacuum {
+ private:
+  PreparedStatement vacuum;
+  PreparedStatement freelist;
+
+  int64_t free_pages() {
+    freelist.step();
+    int64_t pages = freelist.read_integer(0);
+    freelist.reset();
+    return pages;
+  }
+
+ public:
+  static constexpr const char *vacuum_query = "pragma incremental_vacuum(256)";
+  static constexpr const char *freelist_query = "pragma freelist_count";
+
+  IncrementalVacuum(std::shared_ptr<Database> db)
+      : vacuum(db, vacuum_query), freelist(db, freelist_query) {
+    vacuum.set_why("Could not vacuum the database");
+    freelist.set_why("Could not count the free pages of the database");
+  }
+
+  // Releases some free pages and returns how many remain. A database
+  // without auto_vacuum releases none, and then 0 is returned so that
+  // callers do not wait for it forever.
+  int64_t run() {
+    int64_t before = free_pages();
+    while (vacuum.step() == SQLITE_ROW) {
+    }
+    vacuum.reset();
+    int64_t after = free_pages();
+    return after < before ? after : 0;
+  }
+};
+
+// Removes jobs, oldest first. Deleting a job cascades to all of its rows
+// but its blobs are left for the caller since they may be shared.
+class LeastRecentlyUsed {
+ private:
+  PreparedStatement find_oldest;
+  PreparedStatement find_outputs;
+  PreparedStatement remove_job;
+
+ public:
+  static constexpr const char *find_oldest_query =
+      "select job_id from jobs order by last_use, job_id limit 1";
+  static constexpr const char *find_outputs_query = "select hash from output_files where job = ?";
+  static constexpr const char *remove_query = "delete from jobs where job_id = ?";
+
+  LeastRecentlyUsed(std::shared_ptr<Database> db)
+      : find_oldest(db, find_oldest_query),
+        find_outputs(db, find_outputs_query),
+        remove_job(db, remove_query) {
+    find_oldest.set_why("Could not find the least recently used job");
+    find_outputs.set_why("Could not find the outputs of an evicted job");
+    remove_job.set_why("Could not evict a job");
+  }
+
+  // NOTE: It is assumed that this is already running inside of a transaction
+  // Removes the least recently used job and adds the hashes of its outputs
+  // to `hashes`. Returns false if there are no jobs left.
+  bool evict_oldest(std::vector<Hash256> &hashes) {
+    bool found = find_oldest.step() == SQLITE_ROW;
+    int64_t job_id = found ? find_oldest.read_integer(0) : 0;
+    find_oldest.reset();
+    if (!found) return false;
+
+    find_outputs.bind_integer(1, job_id);
+    // A blob whose hash cannot be read cannot be named to unlink it either
+    Hash256 hash;
+    while (find_outputs.step() == SQLITE_ROW) {
+      if (find_outputs.read_hash(0, hash)) hashes.push_back(hash);
+    }
+    find_outputs.reset();
+
+    remove_job.bind_integer(1, job_id);
+    remove_job.step();
+    remove_job.reset();
+    return true;
+  }
+};
+
+// Counts that have not been added to tier_stats yet
+struct TierCounts {
+  int64_t hits = 0;
+  int64_t misses = 0;
+  int64_t promotes = 0;
+
+  bool empty() const { return hits == 0 && misses == 0 && promotes == 0; }
+};
+
+class TierStats {
+ private:
+  PreparedStatement add_counts;
+  PreparedStatement read_counts;
+
+ public:
+  static constexpr const char *add_query =
+      "update tier_stats set hits = hits + ?, misses = misses + ?, promotes = promotes + ?"
+      "  where tier = ?";
+  static constexpr const char *read_query =
+      "select tier, hits, misses, promotes from tier_stats order by tier";
+
+  TierStats(std::shared_ptr<Database> db)
+      : add_counts(db, add_query), read_counts(db, read_query) {
+    add_counts.set_why("Could not update the tier stats");
+    read_counts.set_why("Could not read the tier stats");
+  }
+
+  // NOTE: It is assumed that this is already running inside of a transaction
+  void add(const std::string &tier, const TierCounts &counts) {
+    add_counts.bind_integer(1, counts.hits);
+    add_counts.bind_integer(2, counts.misses);
+    add_counts.bind_integer(3, counts.promotes);
+    add_counts.bind_string(4, tier);
+    add_counts.step();
+    add_counts.reset();
+  }
+
+  JAST read() {
+    JAST json(JSON_OBJECT);
+    while (read_counts.step() == SQLITE_ROW) {
+      auto &tier = json.add(read_counts.read_string(0), JSON_OBJECT);
+      tier.add("hits", static_cast<long long>(read_counts.read_integer(1)));
+      tier.add("misses", static_cast<long long>(read_counts.read_integer(2)));
+      tier.add("promotes", static_cast<long long>(read_counts.read_integer(3)));
+    }
+    read_counts.reset();
+    return json;
+  }
+};
+
+class SharedTier {
+ private:
+  PreparedStatement get_dir;
+  PreparedStatement set_dir;
+  PreparedStatement clear_dir;
+
+ public:
+  static constexpr const char *get_query = "select dir from shared_tier where id = 0";
+  static constexpr const char *set_query =
+      "insert or replace into shared_tier (id, dir) values (0, ?)";
+  static constexpr const char *clear_query = "delete from shared_tier";
+
+  SharedTier(std::shared_ptr<Database> db)
+      : get_dir(db, get_query), set_dir(db, set_query), clear_dir(db, clear_query) {
+    get_dir.set_why("Could not read the shared tier");
+    set_dir.set_why("Could not set the shared tier");
+    clear_dir.set_why("Could not remove the shared tier");
+  }
+
+  // Returns the empty string if there is no shared tier
+  std::string get() {
+    std::string dir;
+    if (get_dir.step() == SQLITE_ROW) dir = get_dir.read_string(0);
+    get_dir.reset();
+    return dir;
+  }
+
+  void set(const std::string &dir) {
+    if (dir.empty()) {
+      clear_dir.step();
+      clear_dir.reset();
+    } else {
+      set_dir.bind_string(1, dir);
+      set_dir.step();
+      set_dir.reset();
+    }
+  }
+};
+
+// Returns the end of the parent directory in the path.
+wcl::optional<std::pair<std::string, std::string>> parent_and_base(const std::string &str) {
+  // traverse backwards but using a normal iterator instead of a reverse
+  // iterator.
+  auto rbegin = str.end() - 1;
+  auto rend = str.begin();
+  for (; rbegin >= rend; --rbegin) {
+    if (*rbegin == '/') {
+      // Advance to the character past the slash
+      rbegin++;
+      // Now return the two strings
+      return {wcl::in_place_t{}, std::string(rend, rbegin), std::string(rbegin, str.end())};
+    }
+  }
+
+  return {};
+}
+
+// Hashes in requests are written as 64 hex digits
+static Hash256 request_hash(const JAST &file_json) {
+  const std::string &hex = file_json.get("hash").value;
+  bool valid = hex.size() == 64;
+  for (char c : hex) valid = valid && isxdigit(static_cast<unsigned char>(c));
+  if (!valid) throw RequestError("malformed hash '" + hex + "'");
+  return Hash256::from_hex(hex);
+}
+
+FindJobRequest::FindJobRequest(const JAST &find_job_json) {
+  cwd = find_job_json.get("cwd").value;
+  command_line = find_job_json.get("command_line").value;
+  envrionment = find_job_json.get("envrionment").value;
+  stdin_str = find_job_json.get("stdin").value;
+
+  // Read the input files, and compute the directory hashes as we go.
+  std::vector<const std::string *> paths;
+  visible.reserve(find_job_json.get("input_files").children.size());
+  for (const auto &input_file : find_job_json.get("input_files").children) {
+    std::string path = input_file.second.get("path").value;
+    Hash256 hash = request_hash(input_file.second);
+    bloom.add_hash(hash);
+    auto it = visible.emplace(std::move(path), hash);
+    if (it.second) paths.push_back(&it.first->first);
+  }
+
+  // Now accumulate the hashables in the directory. Sorting the paths
+  // gives us repeatable hashes on directories.
+  std::sort(paths.begin(), paths.end(),
+            [](const std::string *a, const std::string *b) { return *a < *b; });
+  std::unordered_map<std::string, std::string> dirs;
+  for (const std::string *path : paths) {
+    auto pair = parent_and_base(*path);
+    if (!pair) continue;
+    std::string parent = std::move(pair->first);
+    std::string base = std::move(pair->second);
+    dirs[parent] += base;
+    dirs[parent] += ":";
+  }
+
+  // Now actully perform those hashes. Jobs add their input directory
+  // hashes to their bloom filter so we must add ours as well.
+  for (auto dir : dirs) {
+    Hash256 hash = Hash256::blake2b(dir.second);
+    bloom.add_hash(hash);
+    dir_hashes[dir.first] = hash;
+  }
+
+  // When outputting files we need to map sandbox dirs to output dirs.
+  // Collect those redirects here.
+  for (const auto &dir_redirect : find_job_json.get("dir_redirects").children) {
+    auto dir_range = wcl::make_filepath_range(dir_redirect.first);
+    dir_redirects.move_emplace(dir_range.begin(), dir_range.end(), dir_redirect.second.value);
+  }
+}
+
+// Write transactions take the write lock up front. A deferred transaction
+// that reads first and then writes can be refused the lock part way
+// through when another process got there first, and then the only way
+// out is to roll back and start over. Taking it immediately means the
+// busy handler does all of the waiting before any work is done.
+//
+// Read transactions are deferred. In a local cache the WAL gives them a
+// snapshot of the database and they neither wait for nor hold up writers.
+// A shared tier has a rollback journal, so there a writer's commit waits
+// for the readers to finish, and the busy handler covers that wait too.
+class Transaction {
+ private:
+  PreparedStatement begin_txn_query;
+  PreparedStatement begin_read_txn_query;
+  PreparedStatement commit_txn_query;
+
+ public:
+  static constexpr const char *sql_begin_txn = "begin immediate transaction";
+  static constexpr const char *sql_begin_read_txn = "begin transaction";
+  static constexpr const char *sql_commit_txn = "commit transaction";
+
+  Transaction(std::shared_ptr<Database> db)
+      : begin_txn_query(db, sql_begin_txn),
+        begin_read_txn_query(db, sql_begin_read_txn),
+        commit_txn_query(db, sql_commit_txn) {
+    begin_txn_query.set_why("Could not begin a transaction");
+    begin_read_txn_query.set_why("Could not begin a read transaction");
+    commit_txn_query.set_why("Could not commit a transaction");
+  }
+
+  template <class F>
+  void run(F f) {
+    begin_txn_query.step();
+    begin_txn_query.reset();
+    f();
+    commit_txn_query.step();
+    commit_txn_query.reset();
+  }
+
+  // `f` must not write to the database
+  template <class F>
+  void run_read(F f) {
+    begin_read_txn_query.step();
+    begin_read_txn_query.reset();
+    f();
+    commit_txn_query.step();
+    commit_txn_query.reset();
+  }
+};
+
+class SelectMatchingJobs {
+ private:
+  PreparedStatement find_jobs;
+  PreparedStatement find_inputs;
+  PreparedStatement find_outputs;
+  PreparedStatement find_job;
+
+  // Every input file of the job has to be visible with the same hash,
+  // and every input directory has to hash the same as what is visible.
+  bool all_match(int64_t job_id, const FindJobRequest &find_job_request) {
+    find_inputs.bind_integer(1, job_id);
+    bool match = true;
+    while (match && find_inputs.step() == SQLITE_ROW) {
+      const auto &hashes =
+          find_inputs.read_integer(0) ? find_job_request.dir_hashes : find_job_request.visible;
+      auto iter = hashes.find(find_inputs.read_string(1));
+      Hash256 hash;
+      match = iter != hashes.end() && find_inputs.read_hash(2, hash) && hash == iter->second;
+    }
+    find_inputs.reset();
+    return match;
+  }
+
+  // Returns false if one of the outputs cannot be read back
+  bool read_outputs(int64_t job_id, std::vector<CachedOutputFile> &out) {
+    find_outputs.bind_integer(1, job_id);
+    bool ok = true;
+    while (ok && find_outputs.step() == SQLITE_ROW) {
+      CachedOutputFile file;
+      file.path = find_outputs.read_string(0);
+      ok = find_outputs.read_hash(1, file.hash);
+      out.emplace_back(std::move(file));
+    }
+    find_outputs.reset();
+    return ok;
+  }
+
+ public:
+  // First we manually read everything in and we do additional
+  // processing on match.
+  static constexpr const char *sql_find_jobs =
+      "select job_id, last_use from jobs"
+      "  where directory = ?"
+      "  and   commandline = ?"
+      "  and   environment = ?"
+      "  and   stdin = ?"
+      "  and   bloom_subset(bloom_filter, ?)";
+
+  // When we find a match we check all of its input files and input
+  // directories at once. The first column tells them apart.
+  static constexpr const char *sql_find_inputs =
+      "select 0, p.path, f.hash from input_files f join paths p on p.path_id = f.path"
+      "  where f.job = ?1"
+      "  union all "
+      "select 1, p.path, d.hash from input_dirs d join paths p on p.path_id = d.path"
+      "  where d.job = ?1";
+
+  // Lastly if we find a job we need to read all of its output files
+  static constexpr const char *sql_output_files =
+      "select p.path, o.hash from output_files o join paths p on p.path_id = o.path"
+      "  where o.job = ?";
+
+  // Copying a job to another tier needs the rest of it
+  static constexpr const char *sql_find_job =
+      "select directory, commandline, environment, stdin from jobs where job_id = ?";
+
+  SelectMatchingJobs(std::shared_ptr<Database> db)
+      : find_jobs(db, sql_find_jobs),
+        find_inputs(db, sql_find_inputs),
+        find_outputs(db, sql_output_files),
+        find_job(db, sql_find_job) {
+    find_jobs.set_why("Could not find matching jobs");
+    find_inputs.set_why("Could not find the inputs of the given job");
+    find_outputs.set_why("Could not find the outputs of the given job");
+    find_job.set_why("Could not find the given job");
+  }
+
+  // Reads back everything that was added for the job except for the
+  // sources of its outputs. Returns false if the job no longer exists
+  // or one of its hashes is malformed.
+  // NOTE: It is assumed that this is already running inside of a transaction
+  bool describe(int64_t job_id, AddJobRequest &out) {
+    find_job.bind_integer(1, job_id);
+    bool found = find_job.step() == SQLITE_ROW;
+    if (found) {
+      out.cwd = find_job.read_string(0);
+      out.command_line = find_job.read_string(1);
+      out.envrionment = find_job.read_string(2);
+      out.stdin_str = find_job.read_string(3);
+    }
+    find_job.reset();
+    if (!found) return false;
+
+    find_inputs.bind_integer(1, job_id);
+    bool ok = true;
+    Hash256 hash;
+    while (find_inputs.step() == SQLITE_ROW) {
+      ok = find_inputs.read_hash(2, hash);
+      if (!ok) break;
+      out.bloom.add_hash(hash);
+      if (find_inputs.read_integer(0)) {
+        out.directories.push_back(InputDir{find_inputs.read_string(1), hash});
+      } else {
+        out.inputs.push_back(InputFile{find_inputs.read_string(1), hash});
+      }
+    }
+    find_inputs.reset();
+
+    std::vector<CachedOutputFile> outputs;
+    if (!ok || !read_outputs(job_id, outputs)) return false;
+    for (auto &output : outputs) {
+      out.outputs.push_back(OutputFile{std::string(), std::move(output.path), output.hash});
+    }
+    return true;
+  }
+
+  // NOTE: It is assumed that this is already running inside of a transaction
+  wcl::optional<MatchingJob> find(const FindJobRequest &find_job_request, int64_t &last_use) {
+    wcl::optional<MatchingJob> out;
+
+    // These parts must match exactly
+    find_jobs.bind_string(1, find_job_request.cwd);
+    find_jobs.bind_string(2, find_job_request.command_line);
+    find_jobs.bind_string(3, find_job_request.envrionment);
+    find_jobs.bind_string(4, find_job_request.stdin_str);
+
+    // The bloom filter of a matching job has to be a subset of this one
+    find_jobs.bind_blob(5, find_job_request.bloom.data(), find_job_request.bloom.size());
+
+    // Loop over all matching jobs
+    while (find_jobs.step() == SQLITE_ROW) {
+      // Having found a matching job we need to check all the files
+      // and directories have matching hashes.
+      int64_t job_id = find_jobs.read_integer(0);
+      if (!all_match(job_id, find_job_request)) continue;
+
+      // Ok this is the job, it matches *exactly* so we should
+      // expect running it to produce exaxtly the same result.
+      MatchingJob result;
+      result.job_id = job_id;
+      if (!read_outputs(job_id, result.output_files)) continue;
+      last_use = find_jobs.read_integer(1);
+      out = {wcl::in_place_t{}, std::move(result)};
+      break;
+    }
+
+    // Reset find jobs for the next such transaction
+    find_jobs.reset();
+
+    // Hopefully we found something
+    return out;
+  }
+};
+
+AddJobRequest::AddJobRequest(const JAST &job_result_json) {
+  cwd = job_result_json.get("cwd").value;
+  command_line = job_result_json.get("command_line").value;
+  envrionment = job_result_json.get("envrionment").value;
+  stdin_str = job_result_json.get("stdin").value;
+
+  // Read the input files
+  for (const auto &input_file : job_result_json.get("input_files").children) {
+    InputFile input;
+    input.path = input_file.second.get("path").value;
+    input.hash = request_hash(input_file.second);
+    bloom.add_hash(input.hash);
+    inputs.emplace_back(std::move(input));
+  }
+
+  // Read the input dirs
+  for (const auto &input_dir : job_result_json.get("input_dirs").children) {
+    InputDir input;
+    input.path = input_dir.second.get("path").value;
+    input.hash = request_hash(input_dir.second);
+    bloom.add_hash(input.hash);
+    directories.emplace_back(std::move(input));
+  }
+
+  // Read the output files
+  for (const auto &output_file : job_result_json.get("output_files").children) {
+    OutputFile output;
+    output.source = output_file.second.get("src").value;
+    output.path = output_file.second.get("path").value;
+    output.hash = request_hash(output_file.second);
+    outputs.emplace_back(std::move(output));
+  }
+}
+
+// join takes a sequence of strings and concats that
+// sequence with some seperator between it. It's like
+// python's join method on strings. So ", ".join(seq)
+// in python joins a list of strings with a comma. This
+// function is a C++ equivlent.
+template <class Iter>
+static std::string join(char sep, Iter begin, Iter end) {
+  std::string out;
+  for (; begin != end; ++begin) {
+    out += *begin;
+    if (begin + 1 != end) out += sep;
+  }
+  return out;
+}
+
+static std::vector<std::string> split_path(const std::string &path) {
+  std::vector<std::string> path_vec;
+  for (std::string node : wcl::make_filepath_range_ref(path)) {
+    path_vec.emplace_back(std::move(node));
+  }
+
+  return path_vec;
+}
+
+// Creates every missing parent directory of the given files. Many files
+// share directories so each directory is only created once, parents
+// first. Returns the number of directories visited.
+static size_t mkdir_parents(const std::vector<std::string> &files) {
+  std::unordered_set<std::string> parents;
+  for (const auto &file : files) {
+    size_t slash = file.rfind('/');
+    if (slash != std::string::npos && slash != 0) parents.emplace(file, 0, slash);
+  }
+
+  // Sorting puts every directory before its children
+  std::set<std::string> dirs;
+  for (const auto &parent : parents) {
+    for (size_t slash = parent.find('/', 1); slash != std::string::npos;
+         slash = parent.find('/', slash + 1)) {
+      dirs.emplace(parent, 0, slash);
+    }
+    dirs.insert(parent);
+  }
+
+  for (const auto &dir : dirs) {
+    if (mkdir(dir.c_str(), 0777) < 0 && errno != EEXIST) {
+      throw RequestError("mkdir(" + dir + "): " + strerror(errno));
+    }
+  }
+  return dirs.size();
+}
+
+// The number of threads used to materialize outputs, and the least
+// number of files worth handing to each of them.
+static constexpr size_t max_copy_threads = 16;
+static constexpr size_t files_per_copy_thread = 8;
+
+// Calls `f(i)` for every `i` below `count`, sharing the work between a
+// few threads when there is enough of it. Returns the number of threads.
+// If `f` throws, the remaining calls are skipped and the first exception
+// is rethrown once every thread is done.
+template <class F>
+static size_t parallel_for(size_t count, F f) {
+  size_t threads = std::min<size_t>(std::max<size_t>(std::thread::hardware_concurrency(), 1),
+                                    max_copy_threads);
+  threads = std::min(threads, (count + files_per_copy_thread - 1) / files_per_copy_thread);
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; ++i) f(i);
+    return 1;
+  }
+
+  std::atomic<size_t> next(0);
+  std::mutex failure_mutex;
+  std::exception_ptr failure;
+  auto worker = [&]() {
+    try {
+      for (size_t i = next++; i < count; i = next++) f(i);
+    } catch (...) {
+      next = count;
+      std::lock_guard<std::mutex> lock(failure_mutex);
+      if (!failure) failure = std::current_exception();
+    }
+  };
+  std::vector<std::thread> pool;
+  for (size_t t = 1; t < threads; ++t) pool.emplace_back(worker);
+  worker();
+  for (auto &thread : pool) thread.join();
+  if (failure) std::rethrow_exception(failure);
+  return threads;
+}
+
+static double seconds_between(std::chrono::steady_clock::time_point begin,
+                              std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration<double>(end - begin).count();
+}
+
+// Every output blob lives at `<cache>/blobs/<first byte>/<hash>` no matter
+// how many jobs produced it.
+static std::string blob_dir(const std::string &cache_dir, const std::string &hash_hex) {
+  return cache_dir + "/blobs/" + hash_hex.substr(0, 2);
+}
+
+static std::string blob_path(const std::string &cache_dir, const Hash256 &hash) {
+  std::string hash_hex = hash.to_hex();
+  return blob_dir(cache_dir, hash_hex) + "/" + hash_hex;
+}
+
+// Runs one or more statements that take no parameters
+static void exec_no_fail(std::shared_ptr<Database> db, const char *sql, const char *why) {
+  char *fail = nullptr;
+  if (sqlite3_exec(db->get(), sql, nullptr, nullptr, &fail) != SQLITE_OK) {
+    log_fatal("error: %s: %s", why, fail);
+  }
+}
+
+// `pragma user_version` records which of the migrations below have
+// already been applied to a cache.
+static int64_t read_cache_version(std::shared_ptr<Database> db) {
+  PreparedStatement get_version(db, "pragma user_version");
+  get_version.set_why("Could not read the cache version");
+  get_version.step();
+  int64_t version = get_version.read_integer(0);
+  get_version.reset();
+  return version;
+}
+
+static void write_cache_version(std::shared_ptr<Database> db, int64_t version) {
+  PreparedStatement set_version(db, "pragma user_version = " + std::to_string(version));
+  set_version.set_why("Could not set the cache version");
+  set_version.step();
+}
+
+// Caches written before bloom filters were stored as blobs hold a 32-bit
+// filter in an integer. Those never rule anything out, so rebuild them all
+// from the recorded input hashes.
+static void migrate_bloom_filters(std::shared_ptr<Database> db) {
+  PreparedStatement find_jobs(db, "select job_id from jobs");
+  PreparedStatement find_hashes(db,
+                                "select hash from input_files where job = ?1"
+                                "  union all "
+                                "select hash from input_dirs where job = ?1");
+  PreparedStatement update_bloom(db, "update jobs set bloom_filter = ? where job_id = ?");
+  find_jobs.set_why("Could not list jobs to migrate");
+  find_hashes.set_why("Could not read the input hashes of a job");
+  update_bloom.set_why("Could not update the bloom filter of a job");
+
+  std::vector<int64_t> job_ids;
+  while (find_jobs.step() == SQLITE_ROW) {
+    job_ids.push_back(find_jobs.read_integer(0));
+  }
+  find_jobs.reset();
+
+  for (int64_t job_id : job_ids) {
+    BloomFilter bloom;
+    find_hashes.bind_integer(1, job_id);
+    while (find_hashes.step() == SQLITE_ROW) {
+      bloom.add_hash(Hash256::from_hex(find_hashes.read_string(0)));
+    }
+    find_hashes.reset();
+
+    update_bloom.bind_blob(1, bloom.data(), bloom.size());
+    update_bloom.bind_integer(2, job_id);
+    update_bloom.step();
+    update_bloom.reset();
+  }
+
+  write_cache_version(db, 1);
+}
+
+// Caches written before the blob store kept a private copy of each output
+// in `<cache>/<job_id & 0xFF>/<job_id>/<hash>`. Move one copy of each into
+// the blob store and delete the rest. Every step can be safely repeated
+// so an interrupted migration is simply run again.
+static void migrate_blob_store(std::shared_ptr<Database> db, const std::string &cache_dir) {
+  PreparedStatement find_outputs(db, "select job, hash from output_files");
+  find_outputs.set_why("Could not list output files to migrate");
+
+  while (find_outputs.step() == SQLITE_ROW) {
+    int64_t job_id = find_outputs.read_integer(0);
+    Hash256 hash = Hash256::from_hex(find_outputs.read_string(1));
+    std::string blob = blob_path(cache_dir, hash);
+    if (access(blob.c_str(), F_OK) == 0) continue;
+
+    uint8_t job_group = job_id & 0xFF;
+    std::string job_file = cache_dir + "/" + wcl::to_hex<uint8_t>(&job_group) + "/" +
+                           std::to_string(job_id) + "/" + hash.to_hex();
+    mkdir_no_fail(blob_dir(cache_dir, hash.to_hex()).c_str());
+    if (rename(job_file.c_str(), blob.c_str()) < 0 && errno != ENOENT) {
+      log_fatal("rename(%s, %s): %s", job_file.c_str(), blob.c_str(), strerror(errno));
+    }
+  }
+  find_outputs.reset();
+
+  for (int group = 0; group < 256; ++group) {
+    uint8_t job_group = group;
+    std::string job_group_dir = cache_dir + "/" + wcl::to_hex<uint8_t>(&job_group);
+    int ret = deep_unlink(AT_FDCWD, job_group_dir.c_str());
+    if (ret < 0 && ret != -ENOENT) {
+      log_fatal("deep_unlink(%s): %s", job_group_dir.c_str(), strerror(-ret));
+    }
+  }
+
+  write_cache_version(db, 2);
+}
+
+// Sizes the outputs a client asks us to add, which may well not exist
+static int64_t file_size(const std::string &path) {
+  struct stat buf;
+  if (stat(path.c_str(), &buf) < 0) {
+    throw RequestError("stat(" + path + "): " + strerror(errno));
+  }
+  return buf.st_size;
+}
+
+// Caches written before eviction existed have no `last_use` or `size` on
+// their jobs and no record of the size of the blob store. Existing jobs
+// are treated as the least recently used.
+static void migrate_size_tracking(std::shared_ptr<Database> db, const std::string &cache_dir) {
+  PreparedStatement has_last_use(
+      db, "select count(*) from pragma_table_info('jobs') where name = 'last_use'");
+  has_last_use.set_why("Could not inspect the jobs table");
+  has_last_use.step();
+  bool add_columns = has_last_use.read_integer(0) == 0;
+  has_last_use.reset();
+
+  const char *add_columns_sql =
+      "alter table jobs add column last_use integer not null default 0;"
+      "alter table jobs add column size integer not null default 0;";
+  if (add_columns) exec_no_fail(db, add_columns_sql, "failed to add eviction columns");
+  const char *index_sql = "create index if not exists job_last_use on jobs(last_use);";
+  exec_no_fail(db, index_sql, "failed to index jobs by last use");
+
+  PreparedStatement find_outputs(db, "select job, hash from output_files order by job");
+  PreparedStatement set_job_size(db, "update jobs set size = ? where job_id = ?");
+  PreparedStatement set_cache_size(db, "update cache_size set bytes = ? where id = 0");
+  find_outputs.set_why("Could not list output files to size");
+  set_job_size.set_why("Could not set the size of a job");
+  set_cache_size.set_why("Could not set the size of the cache");
+
+  // Blobs that have gone missing count as empty; reads of their jobs
+  // already fail and they will eventually be evicted.
+  std::map<int64_t, int64_t> job_sizes;
+  std::map<std::string, int64_t> blob_sizes;
+  while (find_outputs.step() == SQLITE_ROW) {
+    int64_t job_id = find_outputs.read_integer(0);
+    Hash256 hash = Hash256::from_hex(find_outputs.read_string(1));
+    std::string blob = blob_path(cache_dir, hash);
+    struct stat buf;
+    int64_t size = stat(blob.c_str(), &buf) == 0 ? buf.st_size : 0;
+    job_sizes[job_id] += size;
+    blob_sizes[hash.to_hex()] = size;
+  }
+  find_outputs.reset();
+
+  for (const auto &job : job_sizes) {
+    set_job_size.bind_integer(1, job.second);
+    set_job_size.bind_integer(2, job.first);
+    set_job_size.step();
+    set_job_size.reset();
+  }
+
+  int64_t bytes = 0;
+  for (const auto &blob : blob_sizes) bytes += blob.second;
+  set_cache_size.bind_integer(1, bytes);
+  set_cache_size.step();
+
+  write_cache_version(db, 3);
+}
+
+// Caches written before paths were interned store paths and hex hashes as
+// text in input_files, input_dirs, and output_files. Rebuild those tables
+// in their current form, keeping the ids of all rows.
+static void migrate_binary_hashes(std::shared_ptr<Database> db) {
+  // The tables as of cache version 4
+  const char *create_tables_sql =
+      "create table input_files("
+      "  input_file_id integer primary key autoincrement,"
+      "  path          integer not null references paths(path_id),"
+      "  hash          blob    not null,"
+      "  job           job_id  not null references jobs(job_id) on delete cascade);"
+      "create table output_files("
+      "  output_file_id integer primary key autoincrement,"
+      "  path           integer not null references paths(path_id),"
+      "  hash           blob    not null,"
+      "  job            job_id  not null references jobs(job_id) on delete cascade);"
+      "create table input_dirs("
+      "  input_dir_id integer primary key autoincrement,"
+      "  path         integer not null references paths(path_id),"
+      "  hash         blob    not null,"
+      "  job          job_id  not null references jobs(job_id) on delete cascade);";
+  const char *create_indexes_sql =
+      "create index input_file on input_files(path, hash);"
+      "create index input_file_job on input_files(job);"
+      "create index output_file on output_files(path, hash);"
+      "create index find_file on output_files(hash);"
+      "create index output_file_job on output_files(job);"
+      "create index input_dir on input_dirs(path, hash);"
+      "create index input_dir_job on input_dirs(job);";
+  const char *tables[] = {"input_files", "output_files", "input_dirs"};
+
+  for (const char *table : tables) {
+    std::string rename = std::string("alter table ") + table + " rename to old_" + table;
+    exec_no_fail(db, rename.c_str(), "failed to rename a table to migrate");
+  }
+  exec_no_fail(db, create_tables_sql, "failed to create the migrated tables");
+
+  PathTable paths(db);
+  for (const char *table : tables) {
+    std::string old_table = std::string("old_") + table;
+    PreparedStatement read_rows(db, "select * from " + old_table);
+    PreparedStatement write_row(
+        db, std::string("insert into ") + table + " values (?, ?, ?, ?)");
+    read_rows.set_why("Could not read a table to migrate");
+    write_row.set_why("Could not write a migrated row");
+    while (read_rows.step() == SQLITE_ROW) {
+      write_row.bind_integer(1, read_rows.read_integer(0));
+      write_row.bind_integer(2, paths.intern(read_rows.read_string(1)));
+      write_row.bind_hash(3, Hash256::from_hex(read_rows.read_string(2)));
+      write_row.bind_integer(4, read_rows.read_integer(3));
+      write_row.step();
+      write_row.reset();
+    }
+    read_rows.reset();
+
+    std::string drop = "drop table " + old_table;
+    exec_no_fail(db, drop.c_str(), "failed to drop a migrated table");
+  }
+  exec_no_fail(db, create_indexes_sql, "failed to index the migrated tables");
+
+  write_cache_version(db, 4);
+}
+
+struct CacheStatements {
+  JobTable jobs;
+  PathTable paths;
+  InputFiles input_files;
+  InputDirs input_dirs;
+  OutputFiles output_files;
+  CacheSize cache_size;
+  LeastRecentlyUsed lru;
+  IncrementalVacuum vacuum;
+  TierStats tier_stats;
+  SharedTier shared_tier;
+  Transaction transact;
+  SelectMatchingJobs matching_jobs;
+
+  CacheStatements(std::shared_ptr<Database> db)
+      : jobs(db),
+        paths(db),
+        input_files(db),
+        input_dirs(db),
+        output_files(db),
+        cache_size(db),
+        lru(db),
+        vacuum(db),
+        tier_stats(db),
+        shared_tier(db),
+        transact(db),
+        matching_jobs(db) {}
+};
+
+JAST ReadTimings::to_json() const {
+  JAST json(JSON_OBJECT);
+  json.add("find", find);
+  json.add("link", link);
+  json.add("mkdir", mkdir);
+  json.add("copy", copy);
+  json.add("files", static_cast<long long>(files));
+  json.add("dirs", static_cast<long long>(dirs));
+  json.add("threads", static_cast<long long>(threads));
+  return json;
+}
+
+JAST MatchingJob::to_json() const {
+  JAST json(JSON_OBJECT);
+  json.add("job_id", static_cast<long long>(job_id));
+  auto &outputs = json.add("output_files", JSON_ARRAY);
+  for (const auto &output_file : output_files) {
+    auto &output = outputs.add(JSON_OBJECT);
+    output.add("path", std::string(output_file.path));
+    output.add("hash", output_file.hash.to_hex());
+  }
+  json.children.emplace_back("timings", timings.to_json());
+  json.add("tier", std::string(tier));
+  return json;
+}
+
+struct TierState {
+  std::mutex mutex;
+  // Jobs of the shared tier to copy into the local one, at most once each
+  std::deque<int64_t> promotions;
+  std::set<int64_t> promoting;
+  // Jobs of the local tier to copy into the shared one
+  std::deque<int64_t> uploads;
+  TierCounts local;
+  TierCounts shared;
+};
+
+Cache::~Cache() {}
+
+Cache::Cache(std::string _dir) : Cache(std::move(_dir), std::make_shared<TierState>()) {}
+
+Cache::Cache(std::string _dir, const Cache &sibling) : Cache(std::move(_dir), sibling.tiers) {}
+
+Cache::Cache(std::string _dir, std::shared_ptr<TierState> _tiers)
+    : dir(std::move(_dir)), rng(wcl::xoshiro_256::get_rng_seed()), tiers(std::move(_tiers)) {
+  auto db = std::make_shared<Database>(dir, !tiers);
+  mkdir_no_fail((dir + "/blobs").c_str());
+
+  // Migrations have to run before any statements are prepared against
+  // the tables they change.
+  //
+  // Every process opening the cache races to migrate it, so the version
+  // is only trusted once we hold the write lock and the migrations all
+  // commit together.
+  if (read_cache_version(db) < 4) {
+    Transaction transact(db);
+    transact.run([&]() {
+      int64_t version = read_cache_version(db);
+      if (version < 1) migrate_bloom_filters(db);
+      if (version < 2) migrate_blob_store(db, dir);
+      if (version < 3) migrate_size_tracking(db, dir);
+      if (version < 4) migrate_binary_hashes(db);
+    });
+  }
+
+  stmts = std::make_unique<CacheStatements>(db);
+
+  // A shared tier never has one of its own
+  if (tiers) {
+    std::string shared_dir = stmts->shared_tier.get();
+    if (!shared_dir.empty()) shared.reset(new Cache(shared_dir, nullptr));
+  }
+}
+
+// A read only records that a job was used if it has not been recorded
+// for this many seconds.
+static constexpr int64_t last_use_resolution = 60;
+
+wcl::optional<MatchingJob> Cache::read(const FindJobRequest &find_request,
+                                       const std::string &output_root) {
+  auto result = read_tier(find_request, output_root);
+  if (!tiers) return result;
+
+  // A miss here is tried in the shared tier, which materializes the
+  // outputs itself. Copying the job here is left to `maintain`.
+  std::unique_lock<std::mutex> lock(tiers->mutex);
+  if (result) {
+    tiers->local.hits += 1;
+    return result;
+  }
+  tiers->local.misses += 1;
+  if (!shared) return {};
+  lock.unlock();
+
+  result = shared->read_tier(find_request, output_root);
+
+  lock.lock();
+  if (!result) {
+    tiers->shared.misses += 1;
+    return {};
+  }
+  tiers->shared.hits += 1;
+  if (tiers->promoting.insert(result->job_id).second) {
+    tiers->promotions.push_back(result->job_id);
+  }
+  result->tier = "shared";
+  return result;
+}
+
+// TODO: Unlike reading, we need to account for
+// directory remappings here.
+wcl::optional<MatchingJob> Cache::read_tier(const FindJobRequest &find_request,
+                                            const std::string &output_root) {
+  auto start = std::chrono::steady_clock::now();
+  wcl::optional<MatchingJob> result;
+
+  // We run the matching job in a transaction. This ensures
+  // that we get the *complete* set of output files. This
+  // allows us to know if one of the job files was tampered
+  // with while we're copying files into place.
+  int64_t last_use = 0;
+  stmts->transact.run_read([this, &find_request, &result, &last_use]() {
+    result = stmts->matching_jobs.find(find_request, last_use);
+  });
+
+  // Return early if there was no match.
+  if (!result) return {};
+
+  // Recording the use takes the write lock, which hot jobs being read by
+  // many clients would otherwise fight over. Eviction only needs to know
+  // roughly when a job was last used.
+  int64_t now = time(nullptr);
+  if (now - last_use >= last_use_resolution) {
+    stmts->transact.run([this, &result, now]() { stmts->jobs.mark_used(result->job_id, now); });
+  }
+
+  auto found = std::chrono::steady_clock::now();
+  ReadTimings &timings = result->timings;
+  timings.find = seconds_between(start, found);
+  size_t count = result->output_files.size();
+  timings.files = count;
+
+  // We need a tmp directory to put these outputs into
+  std::string tmp_job_dir = dir + "/tmp_outputs_" + rng.unique_name();
+  mkdir_no_fail(tmp_job_dir.c_str());
+
+  // We then hard link each file to a new location atomically.
+  // If any of these hard links fail then we fail this read
+  // and clean up. This allows job cleanup to occur during
+  // a read. That would be an unfortunate situation but its
+  // very unlikely to occur so its better to commit the
+  // transaction early and suffer the consequences of unlinking
+  // one of the files just before we need it. The links are
+  // numbered since a job may output the same blob twice.
+  std::vector<std::string> tmp_files(count);
+  std::vector<char> linked(count, 0);
+  std::atomic<bool> success(true);
+  std::exception_ptr failure;
+  timings.threads = parallel_for(count, [&](size_t i) {
+    if (!success) return;
+    std::string cur_file = blob_path(dir, result->output_files[i].hash);
+    tmp_files[i] = tmp_job_dir + "/" + std::to_string(i);
+    if (link(cur_file.c_str(), tmp_files[i].c_str()) < 0) {
+      success = false;
+    } else {
+      linked[i] = 1;
+    }
+  });
+  auto linked_time = std::chrono::steady_clock::now();
+  timings.link = seconds_between(found, linked_time);
+
+  if (success) {
+    // Work out where each file goes. The file that the sandbox wrote to
+    // `sandbox_destination` currently lives in the tmp dir and is safe
+    // from interference. The sandbox location may need to be redirected
+    // to some other output location however.
+    std::vector<std::string> output_paths;
+    output_paths.reserve(count);
+    for (const auto &output_file : result->output_files) {
+      const auto &sandbox_destination = output_file.path;
+      std::vector<std::string> path_vec = split_path(sandbox_destination);
+      auto pair = find_request.dir_redirects.find_max(path_vec.begin(), path_vec.end());
+
+      // If there is no redirect what so ever, just copy and assume the sandbox
+      // had an accurate picture of the current system.
+      if (pair.first == nullptr) {
+        output_paths.push_back(output_root + sandbox_destination);  // TODO: We need join here
+      } else {
+        const auto &output_dir = *pair.first;
+        const auto &rel_path = join('/', pair.second, path_vec.end());
+        output_paths.push_back(output_root + "/" + output_dir +
+                               rel_path);  // TODO: We need join here
+      }
+    }
+
+    // Outputs tend to share directories so each is only created once.
+    // The client may not be able to write where it asked for them, in
+    // which case we still have to clean up before telling it so.
+    try {
+      timings.dirs = mkdir_parents(output_paths);
+      auto made_dirs = std::chrono::steady_clock::now();
+      timings.mkdir = seconds_between(linked_time, made_dirs);
+
+      // Now copy/reflink all files into their final place
+      parallel_for(count, [&](size_t i) {
+        copy_or_reflink(tmp_files[i].c_str(), output_paths[i].c_str());
+      });
+      timings.copy = seconds_between(made_dirs, std::chrono::steady_clock::now());
+    } catch (const RequestError &) {
+      failure = std::current_exception();
+    }
+  }
+
+  // Now clean up those files in the tempdir
+  for (size_t i = 0; i < count; ++i) {
+    if (linked[i]) unlink_no_fail(tmp_files[i].c_str());
+  }
+
+  // Lastly clean up the tmp dir itself
+  rmdir_no_fail(tmp_job_dir.c_str());
+
+  if (failure) std::rethrow_exception(failure);
+
+  // If we didn't link all the files over we need to return a failure.
+  if (!success) return {};
+
+  // TODO: We should really return a different thing here
+  //       that mentions the *output* locations but for
+  //       now this is good enough and we can assume
+  //       workspace relative paths everywhere.
+  return result;
+}
+
+void Cache::add(const AddJobRequest &add_request, const std::string &source_root) {
+  int64_t job_id = add_job(add_request, source_root);
+  if (!shared) return;
+
+  std::lock_guard<std::mutex> lock(tiers->mutex);
+  tiers->uploads.push_back(job_id);
+}
+
+int64_t Cache::add_job(const AddJobRequest &add_request, const std::string &source_root) {
+  // Find the sources of the outputs and how much space they take up
+  std::vector<std::string> sources;
+  std::vector<int64_t> sizes;
+  int64_t job_size = 0;
+  for (const auto &output_file : add_request.outputs) {
+    std::string source = output_file.source;
+    if (source.empty() || source[0] != '/') source = source_root + "/" + source;
+    sizes.push_back(file_size(source));
+    sources.emplace_back(std::move(source));
+    job_size += sizes.back();
+  }
+
+  // Start a transaction so that a job is never without its files.
+  int64_t job_id;
+  stmts->transact.run([this, &add_request, &sizes, job_size, &job_id]() {
+    job_id = stmts->jobs.insert(add_request.cwd, add_request.command_line,
+                                add_request.envrionment, add_request.stdin_str, add_request.bloom,
+                                time(nullptr), job_size);
+
+    // Input Files
+    for (const auto &input_file : add_request.inputs) {
+      stmts->input_files.insert(stmts->paths.intern(input_file.path), input_file.hash, job_id);
+    }
+
+    // Input Dirs
+    for (const auto &input_dir : add_request.directories) {
+      stmts->input_dirs.insert(stmts->paths.intern(input_dir.path), input_dir.hash, job_id);
+    }
+
+    // Output Files. Blobs not yet in the store are about to be added
+    // to it so we account for their size now.
+    // Whether the blob is new is decided by its references rather than
+    // by the blob store since another writer may have committed the
+    // same blob but not yet copied it in.
+    int64_t new_bytes = 0;
+    for (size_t i = 0; i < add_request.outputs.size(); ++i) {
+      const auto &output_file = add_request.outputs[i];
+      if (!stmts->output_files.is_referenced(output_file.hash)) new_bytes += sizes[i];
+      stmts->output_files.insert(stmts->paths.intern(output_file.path), output_file.hash, job_id);
+    }
+    stmts->cache_size.add(new_bytes);
+
+    // We commit the database without having populated the blob store.
+    // On *read* you have to be aware tha the database can be in
+    // this kind of faulty state where the database is populated but
+    // file system is *not* populated. In such a case we interpret that
+    // as if it wasn't in the database and so it doesn't get used.
+  });
+
+  // Now make sure every output is in the blob store. Outputs are only
+  // ever copied once, after which every job that produces the same
+  // content shares the one blob. Our output rows are already committed
+  // so anything removing unreferenced blobs will leave these alone.
+  // Each copy is made under a temporary name and atomically
+  // renamed into place so a read never sees a partial blob. A source
+  // we cannot copy leaves the job without that blob, which reads treat
+  // as a miss as above.
+  for (size_t i = 0; i < add_request.outputs.size(); ++i) {
+    const auto &output_file = add_request.outputs[i];
+    std::string blob = blob_path(dir, output_file.hash);
+    if (access(blob.c_str(), F_OK) == 0) continue;
+
+    std::string tmp_blob = dir + "/tmp_" + rng.unique_name();
+    try {
+      copy_or_reflink(sources[i].c_str(), tmp_blob.c_str());
+    } catch (const RequestError &) {
+      unlink(tmp_blob.c_str());
+      throw;
+    }
+    mkdir_no_fail(blob_dir(dir, output_file.hash.to_hex()).c_str());
+    rename_no_fail(tmp_blob.c_str(), blob.c_str());
+  }
+
+  return job_id;
+}
+
+// Copies a job from one tier to the other. Its blobs are first linked
+// to a temporary directory of `from` so that they can't be evicted from
+// under us, and being in the same file system as the blob store is what
+// lets us link them. Returns false if the job or one of its blobs is
+// already gone, in which case nothing is copied.
+bool Cache::transfer(Cache &from, int64_t job_id, Cache &to) {
+  AddJobRequest job;
+  bool found = false;
+  from.stmts->transact.run_read(
+      [&from, job_id, &job, &found]() { found = from.stmts->matching_jobs.describe(job_id, job); });
+  if (!found) return false;
+
+  std::string tmp_job_dir = from.dir + "/tmp_outputs_" + rng.unique_name();
+  mkdir_no_fail(tmp_job_dir.c_str());
+
+  size_t linked = 0;
+  for (; linked < job.outputs.size(); ++linked) {
+    auto &output = job.outputs[linked];
+    output.source = tmp_job_dir + "/" + std::to_string(linked);
+    std::string blob = blob_path(from.dir, output.hash);
+    if (link(blob.c_str(), output.source.c_str()) < 0) break;
+  }
+
+  // Both tiers are ours, so a copy that fails is not the fault of any
+  // request. The job is left where it is and tried no further.
+  bool complete = linked == job.outputs.size();
+  if (complete) {
+    try {
+      to.add_job(job, ".");
+    } catch (const RequestError &error) {
+      log_info("Could not copy job %lld from %s to %s: %s", static_cast<long long>(job_id),
+               from.dir.c_str(), to.dir.c_str(), error.what());
+      complete = false;
+    }
+  }
+
+  for (size_t i = 0; i < linked; ++i) unlink_no_fail(job.outputs[i].source.c_str());
+  rmdir_no_fail(tmp_job_dir.c_str());
+  return complete;
+}
+
+void Cache::set_watermarks(int64_t low, int64_t high) {
+  stmts->transact.run([this, low, high]() { stmts->cache_size.set_watermarks(low, high); });
+}
+
+void Cache::set_shared_tier(const std::string &shared_dir) {
+  stmts->transact.run([this, &shared_dir]() { stmts->shared_tier.set(shared_dir); });
+}
+
+JAST Cache::tier_stats() {
+  JAST json;
+  stmts->transact.run_read([this, &json]() { json = stmts->tier_stats.read(); });
+  return json;
+}
+
+bool Cache::maintain() {
+  // Tier work comes first, one job at a time. The counts are recorded
+  // here so that reads never take the write lock just to count.
+  if (tiers) {
+    int64_t promotion = -1, upload = -1;
+    {
+      std::lock_guard<std::mutex> lock(tiers->mutex);
+      if (!tiers->promotions.empty()) {
+        promotion = tiers->promotions.front();
+        tiers->promotions.pop_front();
+      } else if (!tiers->uploads.empty()) {
+        upload = tiers->uploads.front();
+        tiers->uploads.pop_front();
+      }
+    }
+
+    bool promoted = promotion != -1 && transfer(*shared, promotion, *this);
+    bool uploaded = upload != -1 && transfer(*this, upload, *shared);
+    shared_maintenance = shared_maintenance || uploaded;
+
+    TierCounts local, shared_counts;
+    bool more;
+    {
+      std::lock_guard<std::mutex> lock(tiers->mutex);
+      if (promotion != -1) tiers->promoting.erase(promotion);
+      tiers->local.promotes += promoted;
+      tiers->shared.promotes += uploaded;
+      std::swap(local, tiers->local);
+      std::swap(shared_counts, tiers->shared);
+      more = !tiers->promotions.empty() || !tiers->uploads.empty();
+    }
+
+    if (!local.empty() || !shared_counts.empty()) {
+      stmts->transact.run([this, &local, &shared_counts]() {
+        stmts->tier_stats.add("local", local);
+        stmts->tier_stats.add("shared", shared_counts);
+      });
+    }
+    if (promotion != -1 || upload != -1 || more) return true;
+  }
+
+  // Uploads may have pushed the shared tier past its high watermark
+  if (shared_maintenance) {
+    shared_maintenance = shared->maintain();
+    if (shared_maintenance) return true;
+  }
+
+  // Evicting a batch of jobs is a short transaction of its own so that
+  // reads get their turn between batches.
+  static constexpr int jobs_per_batch = 64;
+  bool more = false;
+  stmts->transact.run([this, &more]() {
+    CacheSizeInfo info = stmts->cache_size.get();
+    if (info.high_watermark <= 0) {
+      evicting = false;
+      return;
+    }
+    if (info.bytes > info.high_watermark) evicting = true;
+
+    int64_t bytes = info.bytes;
+    for (int i = 0; evicting && i < jobs_per_batch; ++i) {
+      std::vector<Hash256> hashes;
+      if (!stmts->lru.evict_oldest(hashes)) {
+        evicting = false;
+        break;
+      }
+
+      // The job is gone so any blob no one else references can go too.
+      // This happens before the commit so that a concurrent `add` either
+      // sees the blob gone and copies it again, or sees it in use.
+      for (const auto &hash : hashes) {
+        if (stmts->output_files.is_referenced(hash)) continue;
+        std::string blob = blob_path(dir, hash);
+        struct stat buf;
+        if (stat(blob.c_str(), &buf) < 0) continue;  // listed twice by the job
+        unlink_no_fail(blob.c_str());
+        bytes -= buf.st_size;
+      }
+
+      if (bytes <= info.low_watermark) evicting = false;
+    }
+
+    stmts->cache_size.add(bytes - info.bytes);
+    more = evicting;
+  });
+  if (more) return true;
+
+  // Return the pages freed by eviction to the file system, a little at a time
+  return stmts->vacuum.run() > 0;
+}
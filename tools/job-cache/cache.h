@@ -0,0 +1,201 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <json/json5.h>
+#include <wcl/optional.h>
+#include <wcl/trie.h>
+#include <wcl/xoshiro_256.h>
+
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bloom.h"
+
+// A request the cache cannot carry out, such as one with a malformed hash
+// or naming an output that does not exist. The daemon answers it with an
+// error and goes on serving its other clients.
+class RequestError : public std::runtime_error {
+ public:
+  explicit RequestError(const std::string &why) : std::runtime_error(why) {}
+};
+
+struct CachedOutputFile {
+  std::string path;
+  Hash256 hash;
+};
+
+// Where the time of a successful `Cache::read` went, in seconds
+struct ReadTimings {
+  double find = 0;   // finding the matching job
+  double link = 0;   // linking its outputs out of the blob store
+  double mkdir = 0;  // creating the output directories
+  double copy = 0;   // reflinking or copying the outputs into place
+  size_t files = 0;
+  size_t dirs = 0;
+  size_t threads = 0;
+
+  JAST to_json() const;
+};
+
+struct MatchingJob {
+  int64_t job_id;
+  std::vector<CachedOutputFile> output_files;
+  ReadTimings timings;
+  // Which tier the job was found in, "local" or "shared"
+  std::string tier = "local";
+
+  JAST to_json() const;
+};
+
+struct FindJobRequest {
+ public:
+  std::string cwd;
+  std::string command_line;
+  std::string envrionment;
+  std::string stdin_str;
+  wcl::trie<std::string, std::string> dir_redirects;
+  BloomFilter bloom;
+  std::unordered_map<std::string, Hash256> visible;
+  std::unordered_map<std::string, Hash256> dir_hashes;
+
+  FindJobRequest() = delete;
+  FindJobRequest(const FindJobRequest &) = default;
+  FindJobRequest(FindJobRequest &&) = default;
+
+  // Throws RequestError if a hash is malformed
+  explicit FindJobRequest(const JAST &find_job_json);
+};
+
+// JSON parsing stuff
+struct InputFile {
+  std::string path;
+  Hash256 hash;
+};
+
+struct InputDir {
+  std::string path;
+  Hash256 hash;
+};
+
+struct OutputFile {
+  std::string source;
+  std::string path;
+  Hash256 hash;
+};
+
+struct AddJobRequest {
+ public:
+  std::string cwd;
+  std::string command_line;
+  std::string envrionment;
+  std::string stdin_str;
+  BloomFilter bloom;
+  std::vector<InputFile> inputs;
+  std::vector<InputDir> directories;
+  std::vector<OutputFile> outputs;
+
+  // Filled in field by field when a job is copied between tiers
+  AddJobRequest() = default;
+  AddJobRequest(const AddJobRequest &) = default;
+  AddJobRequest(AddJobRequest &&) = default;
+
+  // Throws RequestError if a hash is malformed
+  explicit AddJobRequest(const JAST &job_result_json);
+};
+
+// The prepared statements used by `Cache` are private to cache.cpp
+struct CacheStatements;
+
+// Tier transfers and counts waiting for `Cache::maintain`
+struct TierState;
+
+// the `Cache` class provides the full interface
+// the the underlying complete cache directory.
+// This requires interplay between the file system and
+// the database and must be carefully orchestrated. This
+// class handles all those details and provides a simple
+// interface.
+class Cache {
+ private:
+  std::unique_ptr<CacheStatements> stmts;
+  std::string dir;
+  wcl::xoshiro_256 rng;
+  // Set once the cache passes its high watermark and cleared once
+  // eviction brings it back under the low watermark.
+  bool evicting = false;
+
+  // The shared tier, if this cache has one. A cache that is opened as
+  // a shared tier has no `tiers` of its own.
+  std::unique_ptr<Cache> shared;
+  std::shared_ptr<TierState> tiers;
+  bool shared_maintenance = false;
+
+  Cache(std::string _dir, std::shared_ptr<TierState> tiers);
+
+  wcl::optional<MatchingJob> read_tier(const FindJobRequest &find_request,
+                                       const std::string &output_root);
+  int64_t add_job(const AddJobRequest &add_request, const std::string &source_root);
+  bool transfer(Cache &from, int64_t job_id, Cache &to);
+
+ public:
+  ~Cache();
+
+  Cache() = delete;
+  Cache(const Cache &) = delete;
+
+  Cache(std::string _dir);
+
+  // Opens another connection to the same cache. Tier transfers and
+  // counts left behind by its reads and adds are done by `sibling`'s
+  // `maintain`, which lets several threads share one maintainer.
+  Cache(std::string _dir, const Cache &sibling);
+
+  // Outputs of a matching job are materialized relative to `output_root`.
+  // The command line tool runs in the workspace and so uses ".", but the
+  // daemon serves many clients and is told where each one lives. Throws
+  // RequestError if the outputs cannot be written there.
+  wcl::optional<MatchingJob> read(const FindJobRequest &find_request,
+                                  const std::string &output_root = ".");
+
+  // Relative output sources are likewise read from `source_root`. Throws
+  // RequestError if one of them cannot be read.
+  void add(const AddJobRequest &add_request, const std::string &source_root = ".");
+
+  // Bounds the size of the blob store in bytes. A `high` of 0 removes
+  // the bound. The limits are stored in the cache itself.
+  void set_watermarks(int64_t low, int64_t high);
+
+  // Puts the cache in front of the cache in `shared_dir`, or makes it
+  // stand alone again if `shared_dir` is empty. Takes effect the next
+  // time the cache is opened.
+  void set_shared_tier(const std::string &shared_dir);
+
+  // The hit, miss and promote counts of each tier
+  JAST tier_stats();
+
+  // Does a small, bounded amount of background work: promoting jobs
+  // found in the shared tier, uploading added jobs to it, eviction and
+  // vacuuming. Returns true if there is more to do. Call it whenever
+  // the cache is idle.
+  bool maintain();
+};
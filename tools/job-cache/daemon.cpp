@@ -0,0 +1,356 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <job_cache/job_cache.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "cache.h"
+#include "logging.h"
+
+static JAST error_response(std::string &&why) {
+  JAST response(JSON_OBJECT);
+  response.add("ok", JSON_FALSE);
+  response.add("error", std::move(why));
+  return response;
+}
+
+// `maintain` is set when the request left work for Cache::maintain
+static JAST handle_request(Cache &cache, const std::string &message, bool &maintain) {
+  JAST request;
+  std::stringstream errs;
+  if (!JAST::parse(message, errs, request)) {
+    return error_response("could not parse request: " + errs.str());
+  }
+
+  // Paths in a request are relative to the client, not to the daemon
+  std::string client_cwd = request.get("cwd").value;
+  if (client_cwd.empty()) client_cwd = ".";
+
+  // A bad request fails on its own; every other client shares the daemon
+  const std::string &method = request.get("method").value;
+  JAST result(JSON_OBJECT);
+  try {
+    if (method == "read") {
+      FindJobRequest find_request(request.get("params"));
+      auto match = cache.read(find_request, client_cwd);
+      if (match) result = match->to_json();
+      result.add("found", match ? JSON_TRUE : JSON_FALSE);
+      maintain = true;
+    } else if (method == "add") {
+      AddJobRequest add_request(request.get("params"));
+      cache.add(add_request, client_cwd);
+      maintain = true;
+    } else {
+      return error_response("unknown method '" + method + "'");
+    }
+  } catch (const RequestError &error) {
+    log_info("%s request failed: %s", method.c_str(), error.what());
+    return error_response(error.what());
+  }
+
+  JAST response(JSON_OBJECT);
+  response.add("ok", JSON_TRUE);
+  response.children.emplace_back("result", std::move(result));
+  return response;
+}
+
+// The messages a client sent in one go. Requests from the same client are
+// answered in order so a client is only ever with one worker at a time.
+struct Work {
+  int fd;
+  std::vector<std::string> messages;
+};
+
+// What a worker tells the main loop once it is done with a client
+struct Done {
+  int fd;
+  bool keep;
+  bool maintain;
+};
+
+// Each worker has a cache, and so a sqlite connection, of its own. Reads
+// run side by side and sqlite takes care of ordering the writes.
+class WorkerPool {
+ private:
+  std::mutex mutex;
+  std::condition_variable ready;
+  std::deque<Work> queue;
+  bool stopping = false;
+  int done_fd;
+  std::vector<std::thread> threads;
+
+  void work(Cache *cache) {
+    while (true) {
+      Work item;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [this]() { return stopping || !queue.empty(); });
+        if (queue.empty()) return;
+        item = std::move(queue.front());
+        queue.pop_front();
+      }
+
+      Done done = {item.fd, true, false};
+      for (const auto &message : item.messages) {
+        bool maintain = false;
+        done.keep = job_cache::send_message(item.fd, handle_request(*cache, message, maintain));
+        done.maintain = done.maintain || maintain;
+        if (!done.keep) break;
+      }
+
+      // Small pipe writes are atomic so workers can share the pipe
+      if (write(done_fd, &done, sizeof(done)) != sizeof(done)) {
+        log_fatal("write(done pipe): %s", strerror(errno));
+      }
+    }
+  }
+
+ public:
+  WorkerPool(const std::vector<std::unique_ptr<Cache>> &caches, int done_fd) : done_fd(done_fd) {
+    for (const auto &cache : caches) {
+      threads.emplace_back(&WorkerPool::work, this, cache.get());
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    ready.notify_all();
+    for (auto &thread : threads) thread.join();
+  }
+
+  void submit(Work &&item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queue.emplace_back(std::move(item));
+    }
+    ready.notify_one();
+  }
+};
+
+static int listen_socket(const std::string &path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    log_fatal("socket path %s is too long", path.c_str());
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock == -1) {
+    log_fatal("socket(AF_UNIX): %s", strerror(errno));
+  }
+  (void)fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  // We hold the daemon lock, so any socket left behind belongs to a dead daemon
+  if (unlink(path.c_str()) == -1 && errno != ENOENT) {
+    log_fatal("unlink(%s): %s", path.c_str(), strerror(errno));
+  }
+
+  if (bind(sock, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1) {
+    log_fatal("bind(%s): %s", path.c_str(), strerror(errno));
+  }
+
+  if (listen(sock, SOMAXCONN) == -1) {
+    log_fatal("listen(%s): %s", path.c_str(), strerror(errno));
+  }
+
+  return sock;
+}
+
+int serve(const std::string &cache_dir, int linger_timeout) {
+  if (mkdir(cache_dir.c_str(), 0777) == -1 && errno != EEXIST) {
+    log_fatal("mkdir(%s): %s", cache_dir.c_str(), strerror(errno));
+  }
+
+  std::string log_path = cache_dir + "/job-cache.log";
+  int log = open(log_path.c_str(), O_CREAT | O_RDWR | O_APPEND, 0644);
+  if (log == -1) {
+    log_fatal("open(%s): %s", log_path.c_str(), strerror(errno));
+  }
+
+  int null = open("/dev/null", O_RDONLY);
+  if (null == -1) {
+    log_fatal("open(/dev/null): %s", strerror(errno));
+  }
+
+  // Become a daemon
+  pid_t pid = fork();
+  if (pid == -1) log_fatal("fork: %s", strerror(errno));
+  if (pid != 0) return 0;
+
+  if (setsid() == -1) log_fatal("setsid: %s", strerror(errno));
+
+  pid = fork();
+  if (pid == -1) log_fatal("fork2: %s", strerror(errno));
+  if (pid != 0) return 0;
+
+  // Lock the logfile to ensure we are the only daemon serving this cache.
+  // This has to happen after fork (which would drop the lock)
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  fl.l_start = 0;
+  fl.l_len = 0;  // 0=largest possible
+  if (fcntl(log, F_SETLK, &fl) != 0) {
+    if (errno == EAGAIN || errno == EACCES) return 0;  // another daemon is already running
+    log_fatal("fcntl(%s): %s", log_path.c_str(), strerror(errno));
+  }
+
+  dup2(null, STDIN_FILENO);
+  dup2(log, STDOUT_FILENO);
+  dup2(log, STDERR_FILENO);
+  close(null);
+
+  // Clients that hang up mid-response are dropped, not fatal
+  signal(SIGPIPE, SIG_IGN);
+
+  // Opening the cache is what we want to pay only once, so it happens
+  // before we start accepting clients. The workers' caches answer
+  // requests and leave all background work to the daemon's own cache.
+  Cache cache(cache_dir);
+  size_t worker_count = std::max(1u, std::min(std::thread::hardware_concurrency(), 8u));
+  std::vector<std::unique_ptr<Cache>> worker_caches;
+  for (size_t i = 0; i < worker_count; ++i) {
+    worker_caches.push_back(std::make_unique<Cache>(cache_dir, cache));
+  }
+
+  // Workers hand clients back to us through this pipe
+  int done_pipe[2];
+  if (pipe(done_pipe) == -1) log_fatal("pipe: %s", strerror(errno));
+  (void)fcntl(done_pipe[0], F_SETFD, FD_CLOEXEC);
+  (void)fcntl(done_pipe[1], F_SETFD, FD_CLOEXEC);
+
+  std::string path = job_cache::socket_path(cache_dir);
+  int listen_fd = listen_socket(path);
+  log_info("job-cache daemon serving %s", cache_dir.c_str());
+
+  // Tier transfers, eviction and vacuuming happen in small steps, only
+  // while no request is waiting, so that they never hold up a read. Check
+  // once at startup in case the watermarks changed while no daemon was
+  // running.
+  bool maintenance = true;
+
+  std::map<int, job_cache::MessageParser> clients;
+  // Clients a worker is busy with. We neither poll nor close them.
+  std::set<int> busy;
+  std::vector<struct pollfd> fds;
+  {
+    WorkerPool workers(worker_caches, done_pipe[1]);
+    while (true) {
+      fds.clear();
+      fds.push_back({listen_fd, POLLIN, 0});
+      fds.push_back({done_pipe[0], POLLIN, 0});
+      for (auto &client : clients) {
+        if (!busy.count(client.first)) fds.push_back({client.first, POLLIN, 0});
+      }
+
+      // Maintenance waits for the workers to go idle. Wait a while for
+      // new clients before the daemon exits.
+      bool idle = busy.empty();
+      int timeout = maintenance && idle ? 0 : clients.empty() ? linger_timeout * 1000 : -1;
+      int ready = poll(fds.data(), fds.size(), timeout);
+      if (ready == -1) {
+        if (errno == EINTR) continue;
+        log_fatal("poll: %s", strerror(errno));
+      }
+      if (ready == 0) {
+        if (!maintenance) break;
+        maintenance = cache.maintain();
+        continue;
+      }
+
+      if (fds[1].revents & POLLIN) {
+        Done done;
+        if (read(done_pipe[0], &done, sizeof(done)) != sizeof(done)) {
+          log_fatal("read(done pipe): %s", strerror(errno));
+        }
+        busy.erase(done.fd);
+        maintenance = maintenance || done.maintain;
+        if (!done.keep) {
+          close(done.fd);
+          clients.erase(done.fd);
+        }
+      }
+
+      // Hand whatever each client sent to the workers
+      for (size_t i = 2; i < fds.size(); ++i) {
+        if (fds[i].revents == 0) continue;
+        int fd = fds[i].fd;
+        auto it = clients.find(fd);
+
+        Work item = {fd, {}};
+        bool keep = it->second.read(item.messages) == job_cache::MessageStatus::Ok;
+        if (keep && !item.messages.empty()) {
+          busy.insert(fd);
+          workers.submit(std::move(item));
+        } else if (!keep) {
+          close(fd);
+          clients.erase(it);
+        }
+      }
+
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+          if (errno != EINTR && errno != ECONNABORTED) {
+            log_fatal("accept: %s", strerror(errno));
+          }
+        } else {
+          (void)fcntl(fd, F_SETFD, FD_CLOEXEC);
+          clients.emplace(fd, job_cache::MessageParser(fd));
+        }
+      }
+    }
+  }
+
+  // Remove the socket before releasing the lock so that clients start
+  // a new daemon rather than connecting to one that is going away.
+  unlink(path.c_str());
+  close(listen_fd);
+  log_info("job-cache daemon idle for %d seconds, exiting", linger_timeout);
+  return 0;
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <string>
+
+// Becomes a daemon that keeps `cache_dir` open and answers requests from
+// job_cache::Client on the cache's unix socket. The daemon exits once no
+// client has been connected for `linger_timeout` seconds. If another daemon
+// already owns the cache this returns immediately and successfully.
+int serve(const std::string &cache_dir, int linger_timeout);
@@ -1,35 +1,81 @@
 --dummy, R"(
 pragma auto_vacuum=incremental;
-pragma journal_mode=wal;
-pragma synchronous=0;
-pragma locking_mode=exclusive;
 pragma foreign_keys=on;
 
 -- In order to look up compaitable jobs quickly we need
 -- a special table of some kind. We use a bloom filter
 -- table. We have an index on (directory, commandline, environment,
--- stdin) and from there we do a scan over our bloom_filters. Any
--- remaining matching jobs can be checked against the the input_files,
--- and input_dirs tables.
+-- stdin) and from there we do a scan over our bloom_filters using
+-- the bloom_subset function. Any remaining matching jobs can be checked
+-- against the the input_files, and input_dirs tables. The bloom filter
+-- is stored as a blob whose size depends on the BloomFilter in bloom.h.
 create table if not exists jobs(
   job_id       integer primary key autoincrement,
   directory    text    not null,
   commandline  blob    not null,
   environment  blob    not null,
   stdin        text    not null,
-  bloom_filter integer);
+  bloom_filter blob,
+  last_use     integer not null default 0,
+  size         integer not null default 0);
 create index if not exists job on jobs(directory, commandline, environment, stdin);
+-- Jobs are evicted least recently used first. `last_use` is the time
+-- (in seconds) the job was added or last read, and `size` is the total
+-- size of its outputs. Caches created before these columns existed
+-- get them from a migration, which also creates the job_last_use index
+-- on jobs(last_use).
+
+
+-- The blob store is shared between jobs so the bytes it uses are tracked
+-- here as blobs come and go. Once `bytes` exceeds `high_watermark` the
+-- least recently used jobs are evicted until it drops below
+-- `low_watermark`. A high watermark of 0 means the cache is unbounded.
+create table if not exists cache_size(
+  id             integer primary key check (id = 0),
+  bytes          integer not null,
+  low_watermark  integer not null,
+  high_watermark integer not null);
+insert or ignore into cache_size (id, bytes, low_watermark, high_watermark) values (0, 0, 0, 0);
+
+
+-- A cache may sit in front of a shared cache directory, typically on a
+-- network file system used by many hosts. Reads that miss here are tried
+-- there and the job is promoted into this cache in the background. Jobs
+-- added here are uploaded there in the background as well. Without a
+-- row here the cache stands alone.
+create table if not exists shared_tier(
+  id  integer primary key check (id = 0),
+  dir text    not null);
+
+
+-- How each tier has served the reads made through this cache. `promotes`
+-- counts jobs copied into the tier from the other one, so uploads are the
+-- promotes of the shared tier.
+create table if not exists tier_stats(
+  tier     text    primary key,
+  hits     integer not null default 0,
+  misses   integer not null default 0,
+  promotes integer not null default 0);
+insert or ignore into tier_stats (tier) values ('local'), ('shared');
+
+
+-- Paths are stored once here and every other table refers
+-- to them by id.
+create table if not exists paths(
+  path_id integer primary key autoincrement,
+  path    text    not null unique);
 
 
 -- We only record the input hashes, and not all visible files.
 -- The input file blobs are not stored on disk. Only their hash
--- is stored
+-- is stored. All hashes are stored as 32 byte blobs.
 create table if not exists input_files(
   input_file_id integer primary key autoincrement,
-  path          text    not null,
-  hash          text    not null,
+  path          integer not null references paths(path_id),
+  hash          blob    not null,
   job           job_id  not null references jobs(job_id) on delete cascade);
 create index if not exists input_file on input_files(path, hash);
+create index if not exists input_file_job on input_files(job);
 
 
 -- We don't record where a wake job writes an output file
@@ -40,11 +86,12 @@ create index if not exists input_file on input_files(path, hash);
 -- TODO(jake): Add mode
 create table if not exists output_files(
   output_file_id integer primary key autoincrement,
-  path           text    not null,
-  hash           text    not null,
+  path           integer not null references paths(path_id),
+  hash           blob    not null,
   job            job_id  not null references jobs(job_id) on delete cascade);
 create index if not exists output_file on output_files(path, hash);
 create index if not exists find_file on output_files(hash);
+create index if not exists output_file_job on output_files(job);
 
 
 -- We also need to know about directories that have been read
@@ -56,9 +103,10 @@ create index if not exists find_file on output_files(hash);
 -- collisions.
 create table if not exists input_dirs(
   input_dir_id integer primary key autoincrement,
-  path         text    not null,
-  hash         text    not null,
+  path         integer not null references paths(path_id),
+  hash         blob    not null,
   job          job_id  not null references jobs(job_id) on delete cascade);
 create index if not exists input_dir on input_dirs(path, hash);
+create index if not exists input_dir_job on input_dirs(job);
 
 )"
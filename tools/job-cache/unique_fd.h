@@ -82,4 +82,9 @@ class UniqueFd {
     }
     return UniqueFd(fd);
   }
+
+  // Leaves a failed open to the caller, which checks valid() and errno
+  static UniqueFd try_open(const char* str, int flags, mode_t mode) {
+    return UniqueFd(::open(str, flags, mode));
+  }
 };
@@ -61,7 +61,7 @@ static const char *InvalidParams = "-32602";
 static const char *ServerNotInitialized = "-32002";
 // static const char *UnknownErrorCode     = "-32001";
 
-DiagnosticReporter *reporter;
+thread_local DiagnosticReporter *reporter;
 
 const char *term_colour(int _) { return ""; }
 const char *term_normal() { return ""; }
@@ -0,0 +1,169 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wcl/xoshiro_256.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <queue>
+#include <utility>
+#include <vector>
+
+#include "runtime/scheduler.h"
+
+// Replays a build whose jobs are all queued up front through the job
+// table's scheduling bookkeeping. The build's clock is simulated; only
+// the time spent deciding what to launch is real.
+
+struct Job {
+  LaunchPriority priority;
+  double runtime;
+  uint64_t memory;
+};
+
+struct Result {
+  double seconds;   // wall-clock time spent scheduling
+  double makespan;  // simulated length of the build
+  double critical;  // sum of the critical paths seen, so the work is not optimized away
+};
+
+// Finish time => job, soonest first
+typedef std::priority_queue<std::pair<double, long>, std::vector<std::pair<double, long>>,
+                            std::greater<std::pair<double, long>>>
+    Finishing;
+
+// The scheduler as it was: a binary heap which only ever launches its
+// front, and a scan of every queued and running job for the critical path.
+static Result legacy(const std::vector<Job> &jobs, size_t threads, uint64_t memory) {
+  auto start = std::chrono::steady_clock::now();
+  auto worse = [&](long a, long b) { return jobs[b].priority < jobs[a].priority; };
+
+  std::vector<long> pending;
+  for (long i = 0; i < (long)jobs.size(); ++i) {
+    pending.push_back(i);
+    std::push_heap(pending.begin(), pending.end(), worse);
+  }
+
+  std::map<long, double> running;  // job => finish time
+  Finishing finishing;
+  double now = 0, critical = 0;
+  uint64_t used = 0;
+  while (!pending.empty() || !running.empty()) {
+    while (!pending.empty() && running.size() < threads) {
+      const Job &job = jobs[pending.front()];
+      if (!running.empty() && used + job.memory > memory) break;
+      long id = pending.front();
+      std::pop_heap(pending.begin(), pending.end(), worse);
+      pending.pop_back();
+      used += job.memory;
+      running.emplace(id, now + job.runtime);
+      finishing.emplace(now + job.runtime, id);
+    }
+
+    auto done = finishing.top();
+    finishing.pop();
+    now = done.first;
+    used -= jobs[done.second].memory;
+    running.erase(done.second);
+
+    double longest = 0;
+    for (auto &r : running) longest = std::max(longest, jobs[r.first].priority.pathtime);
+    for (long p : pending) longest = std::max(longest, jobs[p].priority.pathtime);
+    critical += longest;
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return Result{elapsed.count(), now, critical};
+}
+
+// The scheduler in runtime/scheduler.h
+static Result current(const std::vector<Job> &jobs, size_t threads, uint64_t memory) {
+  auto start = std::chrono::steady_clock::now();
+
+  LaunchQueue<long> pending;
+  CriticalPaths paths;
+  std::vector<CriticalPaths::Handle> handles(jobs.size());
+  for (long i = 0; i < (long)jobs.size(); ++i) {
+    handles[i] = paths.add(jobs[i].priority.pathtime, jobs[i].runtime);
+    pending.push(jobs[i].priority, long(i));
+  }
+
+  size_t running = 0;
+  Finishing finishing;
+  double now = 0, critical = 0;
+  uint64_t used = 0;
+  auto fits = [&](long id) { return running == 0 || used + jobs[id].memory <= memory; };
+  while (!pending.empty() || running != 0) {
+    while (running < threads) {
+      auto it = pending.select(fits, 64, 16);
+      if (it == pending.end()) break;
+      long id = pending.pop(it);
+      used += jobs[id].memory;
+      ++running;
+      finishing.emplace(now + jobs[id].runtime, id);
+    }
+
+    auto done = finishing.top();
+    finishing.pop();
+    now = done.first;
+    used -= jobs[done.second].memory;
+    --running;
+    paths.remove(handles[done.second]);
+
+    critical += paths.longest(0).pathtime;
+  }
+
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return Result{elapsed.count(), now, critical};
+}
+
+int main(int argc, char **argv) {
+  // scheduler-bench [jobs] [threads]
+  long count = argc >= 2 ? atol(argv[1]) : 50000;
+  size_t threads = argc >= 3 ? atol(argv[2]) : 64;
+  if (count < 1) count = 1;
+  if (threads < 1) threads = 1;
+
+  wcl::xoshiro_256 rng(wcl::xoshiro_256::get_rng_seed());
+  auto uniform = [&](double limit) { return limit * (rng() >> 11) / double(1ULL << 53); };
+
+  // Jobs need between a few MB and a quarter of the machine's memory
+  uint64_t memory = uint64_t(threads) << 30;
+  std::vector<Job> jobs(count);
+  for (long i = 0; i < count; ++i) {
+    Job &job = jobs[i];
+    job.runtime = 0.1 + uniform(10);
+    job.memory = (4ULL << 20) + uint64_t(uniform(memory / 4));
+    job.priority.urgent = false;
+    job.priority.unknown = uniform(1) < 0.05;
+    job.priority.pathtime = job.runtime + uniform(1000);
+    job.priority.id = i;
+  }
+
+  printf("%ld jobs, %zu threads, %llu GB\n\n", count, threads, (unsigned long long)(memory >> 30));
+  printf("%8s  %12s  %16s\n", "", "scheduling", "simulated build");
+  Result before = legacy(jobs, threads, memory);
+  printf("%8s  %11.3fs  %15.1fs\n", "before", before.seconds, before.makespan);
+  Result after = current(jobs, threads, memory);
+  printf("%8s  %11.3fs  %15.1fs\n", "after", after.seconds, after.makespan);
+
+  return before.critical > 0 && after.critical > 0 ? 0 : 1;
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+/* Resident fork server for wake jobs */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "shim.h"
+
+#ifdef __linux__
+#include <linux/sched.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+// Signals which should not take down the launcher; it exits when wake closes the socket
+static const int ignored[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM, SIGPIPE};
+#define IGNORED (sizeof(ignored) / sizeof(ignored[0]))
+
+static int read_all(int fd, void *data, size_t size) {
+  char *out = data;
+  while (size) {
+    ssize_t got = read(fd, out, size);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) return 0;
+    out += got;
+    size -= got;
+  }
+  return 1;
+}
+
+static void write_all(int fd, const void *data, size_t size) {
+  const char *in = data;
+  while (size) {
+    ssize_t got = write(fd, in, size);
+    if (got == -1 && errno == EINTR) continue;
+    if (got <= 0) exit(1);
+    in += got;
+    size -= got;
+  }
+}
+
+// Receives a request header and the two descriptors sent alongside it
+static int read_header(int sock, uint32_t header[3], int fds[2]) {
+  union {
+    char buf[CMSG_SPACE(2 * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  ssize_t got;
+
+  iov.iov_base = header;
+  iov.iov_len = 3 * sizeof(uint32_t);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  while ((got = recvmsg(sock, &msg, 0)) == -1 && errno == EINTR) {
+  }
+  if (got <= 0) return 0;
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+    fprintf(stderr, "wake launcher: request without descriptors\n");
+    return 0;
+  }
+  memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+
+  // The descriptors arrive with the first byte; the rest may trail behind
+  return read_all(sock, (char *)header + got, 3 * sizeof(uint32_t) - got);
+}
+
+// Splits `count` NUL-terminated strings off the front of `body`
+static char **split(char **body, char *end, uint32_t count) {
+  char **out = malloc((count + 1) * sizeof(char *));
+  uint32_t i;
+  for (i = 0; i < count && *body < end; ++i) {
+    out[i] = *body;
+    *body += strlen(*body) + 1;
+  }
+  out[i] = 0;
+  return out;
+}
+
+int shim_launcher(int sock) {
+  struct sigaction sa, inherited[IGNORED];
+  sigset_t none;
+  char *body = 0;
+  size_t capacity = 0;
+  size_t i;
+
+  // Jobs get back what the launcher inherited from wake, as a job spawned
+  // by wake directly would; wake itself ignores SIGPIPE, for one.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  for (i = 0; i < IGNORED; ++i) sigaction(ignored[i], &sa, &inherited[i]);
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, 0);
+
+  // Jobs must not inherit the socket
+  fcntl(sock, F_SETFD, FD_CLOEXEC);
+
+  while (1) {
+    uint32_t header[3];  // body bytes, arguments, environment variables
+    int fds[2];          // stdout, stderr
+    const char *stdin_file, *dir;
+    char *scan, *end, **argv, **envp;
+    int32_t reply;
+    pid_t pid;
+
+    if (!read_header(sock, header, fds)) return 0;
+    if (header[0] + 1 > capacity) {
+      capacity = header[0] + 1;
+      body = realloc(body, capacity);
+    }
+    if (!read_all(sock, body, header[0])) return 0;
+    body[header[0]] = 0;
+
+    // stdin file, directory, arguments, environment
+    scan = body;
+    end = body + header[0];
+    stdin_file = scan;
+    scan += strlen(scan) + 1;
+    dir = scan < end ? scan : "";
+    scan += strlen(dir) + 1;
+    argv = split(&scan, end, header[1]);
+    envp = split(&scan, end, header[2]);
+
+    // With CLONE_PARENT the job is wake's child, so wake reaps it as usual.
+    // The launcher is small, so copying its address space is cheap.
+    pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+    if (pid == 0) {
+      for (i = 0; i < IGNORED; ++i) sigaction(ignored[i], &inherited[i], 0);
+      environ = envp;
+      exit(argv[0] ? shim_exec(stdin_file, fds[0], fds[1], dir, argv) : 127);
+    }
+
+    reply = pid == -1 ? -errno : pid;
+    close(fds[0]);
+    close(fds[1]);
+    free(argv);
+    free(envp);
+    write_all(sock, &reply, sizeof(reply));
+  }
+}
+
+#else
+
+int shim_launcher(int sock) {
+  (void)sock;
+  fprintf(stderr, "wake launcher: not supported on this platform\n");
+  return 1;
+}
+
+#endif
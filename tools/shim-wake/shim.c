@@ -33,6 +33,7 @@
 
 #include "blake2/blake2.h"
 #include "compat/nofollow.h"
+#include "shim.h"
 
 // Can increase to 64 if needed
 #define HASH_BYTES 32
@@ -116,46 +117,21 @@ static int do_hash(const char *file) {
   return do_hash_file(file, fd);
 }
 
-int main(int argc, char **argv) {
-  int stdin_fd, stdout_fd, stderr_fd;
-  struct rlimit nfd;
-  const char *dir;
-
-  if (argc < 6) return 1;
+int shim_exec(const char *stdin_file, int stdout_fd, int stderr_fd, const char *dir,
+              char **argv) {
+  int stdin_fd;
 
-  // Spawn all wake child processes with a reproducible default umask.
-  // The main wake process has umask(0), but children should not use this.
-  umask(S_IWGRP | S_IWOTH);
-
-  // Put a safety net down for child process that might use select()
-  if (getrlimit(RLIMIT_NOFILE, &nfd) == -1) {
-    perror("getrlimit(RLIMIT_NOFILE)");
-    return 127;
-  }
-
-  if (nfd.rlim_cur == RLIM_INFINITY || nfd.rlim_cur > FD_SETSIZE) {
-    nfd.rlim_cur = FD_SETSIZE;
-    if (setrlimit(RLIMIT_NOFILE, &nfd) == -1) {
-      perror("getrlimit(RLIMIT_NOFILE)");
-      return 127;
-    }
-  }
-
-  dir = argv[4];
   if ((dir[0] != '.' || dir[1] != 0) && chdir(dir)) {
     fprintf(stderr, "chdir: %s: %s\n", dir, strerror(errno));
     return 127;
   }
 
-  stdin_fd = open(argv[1], O_RDONLY);
+  stdin_fd = open(stdin_file, O_RDONLY);
   if (stdin_fd == -1) {
-    fprintf(stderr, "open: %s: %s\n", argv[1], strerror(errno));
+    fprintf(stderr, "open: %s: %s\n", stdin_file, strerror(errno));
     return 127;
   }
 
-  stdout_fd = atoi(argv[2]);
-  stderr_fd = atoi(argv[3]);
-
   while (stdin_fd <= 2 && stdin_fd != 0) stdin_fd = dup(stdin_fd);
   while (stdout_fd <= 2 && stderr_fd != 1) stdout_fd = dup(stdout_fd);
   while (stderr_fd <= 2 && stdout_fd != 2) stderr_fd = dup(stderr_fd);
@@ -175,11 +151,40 @@ int main(int argc, char **argv) {
     close(stderr_fd);
   }
 
-  if (strcmp(argv[5], "<hash>")) {
-    execvp(argv[5], argv + 5);
-    fprintf(stderr, "execvp: %s: %s\n", argv[5], strerror(errno));
+  if (strcmp(argv[0], "<hash>")) {
+    execvp(argv[0], argv);
+    fprintf(stderr, "execvp: %s: %s\n", argv[0], strerror(errno));
     return 127;
   } else {
-    return do_hash(argv[6]);
+    return do_hash(argv[1]);
   }
 }
+
+int main(int argc, char **argv) {
+  struct rlimit nfd;
+
+  // Spawn all wake child processes with a reproducible default umask.
+  // The main wake process has umask(0), but children should not use this.
+  umask(S_IWGRP | S_IWOTH);
+
+  // Put a safety net down for child process that might use select()
+  if (getrlimit(RLIMIT_NOFILE, &nfd) == -1) {
+    perror("getrlimit(RLIMIT_NOFILE)");
+    return 127;
+  }
+
+  if (nfd.rlim_cur == RLIM_INFINITY || nfd.rlim_cur > FD_SETSIZE) {
+    nfd.rlim_cur = FD_SETSIZE;
+    if (setrlimit(RLIMIT_NOFILE, &nfd) == -1) {
+      perror("getrlimit(RLIMIT_NOFILE)");
+      return 127;
+    }
+  }
+
+  // Jobs spawned by the launcher inherit the umask and limits set above
+  if (argc == 3 && !strcmp(argv[1], "<launcher>")) return shim_launcher(atoi(argv[2]));
+
+  if (argc < 6) return 1;
+
+  return shim_exec(argv[1], atoi(argv[2]), atoi(argv[3]), argv[4], argv + 5);
+}
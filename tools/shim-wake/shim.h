@@ -0,0 +1,31 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SHIM_H
+#define SHIM_H
+
+// Enters `dir`, redirects stdin from `stdin_file` and stdout/stderr to the
+// given descriptors, then execs argv (or hashes argv[1] for "<hash>").
+// Returns the exit status to use if that failed.
+int shim_exec(const char *stdin_file, int stdout_fd, int stderr_fd, const char *dir,
+              char **argv);
+
+// Spawns jobs for wake, as requested over the socket `sock`, until wake
+// closes it. See src/runtime/launcher.h for the protocol.
+int shim_launcher(int sock);
+
+#endif
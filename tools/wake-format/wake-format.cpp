@@ -137,7 +137,7 @@ void print_cst(CSTElement node, int depth) {
   }
 }
 
-DiagnosticReporter *reporter;
+thread_local DiagnosticReporter *reporter;
 int main(int argc, char **argv) {
   TerminalReporter terminalReporter;
   reporter = &terminalReporter;
@@ -0,0 +1,271 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime/database.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+
+#include <string>
+#include <vector>
+
+#include "compat/mtime.h"
+#include "unit.h"
+#include "util/execpath.h"
+#include "util/unlink.h"
+
+TEST(database_output_segments) {
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+  long job;
+  db.insert_job(".", "", "echo", "", 0, "echo", "", "", &job);
+
+  // Enough output to fill several segments, and some left buffered
+  std::string out, err;
+  for (int i = 0; i < 100000; ++i) {
+    std::string line = "line " + std::to_string(i) + "\n";
+    db.save_output(job, 1, line.data(), line.size(), i / 1000.0);
+    out += line;
+    if (i % 9999 == 0) {
+      db.save_output(job, 2, line.data(), line.size(), i / 1000.0);
+      err += line;
+    }
+  }
+
+  EXPECT_EQUAL(out, db.get_output(job, 1));
+  EXPECT_EQUAL(err, db.get_output(job, 2));
+
+  // Chunks come back as they were written, interleaved, with their times
+  std::vector<int> order;
+  double last = 0;
+  bool monotonic = true;
+  db.read_output(job, 0, [&](int descriptor, double seconds, const char *, size_t) {
+    if (order.empty() || order.back() != descriptor) order.push_back(descriptor);
+    monotonic = monotonic && seconds >= last;
+    last = seconds;
+  });
+  EXPECT_EQUAL(23, int(order.size()));
+  EXPECT_TRUE(monotonic);
+  EXPECT_EQUAL(99.999, last);
+}
+
+TEST(database_write_behind) {
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+
+  long job;
+  db.insert_job(".", "cmd", "env", "", 42, "label", "", "", &job);
+  Usage usage;
+  usage.status = 0;
+  usage.runtime = usage.cputime = 1;
+  usage.membytes = usage.ibytes = usage.obytes = 0;
+  db.finish_job(job, "", "", "", 0, 1, 7, true, usage);
+  db.tag_job(job, "uri", "content");
+
+  // The finished job is reused even if the writer has not committed it yet
+  long prior = 0;
+  std::vector<FileReflection> files;
+  double pathtime;
+  Usage reuse = db.reuse_job(".", "env", "cmd", "", 42, "", false, prior, files, &pathtime);
+  EXPECT_TRUE(reuse.found);
+  EXPECT_EQUAL(job, prior);
+
+  db.close();
+  WriteStats stats = db.write_stats();
+  EXPECT_EQUAL(0, int(stats.queued));
+  // insert, finish, tag, and marking the job as used by this run
+  EXPECT_EQUAL(4, int(stats.writes));
+  EXPECT_TRUE(stats.commits >= 1);
+  EXPECT_TRUE(stats.max_latency >= 0);
+}
+
+TEST(database_reuse_checks) {
+  char dir[] = "/tmp/wake-unit-database.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != nullptr);
+  std::string output = std::string(dir) + "/out";
+  FILE *f = fopen(output.c_str(), "w");
+  ASSERT_TRUE(f != nullptr);
+  fclose(f);
+
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+  file_stamp stamp = {0, 0, 0, 0, 0};
+  std::string hash(64, 'a');
+  db.add_hash("in/a", hash, stamp);
+  db.add_hash("in/b", hash, stamp);
+  db.add_hash("in/c", hash, stamp);
+  db.add_hash(output, hash, stamp);
+
+  std::string all("in/a\0in/b\0in/c\0", 15);
+  long job;
+  db.insert_job(".", "cmd", "env", "", 42, "label", "", all, &job);
+  Usage usage;
+  usage.status = 0;
+  usage.runtime = usage.cputime = 1;
+  usage.membytes = usage.ibytes = usage.obytes = 0;
+  db.finish_job(job, std::string("in/a\0in/b\0", 10), output + '\0', output + '\0', 0, 1, 7,
+                true, usage);
+
+  auto reuse = [&](const std::string &visible, std::vector<FileReflection> &files) {
+    long prior;
+    double pathtime;
+    files.clear();
+    return db.reuse_job(".", "env", "cmd", "", 42, visible, false, prior, files, &pathtime).found;
+  };
+
+  std::vector<FileReflection> files;
+  EXPECT_TRUE(reuse(all, files));
+  ASSERT_EQUAL(1, int(files.size()));
+  EXPECT_EQUAL(output, files[0].path);
+  EXPECT_EQUAL(hash, files[0].hash);
+
+  // Another list with the inputs in it, and one without
+  EXPECT_TRUE(reuse(std::string("in/bb\0in/b\0in/a\0", 16), files));
+  EXPECT_FALSE(reuse(std::string("in/b\0in/c\0", 10), files));
+  EXPECT_TRUE(files.empty());
+  EXPECT_FALSE(reuse(std::string("in/a\0in/\0", 9), files));
+
+  // A cached job whose output is gone must run again
+  unlink(output.c_str());
+  EXPECT_FALSE(reuse(all, files));
+  EXPECT_TRUE(files.empty());
+
+  db.close();
+  rmdir(dir);
+}
+
+TEST(database_target_results) {
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+
+  TargetResult result;
+  EXPECT_FALSE(db.get_target("key", result));
+
+  std::vector<TargetResult> results(1);
+  results[0].hash = "key";
+  results[0].observed = 2;
+  results[0].value = std::string("S\3abc");
+  std::string log("observations\0", 13);
+  db.save_targets("program", log, std::move(results));
+  db.clean();
+
+  ASSERT_TRUE(db.get_target("key", result));
+  EXPECT_EQUAL(2, int(result.observed));
+  EXPECT_EQUAL(std::string("S\3abc"), result.value);
+  EXPECT_EQUAL(log, db.get_observations(result.run));
+
+  // A later run of a changed program drops them, with their observations
+  long first = result.run;
+  db.prepare("wake-unit");
+  results = std::vector<TargetResult>(1);
+  results[0].hash = "other";
+  results[0].observed = 0;
+  db.save_targets("changed", "", std::move(results));
+  db.clean();
+  EXPECT_FALSE(db.get_target("key", result));
+  EXPECT_EQUAL("", db.get_observations(first));
+  EXPECT_TRUE(db.get_target("other", result));
+
+  db.close();
+}
+
+TEST(database_programs) {
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+
+  EXPECT_EQUAL("", db.get_program("first"));
+  db.save_program("first", "files", "image 1");
+  db.save_program("second", "files", "image 2");
+  db.clean();
+  EXPECT_EQUAL("image 1", db.get_program("first"));
+  EXPECT_EQUAL("image 2", db.get_program("second"));
+
+  // Programs compiled from other wakefiles are dropped
+  db.save_program("third", "changed", "image 3");
+  db.forget_program("second");
+  db.clean();
+  EXPECT_EQUAL("", db.get_program("first"));
+  EXPECT_EQUAL("", db.get_program("second"));
+  EXPECT_EQUAL("image 3", db.get_program("third"));
+
+  db.close();
+}
+
+TEST(database_file_hashes) {
+  char dir[] = "/tmp/wake-unit-hashes.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != nullptr);
+  std::string cwd = get_cwd();
+  ASSERT_EQUAL(0, chdir(dir));
+  // The empty wake.db which 'wake --init' leaves behind
+  int fd = open("wake.db", O_RDWR | O_CREAT | O_TRUNC, 0644);
+  ASSERT_TRUE(fd != -1);
+  close(fd);
+
+  std::string hex(64, 'a');
+  file_stamp stamp = {1, 2, 3, 4, 5};
+  {
+    Database db(false);
+    ASSERT_EQUAL("", db.open(false, false, false));
+    db.prepare("wake-unit");
+    db.add_hash("file", hex, stamp);
+    EXPECT_EQUAL(hex, db.get_hash("file", stamp));
+
+    // Any change to the stamp means the file has to be hashed again
+    for (int64_t file_stamp::*field :
+         {&file_stamp::device, &file_stamp::inode, &file_stamp::size, &file_stamp::mtime_ns,
+          &file_stamp::ctime_ns}) {
+      file_stamp changed = stamp;
+      ++(changed.*field);
+      EXPECT_EQUAL("", db.get_hash("file", changed));
+    }
+    EXPECT_EQUAL("", db.get_hash("other", stamp));
+
+    // A batch of hashes, in both of the forms kept in memory
+    for (int i = 0; i < 100; ++i) {
+      file_stamp each = {1, i, 3, 4, 5};
+      db.add_hash("batch" + std::to_string(i), i % 2 ? hex : "short" + std::to_string(i), each);
+    }
+    db.close();
+  }
+
+  // The batch was written back and a new run reads it in again
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, false, false));
+  db.prepare("wake-unit");
+  EXPECT_EQUAL(hex, db.get_hash("file", stamp));
+  int reused = 0;
+  for (int i = 0; i < 100; ++i) {
+    file_stamp each = {1, i, 3, 4, 5};
+    reused += db.get_hash("batch" + std::to_string(i), each) ==
+              (i % 2 ? hex : "short" + std::to_string(i));
+  }
+  EXPECT_EQUAL(100, reused);
+  file_stamp changed = {1, 0, 3, 4, 6};
+  EXPECT_EQUAL("", db.get_hash("batch0", changed));
+  db.close();
+
+  ASSERT_EQUAL(0, chdir(cwd.c_str()));
+  deep_unlink(AT_FDCWD, dir);
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cmath>
+#include <string>
+
+#include "runtime/gc.h"
+#include "runtime/runtime.h"
+#include "runtime/tuple.h"
+#include "runtime/value.h"
+#include "types/datatype.h"
+#include "unit.h"
+
+static String *string(Heap &h, const std::string &str) {
+  h.guarantee(String::reserve(str.size()));
+  return String::claim(h, str);
+}
+
+static void churn(Heap &h) {
+  for (int i = 0; i < 100000; ++i) string(h, "garbage which dies in the nursery");
+}
+
+TEST_FUNC(void, heap_survives_collections, bool generational) {
+  Runtime runtime(nullptr, 0, 4.0, generational);
+  Heap &h = runtime.heap;
+
+  h.guarantee(Record::reserve(2));
+  RootPointer<Record> record = h.root(Record::claim(h, nullptr, 2));
+  h.GC(1);
+
+  // Once promoted, stores into the record must pass the write barrier
+  String *first = string(h, "first");
+  record->at(0)->fulfill(runtime, first);
+  churn(h);
+
+  h.guarantee(Record::reserve(1) + String::reserve(6));
+  Record *inner = Record::claim(h, nullptr, 1);
+  inner->at(0)->instant_fulfill(String::claim(h, "second"));
+  record->at(1)->fulfill(runtime, inner);
+  churn(h);
+
+  EXPECT_EQUAL("first", record->at(0)->coerce<String>()->as_str());
+  Record *kept = record->at(1)->coerce<Record>();
+  EXPECT_EQUAL("second", kept->at(0)->coerce<String>()->as_str());
+
+  h.GC(0);
+  kept = record->at(1)->coerce<Record>();
+  EXPECT_EQUAL("second", kept->at(0)->coerce<String>()->as_str());
+}
+
+TEST(gc_copying) { TEST_FUNC_CALL(heap_survives_collections, false); }
+
+TEST(gc_generational) { TEST_FUNC_CALL(heap_survives_collections, true); }
+
+TEST(gc_generational_keeps_old_objects_in_place) {
+  Runtime runtime(nullptr, 0, 4.0, true);
+  Heap &h = runtime.heap;
+
+  // Live data gives the old space slack to accept promotions without a major
+  // GC, once a collection has measured it
+  RootPointer<String> ballast = h.root(string(h, std::string(1 << 20, 'x')));
+  h.GC(0);
+  h.GC(0);
+  RootPointer<String> old = h.root(string(h, "old"));
+  h.GC(1);
+  String *promoted = old.get();
+  churn(h);
+  EXPECT_TRUE(promoted == old.get());
+  EXPECT_EQUAL("old", old->as_str());
+}
+
+TEST_FUNC(void, heap_copies_in_parallel, bool generational) {
+  Runtime runtime(nullptr, 0, 4.0, generational, 4);
+  Heap &h = runtime.heap;
+
+  // Enough records that the heap is worth copying with several threads
+  const size_t count = 20000, width = 8;
+  h.guarantee(count * (Record::reserve(width) + width * String::reserve(8)) + Record::reserve(0));
+  Record *list = Record::claim(h, nullptr, 0);
+  for (size_t i = 0; i < count; ++i) {
+    Record *node = Record::claim(h, nullptr, width);
+    for (size_t j = 0; j + 1 < width; ++j) {
+      node->at(j)->instant_fulfill(String::claim(h, std::to_string(i * width + j)));
+    }
+    node->at(width - 1)->instant_fulfill(list);
+    list = node;
+  }
+  RootPointer<Record> root = h.root(list);
+
+  h.GC(0);
+  h.GC(0);
+
+  size_t i = count;
+  bool ok = true;
+  for (Record *node = root.get(); node->size() == width;
+       node = node->at(width - 1)->coerce<Record>()) {
+    --i;
+    for (size_t j = 0; j + 1 < width; ++j) {
+      ok = ok && node->at(j)->coerce<String>()->as_str() == std::to_string(i * width + j);
+    }
+  }
+  EXPECT_EQUAL(0, int(i));
+  EXPECT_TRUE(ok);
+}
+
+TEST(gc_parallel) { TEST_FUNC_CALL(heap_copies_in_parallel, false); }
+
+TEST(gc_parallel_generational) { TEST_FUNC_CALL(heap_copies_in_parallel, true); }
+
+TEST(gc_heap_snapshot) {
+  Heap h(0, 4.0);
+  // Sampling on average every byte samples every allocation at its own size
+  h.sample(1);
+
+  String *shared = string(h, std::string(500, 's'));
+  h.attribute(2);
+  RootPointer<String> other = h.root(shared);
+  string(h, "garbage");
+  h.attribute(3);
+
+  h.guarantee(Record::reserve(3) + 2 * String::reserve(1000));
+  Record *pair = Record::claim(h, &Constructor::array, 3);
+  h.attribute(0);
+  pair->at(0)->instant_fulfill(String::claim(h, std::string(1000, 'a')));
+  pair->at(1)->instant_fulfill(String::claim(h, std::string(1000, 'b')));
+  h.attribute(1);
+  pair->at(2)->instant_fulfill(other.get());
+  RootPointer<Record> root = h.root(pair);
+
+  HeapSnapshot snapshot = h.snapshot();
+  size_t record = Record::reserve(3) * sizeof(PadObject);
+  size_t strings = 2 * String::reserve(1000) * sizeof(PadObject);
+  size_t shared_bytes = String::reserve(500) * sizeof(PadObject);
+  EXPECT_EQUAL(4, int(snapshot.objects));
+  EXPECT_EQUAL(int(record + strings + shared_bytes), int(snapshot.bytes));
+
+  // Both roots reach the shared string, so neither retains it (newest root first)
+  ASSERT_EQUAL(2, int(snapshot.roots.size()));
+  EXPECT_EQUAL(int(record + strings), int(snapshot.roots[0].retained));
+  EXPECT_EQUAL(0, int(snapshot.roots[1].retained));
+
+  ASSERT_EQUAL(4, int(snapshot.sites.size()));
+  EXPECT_EQUAL(int(record + strings), int(std::lround(snapshot.sites[0].retained)));
+  EXPECT_EQUAL(int(strings), int(std::lround(snapshot.sites[1].retained)));
+  EXPECT_EQUAL(2, int(std::lround(snapshot.sites[1].objects)));
+  EXPECT_EQUAL(int(strings), int(std::lround(snapshot.sites[1].live)));
+  EXPECT_EQUAL(int(shared_bytes), int(std::lround(snapshot.sites[2].retained)));
+  EXPECT_EQUAL(int(shared_bytes), int(std::lround(snapshot.sites[2].survived)));
+  EXPECT_EQUAL(0, int(std::lround(snapshot.sites[3].live)));
+  EXPECT_EQUAL(int(String::reserve(7) * sizeof(PadObject)),
+               int(std::lround(snapshot.sites[3].bytes)));
+}
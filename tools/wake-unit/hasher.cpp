@@ -0,0 +1,105 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime/hasher.h"
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+
+#include "unit.h"
+
+static std::string scratch_dir() {
+  char dir[] = "/tmp/wake-unit-hasher.XXXXXX";
+  return mkdtemp(dir) ? dir : "";
+}
+
+static void write_file(const std::string &path, const std::string &content) {
+  FILE *f = fopen(path.c_str(), "w");
+  fwrite(content.data(), 1, content.size(), f);
+  fclose(f);
+}
+
+TEST(hasher_matches_shim) {
+  std::string dir = scratch_dir();
+  ASSERT_FALSE(dir.empty());
+  write_file(dir + "/file", "hello\n");
+  write_file(dir + "/empty", "");
+  ASSERT_EQUAL(0, symlink("target", (dir + "/link").c_str()));
+
+  std::string hash, error;
+  uint64_t bytes;
+  ASSERT_TRUE(hash_file(dir + "/file", hash, error, bytes));
+  EXPECT_EQUAL("93becc6e9882211c3ec3708c95bcd69baab7bb59c7f4bc84ce637b88a534b783", hash);
+  EXPECT_EQUAL(6, int(bytes));
+
+  ASSERT_TRUE(hash_file(dir + "/empty", hash, error, bytes));
+  EXPECT_EQUAL("0e5751c026e543b2e8ab2eb06099daa1d1e5df47778f7787faab45cdf12fe3a8", hash);
+
+  // A symlink hashes as its target path, not what it points to
+  ASSERT_TRUE(hash_file(dir + "/link", hash, error, bytes));
+  EXPECT_EQUAL("874c10b404c95b0d503ef6afb0fb228aaa313a6195a64075843f405eb8449444", hash);
+
+  ASSERT_TRUE(hash_file(dir, hash, error, bytes));
+  EXPECT_EQUAL(std::string(64, '0'), hash);
+
+  EXPECT_FALSE(hash_file(dir + "/missing", hash, error, bytes));
+  EXPECT_FALSE(error.empty());
+
+  unlink((dir + "/file").c_str());
+  unlink((dir + "/empty").c_str());
+  unlink((dir + "/link").c_str());
+  rmdir(dir.c_str());
+}
+
+TEST(hasher_pool) {
+  std::string dir = scratch_dir();
+  ASSERT_FALSE(dir.empty());
+  write_file(dir + "/file", "hello\n");
+
+  FileHasher hasher(4);
+  for (long i = 0; i < 100; ++i) hasher.submit(i, i == 42 ? dir + "/missing" : dir + "/file");
+
+  std::map<long, FileHash> results;
+  while (hasher.outstanding() != 0) {
+    struct pollfd fd = {hasher.ready_fd(), POLLIN, 0};
+    ASSERT_EQUAL(1, poll(&fd, 1, 10000));
+    for (auto &result : hasher.collect()) results[result.token] = result;
+  }
+
+  ASSERT_EQUAL(100, int(results.size()));
+  for (auto &result : results) {
+    if (result.first == 42) {
+      EXPECT_TRUE(result.second.hash.empty());
+      EXPECT_FALSE(result.second.error.empty());
+    } else {
+      EXPECT_EQUAL("93becc6e9882211c3ec3708c95bcd69baab7bb59c7f4bc84ce637b88a534b783",
+                   result.second.hash);
+    }
+  }
+
+  HashStats stats = hasher.stats();
+  EXPECT_EQUAL(100, int(stats.files));
+  EXPECT_EQUAL(99 * 6, int(stats.bytes));
+
+  unlink((dir + "/file").c_str());
+  rmdir(dir.c_str());
+}
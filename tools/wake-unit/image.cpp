@@ -0,0 +1,184 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "optimizer/image.h"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dst/bind.h"
+#include "dst/expr.h"
+#include "dst/todst.h"
+#include "optimizer/ssa.h"
+#include "parser/cst.h"
+#include "runtime/prim.h"
+#include "runtime/runtime.h"
+#include "unit.h"
+#include "util/diagnostic.h"
+#include "util/file.h"
+
+namespace {
+
+struct CountingReporter : public DiagnosticReporter {
+  int errors = 0;
+
+  void report(Diagnostic diagnostic) override {
+    if (diagnostic.getSeverity() == S_ERROR) {
+      ++errors;
+      std::cerr << diagnostic.getMessage() << std::endl;
+    }
+  }
+};
+
+}  // namespace
+
+// What the program needs from the standard library
+static const char prelude[] =
+    "package wake\n"
+    "\n"
+    "export data Unit = Unit\n";
+
+// Sum types, primitives, and a literal which inlining copies into several
+// functions; the recursive one survives optimization, with its fragment
+static const char program[] =
+    "package image\n"
+    "\n"
+    "data Shape =\n"
+    "  Circle Integer\n"
+    "  Rect Integer Integer\n"
+    "\n"
+    "data Named = Named String Integer\n"
+    "\n"
+    "def mul (x: Integer) (y: Integer): Integer = (\\_ \\_ prim \"mul\") x y\n"
+    "def cat (x: String) (y: String): String = (\\_ \\_ prim \"vcat\") x y\n"
+    "\n"
+    "def area = match _\n"
+    "  Circle r = mul (mul r r) 3\n"
+    "  Rect w h = mul w h\n"
+    "\n"
+    "def name s = cat \"shape-literal\" s\n"
+    "\n"
+    "data Nat =\n"
+    "  Zero\n"
+    "  Succ Nat\n"
+    "\n"
+    "def label = match _\n"
+    "  Zero = name \"circle\"\n"
+    "  Succ n = name (label n)\n"
+    "\n"
+    "data Both = Both Named Named\n"
+    "\n"
+    "export def result =\n"
+    "  def circle = Named (label (Succ (Succ Zero))) (area (Circle 5))\n"
+    "  Both circle (Named (name \"rect\") (area (Rect 2 7)))\n";
+
+// Compiles 'file' with 'command' as its body, as main does
+static std::unique_ptr<Term> compile(StringFile &lib, StringFile &file, const char *command,
+                                     const PrimMap &pmap, Runtime &runtime,
+                                     CountingReporter &diagnostics) {
+  CST libcst(lib, diagnostics);
+  CST cst(file, diagnostics);
+  std::unique_ptr<Top> top(new Top);
+  dst_top(libcst.root(), *top);
+  top->def_package = dst_top(cst.root(), *top);
+  if (!flatten_exports(*top)) return nullptr;
+  ExprParser expr(command);
+  top->body = expr.expr(diagnostics);
+
+  bool ok = true;
+  std::unique_ptr<Expr> root = bind_refs(std::move(top), pmap, ok);
+  if (!ok || diagnostics.errors) return nullptr;
+  std::unique_ptr<Term> ssa = Term::fromExpr(std::move(root), runtime);
+  ssa = Term::optimize(std::move(ssa), runtime);
+  return Term::scope(std::move(ssa), runtime);
+}
+
+// Where each function of the program came from
+static void locations(Term *term, const FileContent *file, std::vector<std::string> &out) {
+  RFun *fun = dynamic_cast<RFun *>(term);
+  if (!fun) return;
+  if (fun->fragment.fcontent() == file) {
+    std::stringstream s;
+    s << fun->fragment.location();
+    out.push_back(s.str());
+  }
+  for (auto &child : fun->terms) locations(child.get(), file, out);
+}
+
+static std::string run(Runtime &runtime, Term *root) {
+  runtime.init(static_cast<RFun *>(root));
+  runtime.run();
+  std::stringstream out;
+  HeapObject::format(out, runtime.output.get());
+  return out.str();
+}
+
+TEST(image_round_trip) {
+  CountingReporter diagnostics;
+  DiagnosticReporter *saved = reporter;
+  reporter = &diagnostics;
+
+  StringInfo info(false, false, true, "", ".", nullptr);
+  PrimMap pmap;
+  prim_register_string(pmap, &info);
+  prim_register_integer(pmap);
+
+  Runtime runtime(nullptr, 0, 4.0);
+  StringFile lib("prelude.wake", std::string(prelude));
+  StringFile file("image.wake", std::string(program));
+  std::unique_ptr<Term> original = compile(lib, file, "result", pmap, runtime, diagnostics);
+  reporter = saved;
+  ASSERT_TRUE(original != nullptr);
+
+  std::string image = save_program(original.get(), "type");
+  ASSERT_FALSE(image.empty());
+  // The literal is written once, though several terms use it
+  std::string literal("shape-literal");
+  size_t first = image.find(literal);
+  ASSERT_TRUE(first != std::string::npos);
+  EXPECT_EQUAL(std::string::npos, image.find(literal, first + 1));
+
+  ProgramFiles files;
+  files.known.push_back(&lib);
+  files.known.push_back(&file);
+  std::string type;
+  std::unique_ptr<Term> loaded = load_program(image, runtime.heap, files, type);
+  ASSERT_TRUE(loaded != nullptr);
+  EXPECT_EQUAL("type", type);
+  ASSERT_TRUE(link_program(loaded.get(), pmap));
+
+  RFun *before = static_cast<RFun *>(original.get());
+  RFun *after = static_cast<RFun *>(loaded.get());
+  EXPECT_TRUE(before->hash == after->hash);
+  std::vector<std::string> before_locations, after_locations;
+  locations(before, &file, before_locations);
+  locations(after, &file, after_locations);
+  EXPECT_FALSE(before_locations.empty());
+  EXPECT_TRUE(before_locations == after_locations);
+
+  std::string expect = run(runtime, original.get());
+  EXPECT_EQUAL(expect, run(runtime, loaded.get()));
+  EXPECT_EQUAL("Both (Named \"shape-literalshape-literalshape-literalcircle\" 75) "
+               "(Named \"shape-literalrect\" 14)", expect);
+
+  // A wake lacking one of its primitives cannot run it
+  PrimMap partial;
+  prim_register_integer(partial);
+  EXPECT_FALSE(link_program(loaded.get(), partial));
+}
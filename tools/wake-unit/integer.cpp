@@ -0,0 +1,50 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+
+#include <string>
+
+#include "runtime/gc.h"
+#include "runtime/value.h"
+#include "unit.h"
+
+TEST(integer_small_matches_gmp) {
+  Heap h(0, 4.0);
+  const int64_t values[] = {0, 1, -1, 42, -42, INT64_MAX, -INT64_MAX, INT64_MIN};
+  for (int64_t value : values) {
+    MPZ mpz(std::to_string(value));
+    h.guarantee(Integer::reserve(value) + Integer::reserve(mpz));
+    Integer *small = Integer::claim(h, value);
+    Integer *big = Integer::claim(h, mpz);
+    EXPECT_EQUAL(Integer::reserve(mpz), Integer::reserve(value));
+    EXPECT_EQUAL(big->str(), small->str());
+    EXPECT_TRUE(big->shallow_hash() == small->shallow_hash());
+
+#if GMP_LIMB_BITS == 64 && GMP_NAIL_BITS == 0
+    // INT64_MIN is representable, but never read back as small
+    int64_t out = 0;
+    EXPECT_EQUAL(value != INT64_MIN, small->small(out));
+    if (value != INT64_MIN) EXPECT_EQUAL(value, out);
+#endif
+  }
+
+  MPZ wide(std::string("18446744073709551616"));
+  h.guarantee(Integer::reserve(wide));
+  int64_t out;
+  EXPECT_FALSE(Integer::claim(h, wide)->small(out));
+}
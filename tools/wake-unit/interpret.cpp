@@ -0,0 +1,155 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+#include "dst/bind.h"
+#include "dst/todst.h"
+#include "optimizer/ssa.h"
+#include "parser/cst.h"
+#include "runtime/prim.h"
+#include "runtime/runtime.h"
+#include "unit.h"
+#include "util/diagnostic.h"
+#include "util/file.h"
+
+namespace {
+
+struct CountingReporter : public DiagnosticReporter {
+  int errors = 0;
+
+  void report(Diagnostic diagnostic) override {
+    if (diagnostic.getSeverity() == S_ERROR) {
+      ++errors;
+      std::cerr << diagnostic.getMessage() << std::endl;
+    }
+  }
+};
+
+}  // namespace
+
+// What the program needs from the standard library
+static const char prelude[] =
+    "package wake\n"
+    "\n"
+    "export data Unit = Unit\n"
+    "\n"
+    "export data Order =\n"
+    "  LT\n"
+    "  EQ\n"
+    "  GT\n";
+
+static const char program[] =
+    "package interp\n"
+    "\n"
+    "def add (x: Integer) (y: Integer): Integer = (\\_ \\_ prim \"add\") x y\n"
+    "def sub (x: Integer) (y: Integer): Integer = (\\_ \\_ prim \"sub\") x y\n"
+    "def mul (x: Integer) (y: Integer): Integer = (\\_ \\_ prim \"mul\") x y\n"
+    "def cmp (x: Integer) (y: Integer): Order = (\\_ \\_ prim \"icmp\") x y\n"
+    "\n"
+    "def square x = mul x x\n"
+    "\n"
+    "def sumTo acc n = match (cmp n 0)\n"
+    "  GT = sumTo (add acc n) (sub n 1)\n"
+    "  _ = acc\n"
+    "\n"
+    "def count n = match (cmp n 0)\n"
+    "  GT = add 1 (count (sub n 1))\n"
+    "  _ = 0\n"
+    "\n"
+    "data Ints =\n"
+    "  Done\n"
+    "  More Integer Ints\n"
+    "\n"
+    "def build n acc = match (cmp n 0)\n"
+    "  GT = build (sub n 1) (More n acc)\n"
+    "  _ = acc\n"
+    "\n"
+    "def foldl f acc = match _\n"
+    "  Done = acc\n"
+    "  More x rest = foldl f (f acc x) rest\n"
+    "\n"
+    "def compose f g x = f (g x)\n"
+    "\n"
+    "def pick n = match (cmp n 0)\n"
+    "  LT = sub 0\n"
+    "  _ = add 1\n"
+    "\n"
+    "export def direct = add (square 6) (square 2)\n"
+    "export def tailCalls = sumTo 0 100000\n"
+    "export def deepCalls = count 100000\n"
+    "export def fold = foldl add 0 (build 1000 Done)\n"
+    "export def increment = compose (pick 5) square 7\n"
+    "export def negate = (compose (pick (sub 0 1)) square) 3\n";
+
+// Compiles and runs `command` in the context of the program above
+static std::string evaluate(const char *command) {
+  CountingReporter diagnostics;
+  DiagnosticReporter *saved = reporter;
+  reporter = &diagnostics;
+
+  StringInfo info(false, false, true, "", ".", nullptr);
+  PrimMap pmap;
+  prim_register_string(pmap, &info);
+  prim_register_integer(pmap);
+
+  Runtime runtime(nullptr, 0, 4.0);
+  StringFile lib("prelude.wake", std::string(prelude));
+  StringFile file("interp.wake", std::string(program));
+  CST libcst(lib, diagnostics);
+  CST cst(file, diagnostics);
+  std::unique_ptr<Top> top(new Top);
+  dst_top(libcst.root(), *top);
+  top->def_package = dst_top(cst.root(), *top);
+  bool ok = flatten_exports(*top);
+  ExprParser expr(command);
+  top->body = expr.expr(diagnostics);
+
+  std::unique_ptr<Expr> root = ok ? bind_refs(std::move(top), pmap, ok) : nullptr;
+  reporter = saved;
+  if (!ok || diagnostics.errors) return "<compile error>";
+
+  std::unique_ptr<Term> ssa = Term::fromExpr(std::move(root), runtime);
+  ssa = Term::optimize(std::move(ssa), runtime);
+  ssa = Term::scope(std::move(ssa), runtime);
+  runtime.init(static_cast<RFun *>(ssa.get()));
+  runtime.run();
+  std::stringstream out;
+  HeapObject::format(out, runtime.output.get());
+  return out.str();
+}
+
+// A fully applied call returns straight into its caller's slot
+TEST(interpret_direct_return) { EXPECT_EQUAL("40", evaluate("direct")); }
+
+// Neither a chain of tail calls nor one waiting on each deeper call
+// runs out of anything
+TEST(interpret_deep_calls) {
+  EXPECT_EQUAL("5000050000", evaluate("tailCalls"));
+  EXPECT_EQUAL("100000", evaluate("deepCalls"));
+}
+
+// Partial applications, and functions which are themselves the result of
+// a call, go through a continuation
+TEST(interpret_continuations) {
+  EXPECT_EQUAL("500500", evaluate("fold"));
+  EXPECT_EQUAL("50", evaluate("increment"));
+  EXPECT_EQUAL("-9", evaluate("negate"));
+}
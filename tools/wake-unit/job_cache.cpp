@@ -0,0 +1,608 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Open Group Base Specifications Issue 7
+#define _XOPEN_SOURCE 700
+#define _POSIX_C_SOURCE 200809L
+
+#include "job_cache/job_cache.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "unit.h"
+#include "util/execpath.h"
+#include "util/unlink.h"
+
+// Like the shim, the job-cache tool is only installed next to a full build
+static std::string job_cache_tool() { return find_execpath() + "/job-cache"; }
+
+static void write_file(const std::string &path, const char *content) {
+  FILE *f = fopen(path.c_str(), "w");
+  fputs(content, f);
+  fclose(f);
+}
+
+static std::string read_file(const std::string &path) {
+  std::string out;
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) return "<missing>";
+  char buffer[256];
+  size_t got;
+  while ((got = fread(buffer, 1, sizeof(buffer), f)) > 0) out.append(buffer, got);
+  fclose(f);
+  return out;
+}
+
+static void sleep_ms(int ms) {
+  struct timespec delay;
+  delay.tv_sec = ms / 1000;
+  delay.tv_nsec = (ms % 1000) * INT64_C(1000000);
+  nanosleep(&delay, nullptr);
+}
+
+// The daemon serving a cache holds a lock on its log for as long as it runs
+static pid_t daemon_pid(const std::string &cache) {
+  int fd = open((cache + "/job-cache.log").c_str(), O_RDONLY);
+  if (fd == -1) return -1;
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = F_WRLCK;
+  fl.l_whence = SEEK_SET;
+  int ret = fcntl(fd, F_GETLK, &fl);
+  close(fd);
+  return ret == -1 || fl.l_type == F_UNLCK ? -1 : fl.l_pid;
+}
+
+// Waits up to `ms` for the daemon to be gone
+static bool daemon_gone(const std::string &cache, int ms) {
+  for (int waited = 0; daemon_pid(cache) != -1; waited += 10) {
+    if (waited >= ms) return false;
+    sleep_ms(10);
+  }
+  return true;
+}
+
+// A scratch directory to run a build in, with its cache inside it.
+// Outputs read from the cache land relative to the build.
+struct Scratch {
+  std::string dir;
+  std::string cache;
+  std::string cwd;
+
+  Scratch() {
+    char name[] = "/tmp/wake-unit-cache.XXXXXX";
+    if (mkdtemp(name)) dir = name;
+    cache = dir + "/cache";
+    cwd = get_cwd();
+    if (chdir(dir.c_str()) != 0) dir.clear();
+  }
+
+  ~Scratch() {
+    pid_t pid = daemon_pid(cache);
+    if (pid != -1) kill(pid, SIGTERM);
+    daemon_gone(cache, 5000);
+    if (chdir(cwd.c_str()) != 0) return;
+    if (!dir.empty()) deep_unlink(AT_FDCWD, dir.c_str());
+  }
+};
+
+// Runs the job-cache tool on `cache` to completion, without its output.
+// Returns its exit status.
+static int run_tool(const std::string &cache, std::vector<std::string> args) {
+  std::string tool = job_cache_tool();
+  args.insert(args.begin(), cache);
+  args.insert(args.begin(), tool);
+  std::vector<char *> argv;
+  for (auto &arg : args) argv.push_back(&arg[0]);
+  argv.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1) dup2(null, STDOUT_FILENO);
+    execv(tool.c_str(), argv.data());
+    _exit(127);
+  }
+  int status;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid) return -1;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// The command line tool reads its requests from a file
+static std::string request_file(const std::string &path, const JAST &json) {
+  std::stringstream s;
+  s << json;
+  write_file(path, s.str().c_str());
+  return path;
+}
+
+// Reads a single value from the cache database as text
+static std::string sql_value(const std::string &cache, const char *query) {
+  sqlite3 *db;
+  std::string out = "<failed>";
+  if (sqlite3_open_v2((cache + "/cache.db").c_str(), &db, SQLITE_OPEN_READONLY, nullptr)) {
+    sqlite3_close(db);
+    return out;
+  }
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db, query, -1, &stmt, nullptr) == SQLITE_OK) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      out = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(db);
+  return out;
+}
+
+// Runs `statement` against the cache database, behind the cache's back
+static bool sql(const std::string &cache, const char *statement) {
+  sqlite3 *db;
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+  if (sqlite3_open_v2((cache + "/cache.db").c_str(), &db, flags, nullptr)) {
+    sqlite3_close(db);
+    return false;
+  }
+  sqlite3_busy_timeout(db, 5000);
+  bool ok = sqlite3_exec(db, statement, nullptr, nullptr, nullptr) == SQLITE_OK;
+  sqlite3_close(db);
+  return ok;
+}
+
+static std::string hash(char digit) { return std::string(64, digit); }
+
+static void add_file(JAST &files, const std::string &path, const std::string &hash) {
+  auto &file = files.add(JSON_OBJECT);
+  file.add("path", std::string(path));
+  file.add("hash", std::string(hash));
+}
+
+static void add_header(JAST &json, const std::string &command) {
+  json.add("cwd", std::string("/ws"));
+  json.add("command_line", std::string(command));
+  json.add("envrionment", std::string("PATH=/usr/bin"));
+  json.add("stdin", std::string());
+}
+
+// A job reading /ws/in which wrote `src` to /ws/out/<command>
+static JAST add_request(const std::string &command, const std::string &src,
+                        const std::string &output_hash) {
+  JAST json(JSON_OBJECT);
+  add_header(json, command);
+  auto &inputs = json.add("input_files", JSON_ARRAY);
+  add_file(inputs, "/ws/in", hash('0'));
+  json.add("input_dirs", JSON_ARRAY);
+  auto &outputs = json.add("output_files", JSON_ARRAY);
+  auto &file = outputs.add(JSON_OBJECT);
+  file.add("src", std::string(src));
+  file.add("path", "/ws/out/" + command);
+  file.add("hash", std::string(output_hash));
+  return json;
+}
+
+static JAST read_request(const std::string &command, const std::string &input_hash) {
+  JAST json(JSON_OBJECT);
+  add_header(json, command);
+  auto &visible = json.add("input_files", JSON_ARRAY);
+  add_file(visible, "/ws/in", input_hash);
+  json.add("dir_redirects", JSON_OBJECT);
+  return json;
+}
+
+TEST(job_cache_messages) {
+  int fds[2];
+  ASSERT_EQUAL(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  job_cache::MessageParser parser(fds[0]);
+  std::vector<std::string> messages;
+
+  // Several messages arrive in one read, the last of them only in part
+  const char first[] = "{\"a\":1}\0{\"b\":2}\0{\"c\"";
+  ASSERT_EQUAL(int(sizeof(first) - 1), int(write(fds[1], first, sizeof(first) - 1)));
+  ASSERT_TRUE(parser.read(messages) == job_cache::MessageStatus::Ok);
+  ASSERT_EQUAL(2, int(messages.size()));
+  EXPECT_EQUAL("{\"a\":1}", messages[0]);
+  EXPECT_EQUAL("{\"b\":2}", messages[1]);
+
+  // A read which completes no message is fine too
+  ASSERT_EQUAL(1, int(write(fds[1], ":", 1)));
+  ASSERT_TRUE(parser.read(messages) == job_cache::MessageStatus::Ok);
+  EXPECT_EQUAL(2, int(messages.size()));
+
+  const char rest[] = "3}\0";
+  ASSERT_EQUAL(int(sizeof(rest) - 1), int(write(fds[1], rest, sizeof(rest) - 1)));
+  ASSERT_TRUE(parser.read(messages) == job_cache::MessageStatus::Ok);
+  ASSERT_EQUAL(3, int(messages.size()));
+  EXPECT_EQUAL("{\"c\":3}", messages[2]);
+
+  // What send_message writes is read back as one message
+  JAST sent(JSON_OBJECT);
+  sent.add("method", std::string("read"));
+  ASSERT_TRUE(job_cache::send_message(fds[1], sent));
+  ASSERT_TRUE(parser.read(messages) == job_cache::MessageStatus::Ok);
+  ASSERT_EQUAL(4, int(messages.size()));
+  JAST received;
+  ASSERT_TRUE(JAST::parse(messages[3], std::cerr, received));
+  EXPECT_EQUAL("read", received.get("method").value);
+
+  close(fds[1]);
+  EXPECT_TRUE(parser.read(messages) == job_cache::MessageStatus::Closed);
+
+  // Sending to a peer that hung up fails instead of raising SIGPIPE
+  EXPECT_FALSE(job_cache::send_message(fds[0], sent));
+  close(fds[0]);
+}
+
+TEST(job_cache_client_starts_daemon) {
+  std::string tool = job_cache_tool();
+  if (access(tool.c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  EXPECT_EQUAL(-1, daemon_pid(scratch.cache));
+
+  // The first request starts a daemon
+  job_cache::Client client(scratch.cache, tool);
+  bool found = true;
+  JAST result;
+  ASSERT_TRUE(client.read(read_request("build", hash('0')), found, result));
+  EXPECT_FALSE(found);
+  pid_t pid = daemon_pid(scratch.cache);
+  EXPECT_TRUE(pid != -1);
+  EXPECT_EQUAL(0, access(job_cache::socket_path(scratch.cache).c_str(), F_OK));
+
+  write_file(scratch.dir + "/built", "built");
+  ASSERT_TRUE(client.add(add_request("build", scratch.dir + "/built", hash('1'))));
+
+  // Another client is served by the same daemon
+  job_cache::Client other(scratch.cache, tool);
+  ASSERT_TRUE(other.read(read_request("build", hash('0')), found, result));
+  EXPECT_TRUE(found);
+  EXPECT_EQUAL("built", read_file(scratch.dir + "/ws/out/build"));
+  ASSERT_TRUE(other.read(read_request("build", hash('9')), found, result));
+  EXPECT_FALSE(found);
+  EXPECT_EQUAL(pid, daemon_pid(scratch.cache));
+}
+
+TEST(job_cache_daemon_idle) {
+  if (access(job_cache_tool().c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"serve", "1"}));
+  pid_t pid = -1;
+  for (int waited = 0; (pid = daemon_pid(scratch.cache)) == -1 && waited < 5000; waited += 10) {
+    sleep_ms(10);
+  }
+  ASSERT_TRUE(pid != -1);
+
+  // The daemon stays while a client is connected ...
+  {
+    job_cache::Client client(scratch.cache, job_cache_tool());
+    bool found = true;
+    JAST result;
+    ASSERT_TRUE(client.read(read_request("build", hash('0')), found, result));
+    EXPECT_FALSE(found);
+    sleep_ms(1500);
+    EXPECT_EQUAL(pid, daemon_pid(scratch.cache));
+  }
+
+  // ... and goes, with its socket, once it has been idle for a second
+  EXPECT_TRUE(daemon_gone(scratch.cache, 5000));
+  EXPECT_TRUE(access(job_cache::socket_path(scratch.cache).c_str(), F_OK) != 0);
+}
+
+TEST(job_cache_bad_request) {
+  std::string tool = job_cache_tool();
+  if (access(tool.c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  job_cache::Client client(scratch.cache, tool);
+  ASSERT_TRUE(client.connect());
+  pid_t pid = daemon_pid(scratch.cache);
+  EXPECT_TRUE(pid != -1);
+
+  // Each of these fails on its own, and the daemon goes on serving
+  write_file(scratch.dir + "/built", "built");
+  EXPECT_FALSE(client.add(add_request("missing", scratch.dir + "/nope", hash('1'))));
+  EXPECT_FALSE(client.add(add_request("malformed", scratch.dir + "/built", "not-a-hash")));
+  bool found = true;
+  JAST result;
+  EXPECT_FALSE(client.read(read_request("malformed", "0"), found, result));
+
+  EXPECT_TRUE(client.add(add_request("good", scratch.dir + "/built", hash('2'))));
+  found = false;
+  EXPECT_TRUE(client.read(read_request("good", hash('0')), found, result));
+  EXPECT_TRUE(found);
+  EXPECT_EQUAL("built", read_file(scratch.dir + "/ws/out/good"));
+  EXPECT_EQUAL(pid, daemon_pid(scratch.cache));
+
+  // An output the client cannot write is its own problem too
+  mkdir((scratch.dir + "/ws/out/blocked").c_str(), 0777);
+  EXPECT_TRUE(client.add(add_request("blocked", scratch.dir + "/built", hash('3'))));
+  EXPECT_FALSE(client.read(read_request("blocked", hash('0')), found, result));
+  EXPECT_EQUAL(pid, daemon_pid(scratch.cache));
+}
+
+TEST(job_cache_malformed_hash) {
+  std::string tool = job_cache_tool();
+  if (access(tool.c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  job_cache::Client client(scratch.cache, tool);
+  ASSERT_TRUE(client.connect());
+  pid_t pid = daemon_pid(scratch.cache);
+
+  write_file(scratch.dir + "/built", "built");
+  ASSERT_TRUE(client.add(add_request("inputs", scratch.dir + "/built", hash('1'))));
+  ASSERT_TRUE(client.add(add_request("outputs", scratch.dir + "/built", hash('2'))));
+  bool found = false;
+  JAST result;
+  ASSERT_TRUE(client.read(read_request("outputs", hash('0')), found, result));
+  ASSERT_TRUE(found);
+
+  // A corrupt row reads as a miss
+  ASSERT_TRUE(sql(scratch.cache,
+                  "update input_files set hash = x'00' where job ="
+                  "  (select job_id from jobs where commandline = 'inputs');"
+                  "update output_files set hash = x'0102' where job ="
+                  "  (select job_id from jobs where commandline = 'outputs');"));
+  EXPECT_TRUE(client.read(read_request("inputs", hash('0')), found, result));
+  EXPECT_FALSE(found);
+  EXPECT_TRUE(client.read(read_request("outputs", hash('0')), found, result));
+  EXPECT_FALSE(found);
+  EXPECT_EQUAL(pid, daemon_pid(scratch.cache));
+}
+
+// Hits, misses, and promotes of one tier as seen through `cache`
+static std::string tier_counts(const std::string &cache, const std::string &tier) {
+  std::string query =
+      "select hits || ' ' || misses || ' ' || promotes from tier_stats where tier = '" + tier + "'";
+  return sql_value(cache, query.c_str());
+}
+
+TEST(job_cache_tiers) {
+  if (access(job_cache_tool().c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  std::string shared = scratch.dir + "/shared";
+  std::string local = scratch.dir + "/local", other = scratch.dir + "/other";
+  ASSERT_EQUAL(0, run_tool(local, {"tier", shared}));
+  ASSERT_EQUAL(0, run_tool(other, {"tier", shared}));
+  write_file(scratch.dir + "/built", "built");
+
+  // A job added to one local cache is uploaded to the shared tier
+  std::string file = request_file(scratch.dir + "/add.json",
+                                  add_request("build", scratch.dir + "/built", hash('1')));
+  ASSERT_EQUAL(0, run_tool(other, {"add", file}));
+  EXPECT_EQUAL("1", sql_value(shared, "select count(*) from jobs"));
+  EXPECT_EQUAL("built", read_file(shared + "/blobs/11/" + hash('1')));
+  EXPECT_EQUAL("0 0 1", tier_counts(other, "shared"));
+
+  // Another local cache misses, hits in the shared tier, and promotes it
+  file = request_file(scratch.dir + "/read.json", read_request("build", hash('0')));
+  ASSERT_EQUAL(0, run_tool(local, {"read", file}));
+  EXPECT_EQUAL("built", read_file(scratch.dir + "/ws/out/build"));
+  EXPECT_EQUAL("1", sql_value(local, "select count(*) from jobs"));
+  EXPECT_EQUAL("built", read_file(local + "/blobs/11/" + hash('1')));
+
+  // Now it hits locally
+  unlink((scratch.dir + "/ws/out/build").c_str());
+  ASSERT_EQUAL(0, run_tool(local, {"read", file}));
+  EXPECT_EQUAL("built", read_file(scratch.dir + "/ws/out/build"));
+
+  // A job no tier has misses in both
+  file = request_file(scratch.dir + "/miss.json", read_request("build", hash('9')));
+  ASSERT_EQUAL(0, run_tool(local, {"read", file}));
+  EXPECT_EQUAL("1 2 1", tier_counts(local, "local"));
+  EXPECT_EQUAL("1 1 0", tier_counts(local, "shared"));
+
+  // Promotions are not uploaded back
+  EXPECT_EQUAL("1", sql_value(shared, "select count(*) from jobs"));
+}
+
+TEST(job_cache_shared_writers) {
+  if (access(job_cache_tool().c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  std::string shared = scratch.dir + "/shared";
+  write_file(scratch.dir + "/built", "built");
+
+  // Hosts sharing a network file system each have a cache of their own
+  // in front of the shared tier. Their uploads race to write it.
+  const int hosts = 4, jobs = 8;
+  std::vector<pid_t> pids;
+  for (int host = 0; host < hosts; ++host) {
+    std::string local = scratch.dir + "/local" + std::to_string(host);
+    ASSERT_EQUAL(0, run_tool(local, {"tier", shared}));
+    pid_t pid = fork();
+    if (pid == 0) {
+      int failed = 0;
+      for (int job = 0; job < jobs; ++job) {
+        std::string command = "job" + std::to_string(host) + "-" + std::to_string(job);
+        JAST request = add_request(command, scratch.dir + "/built", hash('1' + job));
+        std::string file = request_file(scratch.dir + "/" + command + ".json", request);
+        failed += run_tool(local, {"add", file}) != 0;
+      }
+      _exit(failed);
+    }
+    pids.push_back(pid);
+  }
+  for (pid_t pid : pids) {
+    int status;
+    ASSERT_EQUAL(pid, waitpid(pid, &status, 0));
+    EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  // Every upload made it, through a rollback journal rather than a WAL
+  EXPECT_EQUAL(std::to_string(hosts * jobs), sql_value(shared, "select count(*) from jobs"));
+  for (int job = 0; job < jobs; ++job) {
+    std::string blob = hash('1' + job);
+    EXPECT_EQUAL("built", read_file(shared + "/blobs/" + blob.substr(0, 2) + "/" + blob));
+  }
+  EXPECT_EQUAL("delete", sql_value(shared, "pragma journal_mode"));
+  EXPECT_EQUAL("wal", sql_value(scratch.dir + "/local0", "pragma journal_mode"));
+}
+
+TEST(job_cache_eviction) {
+  if (access(job_cache_tool().c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  write_file(scratch.dir + "/built", std::string(1000, 'x').c_str());
+
+  // Ten jobs of 1000 bytes each, added oldest first
+  for (int job = 0; job < 10; ++job) {
+    std::string command = "job" + std::to_string(job);
+    JAST request = add_request(command, scratch.dir + "/built", hash('0' + job));
+    std::string file = request_file(scratch.dir + "/" + command + ".json", request);
+    ASSERT_EQUAL(0, run_tool(scratch.cache, {"add", file}));
+  }
+  EXPECT_EQUAL("10000", sql_value(scratch.cache, "select bytes from cache_size"));
+
+  // Past the high watermark the oldest jobs go until the low one is reached
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"limit", "3500", "6000"}));
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"evict"}));
+  EXPECT_EQUAL("3000", sql_value(scratch.cache, "select bytes from cache_size"));
+  EXPECT_EQUAL("3", sql_value(scratch.cache, "select count(*) from jobs"));
+  EXPECT_EQUAL("job7", sql_value(scratch.cache, "select min(commandline) from jobs"));
+  for (int job = 0; job < 10; ++job) {
+    std::string blob = hash('0' + job);
+    std::string path = scratch.cache + "/blobs/" + blob.substr(0, 2) + "/" + blob;
+    EXPECT_EQUAL(job >= 7, access(path.c_str(), F_OK) == 0);
+  }
+
+  // Under the high watermark nothing more is evicted
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"evict"}));
+  EXPECT_EQUAL("3", sql_value(scratch.cache, "select count(*) from jobs"));
+
+  // Maintenance ends even when the free pages cannot be released
+  std::string plain = scratch.dir + "/plain";
+  ASSERT_EQUAL(0, mkdir(plain.c_str(), 0777));
+  ASSERT_TRUE(sql(plain,
+                  "create table filler(x);"
+                  "insert into filler values (zeroblob(100000));"
+                  "drop table filler;"));
+  EXPECT_EQUAL(0, run_tool(plain, {"evict"}));
+}
+
+// A cache as the first versions of the job cache wrote it
+static const char version0_schema[] =
+    "pragma auto_vacuum=incremental;"
+    "create table jobs("
+    "  job_id       integer primary key autoincrement,"
+    "  directory    text    not null,"
+    "  commandline  blob    not null,"
+    "  environment  blob    not null,"
+    "  stdin        text    not null,"
+    "  bloom_filter integer);"
+    "create index job on jobs(directory, commandline, environment, stdin);"
+    "create table input_files("
+    "  input_file_id integer primary key autoincrement,"
+    "  path          text    not null,"
+    "  hash          text    not null,"
+    "  job           job_id  not null references jobs(job_id) on delete cascade);"
+    "create index input_file on input_files(path, hash);"
+    "create table output_files("
+    "  output_file_id integer primary key autoincrement,"
+    "  path           text    not null,"
+    "  hash           text    not null,"
+    "  job            job_id  not null references jobs(job_id) on delete cascade);"
+    "create index output_file on output_files(path, hash);"
+    "create index find_file on output_files(hash);"
+    "create table input_dirs("
+    "  input_dir_id integer primary key autoincrement,"
+    "  path         text    not null,"
+    "  hash         text    not null,"
+    "  job          job_id  not null references jobs(job_id) on delete cascade);"
+    "create index input_dir on input_dirs(path, hash);";
+
+TEST(job_cache_migrations) {
+  if (access(job_cache_tool().c_str(), X_OK) != 0) return;
+  Scratch scratch;
+  ASSERT_FALSE(scratch.dir.empty());
+  ASSERT_EQUAL(0, mkdir(scratch.cache.c_str(), 0777));
+  ASSERT_TRUE(sql(scratch.cache, version0_schema));
+
+  // Two jobs, which both wrote the same file, each with its own copy of it
+  std::string in = hash('0'), same = hash('1'), other = hash('2');
+  std::string rows =
+      "insert into jobs values (1, '/ws', 'build', 'PATH=/usr/bin', '', 0);"
+      "insert into jobs values (2, '/ws', 'other', 'PATH=/usr/bin', '', 0);"
+      "insert into input_files values (5, '/ws/in', '" + in + "', 1);"
+      "insert into input_files values (6, '/ws/in', '" + in + "', 2);"
+      "insert into input_dirs values (7, '/ws', '" + other + "', 2);"
+      "insert into output_files values (3, '/ws/out/build', '" + same + "', 1);"
+      "insert into output_files values (4, '/ws/out/other', '" + same + "', 2);"
+      "insert into output_files values (8, '/ws/out/more', '" + other + "', 2);";
+  ASSERT_TRUE(sql(scratch.cache, rows.c_str()));
+  for (const char *dir : {"/01", "/01/1", "/02", "/02/2"}) {
+    ASSERT_EQUAL(0, mkdir((scratch.cache + dir).c_str(), 0777));
+  }
+  write_file(scratch.cache + "/01/1/" + same, "same");
+  write_file(scratch.cache + "/02/2/" + same, "same");
+  write_file(scratch.cache + "/02/2/" + other, "other!");
+
+  // Opening the cache migrates it
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"stats"}));
+  EXPECT_EQUAL("4", sql_value(scratch.cache, "pragma user_version"));
+
+  // v1: the bloom filters were rebuilt from the inputs
+  EXPECT_EQUAL("0", sql_value(scratch.cache,
+                              "select count(*) from jobs where typeof(bloom_filter) <> 'blob'"));
+
+  // v2: one copy of each output went to the blob store and the rest are gone
+  EXPECT_EQUAL("same", read_file(scratch.cache + "/blobs/11/" + same));
+  EXPECT_EQUAL("other!", read_file(scratch.cache + "/blobs/22/" + other));
+  EXPECT_TRUE(access((scratch.cache + "/01").c_str(), F_OK) != 0);
+  EXPECT_TRUE(access((scratch.cache + "/02").c_str(), F_OK) != 0);
+
+  // v3: the jobs are sized, a shared blob counting once for the cache
+  EXPECT_EQUAL("4", sql_value(scratch.cache, "select size from jobs where job_id = 1"));
+  EXPECT_EQUAL("10", sql_value(scratch.cache, "select size from jobs where job_id = 2"));
+  EXPECT_EQUAL("10", sql_value(scratch.cache, "select bytes from cache_size"));
+  EXPECT_EQUAL("0", sql_value(scratch.cache, "select max(last_use) from jobs"));
+
+  // v4: paths are interned and hashes are binary, and every row kept its id
+  EXPECT_EQUAL("/ws/out/more", sql_value(scratch.cache,
+                                         "select p.path from output_files o join paths p"
+                                         "  on p.path_id = o.path where o.output_file_id = 8"));
+  EXPECT_EQUAL("/ws", sql_value(scratch.cache,
+                                "select p.path from input_dirs d join paths p"
+                                "  on p.path_id = d.path where d.input_dir_id = 7"));
+  EXPECT_EQUAL("0", sql_value(scratch.cache,
+                              "select count(*) from input_files where length(hash) <> 32"
+                              "  or input_file_id not in (5, 6)"));
+  EXPECT_EQUAL("0", sql_value(scratch.cache,
+                              "select count(*) from sqlite_master where name like 'old_%'"));
+
+  // The migrated jobs are found and their outputs read back
+  std::string file = request_file(scratch.dir + "/read.json", read_request("build", in));
+  ASSERT_EQUAL(0, run_tool(scratch.cache, {"read", file}));
+  EXPECT_EQUAL("same", read_file(scratch.dir + "/ws/out/build"));
+}
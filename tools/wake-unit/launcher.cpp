@@ -0,0 +1,136 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime/launcher.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "unit.h"
+#include "util/execpath.h"
+
+// NUL-separated strings, as the job table keeps them
+template <size_t N>
+static std::string nul(const char (&strings)[N]) {
+  return std::string(strings, N - 1);
+}
+
+static std::string run(Launcher &launcher, const std::string &dir, const std::string &cmdline,
+                       int &status) {
+  int fds[2];
+  if (pipe(fds) == -1) return "<pipe>";
+  pid_t pid = launcher.spawn("/dev/null", fds[1], fds[1], dir, cmdline,
+                             nul("X=hello\0PATH=/bin:/usr/bin\0"));
+  close(fds[1]);
+
+  std::string out;
+  char buffer[256];
+  ssize_t got;
+  while ((got = read(fds[0], buffer, sizeof(buffer))) > 0) out.append(buffer, got);
+  close(fds[0]);
+
+  // The job is our own child, not the launcher's
+  status = -1;
+  if (pid == -1 || waitpid(pid, &status, 0) != pid) return "<wait>";
+  return out;
+}
+
+TEST(launcher_spawn) {
+#ifdef __linux__
+  Launcher launcher;
+  EXPECT_FALSE(launcher.start("/wake/no/such/shim"));
+
+  // The shim is only installed next to a full build; nothing to drive without it.
+  std::string shim = find_execpath() + "/../lib/wake/shim-wake";
+  if (access(shim.c_str(), X_OK) != 0) return;
+  ASSERT_TRUE(launcher.start(shim));
+
+  int status;
+  EXPECT_EQUAL("hello\n/tmp\n", run(launcher, "/tmp", nul("sh\0-c\0echo $X; pwd\0"), status));
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  std::string missing = run(launcher, ".", nul("/wake/no/such/command\0"), status);
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 127);
+  EXPECT_EQUAL(0, int(missing.find("execvp: /wake/no/such/command")));
+
+  launcher.stop();
+  EXPECT_FALSE(launcher.running());
+  EXPECT_EQUAL(-1, int(launcher.spawn("/dev/null", 1, 2, ".", nul("true\0"), "")));
+#endif
+}
+
+// The signals this process ignores, as the kernel reports them
+static std::string ignored_signals() {
+  FILE *f = fopen("/proc/self/status", "r");
+  if (!f) return "<status>";
+  char line[256];
+  std::string out;
+  while (fgets(line, sizeof(line), f)) {
+    if (strncmp(line, "SigIgn:", 7) == 0) out = line;
+  }
+  fclose(f);
+  return out;
+}
+
+TEST(launcher_signals) {
+#ifdef __linux__
+  std::string shim = find_execpath() + "/../lib/wake/shim-wake";
+  if (access(shim.c_str(), X_OK) != 0) return;
+
+  // Dispositions like wake's: SIGPIPE ignored, SIGTERM not
+  struct sigaction sa, pipe_saved, term_saved;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, &pipe_saved);
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGTERM, &sa, &term_saved);
+  std::string expect = ignored_signals();
+
+  // A job spawned through the launcher ignores exactly what one exec'd
+  // directly by this process would
+  Launcher launcher;
+  ASSERT_TRUE(launcher.start(shim));
+  int status;
+  std::string got = run(launcher, ".", nul("sh\0-c\0grep SigIgn: /proc/self/status\0"), status);
+  launcher.stop();
+  sigaction(SIGPIPE, &pipe_saved, 0);
+  sigaction(SIGTERM, &term_saved, 0);
+
+  EXPECT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  EXPECT_FALSE(expect.empty());
+  EXPECT_EQUAL(expect, got);
+#endif
+}
+
+TEST(launcher_histogram) {
+  LaunchHistogram histogram;
+  histogram.add(0.5e-6);
+  histogram.add(100e-6);
+  histogram.add(120e-6);
+  histogram.add(3e-3);
+
+  EXPECT_EQUAL(4, int(histogram.launches));
+  EXPECT_EQUAL(1, int(histogram.buckets[0]));
+  EXPECT_EQUAL(2, int(histogram.buckets[7]));
+  EXPECT_EQUAL(1, int(histogram.buckets[12]));
+  EXPECT_TRUE(histogram.format().find("<1us: 1, <128us: 2, <4ms: 1") != std::string::npos);
+}
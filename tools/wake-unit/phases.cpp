@@ -0,0 +1,52 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "util/phases.h"
+
+#include "unit.h"
+
+TEST(phases_nesting) {
+  PhaseLog log;
+  phase_log = &log;
+  count_objects = true;
+  long before = live_terms.load();
+  {
+    Phase outer("outer");
+    {
+      Phase inner("inner");
+      count_object(live_terms, 2);
+    }
+    count_object(live_terms, -1);
+  }
+  phase_log = nullptr;
+  count_objects = false;
+  {
+    Phase ignored("ignored");
+    count_object(live_terms, 5);
+  }
+
+  ASSERT_EQUAL(2u, log.phases.size());
+  EXPECT_EQUAL(std::string("outer"), log.phases[0].name);
+  EXPECT_EQUAL(0, log.phases[0].depth);
+  EXPECT_EQUAL(before + 1, log.phases[0].terms);
+  EXPECT_EQUAL(std::string("inner"), log.phases[1].name);
+  EXPECT_EQUAL(1, log.phases[1].depth);
+  EXPECT_EQUAL(before + 2, log.phases[1].terms);
+  EXPECT_TRUE(log.phases[0].wall >= log.phases[1].wall);
+  EXPECT_EQUAL(before + 1, live_terms.load());
+  live_terms -= 1;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime/scheduler.h"
+
+#include <vector>
+
+#include "unit.h"
+
+static LaunchPriority priority(bool urgent, bool unknown, double pathtime, long id) {
+  LaunchPriority out;
+  out.urgent = urgent;
+  out.unknown = unknown;
+  out.pathtime = pathtime;
+  out.id = id;
+  return out;
+}
+
+TEST(scheduler_launch_order) {
+  LaunchQueue<int> queue;
+  queue.push(priority(false, false, 5.0, 1), 1);
+  queue.push(priority(false, false, 9.0, 2), 2);
+  queue.push(priority(false, true, 0.0, 3), 3);
+  queue.push(priority(true, false, 1.0, 4), 4);
+  queue.push(priority(false, false, 9.0, 5), 5);
+
+  std::vector<int> order;
+  auto any = [](int) { return true; };
+  while (!queue.empty()) order.push_back(queue.pop(queue.select(any, 1, 0)));
+
+  std::vector<int> expected = {4, 3, 5, 2, 1};
+  EXPECT_EQUAL(expected, order);
+}
+
+TEST(scheduler_select_skips_blocked) {
+  LaunchQueue<int> queue;
+  for (int i = 0; i < 10; ++i) queue.push(priority(false, false, 10.0 - i, i), int(i));
+
+  // Only odd tasks fit; the best of those is picked
+  auto odd = [](int x) { return x % 2 == 1; };
+  auto it = queue.select(odd, 4, 10);
+  ASSERT_TRUE(it != queue.end());
+  EXPECT_EQUAL(1, queue.pop(it));
+
+  // Nothing beyond the window is considered
+  auto big = [](int x) { return x >= 8; };
+  EXPECT_TRUE(queue.select(big, 4, 10) == queue.end());
+  EXPECT_TRUE(queue.select(big, 9, 10) != queue.end());
+  EXPECT_EQUAL(size_t(9), queue.size());
+
+  // The best task, 0, has been passed over twice; with patience 4, twice more
+  auto not_zero = [](int x) { return x != 0; };
+  it = queue.select(not_zero, 4, 4);
+  ASSERT_TRUE(it != queue.end());
+  EXPECT_EQUAL(2, queue.pop(it));
+  it = queue.select(not_zero, 4, 4);
+  ASSERT_TRUE(it != queue.end());
+  EXPECT_EQUAL(3, queue.pop(it));
+  EXPECT_TRUE(queue.select(not_zero, 4, 4) == queue.end());
+
+  // Until it fits and goes, after which the next best may be passed over
+  auto any = [](int) { return true; };
+  EXPECT_EQUAL(0, queue.pop(queue.select(any, 4, 4)));
+  auto not_four = [](int x) { return x != 4; };
+  it = queue.select(not_four, 4, 4);
+  ASSERT_TRUE(it != queue.end());
+  EXPECT_EQUAL(5, queue.pop(it));
+}
+
+TEST(scheduler_critical_paths) {
+  CriticalPaths paths;
+  CriticalJob none = paths.longest(3.0);
+  EXPECT_EQUAL(3.0, none.pathtime);
+  EXPECT_EQUAL(0.0, none.runtime);
+
+  auto a = paths.add(10.0, 2.0);
+  auto b = paths.add(7.0, 1.0);
+  auto c = paths.add(10.0, 4.0);
+  EXPECT_EQUAL(10.0, paths.longest(0).pathtime);
+
+  // The floor wins unless something is strictly longer
+  EXPECT_EQUAL(0.0, paths.longest(10.0).runtime);
+
+  paths.remove(a);
+  CriticalJob crit = paths.longest(0);
+  EXPECT_EQUAL(10.0, crit.pathtime);
+  EXPECT_EQUAL(4.0, crit.runtime);
+
+  paths.remove(c);
+  crit = paths.longest(0);
+  EXPECT_EQUAL(7.0, crit.pathtime);
+  EXPECT_EQUAL(1.0, crit.runtime);
+
+  paths.remove(b);
+  EXPECT_EQUAL(size_t(0), paths.size());
+}
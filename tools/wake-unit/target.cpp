@@ -0,0 +1,180 @@
+/*
+ * Copyright 2022 SiFive, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You should have received a copy of LICENSE.Apache2 along with
+ * this software. If not, you may obtain a copy at
+ *
+ *    https://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "runtime/target.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "optimizer/ssa.h"
+#include "runtime/database.h"
+#include "runtime/runtime.h"
+#include "runtime/tuple.h"
+#include "runtime/value.h"
+#include "types/datatype.h"
+#include "unit.h"
+#include "util/file.h"
+
+static CPPFile cppFile(__FILE__);
+
+static void write_file(const std::string &path, const char *content) {
+  FILE *f = fopen(path.c_str(), "w");
+  fputs(content, f);
+  fclose(f);
+}
+
+// Keeps one result, made after observing what 'path' holds
+TEST_FUNC(void, keep_one, Database &db, RFun &root, Runtime &runtime, const std::string &path) {
+  TargetStore store(&db, &root, "version");
+  store.observe("read", path, observe_file(runtime, path));
+  Heap &h = runtime.heap;
+  h.guarantee(String::reserve(4));
+  store.keep(store.key("loc", Hash("args"), Hash()), "loc", String::claim(h, "kept"));
+  store.save();
+  db.clean();
+}
+
+TEST(target_store_values) {
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+  RFun root(FRAGMENT_CPP_LINE, "root", 0);
+  root.hash = Hash("program");
+  Runtime runtime(nullptr, 0, 4.0);
+  Heap &h = runtime.heap;
+
+  std::string digits("123456789012345678901234567890");
+  h.guarantee(Record::reserve(5) + Record::reserve(1) + String::reserve(6) +
+              Integer::reserve(MPZ(digits)) + Integer::reserve(-7) + Double::reserve());
+  String *shared = String::claim(h, "shared");
+  Record *inner = Record::claim(h, &Constructor::array, 1);
+  inner->at(0)->instant_fulfill(shared);
+  Record *outer = Record::claim(h, &Constructor::array, 5);
+  outer->at(0)->instant_fulfill(shared);
+  outer->at(1)->instant_fulfill(Integer::claim(h, MPZ(digits)));
+  outer->at(2)->instant_fulfill(Integer::claim(h, -7));
+  outer->at(3)->instant_fulfill(Double::claim(h, 2.5));
+  outer->at(4)->instant_fulfill(inner);
+
+  {
+    TargetStore store(&db, &root, "version");
+    store.keep(store.key("loc", Hash("args"), Hash()), "loc", outer);
+    store.save();
+  }
+  db.clean();
+
+  TargetStore store(&db, &root, "version");
+  size_t need = store.find(runtime, store.key("loc", Hash("args"), Hash()), "loc");
+  ASSERT_TRUE(need > 0);
+  h.guarantee(need);
+  Record *out = dynamic_cast<Record *>(store.claim(h));
+  ASSERT_TRUE(out != nullptr);
+  ASSERT_EQUAL(5, int(out->size()));
+  EXPECT_TRUE(out->cons == &Constructor::array);
+  EXPECT_EQUAL("shared", out->at(0)->coerce<String>()->as_str());
+  EXPECT_EQUAL(digits, out->at(1)->coerce<Integer>()->str());
+  EXPECT_EQUAL("-7", out->at(2)->coerce<Integer>()->str());
+  EXPECT_TRUE(out->at(3)->coerce<Double>()->value == 2.5);
+
+  // The string reached twice is decoded once
+  Record *copy = out->at(4)->coerce<Record>();
+  ASSERT_EQUAL(1, int(copy->size()));
+  EXPECT_TRUE(copy->at(0)->coerce<String>() == out->at(0)->coerce<String>());
+
+  // Another program never sees the result
+  RFun other(FRAGMENT_CPP_LINE, "other", 0);
+  other.hash = Hash("other program");
+  TargetStore changed(&db, &other, "version");
+  EXPECT_EQUAL(0, int(changed.find(runtime, changed.key("loc", Hash("args"), Hash()), "loc")));
+
+  db.close();
+}
+
+TEST(target_store_observations) {
+  char dir[] = "/tmp/wake-unit-target.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != nullptr);
+  std::string path = std::string(dir) + "/input";
+  write_file(path, "before");
+  observer_register("read", observe_file);
+
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+  RFun root(FRAGMENT_CPP_LINE, "root", 0);
+  root.hash = Hash("program");
+  Runtime runtime(nullptr, 0, 4.0);
+  TEST_FUNC_CALL(keep_one, db, root, runtime, path);
+
+  {
+    TargetStore store(&db, &root, "version");
+    EXPECT_TRUE(store.find(runtime, store.key("loc", Hash("args"), Hash()), "loc") > 0);
+  }
+
+  // The file the result was computed from has changed
+  write_file(path, "after");
+  {
+    TargetStore store(&db, &root, "version");
+    EXPECT_EQUAL(0, int(store.find(runtime, store.key("loc", Hash("args"), Hash()), "loc")));
+  }
+
+  db.close();
+  unlink(path.c_str());
+  rmdir(dir);
+}
+
+TEST(target_store_effects) {
+  char dir[] = "/tmp/wake-unit-target.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != nullptr);
+  std::string path = std::string(dir) + "/input";
+  write_file(path, "content");
+  observer_register("read", observe_file);
+
+  Database db(false);
+  ASSERT_EQUAL("", db.open(false, true, false));
+  db.prepare("wake-unit");
+  RFun root(FRAGMENT_CPP_LINE, "root", 0);
+  root.hash = Hash("program");
+  Runtime runtime(nullptr, 0, 4.0);
+  TEST_FUNC_CALL(keep_one, db, root, runtime, path);
+
+  // After an effect, a kept result is no longer reused ...
+  TargetStore store(&db, &root, "version");
+  Hash key = store.key("loc", Hash("args"), Hash());
+  EXPECT_TRUE(store.active());
+  store.effect();
+  EXPECT_FALSE(store.active());
+  EXPECT_EQUAL(0, int(store.find(runtime, key, "loc")));
+
+  // ... and new results are not kept
+  Heap &h = runtime.heap;
+  h.guarantee(String::reserve(5));
+  Hash fresh = store.key("loc", Hash("fresh"), Hash());
+  store.keep(fresh, "loc", String::claim(h, "fresh"));
+  store.save();
+  db.clean();
+
+  TargetStore later(&db, &root, "version");
+  EXPECT_EQUAL(0, int(later.find(runtime, fresh, "loc")));
+  EXPECT_TRUE(later.find(runtime, key, "loc") > 0);
+
+  db.close();
+  unlink(path.c_str());
+  rmdir(dir);
+}
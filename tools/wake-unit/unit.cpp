@@ -23,7 +23,7 @@
 #include "util/colour.h"
 #include "util/diagnostic.h"
 
-DiagnosticReporter* reporter;
+thread_local DiagnosticReporter* reporter;
 
 struct Test {
   const char* test_name;
@@ -20,14 +20,20 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
 #include <random>
 #include <set>
 #include <sstream>
+#include <thread>
 
 #include "describe.h"
 #include "dst/bind.h"
@@ -36,6 +42,7 @@
 #include "gopt/gopt-arg.h"
 #include "gopt/gopt.h"
 #include "markup.h"
+#include "optimizer/image.h"
 #include "optimizer/ssa.h"
 #include "parser/cst.h"
 #include "parser/parser.h"
@@ -48,6 +55,7 @@
 #include "runtime/runtime.h"
 #include "runtime/sources.h"
 #include "runtime/status.h"
+#include "runtime/target.h"
 #include "runtime/tuple.h"
 #include "runtime/value.h"
 #include "timeline.h"
@@ -57,6 +65,7 @@
 #include "util/diagnostic.h"
 #include "util/execpath.h"
 #include "util/file.h"
+#include "util/phases.h"
 #include "util/shell.h"
 
 #ifndef VERSION
@@ -68,6 +77,87 @@
 
 static CPPFile cppFile(__FILE__);
 
+static std::string hash_bytes(Hash hash) {
+  return std::string(reinterpret_cast<const char *>(&hash.data[0]), sizeof(hash.data));
+}
+
+// Hashes the wake binary and wakefiles a program is compiled from. Development
+// builds share a version string, so the binary is identified by its stamp.
+static bool hash_program_files(const std::vector<ExternalFile> &wakefiles, std::string &out) {
+  struct stat sbuf;
+  if (stat((find_execpath() + "/wake").c_str(), &sbuf) != 0) return false;
+
+  std::vector<uint64_t> codes;
+  Hash(VERSION_STR).push(codes);
+  codes.push_back(sbuf.st_size);
+  codes.push_back(sbuf.st_mtime);
+  for (auto &file : wakefiles) {
+    Hash(file.filename()).push(codes);
+    Hash(file.segment().start, file.segment().size()).push(codes);
+  }
+  out = hash_bytes(Hash(codes));
+  return true;
+}
+
+// Seconds since start, which moves on to now
+static double lap(std::chrono::steady_clock::time_point &start) {
+  auto now = std::chrono::steady_clock::now();
+  std::chrono::duration<double> elapsed = now - start;
+  start = now;
+  return elapsed.count();
+}
+
+// A wakefile parsed and converted, waiting to be merged into the Top
+struct ParsedFile {
+  DiagnosticBuffer diagnostics;
+  FileDST dst;
+  double parse, convert;  // seconds
+};
+
+// Parsing needs this many wakefiles per thread
+#define WAKEFILES_PER_THREAD 8
+#define MAX_PARSE_THREADS 8
+
+// Wakefiles are parsed and converted independently, on several threads if
+// there are enough of them. Returns the number of threads used.
+static size_t parse_wakefiles(std::vector<ExternalFile> &wakefiles, std::vector<ParsedFile> &out) {
+  size_t threads = std::min(wakefiles.size() / WAKEFILES_PER_THREAD, size_t(MAX_PARSE_THREADS));
+  threads = std::min(threads, size_t(std::thread::hardware_concurrency()));
+
+  out.resize(wakefiles.size());
+  std::atomic<size_t> next(0);
+  auto parse = [&]() {
+    DiagnosticReporter *saved = reporter;
+    size_t i;
+    while ((i = next.fetch_add(1)) < wakefiles.size()) {
+      ParsedFile &file = out[i];
+      auto start = std::chrono::steady_clock::now();
+      reporter = &file.diagnostics;
+      CST cst(wakefiles[i], file.diagnostics);
+      file.parse = lap(start);
+      file.dst = dst_file(cst.root());
+      file.convert = lap(start);
+    }
+    reporter = saved;
+  };
+
+  if (threads <= 1) {
+    parse();
+    return 1;
+  }
+
+  // The helpers never take signals meant for the main thread
+  sigset_t all, saved;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &saved);
+  std::vector<std::thread> helpers;
+  for (size_t i = 1; i < threads; ++i) helpers.emplace_back(parse);
+  pthread_sigmask(SIG_SETMASK, &saved, nullptr);
+  parse();
+  for (auto &helper : helpers) helper.join();
+  return threads;
+}
+
 void print_help(const char *argv0) {
   // clang-format off
   std::cout << std::endl
@@ -84,10 +174,16 @@ void print_help(const char *argv0) {
     << "    --no-tty         Surpress interactive build progress interface"              << std::endl
     << "    --no-wait        Do not wait to obtain database lock; fail immediately"      << std::endl
     << "    --no-workspace   Do not open a database or scan for sources files"           << std::endl
+    << "    --no-launcher    Spawn jobs directly instead of through a fork server"       << std::endl
     << "    --fatal-warnings Do not execute if there are any warnings"                   << std::endl
     << "    --heap-factor X  Heap-size is X * live data after the last GC (default 4.0)" << std::endl
+    << "    --generational   Collect short-lived heap objects separately in a nursery"   << std::endl
+    << "    --gc-threads N   Copy large heaps with N threads during GC (default 1)"      << std::endl
     << "    --profile-heap   Report memory consumption on every garbage collection"      << std::endl
     << "    --profile  FILE  Report runtime breakdown by stack trace to HTML/JSON file"  << std::endl
+    << "    --heap-snapshot FILE Write live heap by allocating stack trace to JSON"      << std::endl
+    << "    --phases   FILE  Report time and memory used by compiler phases to JSON"     << std::endl
+    << "    --reuse-targets  Reuse target results whose observed inputs are unchanged"   << std::endl
     << "    --chdir -C PATH  Locate database and default package starting from PATH"     << std::endl
     << "    --in       PKG   Evaluate command-line in package PKG (default is chdir)"    << std::endl
     << "    --exec -x  EXPR  Execute expression EXPR instead of a target function"       << std::endl
@@ -117,7 +213,7 @@ void print_help(const char *argv0) {
   // clang-format on
 }
 
-DiagnosticReporter *reporter;
+thread_local DiagnosticReporter *reporter;
 class TerminalReporter : public DiagnosticReporter {
  public:
   TerminalReporter() : errors(false), warnings(false) {}
@@ -155,11 +251,17 @@ int main(int argc, char **argv) {
     {'q', "quiet", GOPT_ARGUMENT_FORBIDDEN},
     {0, "no-wait", GOPT_ARGUMENT_FORBIDDEN},
     {0, "no-workspace", GOPT_ARGUMENT_FORBIDDEN},
+    {0, "no-launcher", GOPT_ARGUMENT_FORBIDDEN},
     {0, "no-tty", GOPT_ARGUMENT_FORBIDDEN},
     {0, "fatal-warnings", GOPT_ARGUMENT_FORBIDDEN},
     {0, "heap-factor", GOPT_ARGUMENT_REQUIRED | GOPT_ARGUMENT_NO_HYPHEN},
+    {0, "generational", GOPT_ARGUMENT_FORBIDDEN},
+    {0, "gc-threads", GOPT_ARGUMENT_REQUIRED | GOPT_ARGUMENT_NO_HYPHEN},
     {0, "profile-heap", GOPT_ARGUMENT_FORBIDDEN | GOPT_REPEATABLE},
     {0, "profile", GOPT_ARGUMENT_REQUIRED},
+    {0, "heap-snapshot", GOPT_ARGUMENT_REQUIRED},
+    {0, "phases", GOPT_ARGUMENT_REQUIRED},
+    {0, "reuse-targets", GOPT_ARGUMENT_FORBIDDEN},
     {'C', "chdir", GOPT_ARGUMENT_REQUIRED},
     {0, "in", GOPT_ARGUMENT_REQUIRED},
     {'x', "exec", GOPT_ARGUMENT_REQUIRED},
@@ -209,9 +311,12 @@ int main(int argc, char **argv) {
   bool quiet = arg(options, "quiet")->count;
   bool wait = !arg(options, "no-wait")->count;
   bool workspace = !arg(options, "no-workspace")->count;
+  bool launcher = !arg(options, "no-launcher")->count;
   bool tty = !arg(options, "no-tty")->count;
   bool fwarning = arg(options, "fatal-warnings")->count;
   int profileh = arg(options, "profile-heap")->count;
+  bool generational = arg(options, "generational")->count;
+  bool reuse_targets = arg(options, "reuse-targets")->count;
   bool input = arg(options, "input")->count;
   bool output = arg(options, "output")->count;
   bool last = arg(options, "last")->count;
@@ -236,7 +341,10 @@ int main(int argc, char **argv) {
   const char *jobs_str = arg(options, "jobs")->argument;
   const char *memory_str = arg(options, "memory")->argument;
   const char *heapf = arg(options, "heap-factor")->argument;
+  const char *gc_threads_str = arg(options, "gc-threads")->argument;
   const char *profile = arg(options, "profile")->argument;
+  const char *heap_snapshot = arg(options, "heap-snapshot")->argument;
+  const char *phases_file = arg(options, "phases")->argument;
   const char *init = arg(options, "init")->argument;
   const char *chdir = arg(options, "chdir")->argument;
   const char *in = arg(options, "in")->argument;
@@ -274,7 +382,7 @@ int main(int argc, char **argv) {
     return 1;
   }
 
-  if (profile && !debug) {
+  if ((profile || heap_snapshot) && !debug) {
     std::cerr << "Cannot profile without stack trace support (-d)!" << std::endl;
     return 1;
   }
@@ -344,6 +452,17 @@ int main(int argc, char **argv) {
     }
   }
 
+  int gc_threads = 1;
+  if (gc_threads_str) {
+    char *tail;
+    gc_threads = strtol(gc_threads_str, &tail, 0);
+    if (*tail || gc_threads < 1 || gc_threads > 256) {
+      std::cerr << "Cannot run with " << gc_threads_str << " gc-threads (must be 1-256)!"
+                << std::endl;
+      return 1;
+    }
+  }
+
   // Change directory to the location of the invoked script
   // and execute the specified target function
   if (shebang) {
@@ -508,9 +627,20 @@ int main(int argc, char **argv) {
 
   if (noparse) return 0;
 
+  // Compiler phases are recorded on request, and for --verbose --debug
+  PhaseLog phases;
+  if (phases_file || profile || (verbose && debug)) {
+    phase_log = &phases;
+    count_objects = true;
+  }
+
   bool enumok = true;
   std::string libdir = make_canonical(find_execpath() + "/../share/wake/lib");
-  auto wakefilenames = find_all_wakefiles(enumok, workspace, verbose, libdir, ".");
+  std::vector<std::string> wakefilenames;
+  {
+    Phase phase("find_all_wakefiles");
+    wakefilenames = find_all_wakefiles(enumok, workspace, verbose, libdir, ".");
+  }
   if (!enumok) {
     if (verbose) std::cerr << "Workspace wake file enumeration failed" << std::endl;
     // Try to run the build anyway; if wake files are missing, it will fail later
@@ -518,7 +648,9 @@ int main(int argc, char **argv) {
   }
 
   Profile tree;
-  Runtime runtime(profile ? &tree : nullptr, profileh, heap_factor);
+  HeapProfile sites;
+  Runtime runtime(profile ? &tree : nullptr, profileh, heap_factor, generational, gc_threads,
+                  heap_snapshot ? &sites : nullptr);
   bool sources = find_all_sources(runtime, workspace);
   if (!sources) {
     if (verbose) std::cerr << "Source file enumeration failed" << std::endl;
@@ -529,58 +661,134 @@ int main(int argc, char **argv) {
   // Select a default package
   int longest_src_dir = -1;
   bool warned_conflict = false;
+  bool any_conflict = false;
 
   // Read all wake build files
   bool ok = true;
   Scope::debug = debug;
   std::unique_ptr<Top> top(new Top);
   std::vector<ExternalFile> wakefiles;
-  wakefiles.reserve(wakefilenames.size());
-  for (auto &i : wakefilenames) {
-    if (verbose && debug) std::cerr << "Parsing " << i << std::endl;
-
-    wakefiles.emplace_back(terminalReporter, i.c_str());
-    FileContent &file = wakefiles.back();
-    CST cst(file, terminalReporter);
-    auto package = dst_top(cst.root(), *top);
-
-    // Does this file inform our choice of a default package?
-    size_t slash = i.find_last_of('/');
-    std::string dir(i, 0, slash == std::string::npos ? 0 : (slash + 1));  // "" | .+/
-    if (src_dir.compare(0, dir.size(), dir) == 0) {  // dir = prefix or parent of src_dir?
-      int dirlen = dir.size();
-      if (dirlen > longest_src_dir) {
-        longest_src_dir = dirlen;
-        top->def_package = package;
-        warned_conflict = false;
-      } else if (dirlen == longest_src_dir) {
-        if (top->def_package != package && !warned_conflict) {
-          std::cerr << "Directory " << (dir.empty() ? "." : dir.c_str())
-                    << " has wakefiles with both package '" << top->def_package << "' and '"
-                    << package << "'. This prevents default package selection;"
-                    << " defaulting to no package." << std::endl;
-          top->def_package = nullptr;
-          warned_conflict = true;
+  {
+    Phase phase("read");
+    wakefiles.reserve(wakefilenames.size());
+    for (auto &i : wakefilenames) wakefiles.emplace_back(terminalReporter, i.c_str());
+  }
+
+  char *none = nullptr;
+  char **cmdline = &none;
+  std::string command;
+
+  if (exec) {
+    command = exec;
+  } else if (argc > 1) {
+    command = argv[1];
+    cmdline = argv + 2;
+  }
+
+  ExprParser cmdExpr(command);
+
+  // A program compiled by an earlier run from the same wakefiles and command
+  // needs no parsing, type-checking or optimization
+  std::string program_files, program_key, program_type;
+  bool keep_program = !noexecute && workspace && !terminalReporter.errors &&
+                      hash_program_files(wakefiles, program_files);
+  ProgramFiles loaded_files;
+  std::unique_ptr<Term> ssa;
+  if (keep_program) {
+    std::vector<uint64_t> codes;
+    Hash(program_files).push(codes);
+    Hash(command).push(codes);
+    codes.push_back(exec ? 1 : argc > 1 ? 2 : 0);
+    Hash(src_dir).push(codes);
+    Hash(in ? in : "").push(codes);
+    codes.push_back(optim);
+    program_key = hash_bytes(Hash(codes));
+
+    for (auto &file : wakefiles) loaded_files.known.push_back(&file);
+    loaded_files.known.push_back(&cmdExpr.file);
+    Phase phase("load_program");
+    std::string image = db.get_program(program_key);
+    if (!image.empty()) ssa = load_program(image, runtime.heap, loaded_files, program_type);
+    if (ssa && verbose && debug)
+      std::cerr << "Using the program compiled by an earlier run" << std::endl;
+  }
+  bool loaded = static_cast<bool>(ssa);
+
+  // Run later instead, should a loaded program fail to link
+  auto parse_program = [&]() {
+    std::vector<ParsedFile> parsed;
+    {
+      Phase phase("parse");
+      size_t threads = parse_wakefiles(wakefiles, parsed);
+      if (verbose && debug) {
+        double parse = 0, convert = 0;
+        for (auto &file : parsed) {
+          parse += file.parse;
+          convert += file.convert;
         }
+        std::cerr << "Parsed " << parsed.size() << " wakefiles with " << threads << " threads ("
+                  << parse << "s parsing and " << convert << "s converting, over all threads)"
+                  << std::endl;
       }
     }
-  }
 
-  if (in) {
-    auto it = top->packages.find(in);
-    if (it == top->packages.end()) {
-      std::cerr << "Package '" << in << "' selected by --in does not exist!" << std::endl;
-      ok = false;
-    } else {
-      top->def_package = in;
+    // Merged in file order, so diagnostics and package choices match a serial parse
+    {
+      Phase phase("merge");
+      for (size_t f = 0; f < parsed.size(); ++f) {
+        const std::string &i = wakefilenames[f];
+        if (verbose && debug) std::cerr << "Parsing " << i << std::endl;
+
+        parsed[f].diagnostics.replay(terminalReporter);
+        auto package = dst_merge(std::move(parsed[f].dst), *top);
+
+        // Does this file inform our choice of a default package?
+        size_t slash = i.find_last_of('/');
+        std::string dir(i, 0, slash == std::string::npos ? 0 : (slash + 1));  // "" | .+/
+        if (src_dir.compare(0, dir.size(), dir) == 0) {  // dir = prefix or parent of src_dir?
+          int dirlen = dir.size();
+          if (dirlen > longest_src_dir) {
+            longest_src_dir = dirlen;
+            top->def_package = package;
+            warned_conflict = false;
+          } else if (dirlen == longest_src_dir) {
+            if (top->def_package != package && !warned_conflict) {
+              std::cerr << "Directory " << (dir.empty() ? "." : dir.c_str())
+                        << " has wakefiles with both package '" << top->def_package << "' and '"
+                        << package << "'. This prevents default package selection;"
+                        << " defaulting to no package." << std::endl;
+              top->def_package = nullptr;
+              warned_conflict = true;
+              any_conflict = true;
+            }
+          }
+        }
+      }
     }
-  }
 
-  // No wake files in the path from workspace to the current directory
-  if (!top->def_package) top->def_package = "nothing";
-  std::string export_package = top->def_package;
+    if (in) {
+      auto it = top->packages.find(in);
+      if (it == top->packages.end()) {
+        std::cerr << "Package '" << in << "' selected by --in does not exist!" << std::endl;
+        ok = false;
+      } else {
+        top->def_package = in;
+      }
+    }
 
-  if (!flatten_exports(*top)) ok = false;
+    // No wake files in the path from workspace to the current directory
+    if (!top->def_package) top->def_package = "nothing";
+
+    Phase phase("flatten_exports");
+    if (!flatten_exports(*top)) ok = false;
+  };
+
+  if (loaded) {
+    top->def_package = "nothing";
+  } else {
+    parse_program();
+  }
+  std::string export_package = top->def_package;
 
   std::vector<std::pair<std::string, std::string> > defs;
   std::set<std::string> types;
@@ -623,18 +831,6 @@ int main(int argc, char **argv) {
     }
   }
 
-  char *none = nullptr;
-  char **cmdline = &none;
-  std::string command;
-
-  if (exec) {
-    command = exec;
-  } else if (argc > 1) {
-    command = argv[1];
-    cmdline = argv + 2;
-  }
-
-  ExprParser cmdExpr(command);
   if (exec) {
     top->body = cmdExpr.expr(terminalReporter);
   } else if (argc > 1) {
@@ -666,12 +862,24 @@ int main(int argc, char **argv) {
   status_set_bulk_fd(5, fd5);
 
   /* Primitives */
-  JobTable jobtable(&db, memory_budget, cpu_budget, debug, verbose, quiet, check, !tty);
+  JobTable jobtable(&db, memory_budget, cpu_budget, debug, verbose, quiet, check, !tty, launcher);
   StringInfo info(verbose, debug, quiet, VERSION_STR, make_canonical(wake_cwd), cmdline);
   PrimMap pmap = prim_register_all(&info, &jobtable);
 
+  // A program compiled by another build of wake may use primitives this one lacks
+  if (loaded && !link_program(ssa.get(), pmap)) {
+    if (verbose && debug)
+      std::cerr << "The program compiled by an earlier run is stale; compiling it again"
+                << std::endl;
+    db.forget_program(program_key);
+    ssa.reset();
+    loaded = false;
+    parse_program();
+  }
+
   bool isTreeBuilt = true;
-  std::unique_ptr<Expr> root = bind_refs(std::move(top), pmap, isTreeBuilt);
+  std::unique_ptr<Expr> root;
+  if (!loaded) root = bind_refs(std::move(top), pmap, isTreeBuilt);
   if (!isTreeBuilt) ok = false;
 
   sums_ok();
@@ -751,8 +959,10 @@ int main(int argc, char **argv) {
   }
 
   // Convert AST to optimized SSA
-  std::unique_ptr<Term> ssa = Term::fromExpr(std::move(root), runtime);
-  if (optim) ssa = Term::optimize(std::move(ssa), runtime);
+  if (!loaded) {
+    ssa = Term::fromExpr(std::move(root), runtime);
+    if (optim) ssa = Term::optimize(std::move(ssa), runtime);
+  }
 
   // Upon request, dump out the SSA
   if (dumpssa) {
@@ -761,7 +971,28 @@ int main(int argc, char **argv) {
   }
 
   // Implement scope
-  ssa = Term::scope(std::move(ssa), runtime);
+  if (!loaded) {
+    ssa = Term::scope(std::move(ssa), runtime);
+
+    std::stringstream s;
+    type.format(s, type);
+    program_type = s.str();
+
+    // Programs which compiled with complaints are compiled again, to repeat them
+    if (keep_program && !terminalReporter.warnings && !any_conflict) {
+      std::string image = save_program(ssa.get(), program_type);
+      if (!image.empty()) db.save_program(program_key, program_files, std::move(image));
+    }
+  }
+
+  // Compilation is over
+  if (phase_log) {
+    phase_log = nullptr;
+    count_objects = false;
+    if (verbose && debug) phases.report();
+    if (phases_file) report_phases(phases_file, command, phases);
+    if (profile) tree.add_phases(phases);
+  }
 
   // Exit without execution for these arguments
   if (noexecute) return 0;
@@ -769,6 +1000,12 @@ int main(int argc, char **argv) {
   db.prepare(original_command_line);
   runtime.init(static_cast<RFun *>(ssa.get()));
 
+  std::unique_ptr<TargetStore> store;
+  if (reuse_targets) {
+    store.reset(new TargetStore(&db, static_cast<RFun *>(ssa.get()), VERSION_STR));
+    runtime.targets = store.get();
+  }
+
   // Flush buffered IO before we enter the main loop (which uses unbuffered IO exclusively)
   std::cout << std::flush;
   std::cerr << std::flush;
@@ -785,6 +1022,7 @@ int main(int argc, char **argv) {
 
   runtime.heap.report();
   tree.report(profile, command);
+  if (heap_snapshot) sites.report(heap_snapshot, command, runtime.heap.snapshot());
 
   bool pass = true;
   if (runtime.abort) {
@@ -803,9 +1041,7 @@ int main(int argc, char **argv) {
     }
     std::ostream &os = pass ? (std::cout) : (std::cerr);
     if (verbose) {
-      os << command << ": ";
-      type.format(os, type);
-      os << " = ";
+      os << command << ": " << program_type << " = ";
     }
     if (!quiet || !pass) {
       HeapObject::format(os, v, debug, verbose ? 0 : -1);
@@ -813,6 +1049,11 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (store) {
+    store->save();
+    if (verbose) store->report();
+  }
+
   db.clean();
   return pass ? 0 : 1;
 }